@@ -0,0 +1,182 @@
+// Loopback throughput benchmark: shares the given files with a Server and
+// receives them with a Client in the same process, the way the GUIs do, and
+// reports the median wall time of several runs. Each run starts from an empty
+// output folder and checks every received file against its source, so the
+// files need distinct names. Options left out keep the engine's defaults.
+//
+//   fluxdrop_bench [--io auto|buffered] [--encrypt] [--no-compress] [--verify]
+//                  [--checksums] [--stripes N] [--no-bundle] [--runs N]
+//                  [--out DIR] FILE...
+
+#include "networking.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+int usage() {
+    std::cerr << "Usage: fluxdrop_bench [--io auto|buffered] [--encrypt] [--no-compress] [--verify]\n"
+                 "                      [--checksums] [--stripes N] [--no-bundle] [--runs N]\n"
+                 "                      [--out DIR] FILE...\n";
+    return 2;
+}
+
+bool same_contents(const fs::path& a, const fs::path& b) {
+    std::error_code ec;
+    if (fs::file_size(a, ec) != fs::file_size(b, ec) || ec) {
+        return false;
+    }
+    std::ifstream fa(a, std::ios::binary);
+    std::ifstream fb(b, std::ios::binary);
+    std::vector<char> ba(1024 * 1024);
+    std::vector<char> bb(ba.size());
+    while (fa && fb) {
+        fa.read(ba.data(), static_cast<std::streamsize>(ba.size()));
+        fb.read(bb.data(), static_cast<std::streamsize>(bb.size()));
+        if (fa.gcount() != fb.gcount() || !std::equal(ba.begin(), ba.begin() + fa.gcount(), bb.begin())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// One share and one receiver over loopback. Returns the receiver's wall
+// time in seconds, or a negative value if the transfer failed.
+double run_once(const std::vector<std::string>& files, const fs::path& out, const transfer::TransferOptions& options) {
+    fs::remove_all(out);
+    fs::create_directories(out);
+
+    std::queue<networking::TransferJob> jobs;
+    for (const auto& file : files) {
+        jobs.push({file, fs::path(file).filename().string(), 0});
+    }
+
+    std::atomic<bool> failed{false};
+    std::promise<std::pair<unsigned short, uint32_t>> ready;
+    networking::Server server;
+    networking::ServerCallbacks sc;
+    sc.on_ready = [&](const std::string&, unsigned short port, uint32_t pin) { ready.set_value({port, pin}); };
+    sc.on_error = [&](const std::string& e) {
+        std::cerr << "sender: " << e << "\n";
+        failed = true;
+    };
+    sc.on_progress = [](const std::string&, uint64_t, uint64_t, double) {};
+    sc.options = options;
+    std::thread share([&] { server.start_gui(jobs, sc); });
+    auto [port, pin] = ready.get_future().get();
+
+    networking::Client client;
+    networking::ClientCallbacks cc;
+    cc.on_error = [&](const std::string& e) {
+        std::cerr << "receiver: " << e << "\n";
+        failed = true;
+    };
+    cc.on_progress = [](const std::string&, uint64_t, uint64_t, double) {};
+    cc.options = options;
+    auto start = std::chrono::steady_clock::now();
+    client.connect_gui("127.0.0.1", port, std::to_string(pin), out.string(), cc);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    share.join();
+
+    for (const auto& file : files) {
+        if (!same_contents(file, out / fs::path(file).filename())) {
+            std::cerr << "Received copy of " << file << " differs from the source\n";
+            failed = true;
+        }
+    }
+    return failed ? -1 : seconds;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    transfer::TransferOptions options;
+    int runs = 5;
+    fs::path out = fs::temp_directory_path() / "fluxdrop_bench";
+    std::vector<std::string> files;
+    std::string config;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--io" && has_value) {
+            std::string backend = argv[++i];
+            if (backend != "auto" && backend != "buffered") {
+                return usage();
+            }
+            options.io_backend = backend == "buffered" ? transfer::IoBackend::BUFFERED : transfer::IoBackend::AUTO;
+            config += " io=" + backend;
+        } else if (arg == "--encrypt") {
+            options.encrypt_sessions = true;
+            config += " encrypt";
+        } else if (arg == "--no-compress") {
+            options.compress_chunks = false;
+            config += " no-compress";
+        } else if (arg == "--verify") {
+            options.verify_files = true;
+            config += " verify";
+        } else if (arg == "--checksums") {
+            options.chunk_checksums = true;
+            config += " checksums";
+        } else if (arg == "--stripes" && has_value) {
+            options.stripes = static_cast<std::size_t>(std::atoi(argv[++i]));
+            config += " stripes=" + std::to_string(options.stripes);
+        } else if (arg == "--no-bundle") {
+            options.bundle_small_files = false;
+            config += " no-bundle";
+        } else if (arg == "--runs" && has_value) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--out" && has_value) {
+            out = argv[++i];
+        } else if (!arg.empty() && arg[0] == '-') {
+            return usage();
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.empty()) {
+        return usage();
+    }
+
+    uint64_t bytes = 0;
+    for (const auto& file : files) {
+        std::error_code ec;
+        uint64_t size = fs::file_size(file, ec);
+        if (ec) {
+            std::cerr << "Cannot read " << file << ": " << ec.message() << "\n";
+            return 1;
+        }
+        bytes += size;
+    }
+
+    std::vector<double> times;
+    for (int run = 0; run < runs; ++run) {
+        double seconds = run_once(files, out, options);
+        if (seconds < 0) {
+            return 1;
+        }
+        times.push_back(seconds);
+    }
+    fs::remove_all(out);
+
+    std::sort(times.begin(), times.end());
+    double median = times[times.size() / 2];
+    std::printf("%zu files, %.1f MB,%s: median %.3f s (%.0f MB/s), min %.3f s, max %.3f s over %d runs\n",
+                files.size(), bytes / 1e6, config.empty() ? " defaults" : config.c_str(), median,
+                bytes / median / 1e6, times.front(), times.back(), runs);
+    return 0;
+}
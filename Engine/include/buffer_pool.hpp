@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace transfer {
+
+// Recycles fixed-size chunk buffers for one transfer session so the chunk
+// loops stop touching the allocator once the pool is warm. Buffers may be
+// returned from any thread; the pool must outlive every buffer it hands out.
+class BufferPool {
+public:
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& other) noexcept;
+        Buffer& operator=(Buffer&& other) noexcept;
+        ~Buffer();
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        char* data() const { return data_.get(); }
+        std::size_t size() const { return size_; }
+        explicit operator bool() const { return data_ != nullptr; }
+
+    private:
+        friend class BufferPool;
+        Buffer(BufferPool* pool, std::unique_ptr<char[]> data, std::size_t size);
+        void release();
+
+        BufferPool* pool_ = nullptr;
+        std::unique_ptr<char[]> data_;
+        std::size_t size_ = 0;
+    };
+
+    explicit BufferPool(std::size_t buffer_size, std::size_t max_cached = 16);
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    Buffer acquire();
+    std::size_t buffer_size() const { return buffer_size_; }
+
+private:
+    void recycle(std::unique_ptr<char[]> data);
+
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<char[]>> free_;
+    std::size_t buffer_size_;
+    std::size_t max_cached_;
+};
+
+} // namespace transfer
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <boost/asio.hpp>
+
+namespace transfer {
+
+// Picks the FILE_CHUNK payload size for one sending session. Each frame is
+// sized to the larger of the bandwidth-delay product and ~10 ms of measured
+// throughput, capped at ~50 ms so CANCEL and progress stay responsive. Wired
+// gigabit settles in the megabytes, a congested Wi-Fi link near the minimum.
+// With min == max the size is fixed; throughput is still measured. next()
+// may be called from any thread; start_file() and record() only from the
+// sender.
+class ChunkSizer {
+public:
+    ChunkSizer(std::size_t min_size, std::size_t max_size);
+
+    ChunkSizer(const ChunkSizer&) = delete;
+    ChunkSizer& operator=(const ChunkSizer&) = delete;
+
+    std::size_t min_size() const { return min_size_; }
+    std::size_t max_size() const { return max_size_; }
+
+    // Payload size for the next frame.
+    std::size_t next() const { return current_.load(std::memory_order_relaxed); }
+
+    // Smoothed payload rate in bytes per second, or 0 until a full sample
+    // window has been recorded.
+    double throughput() const { return throughput_; }
+
+    // Restarts the clock so the gap between files is not counted as link time.
+    void start_file();
+    // Records `bytes` of payload handed to the socket since the previous call.
+    void record(boost::asio::ip::tcp::socket& socket, std::size_t bytes);
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    void adapt(boost::asio::ip::tcp::socket& socket, double seconds);
+
+    std::size_t min_size_;
+    std::size_t max_size_;
+    std::atomic<std::size_t> current_;
+    double throughput_ = 0; // bytes per second, smoothed
+    std::size_t window_bytes_ = 0;
+    clock::duration window_time_{};
+    clock::time_point last_record_ = clock::now();
+};
+
+} // namespace transfer
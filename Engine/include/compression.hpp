@@ -0,0 +1,182 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <vector>
+#include "buffer_pool.hpp"
+#include "framed_reader.hpp"
+#include "read_ahead.hpp"
+#include "security.hpp"
+#include "protocol/packet.hpp"
+
+namespace transfer {
+
+// True when the engine was built with zstd, so FEATURE_COMPRESSION may be
+// offered. Builds without it never send or accept FILE_CHUNK_Z.
+bool compression_available();
+
+// Decides from `sample`, read from where a file's transfer starts, whether
+// the file should go through ChunkCompressor at all, which gives up
+// zero-copy sending. The sample is compressed once at the level the
+// compressor starts at; that pays off when the worker pool could feed a link
+// of `link_rate` bytes per second at least a quarter more file bytes than
+// the link carries raw. With the link not measured yet (0), any sample that
+// shrinks pays off and the compressor's own back-off has the last word.
+bool compression_pays_off(const char* sample, std::size_t size, double link_rate);
+
+// Compresses the chunks of a FileReadAhead with zstd on a worker pool shared
+// by all transfers, keeping several chunks in flight ahead of the socket and
+// handing them back in file order. A chunk whose sampled byte entropy says it
+// is already compressed (jpg, mp4, zip), or that would not shrink by at least
+// 1/16, is handed back raw.
+//
+// The zstd level follows whichever side is the bottleneck: it steps up while
+// compressed chunks are ready before the socket asks for them (slow link,
+// spare CPU) and down once the socket spends a noticeable share of its time
+// waiting on the workers. When even the fastest level holds the socket back,
+// chunks are sent raw for a while before compression is tried again, so a
+// fast link is not held back for long.
+//
+// In an encrypted session the workers also seal each frame after compressing
+// it, so sealing runs on every core as well, even with compression off.
+class ChunkCompressor {
+public:
+    struct Frame {
+        FileReadAhead::Chunk chunk;
+        // Holds the zstd frame when compressed_size > 0; otherwise send chunk.
+        BufferPool::Buffer compressed;
+        std::size_t compressed_size = 0;
+        // FILE_CHUNK or FILE_CHUNK_Z header to send the payload under.
+        protocol::PacketHeader header{};
+        // A sealed payload goes out between the first nonce_size() bytes of
+        // `nonce` and the tag.
+        bool sealed = false;
+        security::FrameCipher::Nonce nonce{};
+        security::FrameCipher::Tag tag{};
+
+        const char* payload() const { return compressed_size > 0 ? compressed.data() : chunk.buffer.data(); }
+        std::size_t payload_size() const { return compressed_size > 0 ? compressed_size : chunk.size; }
+    };
+
+    // Compressed frames come from `pool`, whose buffers must be at least as
+    // large as the source's chunks. Without `compress` every chunk is sent
+    // raw. A `cipher` seals every frame for the file with manifest index
+    // `file`; `position` is then the file offset of the source's first chunk.
+    // With `checksums` the frames that are not sealed carry their CRC32C (see
+    // protocol::CHUNK_CRC_SIZE).
+    ChunkCompressor(FileReadAhead& source, BufferPool& pool, uint32_t session_id, bool compress = true,
+                    const security::FrameCipher* cipher = nullptr, uint32_t file = 0, uint64_t position = 0,
+                    bool checksums = false);
+    // Waits for in-flight chunks, whose buffers belong to `pool`.
+    ~ChunkCompressor();
+
+    ChunkCompressor(const ChunkCompressor&) = delete;
+    ChunkCompressor& operator=(const ChunkCompressor&) = delete;
+
+    // Blocks until the next chunk is ready. Returns false at end of file and
+    // rethrows read or compression errors.
+    bool next(Frame& frame);
+
+    int level() const;
+
+private:
+    struct Pending {
+        std::future<Frame> result;
+        bool compressing; // false for chunks queued raw
+    };
+
+    using clock = std::chrono::steady_clock;
+
+    void fill();
+    void adapt(clock::duration waited, clock::duration sending);
+
+    FileReadAhead& source_;
+    BufferPool& pool_;
+    uint32_t session_id_;
+    bool compress_;
+    const security::FrameCipher* cipher_;
+    uint32_t file_;
+    uint64_t position_;
+    bool checksums_;
+    std::size_t depth_;
+    std::deque<Pending> in_flight_;
+    bool source_done_ = false;
+    std::size_t level_index_;
+    std::size_t raw_chunks_left_ = 0;
+    std::size_t raw_backoff_;
+    clock::duration wait_time_{};
+    clock::duration send_time_{};
+    std::optional<clock::time_point> last_return_;
+};
+
+// Receiver side of FILE_CHUNK_Z. Reuses one zstd context across frames.
+class ChunkDecompressor {
+public:
+    ChunkDecompressor();
+    ~ChunkDecompressor();
+
+    ChunkDecompressor(const ChunkDecompressor&) = delete;
+    ChunkDecompressor& operator=(const ChunkDecompressor&) = delete;
+
+    // Decompresses one zstd frame into exactly `size` bytes at `out`. Throws
+    // std::runtime_error if the frame is corrupt or of a different size.
+    void decompress(const char* data, std::size_t data_size, char* out, std::size_t size);
+
+private:
+    struct Context;
+    std::unique_ptr<Context> context_;
+};
+
+// Receiver side of sealed FILE_CHUNK and FILE_CHUNK_Z frames. Opens them, and
+// decompresses the latter, on the worker pool ChunkCompressor uses, several
+// frames in flight, and hands the plaintext back in the order the frames
+// arrived.
+class ChunkOpener {
+public:
+    explicit ChunkOpener(const security::FrameCipher& cipher);
+    // Waits for in-flight frames.
+    ~ChunkOpener();
+
+    ChunkOpener(const ChunkOpener&) = delete;
+    ChunkOpener& operator=(const ChunkOpener&) = delete;
+
+    // Reads the payload of `header`, whose plaintext of `size` bytes belongs
+    // at offset `position` of the file with manifest index `file`, from
+    // `reader` and queues it. The caller checks the sizes first.
+    void submit(FramedReader& reader, const protocol::PacketHeader& header, std::size_t size, uint32_t file,
+                uint64_t position);
+
+    // Passes the plaintext of the oldest frames to `out` until at most `keep`
+    // are left in flight. Throws std::runtime_error for a frame that fails
+    // authentication or decompression, unless there is a `damaged` handler:
+    // a frame that fails authentication then goes to it instead, with as many
+    // bytes of garbage as its plaintext would have had.
+    void drain(std::size_t keep, const std::function<void(const char*, std::size_t)>& out,
+               const std::function<void(const char*, std::size_t)>& damaged = nullptr);
+
+    // Frames worth keeping in flight to busy every worker.
+    std::size_t depth() const { return depth_; }
+
+private:
+    struct Job {
+        std::vector<char> payload;
+        std::vector<char> plaintext; // decompressed FILE_CHUNK_Z
+        bool compressed = false;
+        bool authentic = false;
+        std::size_t size = 0;
+        std::future<void> done;
+    };
+
+    const security::FrameCipher& cipher_;
+    std::size_t depth_;
+    std::deque<std::unique_ptr<Job>> in_flight_;
+    std::vector<std::unique_ptr<Job>> spare_;
+};
+
+} // namespace transfer
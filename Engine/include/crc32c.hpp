@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace transfer {
+
+// CRC32C (Castagnoli) of `size` bytes at `data`, continuing from `crc` so
+// data can be checked in pieces. Runs on the SSE4.2 or ARMv8 CRC32
+// instructions when the CPU has them, on a table otherwise.
+uint32_t crc32c(const char* data, std::size_t size, uint32_t crc = 0);
+
+} // namespace transfer
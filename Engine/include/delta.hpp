@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <string>
+#include <vector>
+#include "protocol/packet.hpp"
+
+namespace transfer {
+
+// A file is sent as a delta only when both it and the receiver's existing
+// copy are at least this large; below that the signatures and the extra read
+// of the old copy cost more than they save.
+constexpr uint64_t DELTA_MIN_SIZE = 1024 * 1024;
+
+// Block size for signing a copy of `size` bytes: about its square root, which
+// keeps both the signature list and the literal bytes around a changed spot
+// small, rounded to 1 KiB and clamped to [4 KiB, 1 MiB].
+uint32_t delta_block_size(uint64_t size);
+
+// Reads `path` once and signs each of its full blocks. Returns early with
+// the blocks signed so far if `cancel_flag` is set. Throws
+// std::runtime_error if the file cannot be read.
+protocol::BlockSignatures compute_block_signatures(const std::string& path, uint32_t block_size,
+                                                   std::atomic<bool>* cancel_flag = nullptr);
+
+// Walks `in` from its current position to the end against the receiver's
+// signatures, rsync style: a rolling checksum is kept over a block-sized
+// window and, where it hits a signed block whose BLAKE2b hash also matches,
+// the block is emitted as a reference and the window jumps past it.
+// Everything else is emitted as literal data, in pieces of at most
+// `max_literal` bytes. Consecutive blocks are coalesced into one run.
+// Returns false if `cancel_flag` was set before the end.
+bool encode_delta(std::istream& in, const protocol::BlockSignatures& signatures, std::size_t max_literal,
+                  const std::function<void(const char*, std::size_t)>& literal,
+                  const std::function<void(uint32_t first, uint32_t count)>& copy,
+                  std::atomic<bool>* cancel_flag = nullptr);
+
+// The receiver's existing copy of a file sent as a delta, from which the
+// BLOCK_COPY runs are read while the new version is assembled in .fluxpart.
+class DeltaBasis {
+public:
+    // Throws std::runtime_error if `path` cannot be opened.
+    DeltaBasis(const std::string& path, const protocol::BlockSignatures& signatures);
+
+    uint32_t block_size() const { return block_size_; }
+
+    // Passes blocks [first, first + count) to `out` in buffer-sized pieces.
+    // Throws std::runtime_error if the run lies outside the signed blocks or
+    // the copy can no longer be read.
+    void copy(uint32_t first, uint32_t count, const std::function<void(const char*, std::size_t)>& out);
+
+    // Releases the file, so the finished .fluxpart can replace it.
+    void close();
+
+private:
+    std::ifstream file_;
+    uint32_t block_size_;
+    uint32_t block_count_;
+    std::vector<char> buffer_;
+};
+
+} // namespace transfer
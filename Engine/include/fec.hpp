@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace transfer {
+
+// Systematic Reed-Solomon erasure code over GF(2^8) for one block of a
+// multicast transfer. The block's k source symbols go out as they are;
+// repair symbol s (k <= s < MAX_SYMBOLS) is the sum of source symbol i
+// times 1 / (s ^ i). That generator is a Cauchy matrix under an identity,
+// so any k distinct symbols of a block recover all of its sources, and a
+// new repair symbol helps every receiver, whichever symbols it lost.
+class BlockCode {
+public:
+    // Symbol indices are a byte: source and repair symbols of a block share
+    // the 256 field elements.
+    static constexpr std::size_t MAX_SYMBOLS = 256;
+
+    // Throws std::invalid_argument unless 0 < k < MAX_SYMBOLS.
+    BlockCode(std::size_t k, std::size_t symbol_size);
+
+    std::size_t k() const { return k_; }
+    std::size_t symbol_size() const { return symbol_size_; }
+
+    // Writes repair symbol `index` of the block whose k source symbols are
+    // `sources` to `out`.
+    void encode(const std::vector<const char*>& sources, std::size_t index, char* out) const;
+
+    // Fills in the source symbols not `present` from `repairs`, pairs of
+    // repair index and symbol. `sources` holds k buffers of symbol_size bytes.
+    // Returns false, changing nothing, unless there are at least as many
+    // distinct repairs as missing sources.
+    bool decode(const std::vector<char*>& sources, const std::vector<bool>& present,
+                const std::vector<std::pair<std::size_t, const char*>>& repairs) const;
+
+private:
+    std::size_t k_;
+    std::size_t symbol_size_;
+};
+
+} // namespace transfer
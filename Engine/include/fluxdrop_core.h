@@ -16,11 +16,20 @@ typedef struct {
     const char* ip;
 } fd_device_t;
 
+typedef enum {
+    FD_IO_AUTO = 0,
+    FD_IO_BUFFERED = 1
+} fd_io_backend_t;
+
 typedef void (*fd_server_ready_cb)(const char* ip, int port, int pin);
 typedef void (*fd_server_status_cb)(const char* message);
 typedef void (*fd_server_error_cb)(const char* error);
 typedef void (*fd_server_progress_cb)(const char* filename, uint64_t transferred, uint64_t total, double speed_mbps);
 typedef void (*fd_server_complete_cb)();
+typedef void (*fd_receiver_joined_cb)(uint32_t receiver, const char* ip);
+typedef void (*fd_receiver_progress_cb)(uint32_t receiver, const char* filename, uint64_t transferred, uint64_t total,
+                                        double speed_mbps);
+typedef void (*fd_receiver_finished_cb)(uint32_t receiver, bool completed);
 
 typedef void (*fd_client_device_found_cb)(const fd_device_t* device);
 typedef void (*fd_client_status_cb)(const char* message);
@@ -34,6 +43,24 @@ typedef void (*fd_client_complete_cb)();
 void fd_init();
 void fd_cleanup();
 
+void fd_set_io_backend(fd_io_backend_t backend);
+void fd_set_read_ahead_depth(uint32_t depth);
+void fd_set_write_behind_depth(uint32_t depth);
+void fd_set_stripe_count(uint32_t count);
+void fd_set_parallel_files(bool enabled);
+void fd_set_bundle_small_files(bool enabled);
+void fd_set_compression(bool enabled);
+void fd_set_delta_transfer(bool enabled);
+void fd_set_verify_files(bool enabled);
+void fd_set_encryption(bool enabled);
+void fd_set_chunk_checksums(bool enabled);
+void fd_set_max_receivers(uint32_t count);
+void fd_set_multicast(bool enabled, uint64_t max_rate);
+void fd_set_relay(bool enabled, fd_server_ready_cb ready_cb);
+void fd_set_receiver_callbacks(fd_receiver_joined_cb joined_cb,
+                               fd_receiver_progress_cb progress_cb,
+                               fd_receiver_finished_cb finished_cb);
+
 void fd_start_server(const char** file_paths, int num_files,
                      fd_server_ready_cb ready_cb,
                      fd_server_status_cb status_cb,
@@ -43,6 +70,7 @@ void fd_start_server(const char** file_paths, int num_files,
 
 void fd_cancel_server();
 void fd_request_cancel_server();
+void fd_cancel_receiver(uint32_t receiver);
 
 void fd_start_discovery(uint32_t room_id, fd_client_device_found_cb found_cb);
 void fd_stop_discovery();
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <boost/asio.hpp>
+#include "protocol/packet.hpp"
+
+namespace transfer {
+
+// Read side of a connection. Pulls as much as the kernel has into one large
+// buffer and decodes PacketHeaders and small payloads out of it, so a burst
+// of control packets or small chunks costs one recv() instead of two per
+// frame. Every read on a socket must go through the same reader once one is
+// attached. A capacity of 0 gives an unbuffered reader that issues exact
+// reads, for callers that hand the socket around between readers.
+class FramedReader {
+public:
+    static constexpr std::size_t DEFAULT_CAPACITY = 256 * 1024;
+
+    explicit FramedReader(boost::asio::ip::tcp::socket& socket, std::size_t capacity = DEFAULT_CAPACITY);
+
+    FramedReader(const FramedReader&) = delete;
+    FramedReader& operator=(const FramedReader&) = delete;
+
+    boost::asio::ip::tcp::socket& socket() { return socket_; }
+
+    // Throws boost::system::system_error on EOF or socket errors.
+    protocol::PacketHeader read_header();
+    void read_exact(char* out, std::size_t size);
+
+    // Buffered bytes not yet consumed; valid until the next read call.
+    std::size_t buffered() const { return end_ - begin_; }
+    const char* data() const { return storage_.get() + begin_; }
+    void consume(std::size_t n) { begin_ += n; if (begin_ == end_) begin_ = end_ = 0; }
+
+    // Makes at least `count` bytes available through data(). `count` must not
+    // exceed the capacity. With read-ahead off only the missing bytes are read.
+    void fill(std::size_t count);
+
+    // Read-ahead is worth it for small frames. For large payloads that the
+    // caller moves straight from the socket (splice) it is switched
+    // off so headers are read exactly and payload bytes stay in the kernel.
+    void set_read_ahead(bool enabled) { read_ahead_ = enabled; }
+
+    std::size_t capacity() const { return capacity_; }
+
+private:
+    boost::asio::ip::tcp::socket& socket_;
+    std::unique_ptr<char[]> storage_;
+    std::size_t capacity_;
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+    bool read_ahead_ = true;
+};
+
+} // namespace transfer
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "security.hpp"
+
+namespace networking {
+
+// What the PIN handshake on a control connection settles: the feature bits
+// both ends use and, when the PIN was proven through a key exchange, the
+// session key.
+struct Handshake {
+    bool authenticated = false; // false once the sender answered AUTH_FAIL
+    // The AUTH_FAIL came straight back to a key share, as it does from
+    // senders that predate FEATURE_ENCRYPTION, so no PIN was checked.
+    bool key_exchange_refused = false;
+    uint32_t features = 0;
+    std::optional<security::SessionKey> session_key;
+};
+
+struct SenderHandshakeOptions {
+    std::string pin;
+    uint32_t supported = 0; // feature bits this sender accepts; 0 keeps the original protocol
+    uint32_t session_id = 0;
+    std::function<void(const std::string&)> on_status;
+    std::function<void(const std::string&)> on_error;
+};
+
+// Sender side, once a receiver connected: reads AUTH and checks the PIN,
+// through the key exchange when AUTH carries a key share. Answers AUTH_FAIL
+// to a wrong PIN; AUTH_OK is left to the caller, which may have several
+// receivers racing. Throws std::runtime_error on a malformed handshake.
+// `socket` and `options` must outlive the coroutine.
+boost::asio::awaitable<Handshake> authenticate_receiver(boost::asio::ip::tcp::socket& socket,
+                                                        const SenderHandshakeOptions& options);
+
+// Receiver side, once connected: proves `pin`, offering the `offered`
+// feature bits, and returns the sender's verdict. Throws std::runtime_error
+// if the sender answers anything but AUTH_OK or AUTH_FAIL, or accepts a key
+// exchange without proving the PIN.
+boost::asio::awaitable<Handshake> authenticate_to_sender(boost::asio::ip::tcp::socket& socket, std::string pin,
+                                                         uint32_t offered);
+
+struct AcceptedReceiver {
+    boost::asio::ip::tcp::socket socket;
+    Handshake handshake;
+};
+
+// The listening side of a share. Every connection runs in a coroutine of its
+// own on `io_context`, so one that stalls or guesses the PIN wrong holds up
+// no one else. To bound online guessing, only a few connections may be
+// before or in the handshake at once, each for a few seconds, and the gate
+// stops taking AUTH after a few wrong PINs. Its first packet decides what it
+// is:
+// - AUTH starts the PIN handshake. Receivers that prove the PIN are sent
+//   AUTH_OK and handed to `on_receiver`, on the thread in run(), until
+//   `max_receivers` were (0 for no limit). Those still authenticating then
+//   are dropped.
+// - STRIPE_JOIN joins the data connections expected under its token. These
+//   are still taken once the PINs ran out, so receivers already handed out
+//   can open their stripes.
+// Everything but run() may be called from any thread.
+class ReceiverGate {
+public:
+    using ReceiverHandler = std::function<void(AcceptedReceiver)>;
+
+    // `on_locked` is called on the thread in run() once too many wrong PINs
+    // stopped the gate taking receivers; run() goes on until close(). Without
+    // it the gate closes itself then.
+    ReceiverGate(boost::asio::io_context& io_context, boost::asio::ip::tcp::acceptor& acceptor,
+                 SenderHandshakeOptions options, uint32_t max_receivers, ReceiverHandler on_receiver,
+                 std::function<void()> on_locked = {});
+
+    // Serves connections on the calling thread until close(). Rethrows what
+    // made the acceptor fail, unless that was a cancel.
+    void run();
+    // Ends run() and every take_stripes() wait. Connections not handed out
+    // yet are dropped.
+    void close();
+
+    // Data connections of a session that granted `count` stripes under
+    // `token`. Call expect_stripes() before the SESSION_CONFIG that announces
+    // the token goes out. take_stripes() then waits until all of them joined,
+    // `timeout` passed, `cancel_flag` is set (see wake()) or the gate closed,
+    // and returns them in index order, or none unless all of them joined.
+    void expect_stripes(const std::string& token, uint32_t count);
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::socket>> take_stripes(const std::string& token,
+                                                                            std::chrono::steady_clock::duration timeout,
+                                                                            const std::atomic<bool>* cancel_flag);
+    // Makes take_stripes() callers look at their cancel flag again.
+    void wake();
+
+private:
+    struct StripeSlots {
+        std::vector<std::unique_ptr<boost::asio::ip::tcp::socket>> sockets;
+        std::size_t joined = 0;
+    };
+
+    boost::asio::awaitable<void> accept_connections();
+    boost::asio::awaitable<void> serve_connection(boost::asio::ip::tcp::socket socket);
+    void join_stripe(const std::string& token, uint32_t index, boost::asio::ip::tcp::socket socket);
+    void spawn(boost::asio::awaitable<void> task, std::function<void(std::exception_ptr)> on_exit);
+    // Drops the connections in the handshake; `all` also drops those that
+    // have not sent their first packet yet.
+    void drop_pending(bool all);
+    // Refuses AUTH from now on, after too many wrong PINs.
+    void lock();
+    void shut_down();
+
+    boost::asio::io_context& io_context_;
+    boost::asio::ip::tcp::acceptor& acceptor_;
+    SenderHandshakeOptions options_;
+    uint32_t max_receivers_;
+    ReceiverHandler on_receiver_;
+    std::function<void()> on_locked_;
+
+    // Only touched on the thread in run().
+    uint32_t claimed_ = 0; // receivers past the PIN check, AUTH_OK sent or on its way
+    uint32_t failed_pins_ = 0;
+    bool locked_ = false; // too many wrong PINs; AUTH is refused
+    std::size_t pending_ = 0; // accepted connections not past the handshake yet
+    bool done_ = false;
+    std::exception_ptr accept_error_;
+    std::size_t active_ = 0; // coroutines not finished yet
+    std::set<boost::asio::ip::tcp::socket*> connecting_;     // before their first packet
+    std::set<boost::asio::ip::tcp::socket*> authenticating_; // in the PIN handshake
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool closed_ = false;
+    std::map<std::string, StripeSlots> stripes_;
+};
+
+// Accepts connections until one receiver proves the PIN, and returns it.
+// Returns nothing once the acceptor is closed.
+std::optional<AcceptedReceiver> accept_receiver(boost::asio::io_context& io_context,
+                                                boost::asio::ip::tcp::acceptor& acceptor,
+                                                const SenderHandshakeOptions& options);
+
+// Runs `task` on `io_context` from the calling thread and returns its result,
+// rethrowing what it threw. Handlers posted to `io_context` from other
+// threads run in between, so closing the task's socket that way ends it.
+template <typename T>
+T run_task(boost::asio::io_context& io_context, boost::asio::awaitable<T> task) {
+    std::optional<T> result;
+    std::exception_ptr error;
+    bool done = false;
+    boost::asio::co_spawn(io_context, std::move(task), [&](std::exception_ptr e, T value) {
+        error = e;
+        if (!e) {
+            result.emplace(std::move(value));
+        }
+        done = true;
+    });
+    io_context.restart();
+    while (!done && io_context.run_one() > 0) {
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (!result) {
+        throw std::runtime_error("Stopped before the handshake finished");
+    }
+    return std::move(*result);
+}
+
+} // namespace networking
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "protocol/packet.hpp"
+#include "striping.hpp"
+
+namespace transfer {
+
+// Files are verified on resume in blocks of this size. Block i covers
+// [i * VERIFY_BLOCK_SIZE, (i + 1) * VERIFY_BLOCK_SIZE) clipped to the file,
+// so only the last block may be shorter.
+constexpr uint64_t VERIFY_BLOCK_SIZE = 1024 * 1024;
+
+// Root of the binary hash tree over `leaves`. Each parent is BLAKE2b of a
+// 0x01 byte and its two children; an odd node moves up a level unchanged.
+protocol::BlockHash merkle_root(const std::vector<protocol::BlockHash>& leaves);
+
+// Sender side: BLAKE2b hashes of the first `count` blocks of `path`, fewer
+// if the file is shorter. They are kept per path for the life of the process
+// and extended on demand, so resuming the same file again only reads what was
+// not hashed before; a change of size or mtime drops them. Throws
+// std::runtime_error if the file cannot be read or `stop` is set first.
+std::vector<protocol::BlockHash> source_block_hashes(const std::string& path, uint64_t count,
+                                                     const std::atomic<bool>* stop = nullptr);
+
+// Blocks verified by an earlier resume are remembered in
+// `<name>.fluxpart.hashes`, so they are not read again from disk.
+std::filesystem::path hashes_path(const std::filesystem::path& part_path);
+// Forgets them; for when a .fluxpart is started over or completed.
+void discard_block_hashes(const std::filesystem::path& part_path);
+
+// Receiver side of a verified resume. Hashes every block of the .fluxpart
+// that `completed` covers in full, on several threads, except those recorded
+// in the sidecar by an earlier resume. Bytes of partly covered blocks are
+// given up rather than verified.
+class PartialFileHashes {
+public:
+    PartialFileHashes(const std::filesystem::path& part_path, uint64_t file_size, const ByteRanges& completed);
+
+    // The request for the sender: hashes of blocks up to the last covered
+    // one, with the root over them when every one of them is covered.
+    protocol::HashRequest request() const;
+
+    // The completed ranges cut down to the covered blocks whose hash matches
+    // the sender's. The matching blocks are flushed to disk and recorded in
+    // the sidecar for the next resume.
+    ByteRanges verify(const protocol::HashReply& reply);
+
+private:
+    std::filesystem::path part_path_;
+    uint64_t file_size_;
+    std::vector<uint64_t> blocks_; // covered blocks, ascending
+    std::vector<protocol::BlockHash> hashes_; // hashes_[i] belongs to blocks_[i]
+};
+
+// Sender side of FILE_HASH: the root over every block of a file, hashed on
+// background threads while the file is sent. The blocks are always read
+// again rather than taken from source_block_hashes, whose cache they then
+// replace.
+class SourceFileHash {
+public:
+    explicit SourceFileHash(const std::string& path);
+    // A root known already, such as the one a relay received the file with.
+    explicit SourceFileHash(const protocol::BlockHash& root);
+    // Stops hashing early when the root was never asked for.
+    ~SourceFileHash();
+
+    // Waits for the root. Throws std::runtime_error if the file could not be
+    // read.
+    protocol::BlockHash get();
+
+private:
+    std::atomic<bool> stop_{false};
+    std::future<protocol::BlockHash> root_;
+};
+
+// Receiver side of FILE_HASH. Hashes a .fluxpart while it is being written:
+// worker threads read each block back from the page cache as soon as
+// `written` reports it complete, so the root is ready soon after the last
+// byte. `written` is polled from those threads and must be safe to call
+// concurrently with the writes. Blocks recorded in the sidecar by a verified
+// resume are not read again.
+class PartFileHash {
+public:
+    PartFileHash(const std::filesystem::path& part_path, uint64_t file_size, std::function<ByteRanges()> written);
+    ~PartFileHash();
+
+    // Call once the whole file is written. Hashes what is left and returns
+    // the root; throws std::runtime_error if the file could not be read.
+    protocol::BlockHash finish();
+
+private:
+    void run();
+    // Queues the blocks that have become complete; called with mtx_ held.
+    void refresh();
+
+    std::filesystem::path part_path_;
+    uint64_t file_size_;
+    std::function<ByteRanges()> written_;
+    std::vector<protocol::BlockHash> leaves_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<uint8_t> queued_; // 1 once a block is queued or hashed
+    std::deque<uint64_t> ready_;
+    std::size_t hashed_ = 0;
+    bool complete_ = false;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+    std::chrono::steady_clock::time_point last_refresh_;
+    std::vector<std::thread> threads_;
+};
+
+} // namespace transfer
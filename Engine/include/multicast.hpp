@@ -0,0 +1,257 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include "fec.hpp"
+#include "striping.hpp"
+#include "security.hpp"
+#include "transfer.hpp"
+#include "protocol/multicast.hpp"
+
+namespace transfer {
+
+// A sealed datagram of this many symbol bytes still fits a 1500-byte MTU, so
+// no symbol is ever fragmented. Blocks of 64 symbols are 75 KiB of a file.
+constexpr std::size_t MULTICAST_SYMBOL_SIZE = 1200;
+constexpr std::size_t MULTICAST_BLOCK_SYMBOLS = 64;
+
+// Blocks a file of `size` bytes is cut into under `config`.
+uint64_t multicast_block_count(uint64_t size, const protocol::MulticastConfig& config);
+
+// Sends the files of a multicast round to its group, one file at a time, as
+// datagrams paced to rate() so a burst does not overrun the receivers or the
+// access point. Repair symbols of a block are numbered on from the last one
+// sent, so every repair is new to every receiver.
+class MulticastSender {
+public:
+    // Binds an ephemeral UDP port and sends to `group` through the interface
+    // with `interface_address`. config() has everything but the key.
+    MulticastSender(const boost::asio::ip::address_v4& group, const boost::asio::ip::address_v4& interface_address,
+                    std::shared_ptr<const security::FrameCipher> cipher, uint32_t transfer_id,
+                    double bytes_per_second);
+
+    MulticastSender(const MulticastSender&) = delete;
+    MulticastSender& operator=(const MulticastSender&) = delete;
+
+    const protocol::MulticastConfig& config() const { return config_; }
+
+    // Starts manifest entry `file`. Throws std::runtime_error if it cannot be
+    // opened.
+    void open_file(uint32_t file, const std::string& filepath, uint64_t size);
+    uint64_t block_count() const { return blocks_; }
+    // Sends the source symbols of blocks [begin, end) of the open file, each
+    // block followed by `repair` repair symbols. Returns false if the file
+    // could not be read or `cancel_flag` was set.
+    bool send_blocks(uint64_t begin, uint64_t end, std::size_t repair, const std::atomic<bool>* cancel_flag);
+    // Sends `count` more repair symbols of `block`. Returns false, sending
+    // what is left, once the block runs out of them.
+    bool send_repairs(uint64_t block, std::size_t count);
+
+    // Sequence number of the last datagram sent.
+    uint32_t last_sequence() const { return sequence_ - 1; }
+    double rate() const { return rate_; }
+    void set_rate(double bytes_per_second) { rate_ = bytes_per_second; }
+
+private:
+    // Reads block `block` of the open file into block_ and returns its
+    // source symbol count.
+    std::size_t read_block(uint64_t block);
+    void send_symbol(uint64_t block, std::size_t symbol, const char* data);
+    void pace(std::size_t bytes);
+
+    boost::asio::io_context io_context_;
+    boost::asio::ip::udp::socket socket_;
+    boost::asio::ip::udp::endpoint group_;
+    std::shared_ptr<const security::FrameCipher> cipher_;
+    protocol::MulticastConfig config_;
+    double rate_;
+    std::chrono::steady_clock::time_point next_send_;
+    uint32_t sequence_ = 0;
+
+    uint32_t file_ = 0;
+    uint64_t size_ = 0;
+    uint64_t blocks_ = 0;
+    std::ifstream in_;
+    std::vector<uint16_t> next_repair_; // per block of the open file
+    std::vector<char> block_;
+    std::vector<char> repair_;
+    std::vector<char> datagram_;
+};
+
+// Takes the datagrams of a multicast round on a thread of its own and
+// assembles the files it expects in their .fluxpart. A block stays in memory
+// until enough of its symbols arrived, is decoded if some were lost, and then
+// goes to disk in one write, so memory is bounded by the blocks the sender
+// has not been asked to repair yet.
+class MulticastReceiver {
+public:
+    // Joins the group on the interface with `interface_address`. Throws
+    // boost::system::system_error if the group cannot be joined.
+    MulticastReceiver(const protocol::MulticastConfig& config, const boost::asio::ip::address_v4& interface_address,
+                      std::shared_ptr<const security::FrameCipher> cipher, TransferProgressCallback progress_cb);
+    ~MulticastReceiver();
+
+    MulticastReceiver(const MulticastReceiver&) = delete;
+    MulticastReceiver& operator=(const MulticastReceiver&) = delete;
+
+    // Manifest entry `file` is wanted, under `name` in progress reports.
+    // Datagrams of other files are dropped. What is on disk is kept in the
+    // .fluxpart.ranges sidecar, so a later session resumes only that.
+    void expect_file(uint32_t file, const std::string& name, const std::filesystem::path& part_path, uint64_t size);
+    // Stops assembling `file`, which the sender is about to send over TCP
+    // instead, and closes its .fluxpart.
+    void abandon(uint32_t file);
+
+    // Waits until the datagrams up to the check's last_sequence arrived, or
+    // none did for a moment, and answers it for `file`.
+    protocol::MulticastNack answer(uint32_t file, const protocol::MulticastCheck& check);
+    // True once every block of `file` is written and its .fluxpart closed.
+    // The sidecar is left for the caller to drop with the rename.
+    // Throws std::runtime_error if writing it failed.
+    bool complete(uint32_t file);
+    // What of `file` is on disk so far.
+    ByteRanges completed_ranges(uint32_t file);
+
+private:
+    struct Block {
+        std::vector<char> data; // source symbols, allocated with the first one
+        std::vector<bool> present;
+        std::size_t sources = 0;
+        std::map<uint16_t, std::vector<char>> repairs;
+        bool done = false;
+    };
+
+    struct Assembly {
+        std::string name;
+        std::filesystem::path part_path;
+        uint64_t size = 0;
+        std::ofstream out;
+        std::vector<Block> blocks;
+        uint64_t decoded = 0;
+        uint64_t bytes = 0;
+        std::string error;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point last_report;
+    };
+
+    void receive();
+    void handle(std::size_t size);
+    void store(Assembly& file, const protocol::SymbolHeader& header, const char* symbol);
+    void finish_block(Assembly& file, uint64_t index, Block& block);
+    std::size_t source_count(const Assembly& file, uint64_t block) const;
+    ByteRanges ranges_of(const Assembly& file) const;
+
+    protocol::MulticastConfig config_;
+    std::shared_ptr<const security::FrameCipher> cipher_;
+    TransferProgressCallback progress_cb_;
+
+    boost::asio::io_context io_context_;
+    boost::asio::ip::udp::socket socket_;
+    boost::asio::ip::udp::endpoint sender_;
+    std::vector<char> datagram_;
+    std::thread thread_;
+
+    std::mutex mtx_;
+    std::condition_variable arrival_cv_;
+    std::map<uint32_t, Assembly> files_;
+    uint32_t received_ = 0;
+    uint32_t next_sequence_ = 0; // one past the highest sequence seen
+    std::chrono::steady_clock::time_point last_arrival_;
+};
+
+// A file of a multicast round, under its manifest index.
+struct MulticastFile {
+    uint32_t index = 0;
+    std::string path;
+    std::string name;
+    uint64_t size = 0;
+};
+
+// One receiver of a multicast round. Its session thread hands over the
+// control connection while the round runs, which sends the MULTICAST_CHECKs
+// on it and reads the answers.
+struct MulticastMember {
+    boost::asio::ip::tcp::socket* socket = nullptr;
+    FramedReader* reader = nullptr;
+    uint32_t session_id = 0;
+    std::vector<MulticastFile> files; // the receiver's MULTICAST decisions
+    TransferProgressCallback progress_cb;
+
+    // Filled in by the round: the files the receiver has whole, and whether
+    // its control connection failed.
+    std::vector<uint32_t> completed;
+    bool failed = false;
+};
+
+// The multicast side of a share with TransferOptions::multicast: one group,
+// port and key for every receiver, and the rounds that send to them.
+// Receivers that decide on their manifest within MULTICAST_JOIN_WINDOW of
+// each other, or until `expected_receivers` did, share a round; later ones
+// gather for the next round, which starts when this one is over. A round
+// sends each file window by window and, after every window, asks all of its
+// members what they still miss. The worst need of any member for a block is
+// what goes out again, as fresh repair symbols that help everyone.
+class MulticastShare {
+public:
+    static constexpr auto MULTICAST_JOIN_WINDOW = std::chrono::seconds(3);
+
+    // Sends to `group`. `expected_receivers` is 0 when the share takes any
+    // number.
+    MulticastShare(const boost::asio::ip::address_v4& group, const TransferOptions& options,
+                   uint32_t expected_receivers);
+
+    MulticastShare(const MulticastShare&) = delete;
+    MulticastShare& operator=(const MulticastShare&) = delete;
+
+    // The MULTICAST_CONFIG for a session whose control connection is bound
+    // to `local_address`; the first one picks the interface the group is sent
+    // through. A sealed group's key is sealed under `session_cipher`. The
+    // config has port 0 when the session cannot take part: its connection is
+    // not IPv4, or the group is sealed and the session is not.
+    protocol::MulticastConfig config_for(const boost::asio::ip::address& local_address,
+                                         const security::FrameCipher* session_cipher);
+
+    // Sends `member`'s files in the next round and returns once that round is
+    // over, at once for a member with none. Rounds run one at a time, on the
+    // thread of their first member.
+    void run(MulticastMember& member);
+
+private:
+    struct Round {
+        std::vector<MulticastMember*> members;
+        std::chrono::steady_clock::time_point deadline;
+        bool done = false;
+    };
+
+    // Sends the files of `round` and fills in its members' results.
+    void drive(Round& round);
+
+    boost::asio::ip::address_v4 group_;
+    double max_rate_;
+    uint32_t expected_receivers_;
+    std::optional<security::SessionKey> group_key_;
+    std::shared_ptr<const security::FrameCipher> group_cipher_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::unique_ptr<MulticastSender> sender_;
+    std::shared_ptr<Round> gathering_;
+    bool running_ = false;
+    uint32_t arrived_ = 0;
+    double loss_ = -1; // smoothed worst loss any member reported, -1 before the first
+};
+
+} // namespace transfer
@@ -4,10 +4,18 @@
 #include <cstdint>
 #include <queue>
 #include <functional>
+#include <map>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <optional>
+#include <vector>
 #include <boost/asio.hpp>
+#include "transfer.hpp"
+
+namespace transfer {
+class MulticastShare;
+}
 
 namespace networking {
 
@@ -31,13 +39,22 @@ using DeviceFoundCallback = std::function<void(const DiscoveredDevice&)>;
 using ProgressCallback = std::function<void(const std::string&, uint64_t, uint64_t, double)>;
 using StatusCallback = std::function<void(const std::string&)>;
 
+using ReceiverProgressCallback = std::function<void(uint32_t receiver, const std::string&, uint64_t, uint64_t, double)>;
+
 struct ServerCallbacks {
-    std::function<void(const std::string& ip, unsigned short port, uint16_t pin)> on_ready;
+    std::function<void(const std::string& ip, unsigned short port, uint32_t pin)> on_ready;
     StatusCallback on_status;
     ProgressCallback on_progress;
     std::function<void()> on_complete;
     std::function<void(const std::string&)> on_error;
+    // Receivers of a share are numbered from 1 as they authenticate. With
+    // several at once (TransferOptions::max_receivers), on_progress and
+    // on_status report all of them in turn; these tell them apart.
+    std::function<void(uint32_t receiver, const std::string& ip)> on_receiver_joined;
+    ReceiverProgressCallback on_receiver_progress;
+    std::function<void(uint32_t receiver, bool completed)> on_receiver_finished;
     std::atomic<bool>* cancel_flag = nullptr;
+    transfer::TransferOptions options;
 };
 
 struct ClientCallbacks {
@@ -47,6 +64,15 @@ struct ClientCallbacks {
     std::function<void(const std::string&)> on_error;
     std::function<bool(const std::string&, uint64_t)> on_file_request;
     std::atomic<bool>* cancel_flag = nullptr;
+    transfer::TransferOptions options;
+    // Makes the receiver a relay: once it has the sender's manifest, it
+    // shares the files it takes on to receivers of its own, reported through
+    // these callbacks (on_ready gives their PIN), while it still receives
+    // them. Each chunk goes on from memory as it is written. Such a receiver
+    // takes every file on the control connection, in order, without
+    // multicast; its share offers neither striping, bundles nor deltas.
+    // connect_gui returns once that share is over too.
+    std::optional<ServerCallbacks> relay;
 };
 
 class DiscoveryListener {
@@ -59,16 +85,39 @@ public:
 private:
     std::atomic<bool> running_{false};
     std::thread thread_;
+    std::mutex mtx_;
+    // The listening thread's io_context while it runs; stop() ends it.
+    boost::asio::io_context* io_context_ = nullptr;
 };
+
+class ReceiverGate;
+struct AcceptedReceiver;
+
 class Server {
 public:
     void start(std::queue<TransferJob> jobs);
     void start_gui(std::queue<TransferJob> jobs, ServerCallbacks callbacks);
     void stop();
+    // Stops serving one receiver of a share; the others carry on.
+    void cancel_receiver(uint32_t receiver);
 private:
+    struct Receiver {
+        std::atomic<bool> cancel{false};
+        boost::asio::ip::tcp::socket* socket = nullptr;
+        std::vector<boost::asio::ip::tcp::socket*> stripes;
+    };
+
+    // Sends the share to one authenticated receiver, with the share's other
+    // receivers through `multicast` when it has one. Returns whether every
+    // file went through.
+    bool serve_receiver(uint32_t id, AcceptedReceiver& accepted, std::queue<TransferJob> jobs,
+                        ServerCallbacks callbacks, ReceiverGate& gate, transfer::MulticastShare* multicast);
+    // Called with mtx_ held.
+    void close_receiver(Receiver& receiver);
+
     std::mutex mtx_;
-    boost::asio::ip::tcp::acceptor* acceptor_ = nullptr;
-    boost::asio::ip::tcp::socket* socket_ = nullptr;
+    ReceiverGate* gate_ = nullptr; // while the share takes connections
+    std::map<uint32_t, Receiver*> receivers_;
     bool stopped_ = false;
 };
 
@@ -82,7 +131,12 @@ public:
     void stop();
 private:
     std::mutex mtx_;
+    // While connecting; stop() posts the socket's close to it.
+    boost::asio::io_context* io_context_ = nullptr;
     boost::asio::ip::tcp::socket* socket_ = nullptr;
+    std::vector<boost::asio::ip::tcp::socket*> stripes_;
+    // A relay's share while it runs; stop() stops it too.
+    Server* relay_ = nullptr;
     bool stopped_ = false;
 };
 
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "protocol/file_meta.hpp"
+#include "protocol/manifest.hpp"
+
+namespace protocol {
+
+// Compact encoding of FILE_META, MANIFEST and MANIFEST_REPLY payloads, sent
+// once FEATURE_BINARY_META is negotiated. Every payload starts with the
+// version byte, which no JSON document does, so a receiver tells the two
+// encodings apart by the first byte and older peers keep getting JSON.
+//
+// A file is a flags byte, its size as a varint and its path as a varint
+// length followed by UTF-8 bytes, then the optional fields the flags announce:
+// mtime in Unix seconds as a zigzag varint and permission bits as a varint.
+// A manifest is the version, a varint entry count and the entries; a reply is
+// the version, a varint count and an action byte plus varint offset per entry.
+// Varints are unsigned LEB128.
+constexpr uint8_t BINARY_META_VERSION = 1;
+
+bool is_binary_meta(const char* data, std::size_t size);
+
+// The decoders throw std::runtime_error on truncated or malformed input.
+std::string encode_file_info(const FileInfo& info);
+FileInfo decode_file_info(const char* data, std::size_t size);
+std::string encode_manifest(const Manifest& manifest);
+Manifest decode_manifest(const char* data, std::size_t size);
+std::string encode_manifest_reply(const ManifestReply& reply);
+ManifestReply decode_manifest_reply(const char* data, std::size_t size);
+
+} // namespace protocol
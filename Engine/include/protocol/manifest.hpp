@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+
+namespace protocol {
+
+// One file of a session, in the order the sender will deliver it.
+struct ManifestEntry {
+    std::string path;
+    uint64_t size;
+    int64_t mtime; // seconds since the Unix epoch
+    uint32_t mode = 0; // permission bits, 0 when unknown; binary encoding only
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ManifestEntry, path, size, mtime)
+
+// Payload of MANIFEST, sent once right after the session is set up.
+struct Manifest {
+    std::vector<ManifestEntry> files;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Manifest, files)
+
+enum class FileAction : uint32_t {
+    SKIP = 0,      // not sent at all
+    SEND = 1,      // sent from `offset` to the end after a FILE_START
+    STRIPE = 2,    // FILE_START on the control connection, then a RANGE_REQUEST
+    DELTA = 3,     // FILE_START, BLOCK_SIGNATURES back, then literals and BLOCK_COPY runs
+    MULTICAST = 4  // to the group of MULTICAST_CONFIG; sent whole after a FILE_START if that falls short
+};
+
+// The receiver's answer for one manifest entry, encoded as [action, offset].
+struct FileDecision {
+    FileAction action = FileAction::SKIP;
+    uint64_t offset = 0;
+};
+
+inline void to_json(nlohmann::json& j, const FileDecision& decision) {
+    j = nlohmann::json::array({static_cast<uint32_t>(decision.action), decision.offset});
+}
+
+inline void from_json(const nlohmann::json& j, FileDecision& decision) {
+    uint32_t action = j.at(0).get<uint32_t>();
+    if (action > static_cast<uint32_t>(FileAction::MULTICAST)) {
+        throw std::out_of_range("unknown file action " + std::to_string(action));
+    }
+    decision.action = static_cast<FileAction>(action);
+    decision.offset = j.at(1).get<uint64_t>();
+}
+
+// Payload of MANIFEST_REPLY: one decision per manifest entry, same order.
+struct ManifestReply {
+    std::vector<FileDecision> files;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ManifestReply, files)
+
+} // namespace protocol
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace protocol {
+
+// Payload of MULTICAST_CONFIG, the first packet of a FEATURE_MULTICAST
+// session after the SESSION_CONFIG exchange. Names the group the files of the
+// session will be sent to, once for every receiver of the round, and how they
+// are cut into symbols: blocks of `block_symbols` source symbols of
+// `symbol_size` bytes, the last of a file zero-padded, each followed by
+// Reed-Solomon repair symbols (see fec.hpp). `key` is the hex of the round's
+// group key sealed under this session's key (nonce, ciphertext, tag), empty
+// when the round is not encrypted.
+struct MulticastConfig {
+    std::string group;
+    uint16_t port = 0;
+    uint32_t transfer_id = 0;
+    uint32_t symbol_size = 0;
+    uint32_t block_symbols = 0;
+    std::string key;
+    bool aes_gcm = false;
+};
+
+inline void to_json(nlohmann::json& j, const MulticastConfig& config) {
+    j = nlohmann::json{
+        {"group", config.group},
+        {"port", config.port},
+        {"transfer_id", config.transfer_id},
+        {"symbol_size", config.symbol_size},
+        {"block_symbols", config.block_symbols}
+    };
+    if (!config.key.empty()) {
+        j["key"] = config.key;
+        j["aes_gcm"] = config.aes_gcm;
+    }
+}
+
+inline void from_json(const nlohmann::json& j, MulticastConfig& config) {
+    config.group = j.at("group").get<std::string>();
+    config.port = j.at("port").get<uint16_t>();
+    config.transfer_id = j.at("transfer_id").get<uint32_t>();
+    config.symbol_size = j.at("symbol_size").get<uint32_t>();
+    config.block_symbols = j.at("block_symbols").get<uint32_t>();
+    config.key = j.value("key", std::string());
+    config.aes_gcm = j.value("aes_gcm", false);
+}
+
+// Payload of MULTICAST_CHECK for file `reserved`: its blocks below
+// `block_end` were all sent, the last datagram with `last_sequence`. The
+// receiver answers with MULTICAST_NACK.
+struct MulticastCheck {
+    uint32_t last_sequence = 0;
+    uint32_t block_end = 0;
+};
+
+// Payload of MULTICAST_NACK: for each block below the check's block_end the
+// receiver could not decode yet, [block, symbols still needed]. `received`
+// and `expected` count the round's datagrams so far, for the sender's loss
+// estimate. No blocks once the checked part of the file is complete.
+struct MulticastNack {
+    std::vector<std::array<uint32_t, 2>> blocks;
+    uint32_t received = 0;
+    uint32_t expected = 0;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(MulticastNack, blocks, received, expected)
+
+// Every datagram of a round starts with this header, big-endian. Source
+// symbols have indices below the block's source count, repair symbols follow.
+// Plain datagrams carry the symbol and the CRC32C of header and symbol;
+// sealed ones carry the nonce, the symbol sealed with the header as
+// associated data, and the tag. Datagrams that fail either are dropped as
+// lost.
+struct SymbolHeader {
+    uint32_t transfer_id = 0; // MulticastConfig::transfer_id
+    uint32_t sequence = 0;    // counts the round's datagrams
+    uint32_t file = 0;        // manifest index
+    uint32_t block = 0;
+    uint16_t symbol = 0;
+};
+
+constexpr std::size_t SYMBOL_HEADER_SIZE = 20;
+
+std::array<uint8_t, SYMBOL_HEADER_SIZE> serialize_symbol_header(const SymbolHeader& header);
+SymbolHeader deserialize_symbol_header(const uint8_t* data);
+
+std::array<uint8_t, 8> serialize_multicast_check(const MulticastCheck& check);
+// Throws std::runtime_error unless `size` is that of a check.
+MulticastCheck deserialize_multicast_check(const char* data, std::size_t size);
+
+} // namespace protocol
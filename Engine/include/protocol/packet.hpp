@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <array>
+#include <optional>
+#include <vector>
 
 namespace protocol {
 
@@ -14,9 +17,47 @@ enum class CommandType : uint32_t {
     RESUME = 6,
     AUTH = 7,
     AUTH_OK = 8,
-    AUTH_FAIL = 9
+    AUTH_FAIL = 9,
+    SESSION_CONFIG = 10,
+    STRIPE_JOIN = 11,    // first packet on an extra data connection
+    RANGE_REQUEST = 12,  // receiver asks for byte ranges over the data connections
+    FILE_RANGE = 13,     // payload: 8-byte file offset followed by data
+    MANIFEST = 14,       // every file of the session, sent once up front
+    MANIFEST_REPLY = 15, // receiver's decision for each manifest entry
+    FILE_START = 16,     // data of manifest entry `reserved` follows
+    FILE_BUNDLE = 17,    // several small manifest entries in one frame
+    FILE_CHUNK_Z = 18,   // zstd frame of a FILE_CHUNK; `reserved` is the decompressed size
+    BLOCK_SIGNATURES = 19, // receiver's block signatures of its copy of a DELTA file
+    BLOCK_COPY = 20,       // blocks `reserved` onward of that copy; payload: 4-byte block count
+    HASH_REQUEST = 21,     // receiver asks for block hashes of file `reserved` before resuming it
+    HASH_REPLY = 22,       // sender's answer to HASH_REQUEST
+    FILE_HASH = 23,        // root over the block hashes of the whole file, after its last byte
+    KEY_EXCHANGE = 24,     // sender's key share and key confirmation, answering an encrypted AUTH
+    KEY_CONFIRM = 25,      // receiver's key confirmation
+    CHUNK_NACK = 26,       // receiver's damaged ranges of the file just streamed; empty once none are left
+    MULTICAST_CONFIG = 27, // group and coding of a multicast session (protocol/multicast.hpp)
+    MULTICAST_CHECK = 28,  // sender asks what part of file `reserved` is still missing
+    MULTICAST_NACK = 29    // receiver's answer: symbols still needed per block
 };
 
+// Capability bits carried in the `reserved` field of AUTH (what the client
+// offers) and AUTH_OK (the subset the server accepted). Peers that predate
+// negotiation send 0 and keep the original protocol.
+constexpr uint32_t FEATURE_SESSION_CONFIG = 1u << 0; // client sends SESSION_CONFIG after AUTH_OK
+constexpr uint32_t FEATURE_STRIPING = 1u << 1;       // large files may be striped over extra connections
+constexpr uint32_t FEATURE_PARALLEL_FILES = 1u << 2; // small files are spread over the striping connections
+constexpr uint32_t FEATURE_MANIFEST = 1u << 3;       // files are announced and accepted in one round trip
+constexpr uint32_t FEATURE_BUNDLE = 1u << 4;         // small manifest entries travel packed in FILE_BUNDLE
+constexpr uint32_t FEATURE_BINARY_META = 1u << 5;    // FILE_META and manifests use protocol/binary_meta.hpp
+constexpr uint32_t FEATURE_COMPRESSION = 1u << 6;    // FILE_CHUNK payloads may arrive as FILE_CHUNK_Z
+constexpr uint32_t FEATURE_DELTA = 1u << 7;          // changed files may be sent as a delta (FileAction::DELTA)
+constexpr uint32_t FEATURE_VERIFIED_RESUME = 1u << 8; // a .fluxpart is checked against block hashes before resuming
+constexpr uint32_t FEATURE_FILE_HASH = 1u << 9;       // every streamed file ends with FILE_HASH
+constexpr uint32_t FEATURE_ENCRYPTION = 1u << 10;     // AUTH carries a key share; file data is sealed
+constexpr uint32_t FEATURE_AES_GCM = 1u << 11;        // sealed with AES-256-GCM rather than XChaCha20-Poly1305
+constexpr uint32_t FEATURE_CHUNK_CRC = 1u << 12;      // chunks carry a CRC32C; damaged ones are sent again after CHUNK_NACK
+constexpr uint32_t FEATURE_MULTICAST = 1u << 13;      // file data may reach every receiver at once over UDP multicast
+
 struct PacketHeader {
     uint32_t command;
     uint32_t payload_size;
@@ -27,4 +68,88 @@ struct PacketHeader {
 std::array<uint8_t, 16> serialize_header(const PacketHeader& header);
 PacketHeader deserialize_header(const std::array<uint8_t, 16>& buffer);
 
+// With FEATURE_ENCRYPTION the payloads of FILE_CHUNK, FILE_CHUNK_Z, FILE_RANGE,
+// FILE_BUNDLE, BLOCK_COPY and FILE_HASH are sealed: the nonce, the ciphertext
+// and the 16-byte tag, behind FILE_RANGE's offset, which stays in clear. The
+// associated data ties each one to its header, whose payload_size counts the
+// nonce and tag, to the big-endian manifest index of its file (0 for a file
+// offered by FILE_META) and to the big-endian file offset its plaintext
+// belongs at, 0 for FILE_HASH and FILE_BUNDLE. A FILE_BUNDLE is tied to the
+// first file it carries, whose index its `reserved` holds. So a frame opens
+// only for the file and the place it was sealed for.
+constexpr std::size_t SEALED_FRAME_AD_SIZE = 28;
+std::array<uint8_t, SEALED_FRAME_AD_SIZE> sealed_frame_ad(const PacketHeader& header, uint32_t file,
+                                                          uint64_t position);
+
+// With FEATURE_CHUNK_CRC the CRC32C of a FILE_CHUNK or FILE_RANGE payload
+// travels in `reserved`. FILE_CHUNK_Z, whose `reserved` is taken, ends with
+// the big-endian CRC32C of the zstd frame instead, counted in payload_size.
+// Sealed payloads carry none: their tag already catches damage.
+constexpr std::size_t CHUNK_CRC_SIZE = 4;
+
+// One file packed into a FILE_BUNDLE. The payload starts with an index: the
+// entry count, then (manifest index, size) per file, all big-endian 32-bit.
+// The files' bytes follow back to back in index order.
+struct BundleEntry {
+    uint32_t index;
+    uint32_t size;
+};
+
+constexpr std::size_t bundle_index_size(std::size_t count) {
+    return 4 + 8 * count;
+}
+
+std::vector<uint8_t> serialize_bundle_index(const std::vector<BundleEntry>& entries);
+// Parses the index at the start of a FILE_BUNDLE payload of `size` bytes.
+// Throws std::runtime_error if it does not describe exactly that payload.
+std::vector<BundleEntry> deserialize_bundle_index(const char* data, std::size_t size);
+
+// Payload of BLOCK_SIGNATURES: the block size and block count, then per block
+// its rolling checksum and the first STRONG_SIGNATURE_SIZE bytes of its
+// BLAKE2b hash, all big-endian. Only full blocks are signed.
+constexpr std::size_t STRONG_SIGNATURE_SIZE = 16;
+
+struct BlockSignature {
+    uint32_t weak;
+    std::array<uint8_t, STRONG_SIGNATURE_SIZE> strong;
+};
+
+struct BlockSignatures {
+    uint32_t block_size = 0;
+    std::vector<BlockSignature> blocks;
+};
+
+constexpr std::size_t block_signatures_size(std::size_t count) {
+    return 8 + (4 + STRONG_SIGNATURE_SIZE) * count;
+}
+
+std::vector<uint8_t> serialize_block_signatures(const BlockSignatures& signatures);
+// Throws std::runtime_error if the payload is not exactly one signature list.
+BlockSignatures deserialize_block_signatures(const char* data, std::size_t size);
+
+// A BLAKE2b-256 hash of one block, or of two child hashes in a hash tree.
+constexpr std::size_t BLOCK_HASH_SIZE = 32;
+using BlockHash = std::array<uint8_t, BLOCK_HASH_SIZE>;
+
+// Payload of HASH_REQUEST: the block count as a big-endian 32-bit value,
+// followed by the receiver's hash tree root over those blocks when it holds
+// all of them.
+struct HashRequest {
+    uint32_t block_count = 0;
+    std::optional<BlockHash> root;
+};
+
+// Payload of HASH_REPLY: one byte that is 1 when the request's root matched
+// the sender's, then, if it did not, the sender's block hashes back to back.
+struct HashReply {
+    bool root_matches = false;
+    std::vector<BlockHash> hashes;
+};
+
+std::vector<uint8_t> serialize_hash_request(const HashRequest& request);
+std::vector<uint8_t> serialize_hash_reply(const HashReply& reply);
+// Both throw std::runtime_error if the payload is malformed.
+HashRequest deserialize_hash_request(const char* data, std::size_t size);
+HashReply deserialize_hash_reply(const char* data, std::size_t size);
+
 } // namespace protocol
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace protocol {
+
+// Half-open byte range [begin, end) of a file, encoded as [begin, end].
+struct ByteRange {
+    uint64_t begin;
+    uint64_t end;
+};
+
+inline void to_json(nlohmann::json& j, const ByteRange& range) {
+    j = nlohmann::json::array({range.begin, range.end});
+}
+
+inline void from_json(const nlohmann::json& j, ByteRange& range) {
+    range.begin = j.at(0).get<uint64_t>();
+    range.end = j.at(1).get<uint64_t>();
+}
+
+// Payload of RANGE_REQUEST: the ranges each data connection should carry,
+// indexed like the STRIPE_JOIN packets and sent in order on that connection.
+struct RangeRequest {
+    std::vector<std::vector<ByteRange>> stripes;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(RangeRequest, stripes)
+
+// Payload of CHUNK_NACK: the ranges of the file just streamed whose chunks
+// failed their check, for the sender to send again as FILE_RANGE frames.
+struct ChunkNack {
+    std::vector<ByteRange> ranges;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ChunkNack, ranges)
+
+} // namespace protocol
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <nlohmann/json.hpp>
+
+namespace protocol {
+
+// Receiver limits sent once after AUTH_OK when FEATURE_SESSION_CONFIG was
+// negotiated. With FEATURE_STRIPING the server answers with its own config
+// carrying the granted stripe count and the token the data connections must
+// present. Unknown keys are ignored and missing ones read as empty, so either
+// side can grow the message without breaking older peers.
+struct SessionConfig {
+    uint32_t min_chunk_size = 0;
+    uint32_t max_chunk_size = 0;
+    uint32_t stripes = 0;
+    std::string stripe_token;
+};
+
+inline void to_json(nlohmann::json& j, const SessionConfig& config) {
+    j = nlohmann::json{
+        {"min_chunk_size", config.min_chunk_size},
+        {"max_chunk_size", config.max_chunk_size},
+        {"stripes", config.stripes}
+    };
+    if (!config.stripe_token.empty()) {
+        j["stripe_token"] = config.stripe_token;
+    }
+}
+
+inline void from_json(const nlohmann::json& j, SessionConfig& config) {
+    config.min_chunk_size = j.value("min_chunk_size", 0u);
+    config.max_chunk_size = j.value("max_chunk_size", 0u);
+    config.stripes = j.value("stripes", 0u);
+    config.stripe_token = j.value("stripe_token", std::string());
+}
+
+} // namespace protocol
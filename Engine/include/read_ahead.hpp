@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "buffer_pool.hpp"
+#include "chunk_sizer.hpp"
+
+namespace transfer {
+
+// Reads a file on a background thread into a bounded queue of pooled
+// buffers, so the next chunks are already in memory while the current one
+// is written to the socket. Each chunk holds up to chunk_sizer.next() bytes.
+// With a depth of 0 chunks are read on the caller's thread instead.
+// Destroying the reader stops the thread; queued chunks are dropped.
+class FileReadAhead {
+public:
+    struct Chunk {
+        BufferPool::Buffer buffer;
+        std::size_t size = 0;
+    };
+
+    // Fills up to the given number of bytes and returns how many it did, 0 at
+    // the end.
+    using Source = std::function<std::size_t(char*, std::size_t)>;
+
+    // Reads from the current position of `file` to EOF.
+    FileReadAhead(std::ifstream file, std::size_t depth, BufferPool& pool, const ChunkSizer& chunk_sizer);
+    // Reads from `source` instead, such as a file a relay is still receiving.
+    FileReadAhead(Source source, std::size_t depth, BufferPool& pool, const ChunkSizer& chunk_sizer);
+    ~FileReadAhead();
+
+    FileReadAhead(const FileReadAhead&) = delete;
+    FileReadAhead& operator=(const FileReadAhead&) = delete;
+
+    // Blocks until the next chunk is ready. Returns false at end of file and
+    // rethrows a read error from the background thread.
+    bool next(Chunk& chunk);
+
+private:
+    void run();
+    bool read_chunk(Chunk& chunk);
+
+    std::ifstream file_;
+    Source source_;
+    std::size_t depth_;
+    BufferPool& pool_;
+    const ChunkSizer& chunk_sizer_;
+
+    std::mutex mtx_;
+    std::condition_variable ready_cv_;
+    std::condition_variable space_cv_;
+    std::deque<Chunk> queue_;
+    std::exception_ptr error_;
+    bool done_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+} // namespace transfer
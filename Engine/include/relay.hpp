@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "protocol/manifest.hpp"
+#include "protocol/packet.hpp"
+
+namespace transfer {
+
+// Bytes of received chunks a relay keeps in memory for its downstream
+// receivers. One that falls further behind reads them back from disk.
+constexpr std::size_t RELAY_WINDOW = 32 * 1024 * 1024;
+
+// The files a relay is receiving, as the share that passes them on sees
+// them. The receiving session hands every chunk it writes to a .fluxpart
+// to append() as well; the share's sessions read the same bytes back from
+// memory while they are in the window, and from disk when a downstream
+// receiver resumes or falls behind. Files are keyed by the path they are
+// saved under.
+class RelayFeed {
+public:
+    explicit RelayFeed(std::size_t window = RELAY_WINDOW);
+
+    RelayFeed(const RelayFeed&) = delete;
+    RelayFeed& operator=(const RelayFeed&) = delete;
+
+    // Receiving side. follow() announces a file of the upstream manifest
+    // before any of it arrives, under the `entry` downstream receivers get.
+    // The first `resumed` bytes of its .fluxpart are left from an earlier
+    // session and can be read already.
+    void follow(const std::string& path, const protocol::ManifestEntry& entry, uint64_t resumed = 0);
+    bool follows(const std::string& path) const;
+    // The file is streamed from `offset`; what comes before it is in the
+    // .fluxpart already.
+    void start(const std::string& path, uint64_t offset);
+    // The next `size` bytes of the file. `on_disk` is how far the .fluxpart
+    // can be read back so far.
+    void append(const std::string& path, const char* data, std::size_t size, uint64_t on_disk);
+    // The file is complete under `path`. `root` is the hash the upstream
+    // sender vouched for it with, when there was one.
+    void finish(const std::string& path, const std::optional<protocol::BlockHash>& root);
+    void fail(const std::string& path);
+    // The upstream session is over: every file not finished has failed.
+    // Returns whether all of them were finished.
+    bool close();
+
+    // Share side. The entry of a followed file for the share's manifest.
+    std::optional<protocol::ManifestEntry> entry(const std::string& path) const;
+    // Hashes of the first `count` blocks of a followed file, for a
+    // downstream receiver's verified resume. Waits until that much of it is
+    // on disk, so a receiver that got further than the relay keeps what it
+    // has; fewer come back if the upstream fails it first. Throws
+    // std::runtime_error if `cancel_flag` is set.
+    std::vector<protocol::BlockHash> block_hashes(const std::string& path, uint64_t count,
+                                                  const std::atomic<bool>* cancel_flag = nullptr);
+
+    // Reads a followed file in order as it arrives, for one downstream send.
+    class Reader {
+    public:
+        Reader(RelayFeed& feed, const std::string& path, uint64_t offset, const std::atomic<bool>* cancel_flag);
+
+        // Blocks until the bytes at the read position are there and copies up
+        // to `size` of them to `out`. Returns 0 once the whole file was read
+        // and finished upstream. Throws std::runtime_error if the upstream
+        // failed it or `cancel_flag` was set.
+        std::size_t read(char* out, std::size_t size);
+        // What finish() was given, once read() returned 0.
+        const std::optional<protocol::BlockHash>& root() const { return root_; }
+
+    private:
+        RelayFeed& feed_;
+        std::string path_;
+        uint64_t position_;
+        const std::atomic<bool>* cancel_flag_;
+        std::ifstream disk_; // open only while reading behind the window
+        std::optional<protocol::BlockHash> root_;
+    };
+
+private:
+    enum class State {
+        PENDING,
+        STREAMING,
+        FINISHED,
+        FAILED
+    };
+
+    struct File {
+        protocol::ManifestEntry entry;
+        State state = State::PENDING;
+        uint64_t end = 0;     // one past the last byte received
+        uint64_t on_disk = 0; // of the .fluxpart
+        std::optional<protocol::BlockHash> root;
+    };
+
+    struct Chunk {
+        const File* file;
+        uint64_t offset;
+        std::vector<char> data;
+    };
+
+    // Called with mtx_ held. Throws std::runtime_error for a path the feed
+    // does not follow.
+    File& file(const std::string& path);
+    // Waits on cv_ for a while; throws if `cancel_flag` is set.
+    void wait(std::unique_lock<std::mutex>& lock, const std::atomic<bool>* cancel_flag);
+
+    std::size_t window_;
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::map<std::string, File> files_;
+    std::deque<Chunk> chunks_; // oldest first
+    std::size_t buffered_ = 0;
+    std::vector<std::vector<char>> spare_;
+};
+
+} // namespace transfer
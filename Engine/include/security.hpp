@@ -1,15 +1,122 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <string>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 namespace security {
 
-uint16_t generate_pin();
+// Six digits. The PIN is all the CPace key exchange is keyed by, so the
+// receiver gate bounds how many guesses a share allows.
+uint32_t generate_pin();
 
 std::string hash_pin(const std::string& pin);
 
 bool verify_pin(const std::string& pin, const std::string& expected_hash);
 
+// 128 random bits, hex encoded. Lets extra connections join an authenticated session.
+std::string generate_token();
+
+constexpr std::size_t KEY_SHARE_SIZE = 32;
+constexpr std::size_t KEY_CONFIRMATION_SIZE = 32;
+constexpr std::size_t SESSION_KEY_SIZE = 32;
+
+using KeyShare = std::array<uint8_t, KEY_SHARE_SIZE>;
+using KeyConfirmation = std::array<uint8_t, KEY_CONFIRMATION_SIZE>;
+using SessionKey = std::array<uint8_t, SESSION_KEY_SIZE>;
+
+// One side of a CPace key exchange over ristretto255, keyed by the PIN.
+// Both sides map the PIN to a group element G and send y*G for a random
+// scalar y; only a peer that used the same PIN arrives at the same key.
+// The shares reveal nothing that an eavesdropper could test PIN guesses
+// against offline, so each guess costs a connection to the server.
+class PinKeyExchange {
+public:
+    // Throws std::runtime_error if libsodium cannot be initialised.
+    PinKeyExchange(const std::string& pin, bool server);
+    ~PinKeyExchange();
+
+    PinKeyExchange(const PinKeyExchange&) = delete;
+    PinKeyExchange& operator=(const PinKeyExchange&) = delete;
+
+    const KeyShare& share() const { return share_; }
+
+    // Derives the keys from the peer's share and `context`, which both sides
+    // must pass alike; the session binds its feature bits this way, so they
+    // cannot be changed in transit. Returns false if the share is not a
+    // valid group element.
+    bool complete(const KeyShare& peer_share, const std::vector<uint8_t>& context = {});
+
+    // Proof for the peer that this side holds the same key, and the check of
+    // the peer's proof. Valid once complete() succeeded.
+    KeyConfirmation confirmation() const;
+    bool check_peer_confirmation(const KeyConfirmation& confirmation) const;
+
+    const SessionKey& session_key() const { return session_key_; }
+
+private:
+    bool server_;
+    std::array<uint8_t, 32> scalar_{};
+    KeyShare share_{};
+    SessionKey confirm_key_{};
+    SessionKey session_key_{};
+    std::vector<uint8_t> transcript_; // client share, server share, context
+};
+
+// Authenticated encryption of data frames under a session key, in place:
+// AES-256-GCM where both peers have AES-NI (aes_gcm), XChaCha20-Poly1305
+// otherwise. Each frame takes a fresh random nonce, which the sender puts in
+// front of the ciphertext and the tag after it; 2^32 frames per session keep
+// random GCM nonces well clear of a collision. Thread-safe, so frames can be
+// sealed on several threads at once.
+class FrameCipher {
+public:
+    static constexpr std::size_t TAG_SIZE = 16;
+    static constexpr std::size_t MAX_NONCE_SIZE = 24;
+    using Nonce = std::array<uint8_t, MAX_NONCE_SIZE>;
+    using Tag = std::array<uint8_t, TAG_SIZE>;
+
+    // True when this CPU can run libsodium's AES-256-GCM.
+    static bool aes_gcm_available();
+
+    FrameCipher(const SessionKey& key, bool aes_gcm);
+    ~FrameCipher();
+
+    FrameCipher(const FrameCipher&) = delete;
+    FrameCipher& operator=(const FrameCipher&) = delete;
+
+    bool aes_gcm() const { return aes_gcm_; }
+    std::size_t nonce_size() const;
+    // Bytes a sealed payload carries beyond its plaintext.
+    std::size_t overhead() const { return nonce_size() + TAG_SIZE; }
+
+    // Encrypts `size` bytes at `data` in place, binding `ad`, and fills in
+    // the first nonce_size() bytes of `nonce` and the tag.
+    void seal(char* data, std::size_t size, const uint8_t* ad, std::size_t ad_size, Nonce& nonce, Tag& tag) const;
+    // Decrypts in place. Throws std::runtime_error if the frame was not
+    // sealed under this key with the same `ad`.
+    void open(char* data, std::size_t size, const uint8_t* ad, std::size_t ad_size, const Nonce& nonce,
+              const Tag& tag) const;
+
+private:
+    struct GcmState;
+
+    SessionKey key_;
+    bool aes_gcm_;
+    std::unique_ptr<GcmState> gcm_;
+};
+
+// A random key for a group of peers, such as the receivers of a multicast
+// round. Throws std::runtime_error if libsodium cannot be initialised.
+SessionKey generate_key();
+
+// `key` sealed under `cipher` for one peer of the group, hex encoded.
+std::string seal_key(const FrameCipher& cipher, const SessionKey& key);
+// Throws std::runtime_error unless `sealed` came from seal_key() under the
+// same session key.
+SessionKey open_key(const FrameCipher& cipher, const std::string& sealed);
+
 } // namespace security
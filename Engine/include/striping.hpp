@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+#include "protocol/range_request.hpp"
+
+namespace transfer {
+
+using ByteRanges = std::vector<protocol::ByteRange>;
+
+// Files with at least this much left to download are striped when the
+// session has extra data connections. Smaller ones are not worth the setup.
+constexpr uint64_t STRIPE_THRESHOLD = 64ull * 1024 * 1024;
+
+// A striped download writes out of order, so a .fluxpart's size no longer
+// says what is on disk. The completed ranges are kept next to it in
+// `<name>.fluxpart.ranges`.
+std::filesystem::path ranges_path(const std::filesystem::path& part_path);
+
+// Ranges of the file already on disk: the sidecar's contents if there is one,
+// otherwise the .fluxpart read as a prefix written by the sequential path.
+ByteRanges load_completed_ranges(const std::filesystem::path& part_path, uint64_t file_size);
+// Replaces the sidecar atomically. Throws on I/O errors.
+void save_completed_ranges(const std::filesystem::path& part_path, uint64_t file_size,
+                           const ByteRanges& completed);
+
+// Sorted, coalesced union of `ranges`.
+ByteRanges merge_ranges(ByteRanges ranges);
+ByteRanges missing_ranges(const ByteRanges& completed, uint64_t file_size);
+uint64_t total_bytes(const ByteRanges& ranges);
+// The ranges covering the first `bytes` bytes of `ranges`.
+ByteRanges leading_ranges(const ByteRanges& ranges, uint64_t bytes);
+
+// Splits `ranges` into `count` lists of roughly equal size, each in file order.
+std::vector<ByteRanges> plan_stripes(const ByteRanges& ranges, std::size_t count);
+
+// Readies a .fluxpart for the sequential path: truncates it to the completed
+// prefix and drops the ranges sidecar. Returns the offset to resume from.
+uint64_t prepare_sequential_resume(const std::filesystem::path& part_path, const ByteRanges& completed);
+
+} // namespace transfer
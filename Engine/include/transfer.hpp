@@ -1,14 +1,42 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <filesystem>
 #include <functional>
 #include <boost/asio.hpp>
 #include "protocol/packet.hpp"
 #include "protocol/file_meta.hpp"
+#include "protocol/session_config.hpp"
+#include "protocol/range_request.hpp"
+#include "protocol/manifest.hpp"
+#include "protocol/multicast.hpp"
+#include "buffer_pool.hpp"
+#include "chunk_sizer.hpp"
+#include "framed_reader.hpp"
 #include <atomic>
+#include <memory>
+
+namespace security {
+class FrameCipher;
+}
 
 namespace transfer {
 
+class RelayFeed;
+
+// Frame size used with peers that did not negotiate a range, and the floor
+// of any negotiated one.
+constexpr std::size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+constexpr std::size_t MAX_CHUNK_SIZE = 8 * 1024 * 1024;
+// Receiver buffers. Small frames are coalesced into them, so the disk sees
+// large sequential writes.
+constexpr std::size_t RECEIVE_BUFFER_SIZE = 1024 * 1024;
+// Accepted files below this size are packed into FILE_BUNDLE frames of at
+// most BUNDLE_SIZE payload bytes when the peer negotiated bundling.
+constexpr uint64_t BUNDLE_FILE_THRESHOLD = 64 * 1024;
+constexpr std::size_t BUNDLE_SIZE = RECEIVE_BUFFER_SIZE;
+
 using TransferProgressCallback = std::function<void(const std::string&, uint64_t, uint64_t, double)>;
 
 enum class TransferState {
@@ -17,26 +45,266 @@ enum class TransferState {
     FAILED
 };
 
+enum class IoBackend {
+    AUTO,     // sendfile/splice on Linux, buffered streams elsewhere
+    BUFFERED  // always copy through user-space buffers
+};
+
+struct TransferOptions {
+    IoBackend io_backend = IoBackend::AUTO;
+    // Chunks the sender keeps read ahead of the socket. The buffered path
+    // fills a queue on a reader thread; sendfile(2) asks the kernel to
+    // prefetch the same window. 0 reads each chunk only when it is sent.
+    std::size_t read_ahead_depth = 4;
+    // Buffers the receiver may queue for its disk-writer thread; spliced
+    // payload queues up to as many 1 MB pipes instead. 0 writes each chunk
+    // before the next one is read.
+    std::size_t write_behind_depth = 8;
+    // Extra data connections a session may open for striping large files.
+    // 0 keeps every file on the control connection.
+    std::size_t stripes = 4;
+    // Lets a session send several files at once, one per striping
+    // connection, before the files large enough to be striped.
+    bool parallel_files = true;
+    // Packs accepted files below BUNDLE_FILE_THRESHOLD into FILE_BUNDLE frames
+    // instead of sending each behind its own FILE_START.
+    bool bundle_small_files = true;
+    // Sends FILE_CHUNK payloads as zstd-compressed FILE_CHUNK_Z frames when
+    // the peer negotiated FEATURE_COMPRESSION (see compression.hpp). Each
+    // file is sampled first and only compressed, on the buffered path, when
+    // that beats sending it raw over the measured link; the rest keep
+    // zero-copy. Striped ranges and bundles are sent as they are.
+    bool compress_chunks = true;
+    // Offers FEATURE_DELTA. As the receiver, a changed file of at least
+    // DELTA_MIN_SIZE is then asked for as a delta against the copy already
+    // on disk (see delta.hpp) instead of being sent again in full.
+    bool delta_transfer = true;
+    // Ends every streamed file with FILE_HASH when the peer negotiated
+    // FEATURE_FILE_HASH: both sides hash the file in 1 MiB blocks on
+    // background threads as it goes (see hash_tree.hpp), and the receiver
+    // discards a file whose root differs instead of renaming it into place.
+    // Bundled files are not covered. Off by default: each side spends a
+    // BLAKE2b pass over the file, about a second of CPU per GB, which the
+    // transfer only hides when both machines have cores to spare.
+    bool verify_files = false;
+    // Offers FEATURE_ENCRYPTION: the PIN is proven with a key exchange
+    // instead of its hash (see security.hpp), and the session's file data is
+    // sealed under the key it yields when both peers turn this on. Off by
+    // default: sealed files take the buffered path, which runs at a fraction
+    // of sendfile's rate on machines with few cores, and senders that
+    // predate it refuse the key exchange.
+    bool encrypt_sessions = false;
+    // Offers FEATURE_CHUNK_CRC, for links that damage data TCP's checksum
+    // lets through: every chunk of a streamed or striped file carries a
+    // CRC32C, and the receiver asks with CHUNK_NACK for the ranges whose
+    // chunks failed it, or failed authentication in a sealed session, once
+    // the file is through. Only those ranges are sent again, which costs a
+    // round trip per file. Plain chunks take the buffered path. Bundles are
+    // not covered.
+    bool chunk_checksums = false;
+    // Receivers a share serves before it stops taking more, each on its own
+    // connections and thread, all at once; 0 takes receivers until the share
+    // is stopped. They read the same files, mostly from the page cache.
+    uint32_t max_receivers = 1;
+    // Offers FEATURE_MULTICAST. A share then sends the files its receivers
+    // take whole to a multicast group once for all of them, cut into blocks
+    // with Reed-Solomon repair symbols (see multicast.hpp); each receiver's
+    // control connection carries only the checks and its NACKs. What a
+    // receiver does not get that way follows over TCP as usual.
+    bool multicast = false;
+    // Ceiling of the multicast send rate, in bytes per second. A round
+    // starts at an eighth of it and backs off whenever the receivers report
+    // a jump in loss.
+    uint64_t multicast_rate = 16 * 1024 * 1024;
+    // Set on both sessions of a relay (see relay.hpp). The receiving one
+    // hands every chunk of a file the feed follows to it as the chunk is
+    // written, which keeps those files out of splice(2). The share's
+    // sessions send those files from it instead of from disk, on the
+    // buffered path, and vouch for them with the root they arrived with.
+    std::shared_ptr<RelayFeed> relay;
+    // Set by the session once the key exchange succeeded and both peers
+    // negotiated encryption. Every payload that carries file data is then
+    // sealed, and the receivers reject any that is not. Sealing needs the
+    // bytes in user space, so sealed files take the buffered path.
+    std::shared_ptr<const security::FrameCipher> cipher;
+};
+
+// A small file to pack into a FILE_BUNDLE under its manifest index.
+struct BundledFile {
+    uint32_t index;
+    std::string filepath;
+    uint32_t size;
+};
+
+class DeltaBasis;
+class SourceFileHash;
+
+// Disables Nagle's algorithm. Every frame is emitted with one gathered write,
+// so holding back small segments would only delay control packets.
+void configure_socket(boost::asio::ip::tcp::socket& socket);
+
+// Moves a complete .fluxpart over `final_path`, replacing any file there, and
+// drops its block-hash sidecar. Returns false, leaving it in place, on error.
+bool replace_with_completed_file(const std::filesystem::path& part_path, const std::filesystem::path& final_path);
+
+// Where a file is sent or received, `index` is its manifest index, 0 for one
+// offered by FILE_META. Sealed frames are bound to it (see
+// protocol::sealed_frame_ad), so they cannot be passed off as another file's.
 class MessageSender {
 public:
     static void send(boost::asio::ip::tcp::socket& socket, const std::string& message);
     static void send_header(boost::asio::ip::tcp::socket& socket, const protocol::PacketHeader& header);
-    static void send_file_meta(boost::asio::ip::tcp::socket& socket, const protocol::FileInfo& info);
+    static void send_packet(boost::asio::ip::tcp::socket& socket, const protocol::PacketHeader& header,
+                            boost::asio::const_buffer payload);
+    // `binary` selects protocol/binary_meta.hpp over JSON; only for peers that
+    // negotiated FEATURE_BINARY_META. The receivers accept either encoding.
+    static void send_file_meta(boost::asio::ip::tcp::socket& socket, const protocol::FileInfo& info,
+                               bool binary = false);
+    static void send_session_config(boost::asio::ip::tcp::socket& socket, const protocol::SessionConfig& config);
     static bool send_file(boost::asio::ip::tcp::socket& socket, const std::string& filepath,
-                          uint32_t session_id, uint64_t start_offset = 0,
+                          uint32_t session_id, uint32_t index, uint64_t start_offset = 0,
                           TransferProgressCallback progress_cb = nullptr,
-                          std::atomic<bool>* cancel_flag = nullptr);
+                          std::atomic<bool>* cancel_flag = nullptr,
+                          const TransferOptions& options = {},
+                          BufferPool* pool = nullptr,
+                          ChunkSizer* chunk_sizer = nullptr);
+    // Sends `filepath` as a delta against the receiver's `signatures`: literal
+    // data as FILE_CHUNK frames, blocks the receiver already has as BLOCK_COPY.
+    static bool send_delta(boost::asio::ip::tcp::socket& socket, const std::string& filepath,
+                           uint32_t session_id, uint32_t index, const protocol::BlockSignatures& signatures,
+                           TransferProgressCallback progress_cb = nullptr,
+                           std::atomic<bool>* cancel_flag = nullptr,
+                           const TransferOptions& options = {},
+                           ChunkSizer* chunk_sizer = nullptr);
+    // Waits for the root of `hash` and sends it as FILE_HASH, sealed under
+    // `cipher` if there is one. If the file could not be hashed, sends CANCEL
+    // instead and returns false.
+    static bool send_file_hash(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t index,
+                               SourceFileHash& hash, const security::FrameCipher* cipher = nullptr);
+    static void send_range_request(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                   const protocol::RangeRequest& request);
+    static void send_chunk_nack(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                const protocol::ChunkNack& nack);
+    // The control packets of a multicast round; check and nack carry the
+    // manifest index of their file in `reserved`.
+    static void send_multicast_config(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                      const protocol::MulticastConfig& config);
+    static void send_multicast_check(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t file,
+                                     const protocol::MulticastCheck& check);
+    static void send_multicast_nack(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t file,
+                                    const protocol::MulticastNack& nack);
+    // Follows a file sent with `options.chunk_checksums`: reads the
+    // receiver's CHUNK_NACKs from `reader` and sends the ranges they list
+    // again as FILE_RANGE frames, until one lists none. Returns false if the
+    // file could not be read again or the transfer was cancelled.
+    static bool send_repairs(boost::asio::ip::tcp::socket& socket, FramedReader& reader,
+                             const std::string& filepath, uint32_t session_id, uint32_t index,
+                             std::atomic<bool>* cancel_flag = nullptr,
+                             const TransferOptions& options = {},
+                             BufferPool* pool = nullptr);
+    // `index` is the manifest index of the file, 0 for one offered by FILE_META.
+    static void send_hash_request(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t index,
+                                  const protocol::HashRequest& request);
+    static void send_hash_reply(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t index,
+                                const protocol::HashReply& reply);
+    static void send_manifest(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                              const protocol::Manifest& manifest, bool binary = false);
+    static void send_manifest_reply(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                    const protocol::ManifestReply& reply, bool binary = false);
+    // Sends `files` as one FILE_BUNDLE. A file that can no longer be read in
+    // full is left out of the bundle and never arrives.
+    static bool send_bundle(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                            const std::vector<BundledFile>& files, const TransferOptions& options = {},
+                            BufferPool* pool = nullptr);
+    // Serves a RANGE_REQUEST: stripe i of the request goes out on stripes[i]
+    // as FILE_RANGE frames, all stripes in parallel.
+    static bool send_striped(const std::vector<boost::asio::ip::tcp::socket*>& stripes,
+                             const std::string& filepath, uint32_t session_id, uint32_t index,
+                             const protocol::RangeRequest& request,
+                             TransferProgressCallback progress_cb = nullptr,
+                             std::atomic<bool>* cancel_flag = nullptr,
+                             const TransferOptions& options = {},
+                             BufferPool* pool = nullptr);
 };
 
 class MessageReceiver {
 public:
     static std::string receive(boost::asio::ip::tcp::socket& socket);
     static protocol::PacketHeader receive_header(boost::asio::ip::tcp::socket& socket);
-    static protocol::FileInfo receive_file_meta(boost::asio::ip::tcp::socket& socket, uint32_t payload_size);
+    static protocol::PacketHeader receive_header(FramedReader& reader);
+    static protocol::FileInfo receive_file_meta(boost::asio::ip::tcp::socket& socket, uint32_t payload_size,
+                                                BufferPool* pool = nullptr);
+    static protocol::FileInfo receive_file_meta(FramedReader& reader, uint32_t payload_size,
+                                                BufferPool* pool = nullptr);
+    // Returns a zeroed config if the payload cannot be parsed.
+    static protocol::SessionConfig receive_session_config(FramedReader& reader, uint32_t payload_size);
+    static protocol::RangeRequest receive_range_request(FramedReader& reader, uint32_t payload_size);
+    // Throws if the payload cannot be parsed, since an empty list would
+    // accept the damaged ranges.
+    static protocol::ChunkNack receive_chunk_nack(FramedReader& reader, uint32_t payload_size);
+    // All three throw if the payload cannot be parsed: the sender and its
+    // receivers would no longer agree on what the round sent.
+    static protocol::MulticastConfig receive_multicast_config(FramedReader& reader, uint32_t payload_size);
+    static protocol::MulticastCheck receive_multicast_check(FramedReader& reader, uint32_t payload_size);
+    static protocol::MulticastNack receive_multicast_nack(FramedReader& reader, uint32_t payload_size);
+    // Returns no blocks if the payload cannot be parsed, so the whole file is
+    // sent as literal data.
+    static protocol::BlockSignatures receive_block_signatures(FramedReader& reader, uint32_t payload_size);
+    // Both return an empty request or reply if the payload cannot be parsed,
+    // which makes the receiver start the file over.
+    static protocol::HashRequest receive_hash_request(FramedReader& reader, uint32_t payload_size);
+    static protocol::HashReply receive_hash_reply(FramedReader& reader, uint32_t payload_size);
+    // Both return an empty list if the payload cannot be parsed.
+    static protocol::Manifest receive_manifest(FramedReader& reader, uint32_t payload_size);
+    static protocol::ManifestReply receive_manifest_reply(FramedReader& reader, uint32_t payload_size);
+    // Receives a FILE_BUNDLE and writes each file it carries straight to
+    // `save_path(index)`. The whole payload is in memory before the first file
+    // is opened, so no .fluxpart stage is needed. The indices written are
+    // appended to `saved`; `save_path` may throw to refuse an index.
+    static TransferState receive_bundle(FramedReader& reader, const protocol::PacketHeader& header,
+                                        const std::function<std::string(uint32_t)>& save_path,
+                                        std::vector<uint32_t>& saved, const TransferOptions& options = {},
+                                        BufferPool* pool = nullptr);
+    // Requests the ranges of `filepath` not in `completed`, split across the
+    // data connections, and writes them into the .fluxpart as they arrive.
+    // Progress is kept in the .fluxpart.ranges sidecar so a later session can
+    // resume. With `options.verify_files` the sender's FILE_HASH is then read
+    // from `control`.
+    static TransferState receive_striped(FramedReader& control,
+                                         const std::vector<FramedReader*>& stripes,
+                                         const std::string& filepath, uint64_t expected_size,
+                                         uint32_t session_id, uint32_t index,
+                                         const std::vector<protocol::ByteRange>& completed,
+                                         TransferProgressCallback progress_cb = nullptr,
+                                         std::atomic<bool>* cancel_flag = nullptr,
+                                         const TransferOptions& options = {},
+                                         BufferPool* pool = nullptr);
     static TransferState receive_file(boost::asio::ip::tcp::socket& socket, const std::string& filepath,
-                                      uint64_t expected_size, uint64_t start_offset = 0,
+                                      uint64_t expected_size, uint32_t index, uint64_t start_offset = 0,
+                                      TransferProgressCallback progress_cb = nullptr,
+                                      std::atomic<bool>* cancel_flag = nullptr,
+                                      const TransferOptions& options = {},
+                                      BufferPool* pool = nullptr);
+    // With a `basis`, BLOCK_COPY frames are served from it and it is closed
+    // before the .fluxpart replaces `filepath`. With `options.chunk_checksums`
+    // the ranges whose chunks arrived damaged are asked for again before the
+    // file is hashed; a file still damaged after a few rounds is discarded.
+    static TransferState receive_file(FramedReader& reader, const std::string& filepath,
+                                      uint64_t expected_size, uint32_t index, uint64_t start_offset = 0,
                                       TransferProgressCallback progress_cb = nullptr,
-                                      std::atomic<bool>* cancel_flag = nullptr);
+                                      std::atomic<bool>* cancel_flag = nullptr,
+                                      const TransferOptions& options = {},
+                                      BufferPool* pool = nullptr,
+                                      DeltaBasis* basis = nullptr);
+    // Answers the FILE_START of a DELTA file: signs the copy already at
+    // `filepath`, sends the signatures back as BLOCK_SIGNATURES and rebuilds
+    // the new version in its .fluxpart from what the sender returns.
+    static TransferState receive_delta(FramedReader& reader, const std::string& filepath,
+                                       uint64_t expected_size, uint32_t session_id, uint32_t index,
+                                       TransferProgressCallback progress_cb = nullptr,
+                                       std::atomic<bool>* cancel_flag = nullptr,
+                                       const TransferOptions& options = {},
+                                       BufferPool* pool = nullptr);
 };
 
 } // namespace transfer
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include "buffer_pool.hpp"
+
+namespace transfer {
+
+// Commits received payload to disk on its own thread. The socket side fills
+// pooled buffers and queues them; once `depth` buffers are waiting it blocks,
+// so a slow disk pushes back through TCP flow control instead of growing
+// memory. Time each side spends blocked on the other is recorded, telling a
+// slow disk apart from a slow network. The thread starts with the first full
+// buffer, so tiny files never spawn one. Destroying the stage drops anything
+// still queued, which leaves a shorter but valid prefix on disk.
+class WriteBehind {
+public:
+    using Sink = std::function<void(const char* data, std::size_t size)>;
+    using Duration = std::chrono::steady_clock::duration;
+
+    WriteBehind(Sink sink, std::size_t depth, BufferPool& pool);
+    ~WriteBehind();
+
+    WriteBehind(const WriteBehind&) = delete;
+    WriteBehind& operator=(const WriteBehind&) = delete;
+
+    // Free space in the current staging buffer, which is never empty. Fill
+    // some of it and report how much with commit().
+    char* prepare(std::size_t& available);
+    void commit(std::size_t size);
+    // Copies `size` bytes through prepare()/commit().
+    void write(const char* data, std::size_t size);
+    // Queues the partial staging buffer and waits until the disk thread has
+    // written everything. Rethrows the first write error.
+    void flush();
+
+    // Socket side blocked on a full queue.
+    Duration disk_stall() const { return disk_stall_; }
+    // Disk thread idle on an empty queue.
+    Duration network_stall() const;
+
+private:
+    struct Pending {
+        BufferPool::Buffer buffer;
+        std::size_t size;
+    };
+
+    void enqueue();
+    void run();
+
+    Sink sink_;
+    std::size_t depth_;
+    BufferPool& pool_;
+
+    BufferPool::Buffer staging_;
+    std::size_t staged_ = 0;
+    Duration disk_stall_{};
+
+    mutable std::mutex mtx_;
+    std::condition_variable ready_cv_;
+    std::condition_variable space_cv_;
+    std::deque<Pending> queue_;
+    bool writing_ = false;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+    Duration network_stall_{};
+    std::thread thread_;
+};
+
+#ifdef __linux__
+
+// The same stage for payload spliced from the socket, which never enters
+// user space. The socket side splices it into one of up to `depth` pipes and
+// queues the pipe once it is full or the socket runs dry; the disk thread
+// splices each queued pipe on into the file and hands it back. Waiting for a
+// free pipe and for a queued one are recorded like the buffers' waits.
+// Bytes that are in user space already go through the same pipes, so the
+// file is always written in order. Destroying the stage drops what the
+// pipes still hold.
+class PipeWriteBehind {
+public:
+    using Duration = WriteBehind::Duration;
+
+    // Writes to `fd`, which stays owned by the caller, from `offset` on, with
+    // pipes of up to `pipe_size` bytes. Throws boost::system::system_error if
+    // not even one pipe can be created.
+    PipeWriteBehind(int fd, uint64_t offset, std::size_t depth, std::size_t pipe_size, BufferPool& pool);
+    ~PipeWriteBehind();
+
+    PipeWriteBehind(const PipeWriteBehind&) = delete;
+    PipeWriteBehind& operator=(const PipeWriteBehind&) = delete;
+
+    // Moves the next `count` payload bytes from `socket` into the pipes,
+    // through a buffer if the socket cannot be spliced.
+    void splice_from(boost::asio::ip::tcp::socket& socket, std::size_t count);
+    void write(const char* data, std::size_t size);
+    // Queues the pipe being filled and waits until the disk thread has
+    // written everything. Rethrows the first write error.
+    void flush();
+
+    Duration disk_stall() const { return disk_stall_; }
+    Duration network_stall() const;
+    // End of the bytes that have reached the file.
+    uint64_t written() const { return written_.load(std::memory_order_acquire); }
+
+private:
+    struct Pipe {
+        int read_fd = -1;
+        int write_fd = -1;
+        std::size_t capacity = 0;
+        std::size_t filled = 0;
+    };
+
+    // Adds a pipe to free_ under mtx_. Returns false if none can be created.
+    bool create_pipe();
+    // The pipe being filled, taken from free_ once the last one was queued.
+    Pipe& filling();
+    void enqueue();
+    void run();
+    // Disk thread: moves what `pipe` holds into the file.
+    void drain(Pipe& pipe);
+
+    int fd_;
+    std::size_t depth_;
+    std::size_t pipe_size_;
+    BufferPool& pool_;
+
+    std::vector<std::unique_ptr<Pipe>> pipes_;
+    Pipe* filling_ = nullptr;
+    bool splice_socket_ = true;
+    BufferPool::Buffer socket_bounce_;
+    Duration disk_stall_{};
+
+    mutable std::mutex mtx_;
+    std::condition_variable ready_cv_;
+    std::condition_variable space_cv_;
+    std::deque<Pipe*> queue_;
+    std::vector<Pipe*> free_;
+    bool writing_ = false;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+    Duration network_stall_{};
+    std::thread thread_;
+
+    // Disk thread only, or the caller's before the thread starts.
+    int64_t offset_;
+    bool splice_file_ = true;
+    BufferPool::Buffer file_bounce_;
+    std::atomic<uint64_t> written_;
+};
+
+#endif
+
+} // namespace transfer
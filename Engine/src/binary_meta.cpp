@@ -0,0 +1,196 @@
+#include "protocol/binary_meta.hpp"
+#include <stdexcept>
+
+namespace protocol {
+
+namespace {
+
+constexpr uint8_t kHasMtime = 1u << 0;
+constexpr uint8_t kHasMode = 1u << 1;
+
+// Binary FILE_META carries no MIME type; every sender used this one.
+constexpr const char* kDefaultMime = "application/octet-stream";
+
+void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+void put_file(std::string& out, const std::string& path, uint64_t size, uint8_t flags, int64_t mtime, uint32_t mode) {
+    out.push_back(static_cast<char>(flags));
+    put_varint(out, size);
+    put_varint(out, path.size());
+    out.append(path);
+    if (flags & kHasMtime) {
+        put_varint(out, zigzag(mtime));
+    }
+    if (flags & kHasMode) {
+        put_varint(out, mode);
+    }
+}
+
+class Decoder {
+public:
+    Decoder(const char* data, std::size_t size) : pos_(data), end_(data + size) {}
+
+    uint8_t byte() {
+        if (pos_ == end_) {
+            throw std::runtime_error("Binary metadata is truncated");
+        }
+        return static_cast<uint8_t>(*pos_++);
+    }
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = byte();
+            value |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Binary metadata has an overlong varint");
+    }
+
+    std::string string() {
+        uint64_t length = varint();
+        if (length > static_cast<uint64_t>(end_ - pos_)) {
+            throw std::runtime_error("Binary metadata is truncated");
+        }
+        std::string value(pos_, static_cast<std::size_t>(length));
+        pos_ += length;
+        return value;
+    }
+
+    // Guards reserve() against counts a payload of this size cannot hold.
+    uint64_t count(std::size_t min_entry_size) {
+        uint64_t value = varint();
+        if (value > static_cast<uint64_t>(end_ - pos_) / min_entry_size) {
+            throw std::runtime_error("Binary metadata count exceeds its payload");
+        }
+        return value;
+    }
+
+    void version() {
+        if (byte() != BINARY_META_VERSION) {
+            throw std::runtime_error("Unsupported binary metadata version");
+        }
+    }
+
+    void finish() const {
+        if (pos_ != end_) {
+            throw std::runtime_error("Binary metadata has trailing bytes");
+        }
+    }
+
+private:
+    const char* pos_;
+    const char* end_;
+};
+
+ManifestEntry get_file(Decoder& in) {
+    ManifestEntry entry{};
+    uint8_t flags = in.byte();
+    entry.size = in.varint();
+    entry.path = in.string();
+    if (flags & kHasMtime) {
+        entry.mtime = unzigzag(in.varint());
+    }
+    if (flags & kHasMode) {
+        entry.mode = static_cast<uint32_t>(in.varint());
+    }
+    return entry;
+}
+
+} // namespace
+
+bool is_binary_meta(const char* data, std::size_t size) {
+    return size > 0 && static_cast<uint8_t>(data[0]) == BINARY_META_VERSION;
+}
+
+std::string encode_file_info(const FileInfo& info) {
+    std::string out;
+    out.reserve(info.filename.size() + 16);
+    out.push_back(static_cast<char>(BINARY_META_VERSION));
+    put_file(out, info.filename, info.size, 0, 0, 0);
+    return out;
+}
+
+FileInfo decode_file_info(const char* data, std::size_t size) {
+    Decoder in(data, size);
+    in.version();
+    ManifestEntry entry = get_file(in);
+    in.finish();
+    return {entry.path, entry.size, kDefaultMime};
+}
+
+std::string encode_manifest(const Manifest& manifest) {
+    std::string out;
+    std::size_t estimate = 16;
+    for (const ManifestEntry& entry : manifest.files) {
+        estimate += entry.path.size() + 24;
+    }
+    out.reserve(estimate);
+    out.push_back(static_cast<char>(BINARY_META_VERSION));
+    put_varint(out, manifest.files.size());
+    for (const ManifestEntry& entry : manifest.files) {
+        uint8_t flags = kHasMtime | (entry.mode != 0 ? kHasMode : 0);
+        put_file(out, entry.path, entry.size, flags, entry.mtime, entry.mode);
+    }
+    return out;
+}
+
+Manifest decode_manifest(const char* data, std::size_t size) {
+    Decoder in(data, size);
+    in.version();
+    Manifest manifest;
+    uint64_t count = in.count(3);
+    manifest.files.reserve(static_cast<std::size_t>(count));
+    for (uint64_t i = 0; i < count; ++i) {
+        manifest.files.push_back(get_file(in));
+    }
+    in.finish();
+    return manifest;
+}
+
+std::string encode_manifest_reply(const ManifestReply& reply) {
+    std::string out;
+    out.reserve(16 + reply.files.size() * 2);
+    out.push_back(static_cast<char>(BINARY_META_VERSION));
+    put_varint(out, reply.files.size());
+    for (const FileDecision& decision : reply.files) {
+        out.push_back(static_cast<char>(decision.action));
+        put_varint(out, decision.offset);
+    }
+    return out;
+}
+
+ManifestReply decode_manifest_reply(const char* data, std::size_t size) {
+    Decoder in(data, size);
+    in.version();
+    ManifestReply reply;
+    uint64_t count = in.count(2);
+    reply.files.reserve(static_cast<std::size_t>(count));
+    for (uint64_t i = 0; i < count; ++i) {
+        uint8_t action = in.byte();
+        if (action > static_cast<uint8_t>(FileAction::MULTICAST)) {
+            throw std::runtime_error("unknown file action " + std::to_string(action));
+        }
+        reply.files.push_back({static_cast<FileAction>(action), in.varint()});
+    }
+    in.finish();
+    return reply;
+}
+
+} // namespace protocol
@@ -0,0 +1,62 @@
+#include "buffer_pool.hpp"
+#include <utility>
+
+namespace transfer {
+
+BufferPool::Buffer::Buffer(BufferPool* pool, std::unique_ptr<char[]> data, std::size_t size)
+    : pool_(pool), data_(std::move(data)), size_(size) {}
+
+BufferPool::Buffer::Buffer(Buffer&& other) noexcept
+    : pool_(std::exchange(other.pool_, nullptr)),
+      data_(std::move(other.data_)),
+      size_(std::exchange(other.size_, 0)) {}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        pool_ = std::exchange(other.pool_, nullptr);
+        data_ = std::move(other.data_);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+BufferPool::Buffer::~Buffer() {
+    release();
+}
+
+void BufferPool::Buffer::release() {
+    if (pool_ && data_) {
+        pool_->recycle(std::move(data_));
+    }
+    data_.reset();
+    pool_ = nullptr;
+    size_ = 0;
+}
+
+BufferPool::BufferPool(std::size_t buffer_size, std::size_t max_cached)
+    : buffer_size_(buffer_size), max_cached_(max_cached) {
+    // Reserved up front so recycling never reallocates the free list.
+    free_.reserve(max_cached_);
+}
+
+BufferPool::Buffer BufferPool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!free_.empty()) {
+            auto data = std::move(free_.back());
+            free_.pop_back();
+            return Buffer(this, std::move(data), buffer_size_);
+        }
+    }
+    return Buffer(this, std::unique_ptr<char[]>(new char[buffer_size_]), buffer_size_);
+}
+
+void BufferPool::recycle(std::unique_ptr<char[]> data) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (free_.size() < max_cached_) {
+        free_.push_back(std::move(data));
+    }
+}
+
+} // namespace transfer
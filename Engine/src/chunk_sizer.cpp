@@ -0,0 +1,74 @@
+#include "chunk_sizer.hpp"
+#include <algorithm>
+
+#ifdef __linux__
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+#endif
+
+namespace transfer {
+
+namespace {
+
+constexpr auto kSampleWindow = std::chrono::milliseconds(100);
+constexpr double kMinFrameTime = 0.010;
+constexpr double kMaxFrameTime = 0.050;
+
+// Smoothed round-trip time reported by the kernel, or 0 where unavailable.
+double smoothed_rtt_seconds(boost::asio::ip::tcp::socket& socket) {
+#ifdef __linux__
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (::getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        return info.tcpi_rtt / 1e6;
+    }
+#else
+    (void)socket;
+#endif
+    return 0;
+}
+
+std::size_t round_down_pow2(std::size_t value) {
+    std::size_t result = 1;
+    while (result <= value / 2) {
+        result *= 2;
+    }
+    return result;
+}
+
+} // namespace
+
+ChunkSizer::ChunkSizer(std::size_t min_size, std::size_t max_size)
+    : min_size_(min_size), max_size_(std::max(min_size, max_size)), current_(min_size) {}
+
+void ChunkSizer::start_file() {
+    last_record_ = clock::now();
+}
+
+void ChunkSizer::record(boost::asio::ip::tcp::socket& socket, std::size_t bytes) {
+    auto now = clock::now();
+    window_bytes_ += bytes;
+    window_time_ += now - last_record_;
+    last_record_ = now;
+
+    if (window_time_ >= kSampleWindow) {
+        adapt(socket, std::chrono::duration<double>(window_time_).count());
+        window_bytes_ = 0;
+        window_time_ = {};
+    }
+}
+
+void ChunkSizer::adapt(boost::asio::ip::tcp::socket& socket, double seconds) {
+    double rate = window_bytes_ / seconds;
+    throughput_ = throughput_ > 0 ? (throughput_ + rate) / 2 : rate;
+    if (min_size_ == max_size_) {
+        return;
+    }
+
+    double rtt = smoothed_rtt_seconds(socket);
+    double target = throughput_ * std::clamp(rtt, kMinFrameTime, kMaxFrameTime);
+    current_.store(std::clamp(round_down_pow2(static_cast<std::size_t>(target)), min_size_, max_size_),
+                   std::memory_order_relaxed);
+}
+
+} // namespace transfer
@@ -0,0 +1,471 @@
+#include "compression.hpp"
+#include "crc32c.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef FLUXDROP_HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+namespace transfer {
+
+namespace {
+
+// zstd levels the sender moves between. The negative ones are zstd's fast
+// mode, which runs at lz4-like speed; 9 is only reached on slow links.
+constexpr std::array<int, 6> kLevels = {-5, -1, 1, 3, 6, 9};
+constexpr std::size_t kStartLevel = 2;
+// The level is revisited once kAdaptInterval of sending and waiting has
+// passed, long enough to span the stalls of a full socket buffer. It steps
+// down while the sender spent more than 1/kLowerRatio of its socket time
+// waiting on the workers, and up while it waited less than 1/kRaiseRatio.
+constexpr auto kAdaptInterval = std::chrono::milliseconds(100);
+constexpr int kLowerRatio = 2;
+constexpr int kRaiseRatio = 4;
+// Chunks sent raw once even the fastest level cannot keep up. The pause
+// doubles each time compression is retried and still holds the link back.
+constexpr std::size_t kRawChunks = 64;
+constexpr std::size_t kMaxRawChunks = 4096;
+// Two chunks per worker keep every core busy; the cap bounds the pooled
+// buffers a sender holds on machines with many cores.
+constexpr std::size_t kMaxInFlight = 8;
+// Rate compression must add over sending raw before a file gives up
+// zero-copy for it.
+constexpr double kMinGain = 1.25;
+
+#ifdef FLUXDROP_HAVE_ZSTD
+
+// Entropy is estimated from kSampleBlocks blocks spread over the chunk.
+// Compressed formats sit just below 8 bits per byte, text and logs near 5.
+constexpr std::size_t kSampleBlockSize = 512;
+constexpr std::size_t kSampleBlocks = 32;
+constexpr double kIncompressibleEntropy = 7.5;
+constexpr std::size_t kMinCompressSize = 4096;
+
+bool looks_incompressible(const char* data, std::size_t size) {
+    std::size_t block = std::min(kSampleBlockSize, size);
+    std::size_t blocks = std::min(kSampleBlocks, size / block);
+    std::size_t stride = size / blocks;
+
+    std::array<uint32_t, 256> counts{};
+    for (std::size_t i = 0; i < blocks; ++i) {
+        const auto* p = reinterpret_cast<const unsigned char*>(data + i * stride);
+        for (std::size_t j = 0; j < block; ++j) {
+            ++counts[p[j]];
+        }
+    }
+
+    double sampled = static_cast<double>(blocks * block);
+    double entropy = 0;
+    for (uint32_t count : counts) {
+        if (count > 0) {
+            double p = count / sampled;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy > kIncompressibleEntropy;
+}
+
+struct CCtxDeleter {
+    void operator()(ZSTD_CCtx* ctx) const { ZSTD_freeCCtx(ctx); }
+};
+
+// One compression context per worker thread, reused for every chunk.
+ZSTD_CCtx* thread_cctx() {
+    thread_local std::unique_ptr<ZSTD_CCtx, CCtxDeleter> ctx(ZSTD_createCCtx());
+    return ctx.get();
+}
+
+#endif
+
+ChunkCompressor::Frame compress_chunk(FileReadAhead::Chunk chunk, int level, BufferPool& pool) {
+    ChunkCompressor::Frame frame;
+    frame.chunk = std::move(chunk);
+#ifdef FLUXDROP_HAVE_ZSTD
+    const char* data = frame.chunk.buffer.data();
+    std::size_t size = frame.chunk.size;
+    ZSTD_CCtx* ctx = thread_cctx();
+    if (!ctx || size < kMinCompressSize || looks_incompressible(data, size)) {
+        return frame;
+    }
+
+    // A destination smaller than the chunk makes zstd give up as soon as the
+    // saving drops below 1/16, instead of finishing a frame we would not send.
+    // It also leaves room for the CRC that may follow the frame.
+    BufferPool::Buffer out = pool.acquire();
+    std::size_t limit = std::min(out.size(), size - size / 16);
+    std::size_t written = ZSTD_compressCCtx(ctx, out.data(), limit, data, size, level);
+    if (!ZSTD_isError(written)) {
+        frame.compressed = std::move(out);
+        frame.compressed_size = written;
+    }
+#else
+    (void)level;
+    (void)pool;
+#endif
+    return frame;
+}
+
+// Fills in the header of a frame and, with a cipher, seals its payload.
+// Otherwise `checksum` adds its CRC32C.
+void finish_frame(ChunkCompressor::Frame& frame, uint32_t session_id, const security::FrameCipher* cipher,
+                  uint32_t file, uint64_t position, bool checksum) {
+    bool compressed = frame.compressed_size > 0;
+    uint32_t crc = 0;
+    if (checksum && !cipher) {
+        crc = crc32c(frame.payload(), frame.payload_size());
+        if (compressed) {
+            char* trailer = frame.compressed.data() + frame.compressed_size;
+            for (std::size_t i = 0; i < protocol::CHUNK_CRC_SIZE; ++i) {
+                trailer[i] = static_cast<char>(crc >> (24 - 8 * i));
+            }
+            frame.compressed_size += protocol::CHUNK_CRC_SIZE;
+        }
+    }
+    std::size_t size = frame.payload_size();
+    frame.header = {
+        static_cast<uint32_t>(compressed ? protocol::CommandType::FILE_CHUNK_Z : protocol::CommandType::FILE_CHUNK),
+        static_cast<uint32_t>(size + (cipher ? cipher->overhead() : 0)),
+        session_id,
+        compressed ? static_cast<uint32_t>(frame.chunk.size) : crc
+    };
+    if (cipher) {
+        auto ad = protocol::sealed_frame_ad(frame.header, file, position);
+        char* payload = compressed ? frame.compressed.data() : frame.chunk.buffer.data();
+        cipher->seal(payload, size, ad.data(), ad.size(), frame.nonce, frame.tag);
+        frame.sealed = true;
+    }
+}
+
+// Threads shared by every session, one per core.
+class WorkerPool {
+public:
+    static WorkerPool& shared() {
+        static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+    explicit WorkerPool(std::size_t threads) {
+        for (std::size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    std::size_t size() const { return threads_.size(); }
+
+    void post(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            jobs_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+    }
+
+private:
+    void run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                cv_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty()) {
+                    return;
+                }
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+} // namespace
+
+bool compression_available() {
+#ifdef FLUXDROP_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool compression_pays_off(const char* sample, std::size_t size, double link_rate) {
+#ifdef FLUXDROP_HAVE_ZSTD
+    ZSTD_CCtx* ctx = thread_cctx();
+    if (!ctx || size < kMinCompressSize || looks_incompressible(sample, size)) {
+        return false;
+    }
+
+    std::vector<char> out(ZSTD_compressBound(size));
+    auto start = std::chrono::steady_clock::now();
+    std::size_t written = ZSTD_compressCCtx(ctx, out.data(), out.size(), sample, size, kLevels[kStartLevel]);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (ZSTD_isError(written) || written > size - size / 16) {
+        return false;
+    }
+    if (link_rate <= 0) {
+        return true;
+    }
+
+    // The workers fill at most kMaxInFlight / 2 cores, and the link then
+    // carries the file at its raw rate divided by the ratio.
+    std::size_t workers = std::min(WorkerPool::shared().size(), kMaxInFlight / 2);
+    double compress_rate = size / std::max(seconds, 1e-6) * static_cast<double>(workers);
+    double ratio = static_cast<double>(written) / static_cast<double>(size);
+    return std::min(compress_rate, link_rate / ratio) >= link_rate * kMinGain;
+#else
+    (void)sample;
+    (void)size;
+    (void)link_rate;
+    return false;
+#endif
+}
+
+ChunkCompressor::ChunkCompressor(FileReadAhead& source, BufferPool& pool, uint32_t session_id, bool compress,
+                                 const security::FrameCipher* cipher, uint32_t file, uint64_t position,
+                                 bool checksums)
+    : source_(source), pool_(pool), session_id_(session_id), compress_(compress), cipher_(cipher), file_(file),
+      position_(position), checksums_(checksums), depth_(std::min(2 * WorkerPool::shared().size(), kMaxInFlight)),
+      level_index_(kStartLevel),
+      raw_backoff_(kRawChunks) {}
+
+ChunkCompressor::~ChunkCompressor() {
+    for (auto& pending : in_flight_) {
+        if (pending.result.valid()) {
+            pending.result.wait();
+        }
+    }
+}
+
+int ChunkCompressor::level() const {
+    return kLevels[level_index_];
+}
+
+void ChunkCompressor::fill() {
+    while (!source_done_ && in_flight_.size() < depth_) {
+        FileReadAhead::Chunk chunk;
+        if (!source_.next(chunk)) {
+            source_done_ = true;
+            break;
+        }
+        uint64_t position = position_;
+        position_ += chunk.size;
+        bool compressing = compress_ && raw_chunks_left_ == 0;
+        if (compress_ && raw_chunks_left_ > 0) {
+            --raw_chunks_left_;
+        }
+        if (!compressing && !cipher_ && !checksums_) {
+            Frame frame;
+            frame.chunk = std::move(chunk);
+            finish_frame(frame, session_id_, nullptr, file_, position, false);
+            std::promise<Frame> raw;
+            raw.set_value(std::move(frame));
+            in_flight_.push_back({raw.get_future(), false});
+            continue;
+        }
+        std::optional<int> level;
+        if (compressing) {
+            level = this->level();
+        }
+        auto task = std::make_shared<std::packaged_task<Frame()>>(
+            [chunk = std::move(chunk), level, &pool = pool_, session_id = session_id_, cipher = cipher_,
+             file = file_, position, checksum = checksums_]() mutable {
+                Frame frame;
+                if (level) {
+                    frame = compress_chunk(std::move(chunk), *level, pool);
+                } else {
+                    frame.chunk = std::move(chunk);
+                }
+                finish_frame(frame, session_id, cipher, file, position, checksum);
+                return frame;
+            });
+        in_flight_.push_back({task->get_future(), compressing});
+        WorkerPool::shared().post([task]() { (*task)(); });
+    }
+}
+
+void ChunkCompressor::adapt(clock::duration waited, clock::duration sending) {
+    wait_time_ += waited;
+    send_time_ += sending;
+    if (wait_time_ + send_time_ < kAdaptInterval) {
+        return;
+    }
+    if (wait_time_ * kLowerRatio > send_time_) {
+        if (level_index_ > 0) {
+            --level_index_;
+        } else {
+            raw_chunks_left_ = raw_backoff_;
+            raw_backoff_ = std::min(raw_backoff_ * 2, kMaxRawChunks);
+        }
+    } else {
+        raw_backoff_ = kRawChunks;
+        if (wait_time_ * kRaiseRatio < send_time_ && level_index_ + 1 < kLevels.size()) {
+            ++level_index_;
+        }
+    }
+    wait_time_ = send_time_ = clock::duration::zero();
+}
+
+bool ChunkCompressor::next(Frame& frame) {
+    // Everything the caller did since the previous chunk counts as sending.
+    auto entered = clock::now();
+    clock::duration sending = last_return_ ? entered - *last_return_ : clock::duration::zero();
+
+    fill();
+    if (in_flight_.empty()) {
+        return false;
+    }
+    Pending pending = std::move(in_flight_.front());
+    in_flight_.pop_front();
+    auto waiting_since = clock::now();
+    pending.result.wait();
+    auto ready = clock::now();
+    // Raw chunks queued while backing off say nothing about the workers.
+    if (pending.compressing) {
+        adapt(ready - waiting_since, sending);
+    }
+    frame = pending.result.get();
+    last_return_ = clock::now();
+    return true;
+}
+
+#ifdef FLUXDROP_HAVE_ZSTD
+
+struct ChunkDecompressor::Context {
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    ~Context() { ZSTD_freeDCtx(dctx); }
+};
+
+ChunkDecompressor::ChunkDecompressor() : context_(std::make_unique<Context>()) {
+    if (!context_->dctx) {
+        throw std::runtime_error("Could not create a zstd decompression context");
+    }
+}
+
+void ChunkDecompressor::decompress(const char* data, std::size_t data_size, char* out, std::size_t size) {
+    std::size_t written = ZSTD_decompressDCtx(context_->dctx, out, size, data, data_size);
+    if (ZSTD_isError(written)) {
+        throw std::runtime_error(std::string("Corrupt compressed chunk: ") + ZSTD_getErrorName(written));
+    }
+    if (written != size) {
+        throw std::runtime_error("Compressed chunk is shorter than announced");
+    }
+}
+
+#else
+
+struct ChunkDecompressor::Context {};
+
+ChunkDecompressor::ChunkDecompressor() = default;
+
+void ChunkDecompressor::decompress(const char*, std::size_t, char*, std::size_t) {
+    throw std::runtime_error("Received a compressed chunk, but this build has no zstd");
+}
+
+#endif
+
+ChunkDecompressor::~ChunkDecompressor() = default;
+
+ChunkOpener::ChunkOpener(const security::FrameCipher& cipher)
+    : cipher_(cipher), depth_(std::min(2 * WorkerPool::shared().size(), kMaxInFlight)) {}
+
+ChunkOpener::~ChunkOpener() {
+    for (auto& job : in_flight_) {
+        if (job->done.valid()) {
+            job->done.wait();
+        }
+    }
+}
+
+void ChunkOpener::submit(FramedReader& reader, const protocol::PacketHeader& header, std::size_t size,
+                         uint32_t file, uint64_t position) {
+    std::unique_ptr<Job> job;
+    if (spare_.empty()) {
+        job = std::make_unique<Job>();
+    } else {
+        job = std::move(spare_.back());
+        spare_.pop_back();
+    }
+    job->payload.resize(header.payload_size);
+    reader.read_exact(job->payload.data(), header.payload_size);
+    job->compressed = header.command == static_cast<uint32_t>(protocol::CommandType::FILE_CHUNK_Z);
+    job->size = size;
+    if (job->compressed) {
+        job->plaintext.resize(size);
+    }
+
+    auto task = std::make_shared<std::packaged_task<void()>>(
+        [job = job.get(), ad = protocol::sealed_frame_ad(header, file, position), &cipher = cipher_]() {
+            std::size_t nonce_size = cipher.nonce_size();
+            std::size_t sealed_size = job->payload.size() - cipher.overhead();
+            security::FrameCipher::Nonce nonce{};
+            security::FrameCipher::Tag tag;
+            std::memcpy(nonce.data(), job->payload.data(), nonce_size);
+            std::memcpy(tag.data(), job->payload.data() + nonce_size + sealed_size, tag.size());
+            char* data = job->payload.data() + nonce_size;
+            try {
+                cipher.open(data, sealed_size, ad.data(), ad.size(), nonce, tag);
+            } catch (const std::runtime_error&) {
+                job->authentic = false;
+                return;
+            }
+            job->authentic = true;
+            if (job->compressed) {
+                // One decompression context per worker thread.
+                thread_local ChunkDecompressor decompressor;
+                decompressor.decompress(data, sealed_size, job->plaintext.data(), job->size);
+            }
+        });
+    job->done = task->get_future();
+    WorkerPool::shared().post([task]() { (*task)(); });
+    in_flight_.push_back(std::move(job));
+}
+
+void ChunkOpener::drain(std::size_t keep, const std::function<void(const char*, std::size_t)>& out,
+                        const std::function<void(const char*, std::size_t)>& damaged) {
+    while (in_flight_.size() > keep) {
+        std::unique_ptr<Job> job = std::move(in_flight_.front());
+        in_flight_.pop_front();
+        job->done.get();
+        const char* data = job->compressed ? job->plaintext.data() : job->payload.data() + cipher_.nonce_size();
+        if (job->authentic) {
+            out(data, job->size);
+        } else if (damaged) {
+            damaged(data, job->size);
+        } else {
+            throw std::runtime_error("A sealed frame failed authentication");
+        }
+        if (spare_.size() < depth_) {
+            spare_.push_back(std::move(job));
+        }
+    }
+}
+
+} // namespace transfer
@@ -36,6 +36,15 @@ static std::atomic<bool> g_client_cancel_flag{false};
 static std::thread g_server_thread;
 static std::thread g_client_thread;
 
+static transfer::TransferOptions g_transfer_options;
+
+static fd_receiver_joined_cb g_receiver_joined_cb = nullptr;
+static fd_receiver_progress_cb g_receiver_progress_cb = nullptr;
+static fd_receiver_finished_cb g_receiver_finished_cb = nullptr;
+
+static bool g_relay = false;
+static fd_server_ready_cb g_relay_ready_cb = nullptr;
+
 // Core API Implementation
 
 extern "C" {
@@ -52,6 +61,93 @@ void fd_cleanup() {
     CORE_LOG("fd_cleanup() — done");
 }
 
+void fd_set_io_backend(fd_io_backend_t backend) {
+    CORE_LOG("fd_set_io_backend() — " << backend);
+    switch (backend) {
+        case FD_IO_AUTO:     g_transfer_options.io_backend = transfer::IoBackend::AUTO; break;
+        case FD_IO_BUFFERED: g_transfer_options.io_backend = transfer::IoBackend::BUFFERED; break;
+        default:             CORE_LOG("fd_set_io_backend() — unknown backend ignored"); break;
+    }
+}
+
+void fd_set_read_ahead_depth(uint32_t depth) {
+    CORE_LOG("fd_set_read_ahead_depth() — " << depth);
+    g_transfer_options.read_ahead_depth = depth;
+}
+
+void fd_set_write_behind_depth(uint32_t depth) {
+    CORE_LOG("fd_set_write_behind_depth() — " << depth);
+    g_transfer_options.write_behind_depth = depth;
+}
+
+void fd_set_stripe_count(uint32_t count) {
+    CORE_LOG("fd_set_stripe_count() — " << count);
+    g_transfer_options.stripes = count;
+}
+
+void fd_set_parallel_files(bool enabled) {
+    CORE_LOG("fd_set_parallel_files() — " << enabled);
+    g_transfer_options.parallel_files = enabled;
+}
+
+void fd_set_bundle_small_files(bool enabled) {
+    CORE_LOG("fd_set_bundle_small_files() — " << enabled);
+    g_transfer_options.bundle_small_files = enabled;
+}
+
+void fd_set_compression(bool enabled) {
+    CORE_LOG("fd_set_compression() — " << enabled);
+    g_transfer_options.compress_chunks = enabled;
+}
+
+void fd_set_delta_transfer(bool enabled) {
+    CORE_LOG("fd_set_delta_transfer() — " << enabled);
+    g_transfer_options.delta_transfer = enabled;
+}
+
+void fd_set_verify_files(bool enabled) {
+    CORE_LOG("fd_set_verify_files() — " << enabled);
+    g_transfer_options.verify_files = enabled;
+}
+
+void fd_set_encryption(bool enabled) {
+    CORE_LOG("fd_set_encryption() — " << enabled);
+    g_transfer_options.encrypt_sessions = enabled;
+}
+
+void fd_set_chunk_checksums(bool enabled) {
+    CORE_LOG("fd_set_chunk_checksums() — " << enabled);
+    g_transfer_options.chunk_checksums = enabled;
+}
+
+void fd_set_max_receivers(uint32_t count) {
+    CORE_LOG("fd_set_max_receivers() — " << count);
+    g_transfer_options.max_receivers = count;
+}
+
+void fd_set_multicast(bool enabled, uint64_t max_rate) {
+    CORE_LOG("fd_set_multicast() — " << enabled << ", " << max_rate << " B/s");
+    g_transfer_options.multicast = enabled;
+    if (max_rate > 0) {
+        g_transfer_options.multicast_rate = max_rate;
+    }
+}
+
+void fd_set_relay(bool enabled, fd_server_ready_cb ready_cb) {
+    CORE_LOG("fd_set_relay() — " << enabled);
+    g_relay = enabled;
+    g_relay_ready_cb = ready_cb;
+}
+
+void fd_set_receiver_callbacks(fd_receiver_joined_cb joined_cb,
+                               fd_receiver_progress_cb progress_cb,
+                               fd_receiver_finished_cb finished_cb) {
+    CORE_LOG("fd_set_receiver_callbacks()");
+    g_receiver_joined_cb = joined_cb;
+    g_receiver_progress_cb = progress_cb;
+    g_receiver_finished_cb = finished_cb;
+}
+
 // Server Functions
 
 void fd_start_server(const char** file_paths, int num_files,
@@ -103,7 +199,7 @@ void fd_start_server(const char** file_paths, int num_files,
     CORE_LOG("fd_start_server() — " << jobs.size() << " files queued");
 
     networking::ServerCallbacks callbacks;
-    callbacks.on_ready = [ready_cb](const std::string& ip, unsigned short port, uint16_t pin) {
+    callbacks.on_ready = [ready_cb](const std::string& ip, unsigned short port, uint32_t pin) {
         if (ready_cb) ready_cb(ip.c_str(), port, pin);
     };
     callbacks.on_status = [status_cb](const std::string& msg) {
@@ -118,7 +214,26 @@ void fd_start_server(const char** file_paths, int num_files,
     callbacks.on_complete = [complete_cb]() {
         if (complete_cb) complete_cb();
     };
+    if (g_receiver_joined_cb) {
+        callbacks.on_receiver_joined = [joined_cb = g_receiver_joined_cb](uint32_t receiver, const std::string& ip) {
+            joined_cb(receiver, ip.c_str());
+        };
+    }
+    if (g_receiver_progress_cb) {
+        callbacks.on_receiver_progress = [progress_cb = g_receiver_progress_cb](uint32_t receiver,
+                                                                                const std::string& file,
+                                                                                uint64_t transferred, uint64_t total,
+                                                                                double speed) {
+            progress_cb(receiver, file.c_str(), transferred, total, speed);
+        };
+    }
+    if (g_receiver_finished_cb) {
+        callbacks.on_receiver_finished = [finished_cb = g_receiver_finished_cb](uint32_t receiver, bool completed) {
+            finished_cb(receiver, completed);
+        };
+    }
     callbacks.cancel_flag = &g_server_cancel_flag;
+    callbacks.options = g_transfer_options;
 
     g_server = std::make_unique<networking::Server>();
 
@@ -151,6 +266,13 @@ void fd_request_cancel_server() {
     }
 }
 
+void fd_cancel_receiver(uint32_t receiver) {
+    CORE_LOG("fd_cancel_receiver() — " << receiver);
+    if (g_server) {
+        g_server->cancel_receiver(receiver);
+    }
+}
+
 // Client Functions
 
 void fd_start_discovery(uint32_t room_id, fd_client_device_found_cb found_cb) {
@@ -213,6 +335,41 @@ void fd_connect(const char* ip, int port, const char* pin, const char* save_dir,
         if (complete_cb) complete_cb();
     };
     callbacks.cancel_flag = &g_client_cancel_flag;
+    callbacks.options = g_transfer_options;
+    if (g_relay) {
+        // The relay's share reports through the receiver callbacks, and its
+        // status and errors through the client's.
+        networking::ServerCallbacks relay;
+        relay.on_ready = [ready_cb = g_relay_ready_cb](const std::string& ip, unsigned short port, uint32_t pin) {
+            if (ready_cb) ready_cb(ip.c_str(), port, pin);
+        };
+        relay.on_status = [status_cb](const std::string& msg) {
+            if (status_cb) status_cb(("Relay: " + msg).c_str());
+        };
+        relay.on_error = [error_cb](const std::string& err) {
+            if (error_cb) error_cb(("Relay: " + err).c_str());
+        };
+        if (g_receiver_joined_cb) {
+            relay.on_receiver_joined = [joined_cb = g_receiver_joined_cb](uint32_t receiver, const std::string& ip) {
+                joined_cb(receiver, ip.c_str());
+            };
+        }
+        if (g_receiver_progress_cb) {
+            relay.on_receiver_progress = [progress_cb = g_receiver_progress_cb](uint32_t receiver,
+                                                                                const std::string& file,
+                                                                                uint64_t transferred, uint64_t total,
+                                                                                double speed) {
+                progress_cb(receiver, file.c_str(), transferred, total, speed);
+            };
+        }
+        if (g_receiver_finished_cb) {
+            relay.on_receiver_finished = [finished_cb = g_receiver_finished_cb](uint32_t receiver, bool completed) {
+                finished_cb(receiver, completed);
+            };
+        }
+        relay.options = g_transfer_options;
+        callbacks.relay = relay;
+    }
 
     std::string ip_str = ip ? ip : "";
     std::string pin_str = pin ? pin : "";
@@ -0,0 +1,141 @@
+#include "crc32c.hpp"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+  #define FLUXDROP_CRC32C_X86
+  #include <nmmintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #endif
+#elif defined(__aarch64__)
+  #define FLUXDROP_CRC32C_ARM
+  #include <arm_acle.h>
+  #if defined(__linux__)
+    #include <sys/auxv.h>
+    #include <asm/hwcap.h>
+  #endif
+#endif
+
+namespace transfer {
+
+namespace {
+
+constexpr uint32_t kPolynomial = 0x82F63B78; // reflected Castagnoli
+
+// Slicing-by-8: table[k][b] is the CRC of byte b followed by k zero bytes,
+// so eight bytes are folded in per step.
+constexpr std::array<std::array<uint32_t, 256>, 8> make_tables() {
+    std::array<std::array<uint32_t, 256>, 8> tables{};
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc >> 1) ^ (kPolynomial & (0u - (crc & 1)));
+        }
+        tables[0][b] = crc;
+    }
+    for (std::size_t k = 1; k < tables.size(); ++k) {
+        for (uint32_t b = 0; b < 256; ++b) {
+            uint32_t prev = tables[k - 1][b];
+            tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xFF];
+        }
+    }
+    return tables;
+}
+
+constexpr auto kTables = make_tables();
+
+uint32_t crc32c_portable(const unsigned char* p, std::size_t size, uint32_t crc) {
+    while (size >= 8) {
+        uint32_t lo = crc ^ (uint32_t{p[0]} | uint32_t{p[1]} << 8 | uint32_t{p[2]} << 16 | uint32_t{p[3]} << 24);
+        crc = kTables[7][lo & 0xFF] ^ kTables[6][(lo >> 8) & 0xFF] ^
+              kTables[5][(lo >> 16) & 0xFF] ^ kTables[4][lo >> 24] ^
+              kTables[3][p[4]] ^ kTables[2][p[5]] ^ kTables[1][p[6]] ^ kTables[0][p[7]];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ kTables[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(FLUXDROP_CRC32C_X86)
+
+#ifndef _MSC_VER
+__attribute__((target("sse4.2")))
+#endif
+uint32_t crc32c_hardware(const unsigned char* p, std::size_t size, uint32_t crc) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+bool hardware_available() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#elif defined(FLUXDROP_CRC32C_ARM)
+
+#if defined(__clang__)
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+uint32_t crc32c_hardware(const unsigned char* p, std::size_t size, uint32_t crc) {
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+
+bool hardware_available() {
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+    return true;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+    return false;
+#endif
+}
+
+#endif
+
+} // namespace
+
+uint32_t crc32c(const char* data, std::size_t size, uint32_t crc) {
+    const auto* p = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+#if defined(FLUXDROP_CRC32C_X86) || defined(FLUXDROP_CRC32C_ARM)
+    static const bool hardware = hardware_available();
+    if (hardware) {
+        return ~crc32c_hardware(p, size, crc);
+    }
+#endif
+    return ~crc32c_portable(p, size, crc);
+}
+
+} // namespace transfer
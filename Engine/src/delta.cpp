@@ -0,0 +1,297 @@
+#include "delta.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <sodium.h>
+
+namespace transfer {
+
+namespace {
+
+constexpr uint32_t kMinBlockSize = 4 * 1024;
+constexpr uint32_t kMaxBlockSize = 1024 * 1024;
+// Bytes read from disk at a time, when signing and when encoding.
+constexpr std::size_t kReadSize = 1024 * 1024;
+constexpr uint32_t kNoBlock = UINT32_MAX;
+// Bits of the filter the rolling checksum is tested against before the hash
+// table, so most positions of a changed region cost one bit lookup.
+constexpr unsigned kFilterBits = 20;
+
+// rsync's rolling checksum: a is the byte sum and b the sum of the running
+// sums, each kept to 16 bits. Both roll in O(1) when the window moves by one
+// byte. The arithmetic wraps at 32 bits, which does not disturb the low 16.
+class RollingChecksum {
+public:
+    void reset(const unsigned char* data, std::size_t size) {
+        a_ = b_ = 0;
+        size_ = static_cast<uint32_t>(size);
+        for (std::size_t i = 0; i < size; ++i) {
+            a_ += data[i];
+            b_ += static_cast<uint32_t>(size - i) * data[i];
+        }
+    }
+
+    void roll(unsigned char out, unsigned char in) {
+        a_ += in - out;
+        b_ += a_ - size_ * out;
+    }
+
+    uint32_t value() const { return (a_ & 0xFFFF) | (b_ << 16); }
+
+private:
+    uint32_t a_ = 0;
+    uint32_t b_ = 0;
+    uint32_t size_ = 0;
+};
+
+using StrongSignature = std::array<uint8_t, protocol::STRONG_SIGNATURE_SIZE>;
+
+StrongSignature strong_signature(const char* data, std::size_t size) {
+    StrongSignature digest;
+    crypto_generichash(digest.data(), digest.size(), reinterpret_cast<const unsigned char*>(data), size, nullptr, 0);
+    return digest;
+}
+
+uint32_t weak_signature(const char* data, std::size_t size) {
+    RollingChecksum sum;
+    sum.reset(reinterpret_cast<const unsigned char*>(data), size);
+    return sum.value();
+}
+
+// Finds signed blocks by rolling checksum, then confirms them by hash.
+class BlockIndex {
+public:
+    explicit BlockIndex(const protocol::BlockSignatures& signatures)
+        : blocks_(signatures.blocks), next_(blocks_.size(), kNoBlock), filter_((1u << kFilterBits) / 64) {
+        heads_.reserve(blocks_.size());
+        // Chains are built back to front, so each lists its blocks in order.
+        for (std::size_t i = blocks_.size(); i-- > 0;) {
+            uint32_t weak = blocks_[i].weak;
+            auto [head, inserted] = heads_.try_emplace(weak, static_cast<uint32_t>(i));
+            if (!inserted) {
+                next_[i] = head->second;
+                head->second = static_cast<uint32_t>(i);
+            }
+            uint32_t bit = filter_bit(weak);
+            filter_[bit / 64] |= uint64_t{1} << (bit % 64);
+        }
+    }
+
+    // Returns a block whose signature matches `data`, or kNoBlock. `preferred`
+    // wins among equal blocks, so runs of a repeated block stay coalesced.
+    uint32_t find(uint32_t weak, const char* data, std::size_t size, uint32_t preferred) const {
+        uint32_t bit = filter_bit(weak);
+        if (!(filter_[bit / 64] & (uint64_t{1} << (bit % 64)))) {
+            return kNoBlock;
+        }
+        auto head = heads_.find(weak);
+        if (head == heads_.end()) {
+            return kNoBlock;
+        }
+
+        StrongSignature strong = strong_signature(data, size);
+        if (preferred < blocks_.size() && blocks_[preferred].weak == weak && blocks_[preferred].strong == strong) {
+            return preferred;
+        }
+        for (uint32_t i = head->second; i != kNoBlock; i = next_[i]) {
+            if (blocks_[i].strong == strong) {
+                return i;
+            }
+        }
+        return kNoBlock;
+    }
+
+private:
+    static uint32_t filter_bit(uint32_t weak) {
+        return (weak * 0x9E3779B1u) >> (32 - kFilterBits);
+    }
+
+    const std::vector<protocol::BlockSignature>& blocks_;
+    std::unordered_map<uint32_t, uint32_t> heads_;
+    std::vector<uint32_t> next_;
+    std::vector<uint64_t> filter_;
+};
+
+} // namespace
+
+uint32_t delta_block_size(uint64_t size) {
+    uint64_t root = static_cast<uint64_t>(std::sqrt(static_cast<double>(size)));
+    uint64_t rounded = (root + 1023) / 1024 * 1024;
+    return static_cast<uint32_t>(std::clamp<uint64_t>(rounded, kMinBlockSize, kMaxBlockSize));
+}
+
+protocol::BlockSignatures compute_block_signatures(const std::string& path, uint32_t block_size,
+                                                   std::atomic<bool>* cancel_flag) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open " + path + " to sign its blocks");
+    }
+
+    protocol::BlockSignatures signatures;
+    signatures.block_size = block_size;
+    std::size_t blocks_per_read = std::max<std::size_t>(1, kReadSize / block_size);
+    std::vector<char> buffer(blocks_per_read * block_size);
+    while (!(cancel_flag && cancel_flag->load())) {
+        file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        std::size_t got = static_cast<std::size_t>(file.gcount());
+        for (std::size_t offset = 0; offset + block_size <= got; offset += block_size) {
+            const char* block = buffer.data() + offset;
+            signatures.blocks.push_back({weak_signature(block, block_size), strong_signature(block, block_size)});
+        }
+        if (got < buffer.size()) {
+            if (file.bad()) {
+                throw std::runtime_error("Failed to read " + path + " while signing its blocks");
+            }
+            break;
+        }
+    }
+    return signatures;
+}
+
+bool encode_delta(std::istream& in, const protocol::BlockSignatures& signatures, std::size_t max_literal,
+                  const std::function<void(const char*, std::size_t)>& literal,
+                  const std::function<void(uint32_t first, uint32_t count)>& copy,
+                  std::atomic<bool>* cancel_flag) {
+    const std::size_t block_size = signatures.blocks.empty() ? 1 : signatures.block_size;
+    BlockIndex index(signatures);
+
+    // buffer[literal_start, pos) is pending literal data, buffer[pos, end) the
+    // window and what has been read past it. A refill moves the pending
+    // literal to the front, so it always fits next to a window and a read.
+    std::vector<char> buffer(max_literal + block_size + kReadSize);
+    std::size_t literal_start = 0;
+    std::size_t pos = 0;
+    std::size_t end = 0;
+    bool eof = false;
+
+    auto refill = [&](std::size_t wanted) {
+        while (!eof && end - pos < wanted) {
+            if (literal_start > 0) {
+                std::memmove(buffer.data(), buffer.data() + literal_start, end - literal_start);
+                pos -= literal_start;
+                end -= literal_start;
+                literal_start = 0;
+            }
+            in.read(buffer.data() + end, static_cast<std::streamsize>(buffer.size() - end));
+            std::size_t got = static_cast<std::size_t>(in.gcount());
+            if (got == 0) {
+                if (in.bad()) {
+                    throw std::runtime_error("Failed to read the file while encoding a delta");
+                }
+                eof = true;
+            }
+            end += got;
+        }
+    };
+
+    uint32_t run_first = 0;
+    uint32_t run_count = 0;
+    auto flush_run = [&]() {
+        if (run_count > 0) {
+            copy(run_first, run_count);
+            run_count = 0;
+        }
+    };
+    auto flush_literal = [&](std::size_t until) {
+        while (literal_start < until) {
+            std::size_t size = std::min(until - literal_start, max_literal);
+            literal(buffer.data() + literal_start, size);
+            literal_start += size;
+        }
+    };
+
+    RollingChecksum sum;
+    bool rolling = false;
+    std::size_t since_cancel_check = 0;
+    while (!signatures.blocks.empty()) {
+        if (++since_cancel_check == kReadSize) {
+            since_cancel_check = 0;
+            if (cancel_flag && cancel_flag->load()) {
+                return false;
+            }
+        }
+
+        refill(block_size + 1);
+        if (end - pos < block_size) {
+            break;
+        }
+        const auto* window = reinterpret_cast<const unsigned char*>(buffer.data() + pos);
+        if (!rolling) {
+            sum.reset(window, block_size);
+            rolling = true;
+        }
+
+        uint32_t preferred = run_count > 0 ? run_first + run_count : kNoBlock;
+        uint32_t match = index.find(sum.value(), buffer.data() + pos, block_size, preferred);
+        if (match != kNoBlock) {
+            flush_literal(pos);
+            if (match != preferred) {
+                flush_run();
+                run_first = match;
+            }
+            ++run_count;
+            pos += block_size;
+            literal_start = pos;
+            rolling = false;
+            continue;
+        }
+
+        flush_run();
+        if (end - pos == block_size) {
+            break;
+        }
+        sum.roll(window[0], window[block_size]);
+        ++pos;
+        if (pos - literal_start >= max_literal) {
+            flush_literal(pos);
+        }
+    }
+
+    flush_run();
+    do {
+        if (cancel_flag && cancel_flag->load()) {
+            return false;
+        }
+        pos = end;
+        flush_literal(end);
+        refill(buffer.size());
+    } while (end > literal_start);
+    return true;
+}
+
+DeltaBasis::DeltaBasis(const std::string& path, const protocol::BlockSignatures& signatures)
+    : file_(path, std::ios::binary),
+      block_size_(signatures.block_size),
+      block_count_(static_cast<uint32_t>(signatures.blocks.size())) {
+    if (!file_.is_open()) {
+        throw std::runtime_error("Could not open " + path + " to copy blocks from");
+    }
+}
+
+void DeltaBasis::copy(uint32_t first, uint32_t count, const std::function<void(const char*, std::size_t)>& out) {
+    if (first > block_count_ || count > block_count_ - first) {
+        throw std::runtime_error("BLOCK_COPY refers to blocks that were never signed");
+    }
+    if (buffer_.empty()) {
+        buffer_.resize(std::max<std::size_t>(kReadSize, block_size_));
+    }
+
+    uint64_t remaining = static_cast<uint64_t>(count) * block_size_;
+    file_.seekg(static_cast<std::streamoff>(static_cast<uint64_t>(first) * block_size_));
+    while (remaining > 0) {
+        std::size_t size = static_cast<std::size_t>(std::min<uint64_t>(remaining, buffer_.size()));
+        if (!file_.read(buffer_.data(), static_cast<std::streamsize>(size))) {
+            throw std::runtime_error("Existing copy changed while a delta was applied to it");
+        }
+        out(buffer_.data(), size);
+        remaining -= size;
+    }
+}
+
+void DeltaBasis::close() {
+    file_.close();
+}
+
+} // namespace transfer
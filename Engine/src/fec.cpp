@@ -0,0 +1,195 @@
+#include "fec.hpp"
+
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+namespace transfer {
+
+namespace {
+
+constexpr unsigned kPolynomial = 0x11D; // x^8 + x^4 + x^3 + x^2 + 1, with 2 as generator
+
+struct FieldTables {
+    std::array<uint8_t, 512> exp{}; // doubled, so exp[log a + log b] needs no reduction
+    std::array<uint8_t, 256> log{};
+    std::array<uint8_t, 256> inv{};
+};
+
+constexpr FieldTables make_field_tables() {
+    FieldTables t;
+    unsigned x = 1;
+    for (unsigned i = 0; i < 255; ++i) {
+        t.exp[i] = static_cast<uint8_t>(x);
+        t.exp[i + 255] = static_cast<uint8_t>(x);
+        t.log[x] = static_cast<uint8_t>(i);
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= kPolynomial;
+        }
+    }
+    for (unsigned a = 1; a < 256; ++a) {
+        t.inv[a] = t.exp[255 - t.log[a]];
+    }
+    return t;
+}
+
+constexpr FieldTables kField = make_field_tables();
+
+uint8_t mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return kField.exp[kField.log[a] + kField.log[b]];
+}
+
+// Row c holds c * b for every byte b, so scaling a symbol is one lookup per
+// byte.
+struct ProductTable {
+    std::array<std::array<uint8_t, 256>, 256> rows{};
+    ProductTable() {
+        for (unsigned a = 0; a < 256; ++a) {
+            for (unsigned b = 0; b < 256; ++b) {
+                rows[a][b] = mul(static_cast<uint8_t>(a), static_cast<uint8_t>(b));
+            }
+        }
+    }
+};
+
+const ProductTable& products() {
+    static const ProductTable table;
+    return table;
+}
+
+// dst += c * src over `size` bytes.
+void mul_add(char* dst, const char* src, uint8_t c, std::size_t size) {
+    if (c == 0) {
+        return;
+    }
+    auto* d = reinterpret_cast<uint8_t*>(dst);
+    const auto* s = reinterpret_cast<const uint8_t*>(src);
+    if (c == 1) {
+        std::size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t a;
+            uint64_t b;
+            std::memcpy(&a, d + i, 8);
+            std::memcpy(&b, s + i, 8);
+            a ^= b;
+            std::memcpy(d + i, &a, 8);
+        }
+        for (; i < size; ++i) {
+            d[i] ^= s[i];
+        }
+        return;
+    }
+    const auto& row = products().rows[c];
+    for (std::size_t i = 0; i < size; ++i) {
+        d[i] ^= row[s[i]];
+    }
+}
+
+// Generator coefficient of source `source` in repair symbol `repair`.
+uint8_t coefficient(std::size_t repair, std::size_t source) {
+    return kField.inv[static_cast<uint8_t>(repair ^ source)];
+}
+
+} // namespace
+
+BlockCode::BlockCode(std::size_t k, std::size_t symbol_size) : k_(k), symbol_size_(symbol_size) {
+    if (k == 0 || k >= MAX_SYMBOLS) {
+        throw std::invalid_argument("block code needs between 1 and 255 source symbols");
+    }
+}
+
+void BlockCode::encode(const std::vector<const char*>& sources, std::size_t index, char* out) const {
+    if (index < k_ || index >= MAX_SYMBOLS || sources.size() != k_) {
+        throw std::invalid_argument("no such repair symbol");
+    }
+    std::memset(out, 0, symbol_size_);
+    for (std::size_t i = 0; i < k_; ++i) {
+        mul_add(out, sources[i], coefficient(index, i), symbol_size_);
+    }
+}
+
+bool BlockCode::decode(const std::vector<char*>& sources, const std::vector<bool>& present,
+                       const std::vector<std::pair<std::size_t, const char*>>& repairs) const {
+    std::vector<std::size_t> missing;
+    for (std::size_t i = 0; i < k_; ++i) {
+        if (!present[i]) {
+            missing.push_back(i);
+        }
+    }
+    std::size_t m = missing.size();
+    if (m == 0) {
+        return true;
+    }
+
+    std::vector<std::pair<std::size_t, const char*>> used;
+    std::array<bool, MAX_SYMBOLS> seen{};
+    for (const auto& repair : repairs) {
+        if (repair.first >= k_ && repair.first < MAX_SYMBOLS && !seen[repair.first]) {
+            seen[repair.first] = true;
+            used.push_back(repair);
+            if (used.size() == m) {
+                break;
+            }
+        }
+    }
+    if (used.size() < m) {
+        return false;
+    }
+
+    // What each repair symbol holds beyond the sources that arrived.
+    std::vector<std::vector<char>> residues(m, std::vector<char>(symbol_size_));
+    for (std::size_t j = 0; j < m; ++j) {
+        std::memcpy(residues[j].data(), used[j].second, symbol_size_);
+        for (std::size_t i = 0; i < k_; ++i) {
+            if (present[i]) {
+                mul_add(residues[j].data(), sources[i], coefficient(used[j].first, i), symbol_size_);
+            }
+        }
+    }
+
+    // Invert the m x m Cauchy submatrix by Gauss-Jordan elimination. Every
+    // square submatrix of a Cauchy matrix is invertible, so a pivot is
+    // always found.
+    std::vector<std::vector<uint8_t>> a(m, std::vector<uint8_t>(2 * m, 0));
+    for (std::size_t j = 0; j < m; ++j) {
+        for (std::size_t t = 0; t < m; ++t) {
+            a[j][t] = coefficient(used[j].first, missing[t]);
+        }
+        a[j][m + j] = 1;
+    }
+    for (std::size_t col = 0; col < m; ++col) {
+        std::size_t pivot = col;
+        while (a[pivot][col] == 0) {
+            ++pivot;
+        }
+        std::swap(a[pivot], a[col]);
+        uint8_t scale = kField.inv[a[col][col]];
+        for (auto& value : a[col]) {
+            value = mul(value, scale);
+        }
+        for (std::size_t row = 0; row < m; ++row) {
+            uint8_t factor = a[row][col];
+            if (row == col || factor == 0) {
+                continue;
+            }
+            for (std::size_t c = 0; c < 2 * m; ++c) {
+                a[row][c] ^= mul(factor, a[col][c]);
+            }
+        }
+    }
+
+    for (std::size_t t = 0; t < m; ++t) {
+        char* out = sources[missing[t]];
+        std::memset(out, 0, symbol_size_);
+        for (std::size_t j = 0; j < m; ++j) {
+            mul_add(out, residues[j].data(), a[t][m + j], symbol_size_);
+        }
+    }
+    return true;
+}
+
+} // namespace transfer
@@ -0,0 +1,68 @@
+#include "framed_reader.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+namespace transfer {
+
+FramedReader::FramedReader(boost::asio::ip::tcp::socket& socket, std::size_t capacity)
+    : socket_(socket),
+      storage_(capacity > 0 ? new char[capacity] : nullptr),
+      capacity_(capacity) {}
+
+void FramedReader::fill(std::size_t count) {
+    if (buffered() >= count) {
+        return;
+    }
+    if (count > capacity_) {
+        throw std::length_error("FramedReader::fill beyond capacity");
+    }
+    if (capacity_ - begin_ < count) {
+        std::memmove(storage_.get(), storage_.get() + begin_, buffered());
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    if (!read_ahead_) {
+        std::size_t missing = count - buffered();
+        end_ += boost::asio::read(socket_, boost::asio::buffer(storage_.get() + end_, missing));
+        return;
+    }
+    while (buffered() < count) {
+        end_ += socket_.read_some(boost::asio::buffer(storage_.get() + end_, capacity_ - end_));
+    }
+}
+
+protocol::PacketHeader FramedReader::read_header() {
+    std::array<uint8_t, 16> buf;
+    if (capacity_ == 0) {
+        boost::asio::read(socket_, boost::asio::buffer(buf));
+    } else {
+        fill(buf.size());
+        std::memcpy(buf.data(), data(), buf.size());
+        consume(buf.size());
+    }
+    return protocol::deserialize_header(buf);
+}
+
+void FramedReader::read_exact(char* out, std::size_t size) {
+    std::size_t from_buffer = std::min(size, buffered());
+    if (from_buffer > 0) {
+        std::memcpy(out, data(), from_buffer);
+        consume(from_buffer);
+        out += from_buffer;
+        size -= from_buffer;
+    }
+    if (size == 0) {
+        return;
+    }
+    if (size >= capacity_ / 2) {
+        boost::asio::read(socket_, boost::asio::buffer(out, size));
+        return;
+    }
+    fill(size);
+    std::memcpy(out, data(), size);
+    consume(size);
+}
+
+} // namespace transfer
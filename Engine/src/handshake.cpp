@@ -0,0 +1,481 @@
+#include "handshake.hpp"
+#include "protocol/packet.hpp"
+#include "transfer.hpp"
+#include <algorithm>
+#include <array>
+#include <set>
+#include <vector>
+
+namespace networking {
+
+using boost::asio::awaitable;
+using boost::asio::use_awaitable;
+using boost::asio::ip::tcp;
+
+namespace {
+
+// Larger than any AUTH or KEY_CONFIRM payload; a peer announcing more is not
+// a FluxDrop client and is not worth the allocation.
+constexpr uint32_t kMaxHandshakePayload = 1024;
+// Each wrong PIN is a guess at it, so a share stops accepting receivers
+// after this many. Guesses already in flight then may still fail, bounding
+// an online attack to kMaxFailedPins + kMaxPendingConnections - 1 tries.
+constexpr uint32_t kMaxFailedPins = 5;
+// Connections that may be before or in the handshake at once; more are
+// closed as soon as they are accepted. Each has kHandshakeTimeout to finish,
+// so stalled ones cannot hold the slots for long.
+constexpr std::size_t kMaxPendingConnections = 8;
+constexpr auto kHandshakeTimeout = std::chrono::seconds(10);
+
+awaitable<protocol::PacketHeader> read_header(tcp::socket& socket) {
+    std::array<uint8_t, 16> buffer;
+    co_await boost::asio::async_read(socket, boost::asio::buffer(buffer), use_awaitable);
+    co_return protocol::deserialize_header(buffer);
+}
+
+awaitable<std::vector<uint8_t>> read_payload(tcp::socket& socket, const protocol::PacketHeader& header) {
+    if (header.payload_size > kMaxHandshakePayload) {
+        throw std::runtime_error("Handshake payload too large: " + std::to_string(header.payload_size));
+    }
+    std::vector<uint8_t> payload(header.payload_size);
+    co_await boost::asio::async_read(socket, boost::asio::buffer(payload), use_awaitable);
+    co_return payload;
+}
+
+awaitable<void> write_packet(tcp::socket& socket, const protocol::PacketHeader& header,
+                             boost::asio::const_buffer payload = {}) {
+    std::array<uint8_t, 16> serialized = protocol::serialize_header(header);
+    std::array<boost::asio::const_buffer, 2> buffers{boost::asio::buffer(serialized), payload};
+    co_await boost::asio::async_write(socket, buffers, use_awaitable);
+}
+
+// The offered and accepted feature words of an encrypted AUTH, bound into
+// the key exchange so a relay cannot strip features from either side.
+std::vector<uint8_t> feature_context(uint32_t offered, uint32_t accepted) {
+    std::vector<uint8_t> context;
+    for (uint32_t word : {offered, accepted}) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            context.push_back(static_cast<uint8_t>(word >> shift));
+        }
+    }
+    return context;
+}
+
+// Server side of an AUTH that carries a key share: answers KEY_EXCHANGE with
+// the accepted `features` in `reserved` and checks the client's KEY_CONFIRM.
+// Returns the session key, or nothing when the client used another PIN.
+awaitable<std::optional<security::SessionKey>> answer_key_exchange(tcp::socket& socket,
+                                                                   const SenderHandshakeOptions& options,
+                                                                   const protocol::PacketHeader& auth,
+                                                                   uint32_t features) {
+    std::vector<uint8_t> payload = co_await read_payload(socket, auth);
+    security::KeyShare client_share;
+    if (payload.size() != client_share.size()) {
+        co_return std::nullopt;
+    }
+    std::copy(payload.begin(), payload.end(), client_share.begin());
+
+    security::PinKeyExchange exchange(options.pin, true);
+    if (!exchange.complete(client_share, feature_context(auth.reserved, features))) {
+        co_return std::nullopt;
+    }
+    security::KeyConfirmation confirmation = exchange.confirmation();
+    payload.assign(exchange.share().begin(), exchange.share().end());
+    payload.insert(payload.end(), confirmation.begin(), confirmation.end());
+    protocol::PacketHeader header{static_cast<uint32_t>(protocol::CommandType::KEY_EXCHANGE),
+                                  static_cast<uint32_t>(payload.size()), options.session_id, features};
+    co_await write_packet(socket, header, boost::asio::buffer(payload));
+
+    protocol::PacketHeader reply = co_await read_header(socket);
+    if (reply.command != static_cast<uint32_t>(protocol::CommandType::KEY_CONFIRM)) {
+        throw std::runtime_error("Expected KEY_CONFIRM packet, got: " + std::to_string(reply.command));
+    }
+    payload = co_await read_payload(socket, reply);
+    security::KeyConfirmation client_confirmation;
+    if (payload.size() != client_confirmation.size()) {
+        co_return std::nullopt;
+    }
+    std::copy(payload.begin(), payload.end(), client_confirmation.begin());
+    if (!exchange.check_peer_confirmation(client_confirmation)) {
+        co_return std::nullopt;
+    }
+    co_return exchange.session_key();
+}
+
+// Client side, after an AUTH carrying `exchange`'s share and the `offered`
+// features: checks the server's KEY_EXCHANGE and answers KEY_CONFIRM. Returns
+// the packet that ends the handshake, with `answered` false if the server
+// sent it instead of KEY_EXCHANGE. AUTH_OK is only returned once the server
+// has proven the same PIN, with the features the keys are bound to.
+awaitable<protocol::PacketHeader> confirm_key_exchange(tcp::socket& socket, security::PinKeyExchange& exchange,
+                                                       uint32_t offered, bool& answered) {
+    protocol::PacketHeader header = co_await read_header(socket);
+    answered = header.command == static_cast<uint32_t>(protocol::CommandType::KEY_EXCHANGE);
+    if (!answered) {
+        co_return header;
+    }
+    security::KeyShare server_share;
+    security::KeyConfirmation server_confirmation;
+    if (header.payload_size != server_share.size() + server_confirmation.size()) {
+        throw std::runtime_error("KEY_EXCHANGE payload has the wrong size");
+    }
+    std::vector<uint8_t> payload = co_await read_payload(socket, header);
+    std::copy_n(payload.begin(), server_share.size(), server_share.begin());
+    std::copy_n(payload.begin() + server_share.size(), server_confirmation.size(), server_confirmation.begin());
+    uint32_t features = header.reserved;
+
+    // On a mismatch the server still gets a confirmation, which it rejects
+    // with AUTH_FAIL like a wrong PIN hash.
+    bool server_proven = exchange.complete(server_share, feature_context(offered, features)) &&
+                         exchange.check_peer_confirmation(server_confirmation);
+    security::KeyConfirmation confirmation{};
+    if (server_proven) {
+        confirmation = exchange.confirmation();
+    }
+    protocol::PacketHeader confirm{static_cast<uint32_t>(protocol::CommandType::KEY_CONFIRM),
+                                   static_cast<uint32_t>(confirmation.size()), 0, 0};
+    co_await write_packet(socket, confirm, boost::asio::buffer(confirmation));
+
+    header = co_await read_header(socket);
+    if (header.command == static_cast<uint32_t>(protocol::CommandType::AUTH_OK) &&
+        (!server_proven || header.reserved != features)) {
+        throw std::runtime_error("Server accepted the key exchange without proving the PIN");
+    }
+    co_return header;
+}
+
+// The rest of authenticate_receiver once its AUTH header is read.
+awaitable<Handshake> check_pin(tcp::socket& socket, const SenderHandshakeOptions& options,
+                               const protocol::PacketHeader& auth_header) {
+    if (auth_header.command != static_cast<uint32_t>(protocol::CommandType::AUTH)) {
+        throw std::runtime_error("Expected AUTH packet, got: " + std::to_string(auth_header.command));
+    }
+
+    // A client offering encryption proves the PIN through a key exchange
+    // instead of sending its hash.
+    Handshake handshake;
+    handshake.features = auth_header.reserved & options.supported;
+    if (auth_header.reserved & protocol::FEATURE_ENCRYPTION) {
+        handshake.session_key = co_await answer_key_exchange(socket, options, auth_header, handshake.features);
+        handshake.authenticated = handshake.session_key.has_value();
+    } else {
+        std::vector<uint8_t> received_hash = co_await read_payload(socket, auth_header);
+        handshake.authenticated =
+            security::verify_pin(options.pin, std::string(received_hash.begin(), received_hash.end()));
+    }
+
+    if (!handshake.authenticated) {
+        if (options.on_status) options.on_status("Authentication FAILED. Wrong PIN.");
+        protocol::PacketHeader fail_header{static_cast<uint32_t>(protocol::CommandType::AUTH_FAIL), 0,
+                                           options.session_id, 0};
+        co_await write_packet(socket, fail_header);
+    }
+    co_return handshake;
+}
+
+} // namespace
+
+awaitable<Handshake> authenticate_receiver(tcp::socket& socket, const SenderHandshakeOptions& options) {
+    protocol::PacketHeader auth_header = co_await read_header(socket);
+    co_return co_await check_pin(socket, options, auth_header);
+}
+
+awaitable<Handshake> authenticate_to_sender(tcp::socket& socket, std::string pin, uint32_t offered) {
+    // With encryption on, the PIN is proven through a key exchange and only
+    // the key share goes out; older servers take it for a wrong PIN hash and
+    // answer AUTH_FAIL at once.
+    std::optional<security::PinKeyExchange> exchange;
+    protocol::PacketHeader auth_response;
+    bool answered = true;
+    if (offered & protocol::FEATURE_ENCRYPTION) {
+        exchange.emplace(pin, false);
+        protocol::PacketHeader auth_header{static_cast<uint32_t>(protocol::CommandType::AUTH),
+                                           static_cast<uint32_t>(exchange->share().size()), 0, offered};
+        co_await write_packet(socket, auth_header, boost::asio::buffer(exchange->share()));
+        auth_response = co_await confirm_key_exchange(socket, *exchange, offered, answered);
+    } else {
+        std::string hashed_pin = security::hash_pin(pin);
+        protocol::PacketHeader auth_header{static_cast<uint32_t>(protocol::CommandType::AUTH),
+                                           static_cast<uint32_t>(hashed_pin.size()), 0, offered};
+        co_await write_packet(socket, auth_header, boost::asio::buffer(hashed_pin));
+        auth_response = co_await read_header(socket);
+    }
+
+    Handshake handshake;
+    if (auth_response.command == static_cast<uint32_t>(protocol::CommandType::AUTH_FAIL)) {
+        handshake.key_exchange_refused = !answered;
+        co_return handshake;
+    }
+    if (auth_response.command != static_cast<uint32_t>(protocol::CommandType::AUTH_OK)) {
+        throw std::runtime_error("Unexpected auth response: " + std::to_string(auth_response.command));
+    }
+    handshake.authenticated = true;
+    handshake.features = auth_response.reserved & offered;
+    if (handshake.features & protocol::FEATURE_ENCRYPTION) {
+        handshake.session_key = exchange->session_key();
+    }
+    co_return handshake;
+}
+
+ReceiverGate::ReceiverGate(boost::asio::io_context& io_context, tcp::acceptor& acceptor,
+                           SenderHandshakeOptions options, uint32_t max_receivers, ReceiverHandler on_receiver,
+                           std::function<void()> on_locked)
+    : io_context_(io_context), acceptor_(acceptor), options_(std::move(options)), max_receivers_(max_receivers),
+      on_receiver_(std::move(on_receiver)), on_locked_(std::move(on_locked)) {}
+
+void ReceiverGate::run() {
+    spawn(accept_connections(), [this](std::exception_ptr error) {
+        accept_error_ = error;
+        shut_down();
+    });
+
+    io_context_.restart();
+    while (!done_ && io_context_.run_one() > 0) {
+    }
+
+    // Let every coroutine unwind before the gate can go away.
+    shut_down();
+    io_context_.restart();
+    while (active_ > 0 && io_context_.run_one() > 0) {
+    }
+
+    if (accept_error_) {
+        try {
+            std::rethrow_exception(accept_error_);
+        } catch (const boost::system::system_error& e) {
+            if (e.code() != boost::asio::error::operation_aborted &&
+                e.code() != boost::asio::error::bad_descriptor) {
+                throw;
+            }
+        }
+    }
+}
+
+void ReceiverGate::close() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+    boost::asio::post(io_context_, [this] { shut_down(); });
+}
+
+void ReceiverGate::expect_stripes(const std::string& token, uint32_t count) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stripes_[token].sockets.resize(count);
+}
+
+std::vector<std::unique_ptr<tcp::socket>> ReceiverGate::take_stripes(const std::string& token,
+                                                                     std::chrono::steady_clock::duration timeout,
+                                                                     const std::atomic<bool>* cancel_flag) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    auto it = stripes_.find(token);
+    if (it == stripes_.end()) {
+        return {};
+    }
+    cv_.wait_for(lock, timeout, [&] {
+        return closed_ || (cancel_flag && cancel_flag->load()) || it->second.joined == it->second.sockets.size();
+    });
+    StripeSlots slots = std::move(it->second);
+    stripes_.erase(it);
+    if (slots.joined < slots.sockets.size()) {
+        return {};
+    }
+    return std::move(slots.sockets);
+}
+
+void ReceiverGate::wake() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+    }
+    cv_.notify_all();
+}
+
+awaitable<void> ReceiverGate::accept_connections() {
+    while (true) {
+        tcp::socket socket = co_await acceptor_.async_accept(use_awaitable);
+        if (pending_ >= kMaxPendingConnections) {
+            boost::system::error_code ec;
+            socket.close(ec);
+            continue;
+        }
+        ++pending_;
+        transfer::configure_socket(socket);
+        // A connection that drops or stalls only ends its own coroutine.
+        spawn(serve_connection(std::move(socket)), [this](std::exception_ptr error) {
+            if (!error) {
+                return;
+            }
+            try {
+                std::rethrow_exception(error);
+            } catch (const boost::system::system_error&) {
+            } catch (const std::exception& e) {
+                if (options_.on_error) options_.on_error(e.what());
+            }
+        });
+    }
+}
+
+awaitable<void> ReceiverGate::serve_connection(tcp::socket socket) {
+    struct Tracked {
+        std::set<tcp::socket*>& set;
+        tcp::socket* socket;
+        Tracked(std::set<tcp::socket*>& set, tcp::socket* socket) : set(set), socket(socket) { set.insert(socket); }
+        ~Tracked() { set.erase(socket); }
+    };
+    // Gives back the connection's place among the pending ones and stops its
+    // clock once the handshake is over, whichever way it ends.
+    struct Pending {
+        std::size_t& count;
+        boost::asio::steady_timer& deadline;
+        bool held = true;
+        ~Pending() { release(); }
+        void release() {
+            if (held) {
+                --count;
+                deadline.cancel();
+                held = false;
+            }
+        }
+    };
+
+    // Closing the socket ends whichever read the handshake waits in.
+    boost::asio::steady_timer deadline(socket.get_executor(), kHandshakeTimeout);
+    deadline.async_wait([&socket](const boost::system::error_code& ec) {
+        if (!ec) {
+            boost::system::error_code ignored;
+            socket.close(ignored);
+        }
+    });
+    Pending pending{pending_, deadline};
+
+    protocol::PacketHeader header;
+    {
+        Tracked connecting(connecting_, &socket);
+        header = co_await read_header(socket);
+    }
+    if (header.command == static_cast<uint32_t>(protocol::CommandType::STRIPE_JOIN)) {
+        std::vector<uint8_t> token = co_await read_payload(socket, header);
+        pending.release();
+        join_stripe(std::string(token.begin(), token.end()), header.reserved, std::move(socket));
+        co_return;
+    }
+    if (locked_ || (max_receivers_ != 0 && claimed_ >= max_receivers_)) {
+        co_return;
+    }
+
+    Handshake handshake;
+    {
+        Tracked authenticating(authenticating_, &socket);
+        if (options_.on_status) options_.on_status("Client connected. Authenticating...");
+        handshake = co_await check_pin(socket, options_, header);
+    }
+    if (!handshake.authenticated) {
+        if (done_ || locked_) {
+            co_return;
+        }
+        if (++failed_pins_ >= kMaxFailedPins) {
+            if (options_.on_error) options_.on_error("Too many wrong PINs. The share no longer accepts receivers.");
+            lock();
+            co_return;
+        }
+        if (options_.on_status) options_.on_status("Wrong PIN entered. Waiting for correct PIN...");
+        co_return;
+    }
+    if (done_ || locked_ || (max_receivers_ != 0 && claimed_ >= max_receivers_)) {
+        co_return;
+    }
+
+    ++claimed_;
+    pending.release();
+    protocol::PacketHeader ok_header{static_cast<uint32_t>(protocol::CommandType::AUTH_OK), 0, options_.session_id,
+                                     handshake.features};
+    std::exception_ptr error;
+    try {
+        co_await write_packet(socket, ok_header);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    if (error) {
+        --claimed_;
+        std::rethrow_exception(error);
+    }
+    if (max_receivers_ != 0 && claimed_ == max_receivers_) {
+        drop_pending(false);
+    }
+    if (!done_) {
+        on_receiver_(AcceptedReceiver{std::move(socket), std::move(handshake)});
+    }
+}
+
+void ReceiverGate::join_stripe(const std::string& token, uint32_t index, tcp::socket socket) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = stripes_.find(token);
+        if (it == stripes_.end() || index >= it->second.sockets.size() || it->second.sockets[index]) {
+            return;
+        }
+        it->second.sockets[index] = std::make_unique<tcp::socket>(std::move(socket));
+        if (++it->second.joined < it->second.sockets.size()) {
+            return;
+        }
+    }
+    cv_.notify_all();
+}
+
+void ReceiverGate::spawn(awaitable<void> task, std::function<void(std::exception_ptr)> on_exit) {
+    ++active_;
+    boost::asio::co_spawn(io_context_, std::move(task), [this, on_exit](std::exception_ptr error) {
+        --active_;
+        on_exit(error);
+    });
+}
+
+void ReceiverGate::drop_pending(bool all) {
+    boost::system::error_code ec;
+    for (tcp::socket* socket : authenticating_) {
+        socket->close(ec);
+    }
+    if (all) {
+        for (tcp::socket* socket : connecting_) {
+            socket->close(ec);
+        }
+    }
+}
+
+void ReceiverGate::lock() {
+    if (!on_locked_) {
+        shut_down();
+        return;
+    }
+    locked_ = true;
+    // Connections yet to send their first packet may be stripes, so only the
+    // handshakes are dropped.
+    drop_pending(false);
+    on_locked_();
+}
+
+void ReceiverGate::shut_down() {
+    done_ = true;
+    boost::system::error_code ec;
+    acceptor_.cancel(ec);
+    drop_pending(true);
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+}
+
+std::optional<AcceptedReceiver> accept_receiver(boost::asio::io_context& io_context, tcp::acceptor& acceptor,
+                                                const SenderHandshakeOptions& options) {
+    std::optional<AcceptedReceiver> receiver;
+    ReceiverGate gate(io_context, acceptor, options, 1, [&](AcceptedReceiver accepted) {
+        receiver.emplace(std::move(accepted));
+        gate.close();
+    });
+    gate.run();
+    return receiver;
+}
+
+} // namespace networking
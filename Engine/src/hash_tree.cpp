@@ -0,0 +1,464 @@
+#include "hash_tree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <sodium.h>
+
+#ifdef __linux__
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace transfer {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Hashing threads per call. BLAKE2b runs near 1 GB/s per core, so a few
+// threads are enough to keep up with an SSD.
+constexpr std::size_t kMaxHashThreads = 8;
+// Consecutive blocks a thread takes at a time, so each one reads sequentially.
+constexpr std::size_t kBlocksPerTake = 16;
+// How often the receiver's hashing threads look for newly written blocks.
+constexpr auto kWrittenPollInterval = std::chrono::milliseconds(5);
+// Files whose hashes the sender keeps; the oldest entry is dropped past this.
+constexpr std::size_t kMaxCachedSources = 64;
+
+uint64_t block_count(uint64_t file_size) {
+    return (file_size + VERIFY_BLOCK_SIZE - 1) / VERIFY_BLOCK_SIZE;
+}
+
+std::size_t hash_threads() {
+    return std::min(kMaxHashThreads, static_cast<std::size_t>(std::max(1u, std::thread::hardware_concurrency())));
+}
+
+void hash_block(std::ifstream& file, const fs::path& path, uint64_t file_size, uint64_t block,
+                std::vector<char>& buffer, protocol::BlockHash& hash) {
+    uint64_t offset = block * VERIFY_BLOCK_SIZE;
+    std::size_t size = static_cast<std::size_t>(std::min(VERIFY_BLOCK_SIZE, file_size - offset));
+    file.seekg(static_cast<std::streamoff>(offset));
+    if (!file.read(buffer.data(), static_cast<std::streamsize>(size))) {
+        throw std::runtime_error(path.string() + " is shorter than expected");
+    }
+    crypto_generichash(hash.data(), hash.size(), reinterpret_cast<const unsigned char*>(buffer.data()), size,
+                       nullptr, 0);
+}
+
+// Hashes `blocks` of `path`, a file of `file_size` bytes. hashes[i] belongs
+// to blocks[i].
+std::vector<protocol::BlockHash> hash_blocks(const fs::path& path, uint64_t file_size,
+                                             const std::vector<uint64_t>& blocks,
+                                             const std::atomic<bool>* stop = nullptr) {
+    std::vector<protocol::BlockHash> hashes(blocks.size());
+    std::atomic<std::size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mtx;
+
+    auto work = [&]() {
+        try {
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open()) {
+                throw std::runtime_error("Could not open " + path.string() + " to hash it");
+            }
+            std::vector<char> buffer(VERIFY_BLOCK_SIZE);
+            for (std::size_t first = next.fetch_add(kBlocksPerTake); first < blocks.size();
+                 first = next.fetch_add(kBlocksPerTake)) {
+                if (stop && stop->load()) {
+                    throw std::runtime_error("Hashing of " + path.string() + " was stopped");
+                }
+                for (std::size_t i = first; i < std::min(first + kBlocksPerTake, blocks.size()); ++i) {
+                    hash_block(file, path, file_size, blocks[i], buffer, hashes[i]);
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mtx);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = blocks.size();
+        }
+    };
+
+    std::size_t threads = std::min(hash_threads(), (blocks.size() + kBlocksPerTake - 1) / kBlocksPerTake);
+    std::vector<std::thread> helpers;
+    for (std::size_t i = 1; i < threads; ++i) {
+        helpers.emplace_back(work);
+    }
+    work();
+    for (auto& helper : helpers) {
+        helper.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return hashes;
+}
+
+struct SourceHashes {
+    uint64_t size = 0;
+    fs::file_time_type mtime;
+    std::vector<protocol::BlockHash> hashes;
+};
+
+std::mutex g_sources_mtx;
+std::unordered_map<std::string, SourceHashes> g_sources;
+std::vector<std::string> g_source_order;
+
+// Caches `hashes` for `path`. Unless `replace`, hashes cached for the same
+// size and mtime are only ever extended.
+void remember_source_hashes(const std::string& path, uint64_t size, fs::file_time_type mtime,
+                            const std::vector<protocol::BlockHash>& hashes, bool replace) {
+    std::lock_guard<std::mutex> lock(g_sources_mtx);
+    auto [entry, inserted] = g_sources.try_emplace(path);
+    if (inserted) {
+        g_source_order.push_back(path);
+        if (g_source_order.size() > kMaxCachedSources) {
+            g_sources.erase(g_source_order.front());
+            g_source_order.erase(g_source_order.begin());
+        }
+    }
+    if (replace || inserted || entry->second.hashes.size() < hashes.size() || entry->second.mtime != mtime ||
+        entry->second.size != size) {
+        entry->second = {size, mtime, hashes};
+    }
+}
+
+// The sidecar lists (block, hash) pairs after the size of the file they
+// belong to, in host byte order; it never leaves the machine.
+std::unordered_map<uint64_t, protocol::BlockHash> load_block_hashes(const fs::path& part_path, uint64_t file_size) {
+    std::unordered_map<uint64_t, protocol::BlockHash> known;
+    std::ifstream in(hashes_path(part_path), std::ios::binary);
+    uint64_t size = 0;
+    uint64_t count = 0;
+    if (!in.read(reinterpret_cast<char*>(&size), sizeof(size)) || size != file_size ||
+        !in.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+        return known;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t block = 0;
+        protocol::BlockHash hash;
+        if (!in.read(reinterpret_cast<char*>(&block), sizeof(block)) ||
+            !in.read(reinterpret_cast<char*>(hash.data()), hash.size())) {
+            return {};
+        }
+        known[block] = hash;
+    }
+    return known;
+}
+
+// Replaces the sidecar atomically.
+void save_block_hashes(const fs::path& part_path, uint64_t file_size, const std::vector<uint64_t>& blocks,
+                       const std::vector<protocol::BlockHash>& hashes) {
+    fs::path target = hashes_path(part_path);
+    fs::path temp = fs::path(target.string() + ".tmp");
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        uint64_t count = blocks.size();
+        out.write(reinterpret_cast<const char*>(&file_size), sizeof(file_size));
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (std::size_t i = 0; i < blocks.size(); ++i) {
+            out.write(reinterpret_cast<const char*>(&blocks[i]), sizeof(blocks[i]));
+            out.write(reinterpret_cast<const char*>(hashes[i].data()), hashes[i].size());
+        }
+        if (!out) {
+            throw std::runtime_error("Failed to write " + temp.string());
+        }
+    }
+    fs::rename(temp, target);
+}
+
+// Makes the verified blocks durable before they are recorded as such, so a
+// power cut cannot leave the sidecar vouching for bytes that never reached
+// the disk.
+void flush_to_disk(const fs::path& path) {
+#ifdef __linux__
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ::fdatasync(fd);
+        ::close(fd);
+    }
+#else
+    (void)path;
+#endif
+}
+
+} // namespace
+
+protocol::BlockHash merkle_root(const std::vector<protocol::BlockHash>& leaves) {
+    if (leaves.empty()) {
+        return {};
+    }
+    std::vector<protocol::BlockHash> level = leaves;
+    while (level.size() > 1) {
+        std::size_t parents = 0;
+        for (std::size_t i = 0; i < level.size(); i += 2) {
+            if (i + 1 == level.size()) {
+                level[parents++] = level[i];
+                continue;
+            }
+            const unsigned char node_tag = 1;
+            crypto_generichash_state state;
+            crypto_generichash_init(&state, nullptr, 0, protocol::BLOCK_HASH_SIZE);
+            crypto_generichash_update(&state, &node_tag, 1);
+            crypto_generichash_update(&state, level[i].data(), level[i].size());
+            crypto_generichash_update(&state, level[i + 1].data(), level[i + 1].size());
+            crypto_generichash_final(&state, level[parents++].data(), protocol::BLOCK_HASH_SIZE);
+        }
+        level.resize(parents);
+    }
+    return level.front();
+}
+
+std::vector<protocol::BlockHash> source_block_hashes(const std::string& path, uint64_t count,
+                                                     const std::atomic<bool>* stop) {
+    uint64_t size = fs::file_size(path);
+    fs::file_time_type mtime = fs::last_write_time(path);
+    count = std::min(count, block_count(size));
+
+    std::vector<protocol::BlockHash> hashes;
+    {
+        std::lock_guard<std::mutex> lock(g_sources_mtx);
+        auto cached = g_sources.find(path);
+        if (cached != g_sources.end() && cached->second.size == size && cached->second.mtime == mtime) {
+            hashes = cached->second.hashes;
+        }
+    }
+    if (hashes.size() >= count) {
+        hashes.resize(count);
+        return hashes;
+    }
+
+    std::vector<uint64_t> missing;
+    for (uint64_t block = hashes.size(); block < count; ++block) {
+        missing.push_back(block);
+    }
+    std::vector<protocol::BlockHash> fresh = hash_blocks(path, size, missing, stop);
+    hashes.insert(hashes.end(), fresh.begin(), fresh.end());
+    remember_source_hashes(path, size, mtime, hashes, false);
+    return hashes;
+}
+
+fs::path hashes_path(const fs::path& part_path) {
+    return fs::path(part_path.string() + ".hashes");
+}
+
+void discard_block_hashes(const fs::path& part_path) {
+    std::error_code ec;
+    fs::remove(hashes_path(part_path), ec);
+}
+
+PartialFileHashes::PartialFileHashes(const fs::path& part_path, uint64_t file_size, const ByteRanges& completed)
+    : part_path_(part_path), file_size_(file_size) {
+    for (const protocol::ByteRange& range : merge_ranges(completed)) {
+        uint64_t first = (range.begin + VERIFY_BLOCK_SIZE - 1) / VERIFY_BLOCK_SIZE;
+        for (uint64_t block = first; block < block_count(file_size); ++block) {
+            uint64_t end = std::min((block + 1) * VERIFY_BLOCK_SIZE, file_size);
+            if (end > range.end) {
+                break;
+            }
+            blocks_.push_back(block);
+        }
+    }
+
+    std::unordered_map<uint64_t, protocol::BlockHash> known = load_block_hashes(part_path, file_size);
+    std::vector<uint64_t> unknown;
+    for (uint64_t block : blocks_) {
+        if (!known.count(block)) {
+            unknown.push_back(block);
+        }
+    }
+    std::vector<protocol::BlockHash> fresh = hash_blocks(part_path, file_size, unknown);
+
+    hashes_.reserve(blocks_.size());
+    std::size_t next_fresh = 0;
+    for (uint64_t block : blocks_) {
+        auto cached = known.find(block);
+        hashes_.push_back(cached != known.end() ? cached->second : fresh[next_fresh++]);
+    }
+}
+
+protocol::HashRequest PartialFileHashes::request() const {
+    protocol::HashRequest request;
+    if (blocks_.empty()) {
+        return request;
+    }
+    request.block_count = static_cast<uint32_t>(blocks_.back() + 1);
+    if (blocks_.size() == request.block_count) {
+        request.root = merkle_root(hashes_);
+    }
+    return request;
+}
+
+ByteRanges PartialFileHashes::verify(const protocol::HashReply& reply) {
+    // A root only vouches for blocks when one was sent for all of them.
+    if (reply.root_matches && !request().root) {
+        discard_block_hashes(part_path_);
+        return {};
+    }
+
+    std::vector<uint64_t> good_blocks;
+    std::vector<protocol::BlockHash> good_hashes;
+    ByteRanges verified;
+    for (std::size_t i = 0; i < blocks_.size(); ++i) {
+        uint64_t block = blocks_[i];
+        bool matches = reply.root_matches ||
+                       (block < reply.hashes.size() && reply.hashes[block] == hashes_[i]);
+        if (matches) {
+            good_blocks.push_back(block);
+            good_hashes.push_back(hashes_[i]);
+            verified.push_back({block * VERIFY_BLOCK_SIZE, std::min((block + 1) * VERIFY_BLOCK_SIZE, file_size_)});
+        }
+    }
+    if (!good_blocks.empty()) {
+        flush_to_disk(part_path_);
+        try {
+            save_block_hashes(part_path_, file_size_, good_blocks, good_hashes);
+        } catch (std::exception& e) {
+            std::cerr << "Could not record verified blocks: " << e.what() << "\n";
+        }
+    } else {
+        discard_block_hashes(part_path_);
+    }
+    return merge_ranges(std::move(verified));
+}
+
+SourceFileHash::SourceFileHash(const std::string& path)
+    : root_(std::async(std::launch::async, [this, path]() {
+          // Never from the cache: a file rewritten without changing its size
+          // or mtime would be vouched for with the root of its old content.
+          uint64_t size = fs::file_size(path);
+          fs::file_time_type mtime = fs::last_write_time(path);
+          std::vector<uint64_t> blocks(block_count(size));
+          for (uint64_t block = 0; block < blocks.size(); ++block) {
+              blocks[block] = block;
+          }
+          std::vector<protocol::BlockHash> hashes = hash_blocks(path, size, blocks, &stop_);
+          remember_source_hashes(path, size, mtime, hashes, true);
+          return merkle_root(hashes);
+      })) {}
+
+SourceFileHash::SourceFileHash(const protocol::BlockHash& root) {
+    std::promise<protocol::BlockHash> known;
+    known.set_value(root);
+    root_ = known.get_future();
+}
+
+SourceFileHash::~SourceFileHash() {
+    stop_ = true;
+    if (root_.valid()) {
+        root_.wait();
+    }
+}
+
+protocol::BlockHash SourceFileHash::get() {
+    return root_.get();
+}
+
+PartFileHash::PartFileHash(const fs::path& part_path, uint64_t file_size, std::function<ByteRanges()> written)
+    : part_path_(part_path),
+      file_size_(file_size),
+      written_(std::move(written)),
+      leaves_(block_count(file_size)),
+      queued_(leaves_.size(), 0) {
+    for (const auto& [block, hash] : load_block_hashes(part_path, file_size)) {
+        if (block < leaves_.size()) {
+            leaves_[block] = hash;
+            queued_[block] = 1;
+            ++hashed_;
+        }
+    }
+    std::size_t threads = std::min<std::size_t>(hash_threads(), leaves_.size() - hashed_);
+    for (std::size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back([this]() { run(); });
+    }
+}
+
+PartFileHash::~PartFileHash() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void PartFileHash::refresh() {
+    last_refresh_ = std::chrono::steady_clock::now();
+    ByteRanges written = complete_ ? ByteRanges{{0, file_size_}} : written_();
+    for (const protocol::ByteRange& range : written) {
+        uint64_t first = (range.begin + VERIFY_BLOCK_SIZE - 1) / VERIFY_BLOCK_SIZE;
+        for (uint64_t block = first; block < leaves_.size(); ++block) {
+            if (std::min((block + 1) * VERIFY_BLOCK_SIZE, file_size_) > range.end) {
+                break;
+            }
+            if (!queued_[block]) {
+                queued_[block] = 1;
+                ready_.push_back(block);
+            }
+        }
+    }
+}
+
+void PartFileHash::run() {
+    std::ifstream file;
+    std::vector<char> buffer;
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (!stopping_ && !error_ && hashed_ < leaves_.size()) {
+        if (ready_.empty()) {
+            if (std::chrono::steady_clock::now() - last_refresh_ >= kWrittenPollInterval) {
+                refresh();
+            }
+            if (ready_.empty()) {
+                cv_.wait_for(lock, kWrittenPollInterval);
+                continue;
+            }
+        }
+        uint64_t block = ready_.front();
+        ready_.pop_front();
+        lock.unlock();
+
+        std::exception_ptr error;
+        try {
+            if (!file.is_open()) {
+                file.open(part_path_, std::ios::binary);
+                if (!file.is_open()) {
+                    throw std::runtime_error("Could not open " + part_path_.string() + " to hash it");
+                }
+                buffer.resize(VERIFY_BLOCK_SIZE);
+            }
+            hash_block(file, part_path_, file_size_, block, buffer, leaves_[block]);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        lock.lock();
+        if (error && !error_) {
+            error_ = error;
+        }
+        ++hashed_;
+        cv_.notify_all();
+    }
+}
+
+protocol::BlockHash PartFileHash::finish() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    complete_ = true;
+    refresh();
+    cv_.notify_all();
+    cv_.wait(lock, [this]() { return error_ || hashed_ == leaves_.size(); });
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    return merkle_root(leaves_);
+}
+
+} // namespace transfer
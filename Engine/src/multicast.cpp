@@ -0,0 +1,864 @@
+#include "multicast.hpp"
+#include "crc32c.hpp"
+#include "security.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+namespace transfer {
+
+namespace {
+
+namespace fs = std::filesystem;
+using boost::asio::ip::udp;
+
+constexpr std::size_t kSocketBufferSize = 8 * 1024 * 1024;
+// A check waits this long after the last datagram for any still on the way.
+constexpr auto kQuietTime = std::chrono::milliseconds(50);
+constexpr auto kProgressInterval = std::chrono::milliseconds(300);
+// How far the sender may fall behind its pace before it stops catching up.
+constexpr auto kPaceSlack = std::chrono::milliseconds(10);
+// Blocks a round sends before it asks its members what they miss: 2.3 MiB,
+// which bounds what a receiver holds undecoded.
+constexpr uint64_t kWindowBlocks = 32;
+// Checks a window gets before what is still missing is left to TCP.
+constexpr int kMaxRepairRounds = 8;
+constexpr double kMinRate = 128 * 1024;
+// A member that has not answered a check this long after it went out leaves
+// the round, and what it misses follows over TCP. It then has until
+// kLateNackTimeout after the round to deliver the answers it still owes
+// before its connection is given up on.
+constexpr auto kNackTimeout = std::chrono::seconds(2);
+constexpr auto kLateNackTimeout = std::chrono::seconds(10);
+// How often members are looked at while none of them has answered.
+constexpr auto kNackPollInterval = std::chrono::milliseconds(1);
+constexpr std::size_t kHeaderSize = 16;
+
+#ifdef FLUXDROP_FAULT_INJECTION
+// Test builds drop the share of datagrams FLUXDROP_MULTICAST_LOSS names (0
+// to 1) on arrival, so the repairs can be exercised over loopback.
+bool simulated_loss() {
+    static const double loss = [] {
+        const char* value = std::getenv("FLUXDROP_MULTICAST_LOSS");
+        return value ? std::atof(value) : 0.0;
+    }();
+    thread_local std::minstd_rand rng(std::random_device{}());
+    return loss > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < loss;
+}
+#endif
+
+uint64_t block_bytes(const protocol::MulticastConfig& config) {
+    return static_cast<uint64_t>(config.symbol_size) * config.block_symbols;
+}
+
+void put_u32(char* out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = static_cast<char>(value >> (24 - 8 * i));
+    }
+}
+
+uint32_t get_u32(const char* data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value = (value << 8) | static_cast<uint8_t>(data[i]);
+    }
+    return value;
+}
+
+// Reads a MULTICAST_NACK from `reader` if all of it has arrived, so a member
+// that is slow to answer holds up no other. Returns false while it has not.
+// Throws if the connection failed or sent anything else.
+bool try_receive_nack(FramedReader& reader, uint32_t& file, protocol::MulticastNack& nack) {
+    std::size_t available = reader.buffered() + reader.socket().available();
+    if (available < kHeaderSize) {
+        return false;
+    }
+    if (reader.capacity() >= kHeaderSize) {
+        std::array<uint8_t, kHeaderSize> raw;
+        reader.fill(raw.size());
+        std::memcpy(raw.data(), reader.data(), raw.size());
+        protocol::PacketHeader peeked = protocol::deserialize_header(raw);
+        if (peeked.payload_size <= reader.capacity() - kHeaderSize &&
+            available < kHeaderSize + peeked.payload_size) {
+            return false;
+        }
+    }
+
+    protocol::PacketHeader header = MessageReceiver::receive_header(reader);
+    if (header.command != static_cast<uint32_t>(protocol::CommandType::MULTICAST_NACK)) {
+        throw std::runtime_error("Expected MULTICAST_NACK packet, got: " + std::to_string(header.command));
+    }
+    file = header.reserved;
+    nack = MessageReceiver::receive_multicast_nack(reader, header.payload_size);
+    return true;
+}
+
+} // namespace
+
+uint64_t multicast_block_count(uint64_t size, const protocol::MulticastConfig& config) {
+    uint64_t bytes = block_bytes(config);
+    return (size + bytes - 1) / bytes;
+}
+
+// MulticastSender
+
+MulticastSender::MulticastSender(const boost::asio::ip::address_v4& group,
+                                 const boost::asio::ip::address_v4& interface_address,
+                                 std::shared_ptr<const security::FrameCipher> cipher, uint32_t transfer_id,
+                                 double bytes_per_second)
+    : socket_(io_context_, udp::endpoint(udp::v4(), 0)), cipher_(std::move(cipher)), rate_(bytes_per_second),
+      next_send_(std::chrono::steady_clock::now()) {
+    socket_.set_option(boost::asio::ip::multicast::outbound_interface(interface_address));
+    socket_.set_option(boost::asio::ip::multicast::hops(1));
+    socket_.set_option(boost::asio::ip::multicast::enable_loopback(true));
+    boost::system::error_code ec;
+    socket_.set_option(boost::asio::socket_base::send_buffer_size(static_cast<int>(kSocketBufferSize)), ec);
+
+    // Our own source port is not bound on the receivers, so the group gets a
+    // port of its own from the dynamic range.
+    std::random_device random;
+    unsigned short port = static_cast<unsigned short>(49152 + random() % 16384);
+    group_ = udp::endpoint(group, port);
+
+    config_.group = group.to_string();
+    config_.port = port;
+    config_.transfer_id = transfer_id;
+    config_.symbol_size = static_cast<uint32_t>(MULTICAST_SYMBOL_SIZE);
+    config_.block_symbols = static_cast<uint32_t>(MULTICAST_BLOCK_SYMBOLS);
+    config_.aes_gcm = cipher_ && cipher_->aes_gcm();
+
+    block_.resize(MULTICAST_SYMBOL_SIZE * MULTICAST_BLOCK_SYMBOLS);
+    repair_.resize(MULTICAST_SYMBOL_SIZE);
+    datagram_.resize(protocol::SYMBOL_HEADER_SIZE + security::FrameCipher::MAX_NONCE_SIZE + MULTICAST_SYMBOL_SIZE +
+                     security::FrameCipher::TAG_SIZE);
+}
+
+void MulticastSender::open_file(uint32_t file, const std::string& filepath, uint64_t size) {
+    in_ = std::ifstream(filepath, std::ios::binary);
+    if (!in_.is_open()) {
+        throw std::runtime_error("Could not open file for reading: " + filepath);
+    }
+    file_ = file;
+    size_ = size;
+    blocks_ = multicast_block_count(size, config_);
+    next_repair_.assign(blocks_, 0);
+}
+
+std::size_t MulticastSender::read_block(uint64_t block) {
+    uint64_t offset = block * block_bytes(config_);
+    std::size_t length = static_cast<std::size_t>(std::min<uint64_t>(block_bytes(config_), size_ - offset));
+    in_.clear();
+    in_.seekg(static_cast<std::streamoff>(offset));
+    in_.read(block_.data(), static_cast<std::streamsize>(length));
+    if (static_cast<std::size_t>(in_.gcount()) != length) {
+        throw std::runtime_error("File shrank while it was being sent");
+    }
+    std::size_t sources = (length + MULTICAST_SYMBOL_SIZE - 1) / MULTICAST_SYMBOL_SIZE;
+    std::memset(block_.data() + length, 0, sources * MULTICAST_SYMBOL_SIZE - length);
+    if (next_repair_[block] < sources) {
+        next_repair_[block] = static_cast<uint16_t>(sources);
+    }
+    return sources;
+}
+
+bool MulticastSender::send_blocks(uint64_t begin, uint64_t end, std::size_t repair,
+                                  const std::atomic<bool>* cancel_flag) {
+    try {
+        for (uint64_t block = begin; block < end; ++block) {
+            if (cancel_flag && cancel_flag->load()) {
+                return false;
+            }
+            std::size_t sources = read_block(block);
+            for (std::size_t symbol = 0; symbol < sources; ++symbol) {
+                send_symbol(block, symbol, block_.data() + symbol * MULTICAST_SYMBOL_SIZE);
+            }
+            if (repair > 0) {
+                send_repairs(block, repair);
+            }
+        }
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool MulticastSender::send_repairs(uint64_t block, std::size_t count) {
+    std::size_t sources = read_block(block);
+    BlockCode code(sources, MULTICAST_SYMBOL_SIZE);
+    std::vector<const char*> symbols;
+    for (std::size_t symbol = 0; symbol < sources; ++symbol) {
+        symbols.push_back(block_.data() + symbol * MULTICAST_SYMBOL_SIZE);
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        if (next_repair_[block] >= BlockCode::MAX_SYMBOLS) {
+            return false;
+        }
+        code.encode(symbols, next_repair_[block], repair_.data());
+        send_symbol(block, next_repair_[block]++, repair_.data());
+    }
+    return true;
+}
+
+void MulticastSender::send_symbol(uint64_t block, std::size_t symbol, const char* data) {
+    protocol::SymbolHeader header{config_.transfer_id, sequence_++, file_, static_cast<uint32_t>(block),
+                                  static_cast<uint16_t>(symbol)};
+    auto header_bytes = protocol::serialize_symbol_header(header);
+    char* out = datagram_.data();
+    std::memcpy(out, header_bytes.data(), header_bytes.size());
+    std::size_t size = header_bytes.size();
+    if (cipher_) {
+        security::FrameCipher::Nonce nonce{};
+        security::FrameCipher::Tag tag{};
+        char* sealed = out + size + cipher_->nonce_size();
+        std::memcpy(sealed, data, MULTICAST_SYMBOL_SIZE);
+        cipher_->seal(sealed, MULTICAST_SYMBOL_SIZE, header_bytes.data(), header_bytes.size(), nonce, tag);
+        std::memcpy(out + size, nonce.data(), cipher_->nonce_size());
+        size += cipher_->nonce_size() + MULTICAST_SYMBOL_SIZE;
+        std::memcpy(out + size, tag.data(), tag.size());
+        size += tag.size();
+    } else {
+        std::memcpy(out + size, data, MULTICAST_SYMBOL_SIZE);
+        size += MULTICAST_SYMBOL_SIZE;
+        put_u32(out + size, crc32c(out, size));
+        size += protocol::CHUNK_CRC_SIZE;
+    }
+
+    pace(size);
+    // A full send buffer is the kernel pushing back; anything else is a
+    // datagram lost on the way, which the repairs take care of.
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        boost::system::error_code ec;
+        socket_.send_to(boost::asio::buffer(out, size), group_, 0, ec);
+        if (ec != boost::asio::error::no_buffer_space && ec != boost::asio::error::would_block) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void MulticastSender::pace(std::size_t bytes) {
+    auto now = std::chrono::steady_clock::now();
+    if (next_send_ < now - kPaceSlack) {
+        next_send_ = now;
+    }
+    next_send_ += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(static_cast<double>(bytes) / rate_));
+    if (next_send_ > now + std::chrono::milliseconds(1)) {
+        std::this_thread::sleep_until(next_send_);
+    }
+}
+
+// MulticastReceiver
+
+MulticastReceiver::MulticastReceiver(const protocol::MulticastConfig& config,
+                                     const boost::asio::ip::address_v4& interface_address,
+                                     std::shared_ptr<const security::FrameCipher> cipher,
+                                     TransferProgressCallback progress_cb)
+    : config_(config), cipher_(std::move(cipher)), progress_cb_(std::move(progress_cb)), socket_(io_context_),
+      last_arrival_(std::chrono::steady_clock::now()) {
+    if (config_.symbol_size == 0 || config_.symbol_size > 64 * 1024 || config_.block_symbols == 0 ||
+        config_.block_symbols >= BlockCode::MAX_SYMBOLS) {
+        throw std::runtime_error("Unusable multicast coding parameters");
+    }
+    socket_.open(udp::v4());
+    socket_.set_option(boost::asio::socket_base::reuse_address(true));
+    boost::system::error_code ec;
+    socket_.set_option(boost::asio::socket_base::receive_buffer_size(static_cast<int>(kSocketBufferSize)), ec);
+    socket_.bind(udp::endpoint(udp::v4(), config_.port));
+    socket_.set_option(boost::asio::ip::multicast::join_group(boost::asio::ip::make_address_v4(config_.group),
+                                                              interface_address));
+
+    datagram_.resize(protocol::SYMBOL_HEADER_SIZE + security::FrameCipher::MAX_NONCE_SIZE + config_.symbol_size +
+                     security::FrameCipher::TAG_SIZE);
+    receive();
+    thread_ = std::thread([this]() { io_context_.run(); });
+}
+
+MulticastReceiver::~MulticastReceiver() {
+    boost::asio::post(io_context_, [this]() {
+        boost::system::error_code ec;
+        socket_.close(ec);
+    });
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void MulticastReceiver::expect_file(uint32_t file, const std::string& name, const fs::path& part_path,
+                                    uint64_t size) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    Assembly& assembly = files_[file];
+    assembly.name = name;
+    assembly.part_path = part_path;
+    assembly.size = size;
+    assembly.blocks.resize(multicast_block_count(size, config_));
+    assembly.start = std::chrono::steady_clock::now();
+    assembly.last_report = assembly.start;
+
+    std::error_code ec;
+    fs::create_directories(part_path.parent_path(), ec);
+    if (size == 0) {
+        std::ofstream empty(part_path, std::ios::binary | std::ios::trunc);
+        if (!empty.is_open()) {
+            assembly.error = "Could not open file for writing: " + part_path.string();
+        }
+        return;
+    }
+    // Blocks land out of order, so the length of the .fluxpart says nothing
+    // about what it holds until the sidecar does.
+    try {
+        save_completed_ranges(part_path, size, {});
+    } catch (const std::exception& e) {
+        assembly.error = e.what();
+    }
+}
+
+void MulticastReceiver::abandon(uint32_t file) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    files_.erase(file);
+}
+
+void MulticastReceiver::receive() {
+    socket_.async_receive_from(boost::asio::buffer(datagram_), sender_,
+                               [this](const boost::system::error_code& ec, std::size_t size) {
+                                   if (ec == boost::asio::error::operation_aborted || !socket_.is_open()) {
+                                       return;
+                                   }
+                                   if (!ec) {
+                                       handle(size);
+                                   }
+                                   receive();
+                               });
+}
+
+void MulticastReceiver::handle(std::size_t size) {
+    if (size < protocol::SYMBOL_HEADER_SIZE) {
+        return;
+    }
+    const auto* header_bytes = reinterpret_cast<const uint8_t*>(datagram_.data());
+    protocol::SymbolHeader header = protocol::deserialize_symbol_header(header_bytes);
+    if (header.transfer_id != config_.transfer_id) {
+        return;
+    }
+#ifdef FLUXDROP_FAULT_INJECTION
+    if (simulated_loss()) {
+        return;
+    }
+#endif
+
+    char* symbol = nullptr;
+    if (cipher_) {
+        std::size_t nonce_size = cipher_->nonce_size();
+        if (size != protocol::SYMBOL_HEADER_SIZE + nonce_size + config_.symbol_size + security::FrameCipher::TAG_SIZE) {
+            return;
+        }
+        security::FrameCipher::Nonce nonce{};
+        security::FrameCipher::Tag tag{};
+        std::memcpy(nonce.data(), datagram_.data() + protocol::SYMBOL_HEADER_SIZE, nonce_size);
+        symbol = datagram_.data() + protocol::SYMBOL_HEADER_SIZE + nonce_size;
+        std::memcpy(tag.data(), symbol + config_.symbol_size, tag.size());
+        try {
+            cipher_->open(symbol, config_.symbol_size, header_bytes, protocol::SYMBOL_HEADER_SIZE, nonce, tag);
+        } catch (const std::exception&) {
+            return;
+        }
+    } else {
+        std::size_t covered = protocol::SYMBOL_HEADER_SIZE + config_.symbol_size;
+        if (size != covered + protocol::CHUNK_CRC_SIZE ||
+            crc32c(datagram_.data(), covered) != get_u32(datagram_.data() + covered)) {
+            return;
+        }
+        symbol = datagram_.data() + protocol::SYMBOL_HEADER_SIZE;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    ++received_;
+    next_sequence_ = std::max(next_sequence_, header.sequence + 1);
+    last_arrival_ = std::chrono::steady_clock::now();
+    arrival_cv_.notify_all();
+
+    auto it = files_.find(header.file);
+    if (it == files_.end() || !it->second.error.empty()) {
+        return;
+    }
+    store(it->second, header, symbol);
+}
+
+std::size_t MulticastReceiver::source_count(const Assembly& file, uint64_t block) const {
+    uint64_t offset = block * block_bytes(config_);
+    uint64_t length = std::min<uint64_t>(block_bytes(config_), file.size - offset);
+    return static_cast<std::size_t>((length + config_.symbol_size - 1) / config_.symbol_size);
+}
+
+void MulticastReceiver::store(Assembly& file, const protocol::SymbolHeader& header, const char* symbol) {
+    if (header.block >= file.blocks.size()) {
+        return;
+    }
+    Block& block = file.blocks[header.block];
+    if (block.done) {
+        return;
+    }
+    std::size_t sources = source_count(file, header.block);
+    if (block.data.empty()) {
+        block.data.assign(sources * config_.symbol_size, 0);
+        block.present.assign(sources, false);
+    }
+    if (header.symbol < sources) {
+        if (block.present[header.symbol]) {
+            return;
+        }
+        std::memcpy(block.data.data() + header.symbol * config_.symbol_size, symbol, config_.symbol_size);
+        block.present[header.symbol] = true;
+        ++block.sources;
+    } else {
+        if (header.symbol >= BlockCode::MAX_SYMBOLS || block.repairs.count(header.symbol) > 0) {
+            return;
+        }
+        block.repairs.emplace(header.symbol, std::vector<char>(symbol, symbol + config_.symbol_size));
+    }
+    if (block.sources + block.repairs.size() >= sources) {
+        finish_block(file, header.block, block);
+    }
+}
+
+void MulticastReceiver::finish_block(Assembly& file, uint64_t index, Block& block) {
+    try {
+        std::size_t sources = block.present.size();
+        if (block.sources < sources) {
+            BlockCode code(sources, config_.symbol_size);
+            std::vector<char*> symbols;
+            for (std::size_t i = 0; i < sources; ++i) {
+                symbols.push_back(block.data.data() + i * config_.symbol_size);
+            }
+            std::vector<std::pair<std::size_t, const char*>> repairs;
+            for (const auto& [symbol, data] : block.repairs) {
+                repairs.emplace_back(symbol, data.data());
+            }
+            code.decode(symbols, block.present, repairs);
+        }
+
+        uint64_t offset = index * block_bytes(config_);
+        uint64_t length = std::min<uint64_t>(block_bytes(config_), file.size - offset);
+        if (!file.out.is_open()) {
+            file.out.open(file.part_path, std::ios::binary | std::ios::trunc);
+            if (!file.out.is_open()) {
+                throw std::runtime_error("Could not open file for writing: " + file.part_path.string());
+            }
+        }
+        file.out.seekp(static_cast<std::streamoff>(offset));
+        file.out.write(block.data.data(), static_cast<std::streamsize>(length));
+        if (!file.out) {
+            throw std::runtime_error("Could not write to " + file.part_path.string());
+        }
+
+        block = Block{};
+        block.done = true;
+        ++file.decoded;
+        file.bytes += length;
+        if (file.decoded == file.blocks.size()) {
+            file.out.close();
+            if (file.out.fail()) {
+                throw std::runtime_error("Could not write to " + file.part_path.string());
+            }
+        }
+    } catch (const std::exception& e) {
+        file.error = e.what();
+        file.out.close();
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (progress_cb_ && (now - file.last_report >= kProgressInterval || file.bytes == file.size)) {
+        double elapsed = std::chrono::duration<double>(now - file.start).count();
+        double speed = elapsed > 0 ? file.bytes / elapsed / (1024.0 * 1024.0) : 0;
+        progress_cb_(file.name, file.bytes, file.size, speed);
+        file.last_report = now;
+    }
+}
+
+protocol::MulticastNack MulticastReceiver::answer(uint32_t file, const protocol::MulticastCheck& check) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    uint32_t wanted = check.last_sequence + 1;
+    while (next_sequence_ < wanted) {
+        auto last = last_arrival_;
+        if (!arrival_cv_.wait_for(lock, kQuietTime,
+                                  [&]() { return next_sequence_ >= wanted || last_arrival_ != last; })) {
+            break;
+        }
+    }
+
+    protocol::MulticastNack nack;
+    nack.received = received_;
+    nack.expected = std::max(next_sequence_, wanted);
+    auto it = files_.find(file);
+    if (it == files_.end()) {
+        return nack;
+    }
+    Assembly& assembly = it->second;
+    uint64_t end = std::min<uint64_t>(check.block_end, assembly.blocks.size());
+    // A file that could not be written lists every block it lacks, so the
+    // sender ends up sending it over TCP.
+    for (uint64_t index = 0; index < end; ++index) {
+        const Block& block = assembly.blocks[index];
+        if (!block.done) {
+            std::size_t sources = source_count(assembly, index);
+            std::size_t held = block.sources + block.repairs.size();
+            nack.blocks.push_back({static_cast<uint32_t>(index), static_cast<uint32_t>(sources - held)});
+        }
+    }
+
+    // Once a window is checked, what it left on disk is recorded for a later
+    // session; the blocks go to disk first.
+    if (assembly.error.empty() && assembly.out.is_open() && assembly.decoded < assembly.blocks.size()) {
+        assembly.out.flush();
+        try {
+            save_completed_ranges(assembly.part_path, assembly.size, ranges_of(assembly));
+        } catch (const std::exception& e) {
+            assembly.error = e.what();
+        }
+    }
+    return nack;
+}
+
+bool MulticastReceiver::complete(uint32_t file) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = files_.find(file);
+    if (it == files_.end()) {
+        return false;
+    }
+    if (!it->second.error.empty()) {
+        throw std::runtime_error(it->second.error);
+    }
+    return it->second.decoded == it->second.blocks.size();
+}
+
+ByteRanges MulticastReceiver::completed_ranges(uint32_t file) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = files_.find(file);
+    if (it == files_.end()) {
+        return {};
+    }
+    return ranges_of(it->second);
+}
+
+ByteRanges MulticastReceiver::ranges_of(const Assembly& file) const {
+    ByteRanges ranges;
+    for (uint64_t index = 0; index < file.blocks.size(); ++index) {
+        if (file.blocks[index].done) {
+            uint64_t offset = index * block_bytes(config_);
+            ranges.push_back({offset, std::min(offset + block_bytes(config_), file.size)});
+        }
+    }
+    return merge_ranges(std::move(ranges));
+}
+
+// MulticastShare
+
+MulticastShare::MulticastShare(const boost::asio::ip::address_v4& group, const TransferOptions& options,
+                               uint32_t expected_receivers)
+    : group_(group), max_rate_(std::max(static_cast<double>(options.multicast_rate), kMinRate)),
+      expected_receivers_(expected_receivers) {
+    // XChaCha20-Poly1305, since a group cannot count on every receiver
+    // having AES instructions.
+    if (options.encrypt_sessions) {
+        group_key_ = security::generate_key();
+        group_cipher_ = std::make_shared<const security::FrameCipher>(*group_key_, false);
+    }
+}
+
+protocol::MulticastConfig MulticastShare::config_for(const boost::asio::ip::address& local_address,
+                                                     const security::FrameCipher* session_cipher) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    protocol::MulticastConfig config;
+    if (!local_address.is_v4() || (group_cipher_ && !session_cipher)) {
+        return config;
+    }
+    if (!sender_) {
+        try {
+            sender_ = std::make_unique<MulticastSender>(group_, local_address.to_v4(), group_cipher_,
+                                                        std::random_device{}(), max_rate_ / 8);
+        } catch (const std::exception& e) {
+            std::cerr << "Multicast unavailable: " << e.what() << "\n";
+            return config;
+        }
+    }
+    config = sender_->config();
+    if (group_cipher_) {
+        config.key = security::seal_key(*session_cipher, *group_key_);
+    }
+    return config;
+}
+
+void MulticastShare::run(MulticastMember& member) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    ++arrived_;
+    cv_.notify_all();
+    if (!sender_ || member.files.empty()) {
+        return;
+    }
+
+    bool first = !gathering_;
+    if (first) {
+        gathering_ = std::make_shared<Round>();
+        gathering_->deadline = std::chrono::steady_clock::now() + MULTICAST_JOIN_WINDOW;
+    }
+    std::shared_ptr<Round> round = gathering_;
+    round->members.push_back(&member);
+    if (!first) {
+        cv_.wait(lock, [&]() { return round->done; });
+        return;
+    }
+
+    cv_.wait_until(lock, round->deadline,
+                   [&]() { return expected_receivers_ != 0 && arrived_ >= expected_receivers_; });
+    cv_.wait(lock, [&]() { return !running_; });
+    gathering_ = nullptr;
+    running_ = true;
+    lock.unlock();
+
+    drive(*round);
+
+    lock.lock();
+    running_ = false;
+    round->done = true;
+    cv_.notify_all();
+}
+
+void MulticastShare::drive(Round& round) {
+    struct Member {
+        MulticastMember* member;
+        bool active = true;     // multicast reaches it and its connection works
+        uint32_t received = 0;  // datagram counts of its last NACK
+        uint32_t expected = 0;
+        bool clean = false;     // its last NACK listed no blocks
+        uint32_t owed = 0;      // checks sent that it has not answered yet
+    };
+    std::vector<Member> members;
+    std::map<uint32_t, const MulticastFile*> files;
+    for (MulticastMember* member : round.members) {
+        members.push_back({member});
+        for (const MulticastFile& file : member->files) {
+            files.emplace(file.index, &file);
+        }
+    }
+    MulticastSender& sender = *sender_;
+
+    for (const auto& [index, file] : files) {
+        std::vector<Member*> wanting;
+        for (Member& m : members) {
+            bool wants = std::any_of(m.member->files.begin(), m.member->files.end(),
+                                     [index = index](const MulticastFile& f) { return f.index == index; });
+            if (m.active && wants) {
+                wanting.push_back(&m);
+            }
+        }
+        if (wanting.empty()) {
+            continue;
+        }
+        try {
+            sender.open_file(index, file->path, file->size);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            continue;
+        }
+        uint64_t blocks = sender.block_count();
+        std::vector<bool> exhausted(blocks, false);
+
+        // Asks every member still in the round about the blocks below `end`
+        // and returns the most symbols any of them needs per block. Answers
+        // are taken in the order they arrive; members that have not answered
+        // within kNackTimeout leave the round. So does a member that got
+        // none of the datagrams since its last answer, as it is not on the
+        // group's path. The check after a whole window has counted enough
+        // datagrams to `adapt` the rate to.
+        auto check = [&](uint64_t end, bool adapt) {
+            protocol::MulticastCheck request{sender.last_sequence(), static_cast<uint32_t>(end)};
+            std::vector<Member*> waiting;
+            for (Member* m : wanting) {
+                if (!m->active) {
+                    continue;
+                }
+                try {
+                    MessageSender::send_multicast_check(*m->member->socket, m->member->session_id, index, request);
+                    ++m->owed;
+                    waiting.push_back(m);
+                } catch (const std::exception&) {
+                    m->active = false;
+                    m->member->failed = true;
+                }
+            }
+
+            std::map<uint32_t, uint32_t> needed;
+            double worst = 0;
+            auto deadline = std::chrono::steady_clock::now() + kNackTimeout;
+            while (!waiting.empty()) {
+                bool answered = false;
+                for (auto it = waiting.begin(); it != waiting.end();) {
+                    Member* m = *it;
+                    uint32_t file = 0;
+                    protocol::MulticastNack nack;
+                    try {
+                        if (!try_receive_nack(*m->member->reader, file, nack)) {
+                            ++it;
+                            continue;
+                        }
+                        if (file != index) {
+                            throw std::runtime_error("MULTICAST_NACK for the wrong file");
+                        }
+                    } catch (const std::exception&) {
+                        m->active = false;
+                        m->member->failed = true;
+                        it = waiting.erase(it);
+                        continue;
+                    }
+                    --m->owed;
+                    it = waiting.erase(it);
+                    answered = true;
+
+                    uint32_t got = nack.received - m->received;
+                    uint32_t sent = nack.expected - m->expected;
+                    m->received = nack.received;
+                    m->expected = nack.expected;
+                    if (sent > 0 && got == 0) {
+                        m->active = false;
+                        continue;
+                    }
+                    if (sent > 0) {
+                        worst = std::max(worst, 1.0 - static_cast<double>(got) / sent);
+                    }
+                    m->clean = nack.blocks.empty();
+                    for (const auto& [block, count] : nack.blocks) {
+                        if (block < blocks && !exhausted[block]) {
+                            needed[block] = std::max(needed[block], count);
+                        }
+                    }
+                }
+                if (waiting.empty()) {
+                    break;
+                }
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    for (Member* m : waiting) {
+                        m->active = false;
+                    }
+                    break;
+                }
+                if (!answered) {
+                    std::this_thread::sleep_for(kNackPollInterval);
+                }
+            }
+
+            // Loss that holds steady is the medium and is met with repairs;
+            // a jump in it is the sender overrunning someone.
+            if (adapt) {
+                if (loss_ < 0) {
+                    loss_ = worst;
+                }
+                double rate = worst > loss_ * 1.5 + 0.01 ? sender.rate() * 0.75 : sender.rate() * 1.25;
+                sender.set_rate(std::clamp(rate, kMinRate, max_rate_));
+                loss_ = 0.8 * loss_ + 0.2 * worst;
+            }
+            return needed;
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        uint64_t begin = 0;
+        uint64_t end = 0;
+        bool readable = true;
+        do {
+            end = std::min(blocks, begin + kWindowBlocks);
+            std::size_t repair = std::min<std::size_t>(
+                static_cast<std::size_t>(std::ceil(MULTICAST_BLOCK_SYMBOLS * std::max(loss_, 0.0) * 1.5)),
+                BlockCode::MAX_SYMBOLS - MULTICAST_BLOCK_SYMBOLS);
+            if (!sender.send_blocks(begin, end, repair, nullptr)) {
+                readable = false;
+                break;
+            }
+
+            for (int attempt = 0; attempt < kMaxRepairRounds; ++attempt) {
+                std::map<uint32_t, uint32_t> needed = check(end, attempt == 0);
+                if (needed.empty()) {
+                    break;
+                }
+                try {
+                    for (const auto& [block, count] : needed) {
+                        std::size_t extra = static_cast<std::size_t>(std::ceil(count * std::max(loss_, 0.0) * 1.5)) + 1;
+                        if (!sender.send_repairs(block, count + extra)) {
+                            exhausted[block] = true;
+                        }
+                    }
+                } catch (const std::exception&) {
+                    readable = false;
+                    break;
+                }
+            }
+            if (!readable) {
+                break;
+            }
+
+            uint64_t sent = std::min(end * block_bytes(sender.config()), file->size);
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double speed = elapsed > 0 ? sent / elapsed / (1024.0 * 1024.0) : 0;
+            for (Member* m : wanting) {
+                if (m->active && m->member->progress_cb) {
+                    m->member->progress_cb(file->name, sent, file->size, speed);
+                }
+            }
+            begin = end;
+        } while (begin < blocks &&
+                 std::any_of(wanting.begin(), wanting.end(), [](const Member* m) { return m->active; }));
+
+        for (Member* m : wanting) {
+            if (readable && m->active && m->clean && end == blocks) {
+                m->member->completed.push_back(index);
+            }
+        }
+    }
+
+    // What late members still owe would otherwise arrive in front of
+    // whatever their session reads next.
+    auto deadline = std::chrono::steady_clock::now() + kLateNackTimeout;
+    while (true) {
+        bool owing = false;
+        bool answered = false;
+        for (Member& m : members) {
+            if (m.owed == 0 || m.member->failed) {
+                continue;
+            }
+            uint32_t file = 0;
+            protocol::MulticastNack nack;
+            try {
+                if (try_receive_nack(*m.member->reader, file, nack)) {
+                    --m.owed;
+                    answered = true;
+                }
+            } catch (const std::exception&) {
+                m.member->failed = true;
+                continue;
+            }
+            owing = owing || m.owed > 0;
+        }
+        if (!owing) {
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            for (Member& m : members) {
+                if (m.owed > 0) {
+                    m.member->failed = true;
+                }
+            }
+            break;
+        }
+        if (!answered) {
+            std::this_thread::sleep_for(kNackPollInterval);
+        }
+    }
+}
+
+} // namespace transfer
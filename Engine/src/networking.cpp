@@ -1,8 +1,16 @@
 #include "networking.hpp"
+#include "handshake.hpp"
 #include "transfer.hpp"
 #include "security.hpp"
 #include "protocol/packet.hpp"
 #include "protocol/file_meta.hpp"
+#include "protocol/session_config.hpp"
+#include "striping.hpp"
+#include "compression.hpp"
+#include "delta.hpp"
+#include "hash_tree.hpp"
+#include "multicast.hpp"
+#include "relay.hpp"
 #include <algorithm>
 #include <iostream>
 #include <boost/asio.hpp>
@@ -12,6 +20,9 @@
 #include <filesystem>
 #include <random>
 #include <stdexcept>
+#include <exception>
+#include <memory>
+#include <optional>
 
 #ifdef __ANDROID__
   #include <ifaddrs.h>
@@ -27,6 +38,110 @@ namespace fs = std::filesystem;
 
 namespace {
 
+// How long the server waits for the data connections of a striped session.
+constexpr auto kStripeJoinTimeout = std::chrono::seconds(10);
+
+// Feature bits the GUI paths offer in AUTH and accept from it.
+uint32_t supported_features(const transfer::TransferOptions& options) {
+    uint32_t features = protocol::FEATURE_SESSION_CONFIG | protocol::FEATURE_MANIFEST | protocol::FEATURE_BINARY_META |
+                        protocol::FEATURE_VERIFIED_RESUME;
+    if (options.bundle_small_files) {
+        features |= protocol::FEATURE_BUNDLE;
+    }
+    if (options.compress_chunks && transfer::compression_available()) {
+        features |= protocol::FEATURE_COMPRESSION;
+    }
+    if (options.delta_transfer) {
+        features |= protocol::FEATURE_DELTA;
+    }
+    if (options.verify_files) {
+        features |= protocol::FEATURE_FILE_HASH;
+    }
+    if (options.chunk_checksums) {
+        features |= protocol::FEATURE_CHUNK_CRC;
+    }
+    if (options.multicast) {
+        features |= protocol::FEATURE_MULTICAST;
+    }
+    if (options.encrypt_sessions) {
+        features |= protocol::FEATURE_ENCRYPTION;
+        if (security::FrameCipher::aes_gcm_available()) {
+            features |= protocol::FEATURE_AES_GCM;
+        }
+    }
+    if (options.stripes > 0) {
+        features |= protocol::FEATURE_STRIPING;
+        if (options.parallel_files) {
+            features |= protocol::FEATURE_PARALLEL_FILES;
+        }
+    }
+    return features;
+}
+
+protocol::SessionConfig expect_session_config(transfer::FramedReader& reader) {
+    protocol::PacketHeader header = transfer::MessageReceiver::receive_header(reader);
+    if (header.command != static_cast<uint32_t>(protocol::CommandType::SESSION_CONFIG)) {
+        throw std::runtime_error("Expected SESSION_CONFIG packet, got: " + std::to_string(header.command));
+    }
+    return transfer::MessageReceiver::receive_session_config(reader, header.payload_size);
+}
+
+// Turns off the options a session's peer did not accept in `features`.
+void restrict_to_features(transfer::TransferOptions& options, uint32_t features) {
+    if (!(features & protocol::FEATURE_COMPRESSION)) {
+        options.compress_chunks = false;
+    }
+    if (!(features & protocol::FEATURE_FILE_HASH)) {
+        options.verify_files = false;
+    }
+    if (!(features & protocol::FEATURE_CHUNK_CRC)) {
+        options.chunk_checksums = false;
+    }
+}
+
+// Intersects the receiver's chunk range with ours. Without a SESSION_CONFIG
+// (all zero), or when the ranges do not overlap, the fixed legacy size is used.
+transfer::ChunkSizer negotiate_chunk_sizer(const protocol::SessionConfig& peer) {
+    std::size_t min_size = std::max<std::size_t>(peer.min_chunk_size, transfer::DEFAULT_CHUNK_SIZE);
+    std::size_t max_size = std::min<std::size_t>(peer.max_chunk_size, transfer::MAX_CHUNK_SIZE);
+    if (min_size > max_size) {
+        return {transfer::DEFAULT_CHUNK_SIZE, transfer::DEFAULT_CHUNK_SIZE};
+    }
+    return {min_size, max_size};
+}
+
+// Runs `io_context` until one of its handlers sets `done`. Handlers that
+// stop() posted from another thread run here as well.
+void run_until(boost::asio::io_context& io_context, const bool& done) {
+    io_context.restart();
+    while (!done && io_context.run_one() > 0) {
+    }
+}
+
+// Opens the data connections the server granted, presenting the stripe token
+// on each. The server confirms on the control connection once all joined.
+std::vector<std::unique_ptr<tcp::socket>> open_stripes(tcp::socket& control, const protocol::SessionConfig& granted) {
+    std::vector<std::unique_ptr<tcp::socket>> stripes;
+    tcp::endpoint endpoint = control.remote_endpoint();
+    for (uint32_t i = 0; i < granted.stripes; ++i) {
+        auto stripe = std::make_unique<tcp::socket>(control.get_executor());
+        boost::system::error_code ec;
+        stripe->connect(endpoint, ec);
+        if (ec) {
+            break;
+        }
+        transfer::configure_socket(*stripe);
+        protocol::PacketHeader join{
+            static_cast<uint32_t>(protocol::CommandType::STRIPE_JOIN),
+            static_cast<uint32_t>(granted.stripe_token.size()),
+            0, i
+        };
+        transfer::MessageSender::send_packet(*stripe, join, boost::asio::buffer(granted.stripe_token));
+        stripes.push_back(std::move(stripe));
+    }
+    return stripes;
+}
+
 uint64_t decode_resume_offset(const protocol::PacketHeader& header) {
     return (static_cast<uint64_t>(header.reserved) << 32) | header.payload_size;
 }
@@ -152,135 +267,56 @@ std::string get_instance_id() {
     return instance_id;
 }
 
-void Server::start(std::queue<TransferJob> jobs) {
-    try {
-        if (jobs.empty()) {
-            std::cout << "No files to transfer.\n";
-            return;
-        }
-        
-        uint32_t session_id = jobs.front().session_id;
-
-        boost::asio::io_context io_context;
-        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 0));
-        
-        std::string ip = get_local_ip(io_context);
-        unsigned short port = acceptor.local_endpoint().port();
-        
-        uint16_t pin = security::generate_pin();
-        std::string pin_str = std::to_string(pin);
-        std::string pin_hash = security::hash_pin(pin_str);
-        
-        std::cout << "Listening on " << ip << ":" << port << std::endl;
-        std::cout << "┌──────────────────────┐\n";
-        std::cout << "│  Room PIN: " << pin_str << "       │\n";
-        std::cout << "└──────────────────────┘\n";
-        
-        // UDP Broadcast Thread
-        std::atomic<bool> running{true};
-        std::thread broadcast_thread([port, session_id, &running]() {
-            try {
-                boost::asio::io_context udp_io_context;
-                boost::asio::ip::udp::socket udp_socket(udp_io_context, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0));
-                udp_socket.set_option(boost::asio::socket_base::broadcast(true));
-                
-                boost::asio::ip::udp::endpoint broadcast_endpoint(boost::asio::ip::address_v4::broadcast(), DISCOVERY_PORT);
-                boost::asio::ip::udp::endpoint multicast_endpoint(
-                    boost::asio::ip::make_address(MULTICAST_GROUP), DISCOVERY_PORT);
-                
-                while (running) {
-                    std::string message = "FLUXDROP|" + std::to_string(session_id) + "|" + std::to_string(port) + "|" + get_instance_id();
-                    udp_socket.send_to(boost::asio::buffer(message), broadcast_endpoint);
-                    udp_socket.send_to(boost::asio::buffer(message), multicast_endpoint);
-                    std::this_thread::sleep_for(std::chrono::seconds(1));
-                }
-            } catch (...) {}
-        });
+namespace {
 
-        while (true) {
-            // TCP Acceptor
-            tcp::socket socket(io_context);
-            acceptor.accept(socket);
-            
-            std::cout << "Client connected. Awaiting PIN authentication...\n";
-            
-            // PIN Authentication
-            protocol::PacketHeader auth_header = transfer::MessageReceiver::receive_header(socket);
-            if (auth_header.command != static_cast<uint32_t>(protocol::CommandType::AUTH)) {
-                std::cerr << "Expected AUTH packet, got command: " << auth_header.command << "\n";
-                continue;
-            }
-            
-            std::vector<char> auth_buf(auth_header.payload_size);
-            boost::asio::read(socket, boost::asio::buffer(auth_buf));
-            std::string received_hash(auth_buf.begin(), auth_buf.end());
-            
-            if (received_hash != pin_hash) {
-                std::cout << "Authentication FAILED. Wrong PIN.\n";
-                protocol::PacketHeader fail_header{static_cast<uint32_t>(protocol::CommandType::AUTH_FAIL), 0, session_id, 0};
-                transfer::MessageSender::send_header(socket, fail_header);
-                continue;
-            }
-            
-            running = false;
-            if (broadcast_thread.joinable()) {
-                broadcast_thread.join();
-            }
+constexpr auto kAnnounceInterval = std::chrono::seconds(1);
+
+// Announces a sharing session on the discovery port every second, from a
+// timer on the server's io_context, for as long as the server waits for a
+// receiver. A send that fails, as when no network is up yet, is tried again
+// at the next tick.
+class SessionAnnouncer {
+public:
+    SessionAnnouncer(boost::asio::io_context& io_context, uint32_t session_id, unsigned short port)
+        : socket_(io_context), timer_(io_context),
+          message_("FLUXDROP|" + std::to_string(session_id) + "|" + std::to_string(port) + "|" + get_instance_id()) {
+        boost::system::error_code ec;
+        socket_.open(boost::asio::ip::udp::v4(), ec);
+        if (!ec) {
+            socket_.set_option(boost::asio::socket_base::broadcast(true), ec);
+        }
+        if (!ec) {
+            announce();
+        }
+    }
 
-            std::cout << "Authentication successful!\n";
-            protocol::PacketHeader ok_header{static_cast<uint32_t>(protocol::CommandType::AUTH_OK), 0, session_id, 0};
-            transfer::MessageSender::send_header(socket, ok_header);
+    void stop() {
+        timer_.cancel();
+        boost::system::error_code ec;
+        socket_.close(ec);
+    }
 
-        while (!jobs.empty()) {
-            TransferJob job = jobs.front();
-            
-            std::error_code ec;
-            auto fsize = std::filesystem::file_size(job.filepath, ec);
-            if (ec) {
-                std::cerr << "File not found: " << job.filepath << "\n";
-                jobs.pop();
-                continue;
+private:
+    void announce() {
+        boost::asio::ip::udp::endpoint broadcast_ep(boost::asio::ip::address_v4::broadcast(), DISCOVERY_PORT);
+        boost::asio::ip::udp::endpoint multicast_ep(boost::asio::ip::make_address(MULTICAST_GROUP), DISCOVERY_PORT);
+        boost::system::error_code ec;
+        socket_.send_to(boost::asio::buffer(message_), broadcast_ep, 0, ec);
+        socket_.send_to(boost::asio::buffer(message_), multicast_ep, 0, ec);
+        timer_.expires_after(kAnnounceInterval);
+        timer_.async_wait([this](const boost::system::error_code& wait_ec) {
+            if (!wait_ec) {
+                announce();
             }
-            
-            protocol::FileInfo file_info{job.filename, fsize, "application/octet-stream"};
-            std::cout << "Initiating transfer for " << file_info.filename << "...\n";
-            transfer::MessageSender::send_file_meta(socket, file_info);
+        });
+    }
 
-            bool job_done = false;
-            while (!job_done) {
-                protocol::PacketHeader header = transfer::MessageReceiver::receive_header(socket);
-                
-                if (header.command == 0 && header.payload_size == 0 && header.session_id == 0) {
-                    std::cout << "Client disconnected.\n";
-                    return; // abort all jobs
-                }
+    boost::asio::ip::udp::socket socket_;
+    boost::asio::steady_timer timer_;
+    std::string message_;
+};
 
-                if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
-                    protocol::PacketHeader pong_header{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, pong_header);
-                } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PONG)) {
-                    std::cout << "Client accepted " << file_info.filename << ". Sending...\n";
-                    transfer::MessageSender::send_file(socket, job.filepath, header.session_id);
-                    job_done = true;
-                } else if (header.command == static_cast<uint32_t>(protocol::CommandType::RESUME)) {
-                    uint64_t resume_offset = decode_resume_offset(header);
-                    std::cout << "Client requested RESUME for " << file_info.filename << " from offset: " << resume_offset << " bytes.\n";
-                    transfer::MessageSender::send_file(socket, job.filepath, header.session_id, resume_offset);
-                    job_done = true;
-                } else if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
-                    std::cout << "Client rejected " << file_info.filename << ".\n";
-                    job_done = true;
-                }
-            }
-            jobs.pop();
-        }
-        break;
-        }
-        std::cout << "All transfers completed.\n";
-    } catch (std::exception& e) {
-        std::cerr << "Server Exception: " << e.what() << "\n";
-    }
-}
+} // namespace
 
 void Client::join(uint32_t room_id) {
     try {
@@ -335,133 +371,44 @@ void Client::join(uint32_t room_id) {
     }
 }
 
-void Client::connect(const std::string& ip, unsigned short port) {
-    try {
-        boost::asio::io_context io_context;
-        tcp::socket socket(io_context);
-        tcp::resolver resolver(io_context);
-        boost::asio::connect(socket, resolver.resolve(ip, std::to_string(port)));
-        std::cout << "Connected to peer!\n";
-        
-        // PIN Authentication
-        std::cout << "Enter room PIN: ";
-        std::string pin_input;
-        std::getline(std::cin, pin_input);
-        
-        std::string hashed_pin = security::hash_pin(pin_input);
-        
-        protocol::PacketHeader auth_header{
-            static_cast<uint32_t>(protocol::CommandType::AUTH),
-            static_cast<uint32_t>(hashed_pin.size()),
-            0, 0
-        };
-        transfer::MessageSender::send_header(socket, auth_header);
-        boost::asio::write(socket, boost::asio::buffer(hashed_pin));
-        
-        protocol::PacketHeader auth_response = transfer::MessageReceiver::receive_header(socket);
-        if (auth_response.command == static_cast<uint32_t>(protocol::CommandType::AUTH_FAIL)) {
-            std::cout << "Authentication failed. Wrong PIN.\n";
-            return;
-        } else if (auth_response.command != static_cast<uint32_t>(protocol::CommandType::AUTH_OK)) {
-            std::cout << "Unexpected response during authentication.\n";
-            return;
-        }
-        std::cout << "Authenticated! Waiting for file streams...\n";
+// DiscoveryListener
 
-        std::cout << "Save files to (default: current directory): ";
-        std::string save_dir;
-        std::getline(std::cin, save_dir);
-        if (save_dir.empty()) save_dir = ".";
-        if (save_dir != ".") {
-            std::filesystem::create_directories(save_dir);
-        }
-        std::cout << "Saving to: " << std::filesystem::absolute(save_dir) << "\n";
+namespace {
 
-        while (true) {
-            protocol::PacketHeader header = transfer::MessageReceiver::receive_header(socket);
-            
-            if (header.command == 0 && header.payload_size == 0 && header.session_id == 0) {
-                std::cout << "Server closed connection (All files sent or aborted).\n";
-                break;
+// Reports a server's announcement to `callback` if it is for `room_id` and
+// comes from another device.
+void handle_announcement(const std::string& message, const boost::asio::ip::udp::endpoint& sender_endpoint,
+                         const std::string& local_ip, uint32_t room_id, const DeviceFoundCallback& callback) {
+    std::string sender_ip = sender_endpoint.address().to_string();
+    if (sender_ip == local_ip) return;
+
+    if (message.find("FLUXDROP|") == 0) {
+        size_t first_pipe = message.find('|');
+        size_t second_pipe = message.find('|', first_pipe + 1);
+        size_t third_pipe = message.find('|', second_pipe + 1);
+
+        if (first_pipe != std::string::npos && second_pipe != std::string::npos) {
+            DiscoveredDevice device;
+            device.session_id = std::stoul(message.substr(first_pipe + 1, second_pipe - first_pipe - 1));
+            std::string instance_id;
+
+            if (third_pipe != std::string::npos) {
+                device.port = std::stoi(message.substr(second_pipe + 1, third_pipe - second_pipe - 1));
+                instance_id = message.substr(third_pipe + 1);
+            } else {
+                device.port = std::stoi(message.substr(second_pipe + 1));
             }
 
-            if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_META)) {
-                protocol::FileInfo meta = transfer::MessageReceiver::receive_file_meta(socket, header.payload_size);
-                
-                std::cout << "\nIncoming file: " << meta.filename << " (" << format_size(meta.size) << ")\n";
-
-                fs::path relative_path;
-                try {
-                    relative_path = sanitize_relative_save_path(meta.filename);
-                } catch (const std::exception& ex) {
-                    std::cout << "Rejecting file: " << ex.what() << "\n";
-                    protocol::PacketHeader reject_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, reject_header);
-                    continue;
-                }
-
-                fs::path base_dir = save_dir.empty() ? fs::current_path() : fs::path(save_dir);
-                fs::path save_path = (base_dir / relative_path).lexically_normal();
-                uint64_t available_space = available_space_for_target(save_path);
-                if (available_space > 0 && available_space < meta.size) {
-                    std::cout << "Error: Insufficient disk space! Requires " << format_size(meta.size) 
-                              << " but only " << format_size(available_space) << " available.\n";
-                    std::cout << "Rejecting file automatically.\n";
-                    protocol::PacketHeader reject_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, reject_header);
-                    continue;
-                }
-
-                uint64_t resume_offset = 0;
-                std::string save_path_string = save_path.string();
-                std::string part_file = save_path_string + ".fluxpart";
-                std::error_code ec;
-                auto part_size = fs::file_size(part_file, ec);
-                if (!ec) {
-                    resume_offset = part_size;
-                    std::cout << "Found partial download. " << format_size(resume_offset) << " out of " << format_size(meta.size) << " downloaded.\n";
-                }
+            if (instance_id == get_instance_id()) return;
+            if (device.session_id != room_id) return;
 
-                std::cout << "Accept? (y/n) ";
-                std::string answer;
-                std::getline(std::cin, answer);
-                
-                if (answer == "y" || answer == "Y") {
-                    if (resume_offset > 0) {
-                        std::cout << "Resuming file transfer from offset...\n";
-                        protocol::PacketHeader resume_header = make_resume_header(header.session_id, resume_offset);
-                        transfer::MessageSender::send_header(socket, resume_header);
-                    } else {
-                        std::cout << "File accepted. Downloading...\n";
-                        protocol::PacketHeader accept_header{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
-                        transfer::MessageSender::send_header(socket, accept_header);
-                    }
-                    
-                    transfer::TransferState state = transfer::MessageReceiver::receive_file(socket, save_path_string, meta.size, resume_offset);
-                    if (state == transfer::TransferState::COMPLETED) {
-                        std::cout << "Download complete!\n";
-                    } else if (state == transfer::TransferState::CANCELLED) {
-                        std::cout << "Download successfully cancelled.\n";
-                    } else {
-                        std::cout << "Download failed or interrupted. Leaving .fluxpart for future resume.\n";
-                        break;
-                    }
-                } else {
-                    std::cout << "File rejected.\n";
-                    protocol::PacketHeader cancel_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, cancel_header);
-                }
-            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
-                protocol::PacketHeader pong_header{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
-                transfer::MessageSender::send_header(socket, pong_header);
-            }
+            device.ip = sender_ip;
+            if (callback) callback(device);
         }
-    } catch (std::exception& e) {
-        std::cerr << "Client Exception: " << e.what() << "\n";
     }
 }
 
-// DiscoveryListener
+} // namespace
 
 DiscoveryListener::~DiscoveryListener() {
     stop();
@@ -472,8 +419,21 @@ void DiscoveryListener::start(uint32_t room_id, DeviceFoundCallback callback) {
     running_ = true;
 
     thread_ = std::thread([this, room_id, callback]() {
+        boost::asio::io_context io_context;
+        struct Registration {
+            DiscoveryListener* l;
+            ~Registration() {
+                std::lock_guard<std::mutex> lock(l->mtx_);
+                l->io_context_ = nullptr;
+            }
+        } registration{this};
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!running_) return;
+            io_context_ = &io_context;
+        }
+
         try {
-            boost::asio::io_context io_context;
             boost::asio::ip::udp::socket socket(io_context,
                 boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), DISCOVERY_PORT));
             socket.set_option(boost::asio::socket_base::reuse_address(true));
@@ -483,52 +443,22 @@ void DiscoveryListener::start(uint32_t room_id, DeviceFoundCallback callback) {
 
             std::string local_ip = get_local_ip(io_context);
 
-            socket.non_blocking(true);
-
-            while (running_) {
-                std::array<char, 1024> recv_buf;
-                boost::asio::ip::udp::endpoint sender_endpoint;
-                boost::system::error_code ec;
-
-                size_t len = socket.receive_from(
-                    boost::asio::buffer(recv_buf), sender_endpoint, 0, ec);
-
-                if (ec == boost::asio::error::would_block) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(200));
-                    continue;
-                }
-
-                if (ec) continue;
-
-                std::string sender_ip = sender_endpoint.address().to_string();
-                if (sender_ip == local_ip) continue;
-
-                std::string message(recv_buf.data(), len);
-                if (message.find("FLUXDROP|") == 0) {
-                    size_t first_pipe = message.find('|');
-                    size_t second_pipe = message.find('|', first_pipe + 1);
-                    size_t third_pipe = message.find('|', second_pipe + 1);
-
-                    if (first_pipe != std::string::npos && second_pipe != std::string::npos) {
-                        DiscoveredDevice device;
-                        device.session_id = std::stoul(message.substr(first_pipe + 1, second_pipe - first_pipe - 1));
-                        std::string instance_id;
-
-                        if (third_pipe != std::string::npos) {
-                            device.port = std::stoi(message.substr(second_pipe + 1, third_pipe - second_pipe - 1));
-                            instance_id = message.substr(third_pipe + 1);
-                        } else {
-                            device.port = std::stoi(message.substr(second_pipe + 1));
-                        }
-
-                        if (instance_id == get_instance_id()) continue;
-                        if (device.session_id != room_id) continue;
-
-                        device.ip = sender_ip;
-                        if (callback) callback(device);
-                    }
+            std::array<char, 1024> recv_buf;
+            boost::asio::ip::udp::endpoint sender_endpoint;
+            std::function<void()> receive;
+            auto on_datagram = [&](const boost::system::error_code& ec, size_t len) {
+                if (ec == boost::asio::error::operation_aborted) return;
+                if (!ec) {
+                    handle_announcement(std::string(recv_buf.data(), len), sender_endpoint, local_ip, room_id, callback);
                 }
-            }
+                receive();
+            };
+            receive = [&]() {
+                socket.async_receive_from(boost::asio::buffer(recv_buf), sender_endpoint, on_datagram);
+            };
+
+            receive();
+            io_context.run();
         } catch (std::exception& e) {
             std::cerr << "DiscoveryListener Exception: " << e.what() << "\n";
         }
@@ -536,202 +466,1257 @@ void DiscoveryListener::start(uint32_t room_id, DeviceFoundCallback callback) {
 }
 
 void DiscoveryListener::stop() {
-    running_ = false;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        running_ = false;
+        if (io_context_) {
+            io_context_->stop();
+        }
+    }
     if (thread_.joinable()) {
         thread_.join();
     }
 }
 
-// Server GUI Mode
-
-void Server::start_gui(std::queue<TransferJob> jobs, ServerCallbacks callbacks) {
-    try {
-        if (jobs.empty()) {
-            if (callbacks.on_error) callbacks.on_error("No files to transfer.");
-            return;
-        }
-
-        uint32_t session_id = jobs.front().session_id;
-
-        boost::asio::io_context io_context;
-        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 0));
+namespace {
 
-        std::string ip = get_local_ip(io_context);
-        unsigned short port = acceptor.local_endpoint().port();
+// Serializes calls into a user callback that several file workers share.
+template <typename R, typename... Args>
+std::function<R(Args...)> serialized(std::function<R(Args...)> fn, std::shared_ptr<std::mutex> mtx) {
+    if (!fn) {
+        return fn;
+    }
+    return [fn = std::move(fn), mtx = std::move(mtx)](Args... args) -> R {
+        std::lock_guard<std::mutex> lock(*mtx);
+        return fn(args...);
+    };
+}
 
-        uint16_t pin = security::generate_pin();
-        std::string pin_str = std::to_string(pin);
-        std::string pin_hash = security::hash_pin(pin_str);
+// std::filesystem's clock has an implementation-defined epoch, so file times
+// travel as Unix seconds converted through the system clock.
+int64_t to_unix_seconds(fs::file_time_type time) {
+    auto system_time = time - fs::file_time_type::clock::now() + std::chrono::system_clock::now();
+    return std::chrono::duration_cast<std::chrono::seconds>(system_time.time_since_epoch()).count();
+}
 
-        if (callbacks.on_ready) callbacks.on_ready(ip, port, pin);
+fs::file_time_type from_unix_seconds(int64_t seconds) {
+    // Half a second keeps the round trip through both clocks from landing on
+    // the previous second.
+    auto system_time = std::chrono::system_clock::time_point(std::chrono::seconds(seconds) + std::chrono::milliseconds(500));
+    return std::chrono::time_point_cast<fs::file_time_type::duration>(
+        system_time - std::chrono::system_clock::now() + fs::file_time_type::clock::now());
+}
 
-        std::atomic<bool> broadcasting{true};
-        std::thread broadcast_thread([port, session_id, &broadcasting]() {
-            try {
-                boost::asio::io_context udp_io;
-                boost::asio::ip::udp::socket udp_socket(udp_io,
-                    boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0));
-                udp_socket.set_option(boost::asio::socket_base::broadcast(true));
-                boost::asio::ip::udp::endpoint broadcast_ep(
-                    boost::asio::ip::address_v4::broadcast(), DISCOVERY_PORT);
-                boost::asio::ip::udp::endpoint multicast_ep(
-                    boost::asio::ip::make_address(MULTICAST_GROUP), DISCOVERY_PORT);
-
-                while (broadcasting) {
-                    std::string msg = "FLUXDROP|" + std::to_string(session_id) + "|" + std::to_string(port) + "|" + get_instance_id();
-                    udp_socket.send_to(boost::asio::buffer(msg), broadcast_ep);
-                    udp_socket.send_to(boost::asio::buffer(msg), multicast_ep);
-                    std::this_thread::sleep_for(std::chrono::seconds(1));
-                }
-            } catch (...) {}
-        });
+// The permission bits that travel in a binary manifest.
+constexpr fs::perms kPermissionBits = fs::perms::owner_all | fs::perms::group_all | fs::perms::others_all;
+
+enum class OfferResult {
+    DONE,
+    DISCONNECTED
+};
+
+// Serves the RANGE_REQUEST in `header` for the file at `filepath`, whose
+// manifest index is `index`.
+using RangeHandler =
+    std::function<void(const std::string& filepath, uint32_t index, const protocol::PacketHeader& header)>;
+
+// Answers a HASH_REQUEST with the hashes of `filepath`'s first blocks, or
+// just confirms the receiver's root when it matches ours. A file that can no
+// longer be read is answered with no hashes, so the receiver starts it over.
+// A relay answers for a file it is still receiving once it got that far.
+void answer_hash_request(tcp::socket& socket, transfer::FramedReader& reader, const protocol::PacketHeader& header,
+                         const std::string& filepath, const ServerCallbacks& callbacks) {
+    protocol::HashRequest request = transfer::MessageReceiver::receive_hash_request(reader, header.payload_size);
+    protocol::HashReply reply;
+    try {
+        const std::shared_ptr<transfer::RelayFeed>& relay = callbacks.options.relay;
+        if (relay && relay->follows(filepath)) {
+            reply.hashes = relay->block_hashes(filepath, request.block_count, callbacks.cancel_flag);
+        } else {
+            reply.hashes = transfer::source_block_hashes(filepath, request.block_count);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Could not hash " << filepath << " for a resume: " << e.what() << "\n";
+    }
+    if (request.root && reply.hashes.size() == request.block_count && transfer::merkle_root(reply.hashes) == *request.root) {
+        reply.root_matches = true;
+        reply.hashes.clear();
+    }
+    transfer::MessageSender::send_hash_reply(socket, header.session_id, header.reserved, reply);
+}
 
-        {
-            std::lock_guard<std::mutex> lock(mtx_);
-            acceptor_ = &acceptor;
+// Offers one file with FILE_META and serves the receiver's answer: the whole
+// file on PONG, the rest of it on RESUME, nothing on CANCEL. A HASH_REQUEST
+// may come first. Connections that can stripe handle RANGE_REQUEST through
+// `serve_ranges`; the others pass an empty function.
+OfferResult offer_file(tcp::socket& socket, transfer::FramedReader& reader, const TransferJob& job, uint64_t file_size,
+                       uint32_t features, const ServerCallbacks& callbacks, transfer::BufferPool& buffer_pool,
+                       transfer::ChunkSizer& chunk_sizer, const RangeHandler& serve_ranges) {
+    protocol::FileInfo file_info{job.filename, file_size, "application/octet-stream"};
+    if (callbacks.on_status) callbacks.on_status("Sending: " + file_info.filename);
+    transfer::MessageSender::send_file_meta(socket, file_info, (features & protocol::FEATURE_BINARY_META) != 0);
+
+    while (true) {
+        protocol::PacketHeader header = transfer::MessageReceiver::receive_header(reader);
+
+        if (header.command == 0 && header.payload_size == 0 && header.session_id == 0) {
+            return OfferResult::DISCONNECTED;
         }
 
-        while (true) {
-            tcp::socket socket(io_context);
-            
-            {
-                std::lock_guard<std::mutex> lock(mtx_);
-                socket_ = &socket;
+        if (header.command == static_cast<uint32_t>(protocol::CommandType::PONG) ||
+            header.command == static_cast<uint32_t>(protocol::CommandType::RESUME)) {
+            uint64_t offset = header.command == static_cast<uint32_t>(protocol::CommandType::RESUME) ? decode_resume_offset(header) : 0;
+            if (transfer::MessageSender::send_file(socket, job.filepath, header.session_id, 0, offset, callbacks.on_progress, callbacks.cancel_flag, callbacks.options, &buffer_pool, &chunk_sizer) &&
+                callbacks.options.chunk_checksums) {
+                transfer::MessageSender::send_repairs(socket, reader, job.filepath, header.session_id, 0,
+                                                      callbacks.cancel_flag, callbacks.options, &buffer_pool);
             }
-
-            acceptor.non_blocking(true);
-            boost::system::error_code accept_ec;
-            while (true) {
-                {
-                    std::lock_guard<std::mutex> lock(mtx_);
-                    if (stopped_) {
-                        accept_ec = boost::asio::error::operation_aborted;
-                        break;
-                    }
-                }
-                if (callbacks.cancel_flag && callbacks.cancel_flag->load()) {
-                    accept_ec = boost::asio::error::operation_aborted;
-                    break;
-                }
-                acceptor.accept(socket, accept_ec);
-                if (accept_ec == boost::asio::error::would_block ||
-                    accept_ec == boost::asio::error::try_again) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                    continue;
-                }
-                break;
+            return OfferResult::DONE;
+        } else if (header.command == static_cast<uint32_t>(protocol::CommandType::RANGE_REQUEST)) {
+            if (!serve_ranges) {
+                throw std::runtime_error("Receiver asked for ranges on a connection that cannot stripe.");
             }
+            serve_ranges(job.filepath, 0, header);
+            return OfferResult::DONE;
+        } else if (header.command == static_cast<uint32_t>(protocol::CommandType::HASH_REQUEST)) {
+            answer_hash_request(socket, reader, header, job.filepath, callbacks);
+        } else if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
+            return OfferResult::DONE;
+        } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
+            protocol::PacketHeader pong{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
+            transfer::MessageSender::send_header(socket, pong);
+        }
+    }
+}
 
-            if (accept_ec || (callbacks.cancel_flag && callbacks.cancel_flag->load())) {
-                broadcasting = false;
-                if (broadcast_thread.joinable()) broadcast_thread.join();
+// Runs `send(socket, reader, item, chunk_sizer)` for each of `items` over the
+// data connections, each connection taking the next item as soon as its
+// previous one is done. Every connection ends its share with STRIPE_JOIN so
+// the receiver knows it may be striped again. If one connection fails, all of
+// them are closed and the error is rethrown once the workers have stopped.
+template <typename Item, typename Send>
+void run_file_pool(const std::vector<tcp::socket*>& connections, std::queue<Item> items, uint32_t session_id,
+                   std::atomic<bool>* cancel_flag, const protocol::SessionConfig& peer_config, Send send) {
+    std::mutex items_mtx;
+    std::exception_ptr error;
+    std::mutex error_mtx;
+
+    auto next_item = [&](Item& item) {
+        std::lock_guard<std::mutex> lock(items_mtx);
+        if (items.empty() || (cancel_flag && cancel_flag->load())) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop();
+        return true;
+    };
 
-                if (callbacks.on_status) callbacks.on_status("Sharing cancelled.");
-                {
-                    std::lock_guard<std::mutex> lock(mtx_);
-                    socket_ = nullptr;
+    auto work = [&](std::size_t index) {
+        tcp::socket& socket = *connections[index];
+        try {
+            transfer::FramedReader reader(socket);
+            transfer::ChunkSizer chunk_sizer = negotiate_chunk_sizer(peer_config);
+            Item item;
+            while (next_item(item)) {
+                send(socket, reader, item, chunk_sizer);
+            }
+            protocol::PacketHeader released{static_cast<uint32_t>(protocol::CommandType::STRIPE_JOIN), 0,
+                                            session_id, static_cast<uint32_t>(index)};
+            transfer::MessageSender::send_header(socket, released);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mtx);
+            if (!error) {
+                error = std::current_exception();
+                for (tcp::socket* connection : connections) {
+                    boost::system::error_code ec;
+                    connection->close(ec);
                 }
-                return;
             }
+        }
+    };
 
-            if (callbacks.on_status) callbacks.on_status("Client connected. Authenticating...");
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+        workers.emplace_back(work, i);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
 
-            protocol::PacketHeader auth_header = transfer::MessageReceiver::receive_header(socket);
-            if (auth_header.command != static_cast<uint32_t>(protocol::CommandType::AUTH)) {
-                if (callbacks.on_error) callbacks.on_error("Expected AUTH packet, got: " + std::to_string(auth_header.command));
-                {
-                    std::lock_guard<std::mutex> lock(mtx_);
-                    socket_ = nullptr;
-                }
+// Files sent as one unit: a single file behind FILE_START, or several small
+// ones packed into a FILE_BUNDLE.
+struct ManifestBatch {
+    std::vector<uint32_t> files;
+    bool bundled = false;
+};
+
+// Drains `jobs` into one MANIFEST, reads the receiver's decisions, then
+// streams the accepted files back to back, each behind a FILE_START or, with
+// FEATURE_BUNDLE, packed into FILE_BUNDLEs when small. A relay offers the
+// files it is still receiving as its sender announced them. Files the receiver
+// takes from the multicast group go first, in a round of `multicast`; those
+// it did not get whole are sent over TCP after all. Small files go over the
+// data connections when `pool_connections` is set; the rest follow on the
+// control connection, where striped files get their RANGE_REQUEST.
+OfferResult send_with_manifest(tcp::socket& socket, transfer::FramedReader& reader, std::queue<TransferJob>& jobs,
+                               uint32_t session_id, uint32_t features, const ServerCallbacks& callbacks,
+                               const ServerCallbacks& pool_callbacks, const std::vector<tcp::socket*>& pool_connections,
+                               const protocol::SessionConfig& peer_config, transfer::BufferPool& buffer_pool,
+                               transfer::ChunkSizer& chunk_sizer, const RangeHandler& serve_ranges,
+                               transfer::MulticastShare* multicast) {
+    protocol::Manifest manifest;
+    std::vector<std::string> paths;
+    while (!jobs.empty()) {
+        const TransferJob& job = jobs.front();
+        if (callbacks.options.relay) {
+            if (std::optional<protocol::ManifestEntry> relayed = callbacks.options.relay->entry(job.filepath)) {
+                relayed->path = job.filename;
+                manifest.files.push_back(std::move(*relayed));
+                paths.push_back(job.filepath);
+                jobs.pop();
                 continue;
             }
+        }
+        std::error_code size_ec;
+        std::error_code time_ec;
+        auto fsize = fs::file_size(job.filepath, size_ec);
+        auto mtime = fs::last_write_time(job.filepath, time_ec);
+        if (!size_ec && !time_ec) {
+            std::error_code status_ec;
+            fs::perms perms = fs::status(job.filepath, status_ec).permissions() & kPermissionBits;
+            manifest.files.push_back({job.filename, fsize, to_unix_seconds(mtime),
+                                      status_ec ? 0u : static_cast<uint32_t>(perms)});
+            paths.push_back(job.filepath);
+        }
+        jobs.pop();
+    }
 
-            std::vector<char> auth_buf(auth_header.payload_size);
-            boost::asio::read(socket, boost::asio::buffer(auth_buf));
-            std::string received_hash(auth_buf.begin(), auth_buf.end());
+    if (callbacks.on_status) callbacks.on_status("Offering " + std::to_string(manifest.files.size()) + " files...");
+    transfer::MessageSender::send_manifest(socket, session_id, manifest, (features & protocol::FEATURE_BINARY_META) != 0);
 
-            if (received_hash != pin_hash) {
-                if (callbacks.on_status) callbacks.on_status("Authentication FAILED. Wrong PIN.");
-                protocol::PacketHeader fail_header{static_cast<uint32_t>(protocol::CommandType::AUTH_FAIL), 0, session_id, 0};
-                transfer::MessageSender::send_header(socket, fail_header);
-                if (callbacks.on_status) callbacks.on_status("Wrong PIN entered. Waiting for correct PIN...");
-                {
-                    std::lock_guard<std::mutex> lock(mtx_);
-                    socket_ = nullptr;
-                }
-                continue;
+    // The receiver checks the files it resumes before it decides on them.
+    protocol::PacketHeader header = transfer::MessageReceiver::receive_header(reader);
+    while (header.command == static_cast<uint32_t>(protocol::CommandType::HASH_REQUEST)) {
+        if (header.reserved >= paths.size()) {
+            throw std::runtime_error("Receiver asked for the hashes of an unknown file.");
+        }
+        answer_hash_request(socket, reader, header, paths[header.reserved], callbacks);
+        header = transfer::MessageReceiver::receive_header(reader);
+    }
+    if (header.command == 0 && header.payload_size == 0 && header.session_id == 0) {
+        return OfferResult::DISCONNECTED;
+    }
+    if (header.command != static_cast<uint32_t>(protocol::CommandType::MANIFEST_REPLY)) {
+        throw std::runtime_error("Expected MANIFEST_REPLY packet, got: " + std::to_string(header.command));
+    }
+    protocol::ManifestReply reply = transfer::MessageReceiver::receive_manifest_reply(reader, header.payload_size);
+    if (reply.files.size() != manifest.files.size()) {
+        throw std::runtime_error("Receiver answered " + std::to_string(reply.files.size()) + " of " +
+                                 std::to_string(manifest.files.size()) + " offered files.");
+    }
+
+    transfer::MulticastMember member;
+    member.socket = &socket;
+    member.reader = &reader;
+    member.session_id = session_id;
+    member.progress_cb = callbacks.on_progress;
+    for (uint32_t i = 0; i < reply.files.size(); ++i) {
+        if (reply.files[i].action == protocol::FileAction::MULTICAST) {
+            member.files.push_back({i, paths[i], manifest.files[i].path, manifest.files[i].size});
+        }
+    }
+    if (multicast) {
+        if (!member.files.empty() && callbacks.on_status) {
+            callbacks.on_status("Multicasting " + std::to_string(member.files.size()) + " files...");
+        }
+        multicast->run(member);
+        if (member.failed) {
+            return OfferResult::DISCONNECTED;
+        }
+    }
+    for (const transfer::MulticastFile& file : member.files) {
+        bool delivered = std::find(member.completed.begin(), member.completed.end(), file.index) != member.completed.end();
+        reply.files[file.index] = delivered ? protocol::FileDecision{} : protocol::FileDecision{protocol::FileAction::SEND, 0};
+    }
+    if (!member.files.empty() && callbacks.on_status) {
+        callbacks.on_status("Multicast delivered " + std::to_string(member.completed.size()) + " of " +
+                            std::to_string(member.files.size()) + " files");
+    }
+
+    // Sends a bundle, or a FILE_START followed by the file's data unless it is
+    // striped, in which case the caller serves the RANGE_REQUEST. A DELTA file
+    // waits for the receiver's BLOCK_SIGNATURES on the same connection, as
+    // does a streamed file for its CHUNK_NACKs when chunks are checked.
+    auto send_batch = [&](tcp::socket& connection, transfer::FramedReader& connection_reader, const ManifestBatch& batch,
+                          const ServerCallbacks& cb, transfer::ChunkSizer& sizer) {
+        if (batch.bundled) {
+            std::vector<transfer::BundledFile> files;
+            files.reserve(batch.files.size());
+            for (uint32_t index : batch.files) {
+                files.push_back({index, paths[index], static_cast<uint32_t>(manifest.files[index].size)});
+            }
+            if (cb.on_status) cb.on_status("Sending " + std::to_string(files.size()) + " small files...");
+            transfer::MessageSender::send_bundle(connection, session_id, files, cb.options, &buffer_pool);
+            return;
+        }
+        uint32_t index = batch.files.front();
+        if (cb.on_status) cb.on_status("Sending: " + manifest.files[index].path);
+        protocol::PacketHeader start{static_cast<uint32_t>(protocol::CommandType::FILE_START), 0, session_id, index};
+        transfer::MessageSender::send_header(connection, start);
+        bool sent = false;
+        if (reply.files[index].action == protocol::FileAction::SEND) {
+            sent = transfer::MessageSender::send_file(connection, paths[index], session_id, index, reply.files[index].offset,
+                                                      cb.on_progress, callbacks.cancel_flag, callbacks.options,
+                                                      &buffer_pool, &sizer);
+        } else if (reply.files[index].action == protocol::FileAction::DELTA) {
+            protocol::PacketHeader answer = transfer::MessageReceiver::receive_header(connection_reader);
+            if (answer.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
+                return;
+            }
+            if (answer.command != static_cast<uint32_t>(protocol::CommandType::BLOCK_SIGNATURES)) {
+                throw std::runtime_error("Expected BLOCK_SIGNATURES packet, got: " + std::to_string(answer.command));
             }
+            protocol::BlockSignatures signatures =
+                transfer::MessageReceiver::receive_block_signatures(connection_reader, answer.payload_size);
+            sent = transfer::MessageSender::send_delta(connection, paths[index], session_id, index, signatures,
+                                                       cb.on_progress, callbacks.cancel_flag, callbacks.options, &sizer);
+        }
+        if (sent && callbacks.options.chunk_checksums) {
+            transfer::MessageSender::send_repairs(connection, connection_reader, paths[index], session_id, index,
+                                                  callbacks.cancel_flag, callbacks.options, &buffer_pool);
+        }
+        // The receiver cannot be told how far a relay got with a file its
+        // sender gave up on. Dropping the connection leaves it the .fluxpart
+        // to resume from, through the relay's next session or another sender.
+        if (!sent && callbacks.options.relay && callbacks.options.relay->follows(paths[index])) {
+            throw std::runtime_error("Lost " + manifest.files[index].path + " upstream");
+        }
+    };
 
-            broadcasting = false;
-            if (broadcast_thread.joinable()) broadcast_thread.join();
-            
-            {
-                std::lock_guard<std::mutex> lock(mtx_);
-                acceptor_ = nullptr;
+    std::queue<ManifestBatch> pooled;
+    std::vector<ManifestBatch> on_control;
+    auto schedule = [&](ManifestBatch batch, uint64_t size) {
+        if (!pool_connections.empty() && size < transfer::STRIPE_THRESHOLD) {
+            pooled.push(std::move(batch));
+        } else {
+            on_control.push_back(std::move(batch));
+        }
+    };
+
+    ManifestBatch open_bundle{{}, true};
+    std::size_t open_bundle_data = 0;
+    for (uint32_t i = 0; i < reply.files.size(); ++i) {
+        const protocol::FileDecision& decision = reply.files[i];
+        if (decision.action == protocol::FileAction::SKIP) {
+            continue;
+        }
+        uint64_t size = manifest.files[i].size;
+        if (decision.action == protocol::FileAction::STRIPE) {
+            on_control.push_back({{i}, false});
+        } else if ((features & protocol::FEATURE_BUNDLE) && decision.offset == 0 && size < transfer::BUNDLE_FILE_THRESHOLD) {
+            if (protocol::bundle_index_size(open_bundle.files.size() + 1) + open_bundle_data + size > transfer::BUNDLE_SIZE) {
+                schedule(std::move(open_bundle), 0);
+                open_bundle = {{}, true};
+                open_bundle_data = 0;
             }
+            open_bundle.files.push_back(i);
+            open_bundle_data += size;
+        } else {
+            schedule({{i}, false}, size);
+        }
+    }
+    if (!open_bundle.files.empty()) {
+        schedule(std::move(open_bundle), 0);
+    }
 
-            if (callbacks.on_status) callbacks.on_status("Authenticated! Sending files...");
-            protocol::PacketHeader ok_header{static_cast<uint32_t>(protocol::CommandType::AUTH_OK), 0, session_id, 0};
-            transfer::MessageSender::send_header(socket, ok_header);
+    if (!pool_connections.empty()) {
+        run_file_pool(pool_connections, std::move(pooled), session_id, callbacks.cancel_flag, peer_config,
+                      [&](tcp::socket& connection, transfer::FramedReader& connection_reader, const ManifestBatch& batch,
+                          transfer::ChunkSizer& sizer) {
+                          send_batch(connection, connection_reader, batch, pool_callbacks, sizer);
+                      });
+    }
 
-        while (!jobs.empty()) {
-            TransferJob job = jobs.front();
+    for (const ManifestBatch& batch : on_control) {
+        if (callbacks.cancel_flag && callbacks.cancel_flag->load()) {
+            break;
+        }
+        send_batch(socket, reader, batch, callbacks, chunk_sizer);
+        uint32_t index = batch.files.front();
+        if (batch.bundled || reply.files[index].action != protocol::FileAction::STRIPE) {
+            continue;
+        }
+
+        protocol::PacketHeader request = transfer::MessageReceiver::receive_header(reader);
+        if (request.command == 0 && request.payload_size == 0 && request.session_id == 0) {
+            return OfferResult::DISCONNECTED;
+        }
+        if (request.command != static_cast<uint32_t>(protocol::CommandType::RANGE_REQUEST)) {
+            throw std::runtime_error("Expected RANGE_REQUEST packet, got: " + std::to_string(request.command));
+        }
+        serve_ranges(paths[index], index, request);
+    }
+    return OfferResult::DONE;
+}
 
+// Checks the ranges of a .fluxpart an earlier session completed and returns
+// those that still match the sender's file.
+using ResumeVerifier = std::function<transfer::ByteRanges(const fs::path& part_file, const transfer::ByteRanges& completed)>;
+
+// Asks the sender for the block hashes of file `index` and keeps the blocks
+// of `part_file` that match them, so a torn write or a source changed since
+// the earlier session is sent again instead of being trusted by its length.
+transfer::ByteRanges verify_partial_file(tcp::socket& socket, transfer::FramedReader& reader, uint32_t session_id,
+                                         uint32_t index, const fs::path& part_file, uint64_t size,
+                                         const transfer::ByteRanges& completed, const ClientCallbacks& callbacks) {
+    std::optional<transfer::PartialFileHashes> partial;
+    try {
+        partial.emplace(part_file, size, completed);
+    } catch (const std::exception& e) {
+        if (callbacks.on_error) callbacks.on_error(std::string("Cannot verify partial file, starting over: ") + e.what());
+        return {};
+    }
+    protocol::HashRequest request = partial->request();
+    if (request.block_count == 0) {
+        return {};
+    }
+
+    transfer::MessageSender::send_hash_request(socket, session_id, index, request);
+    protocol::PacketHeader header = transfer::MessageReceiver::receive_header(reader);
+    if (header.command != static_cast<uint32_t>(protocol::CommandType::HASH_REPLY) || header.reserved != index) {
+        throw std::runtime_error("Expected HASH_REPLY packet, got: " + std::to_string(header.command));
+    }
+    transfer::ByteRanges verified = partial->verify(transfer::MessageReceiver::receive_hash_reply(reader, header.payload_size));
+
+    uint64_t discarded = transfer::total_bytes(completed) - transfer::total_bytes(verified);
+    if (discarded > 0 && callbacks.on_status) {
+        callbacks.on_status("Discarding " + format_size(discarded) + " of " + part_file.stem().string() +
+                            " that could not be verified against the sender");
+    }
+    return verified;
+}
+
+// What the receiver decided for one offered file.
+struct PlannedFile {
+    fs::path relative_path;
+    std::string save_path;
+    uint64_t size = 0;
+    std::optional<int64_t> mtime;
+    uint32_t mode = 0;
+    std::vector<protocol::ByteRange> completed;
+    protocol::FileDecision decision;
+};
+
+// Checks an offered file against the save folder and asks the user about it.
+// `reserved` is disk space already promised to earlier files of the same
+// manifest. When the sender's mtime is known, a copy left by an earlier
+// session with the same size and mtime is skipped without asking. With
+// `can_delta`, a large file that differs from the copy already saved is asked
+// for as a delta against it, unless a .fluxpart can be resumed instead. With
+// `can_multicast`, a file to be received whole from its start is taken from
+// the multicast group unless it is small enough to bundle. What a .fluxpart
+// holds is only resumed after `verify_resume`, when given, has checked it
+// against the sender.
+PlannedFile plan_file(const std::string& remote_name, uint64_t size, std::optional<int64_t> mtime,
+                      const std::string& save_dir, const ClientCallbacks& callbacks, bool can_stripe,
+                      bool can_delta, bool can_multicast, uint64_t reserved, const ResumeVerifier& verify_resume) {
+    PlannedFile file;
+    file.size = size;
+    file.mtime = mtime;
+
+    try {
+        file.relative_path = sanitize_relative_save_path(remote_name);
+    } catch (const std::exception& ex) {
+        if (callbacks.on_error) callbacks.on_error(ex.what());
+        return file;
+    }
+
+    fs::path base_dir = save_dir.empty() ? fs::current_path() : fs::path(save_dir);
+    fs::path save_path = (base_dir / file.relative_path).lexically_normal();
+    file.save_path = save_path.string();
+
+    if (mtime) {
+        std::error_code size_ec;
+        std::error_code time_ec;
+        auto existing_size = fs::file_size(save_path, size_ec);
+        auto existing_time = fs::last_write_time(save_path, time_ec);
+        if (!size_ec && !time_ec && existing_size == size && to_unix_seconds(existing_time) == *mtime) {
+            if (callbacks.on_status) callbacks.on_status("Already received: " + file.relative_path.generic_string());
+            return file;
+        }
+    }
+
+    uint64_t available_space = available_space_for_target(save_path);
+    if (available_space > 0 && available_space < size + reserved) {
+        if (callbacks.on_error) callbacks.on_error("Insufficient disk space. Requires " + format_size(size) + " but only " + format_size(available_space - std::min(available_space, reserved)) + " available.");
+        return file;
+    }
+
+    bool acc = true;
+    if (callbacks.on_file_request) {
+        acc = callbacks.on_file_request(remote_name, size);
+    }
+
+    if (!acc) {
+        if (callbacks.on_status) callbacks.on_status("Skipped: " + file.relative_path.generic_string());
+        return file;
+    }
+
+    fs::path part_file = file.save_path + ".fluxpart";
+    file.completed = transfer::load_completed_ranges(part_file, size);
+    if (verify_resume && !file.completed.empty()) {
+        file.completed = verify_resume(part_file, file.completed);
+    }
+    uint64_t completed_bytes = transfer::total_bytes(file.completed);
+    if (completed_bytes > 0) {
+        if (callbacks.on_status) callbacks.on_status("Resuming from " + format_size(completed_bytes));
+    }
+
+    std::error_code basis_ec;
+    bool has_basis = can_delta && completed_bytes == 0 && size >= transfer::DELTA_MIN_SIZE &&
+                     fs::is_regular_file(save_path, basis_ec) &&
+                     fs::file_size(save_path, basis_ec) >= transfer::DELTA_MIN_SIZE && !basis_ec;
+
+    if (has_basis) {
+        file.decision.action = protocol::FileAction::DELTA;
+    } else if (can_multicast && completed_bytes == 0 && size >= transfer::BUNDLE_FILE_THRESHOLD) {
+        file.decision.action = protocol::FileAction::MULTICAST;
+    } else if (can_stripe && size - completed_bytes >= transfer::STRIPE_THRESHOLD) {
+        file.decision.action = protocol::FileAction::STRIPE;
+    } else {
+        file.decision.action = protocol::FileAction::SEND;
+        file.decision.offset = transfer::prepare_sequential_resume(part_file, file.completed);
+    }
+    return file;
+}
+
+// Gives a received file the sender's mtime and, when the manifest carried
+// them, its permission bits. The owner keeps read and write access so a later
+// session can still replace the file.
+void apply_sender_metadata(const PlannedFile& file) {
+    std::error_code ec;
+    if (file.mtime) {
+        fs::last_write_time(file.save_path, from_unix_seconds(*file.mtime), ec);
+    }
+    if (file.mode != 0) {
+        fs::perms perms = (static_cast<fs::perms>(file.mode) & kPermissionBits) | fs::perms::owner_read | fs::perms::owner_write;
+        fs::permissions(file.save_path, perms, ec);
+    }
+}
+
+// Receives a planned file once the sender starts streaming it: sequentially
+// from the decided offset on `reader`, as a delta against the saved copy, or
+// striped over `stripe_readers`. A MULTICAST file the group fell short on is
+// received whole, over what the group delivered of it. `index` is the file's
+// manifest index, 0 for one offered by FILE_META.
+transfer::TransferState receive_planned_file(transfer::FramedReader& reader, const PlannedFile& file, uint32_t index,
+                                             uint32_t session_id, const ClientCallbacks& callbacks,
+                                             transfer::BufferPool& buffer_pool,
+                                             const std::vector<transfer::FramedReader*>& stripe_readers) {
+    if (callbacks.on_status) callbacks.on_status("Receiving: " + file.relative_path.generic_string() + " (" + format_size(file.size) + ")");
+
+    transfer::TransferState state;
+    if (file.decision.action == protocol::FileAction::STRIPE) {
+        state = transfer::MessageReceiver::receive_striped(
+            reader, stripe_readers, file.save_path, file.size, session_id, index, file.completed,
+            callbacks.on_progress, callbacks.cancel_flag, callbacks.options, &buffer_pool);
+    } else if (file.decision.action == protocol::FileAction::DELTA) {
+        state = transfer::MessageReceiver::receive_delta(
+            reader, file.save_path, file.size, session_id, index, callbacks.on_progress, callbacks.cancel_flag,
+            callbacks.options, &buffer_pool);
+    } else {
+        if (file.decision.action == protocol::FileAction::MULTICAST) {
+            transfer::prepare_sequential_resume(file.save_path + ".fluxpart", {});
+        }
+        state = transfer::MessageReceiver::receive_file(
+            reader, file.save_path, file.size, index, file.decision.offset, callbacks.on_progress, callbacks.cancel_flag,
+            callbacks.options, &buffer_pool);
+    }
+
+    if (state == transfer::TransferState::COMPLETED) {
+        apply_sender_metadata(file);
+        if (callbacks.on_status) callbacks.on_status("Received: " + file.relative_path.generic_string());
+    } else if (state == transfer::TransferState::CANCELLED) {
+         if (callbacks.on_status) callbacks.on_status("Cancelled: " + file.relative_path.generic_string());
+    } else if (state == transfer::TransferState::FAILED) {
+        if (callbacks.on_error) callbacks.on_error("Failed to receive: " + file.relative_path.generic_string());
+    }
+    return state;
+}
+
+// Answers one FILE_META and receives the file it announces. Returns false
+// when the session should end because the file was cancelled or failed.
+bool receive_offered_file(tcp::socket& socket, transfer::FramedReader& reader, const protocol::PacketHeader& header,
+                          const std::string& save_dir, const ClientCallbacks& callbacks, transfer::BufferPool& buffer_pool,
+                          const std::vector<transfer::FramedReader*>& stripe_readers, bool verified_resume) {
+    protocol::FileInfo meta = transfer::MessageReceiver::receive_file_meta(reader, header.payload_size, &buffer_pool);
+    ResumeVerifier verify;
+    if (verified_resume) {
+        verify = [&](const fs::path& part_file, const transfer::ByteRanges& completed) {
+            return verify_partial_file(socket, reader, header.session_id, 0, part_file, meta.size, completed, callbacks);
+        };
+    }
+    PlannedFile file = plan_file(meta.filename, meta.size, std::nullopt, save_dir, callbacks, !stripe_readers.empty(), false,
+                                 false, 0, verify);
+
+    if (file.decision.action == protocol::FileAction::SKIP) {
+        protocol::PacketHeader reject_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, header.session_id, 0};
+        transfer::MessageSender::send_header(socket, reject_header);
+        return true;
+    }
+    if (file.decision.action == protocol::FileAction::SEND) {
+        if (file.decision.offset > 0) {
+            protocol::PacketHeader resume_header = make_resume_header(header.session_id, file.decision.offset);
+            transfer::MessageSender::send_header(socket, resume_header);
+        } else {
+            protocol::PacketHeader accept{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
+            transfer::MessageSender::send_header(socket, accept);
+        }
+    }
+
+    return receive_planned_file(reader, file, 0, header.session_id, callbacks, buffer_pool, stripe_readers) ==
+           transfer::TransferState::COMPLETED;
+}
+
+// Reads the sender's MANIFEST, plans every entry and answers with one
+// MANIFEST_REPLY, binary encoded when `binary_meta` was negotiated. With
+// `verified_resume`, files to resume are checked against the sender first.
+// Files planned as MULTICAST are expected by `multicast` before the reply
+// lets the sender start on them. Sets `session_id` to the manifest's.
+std::vector<PlannedFile> answer_manifest(tcp::socket& socket, transfer::FramedReader& reader, const std::string& save_dir,
+                                         const ClientCallbacks& callbacks, bool can_stripe, bool can_delta,
+                                         bool verified_resume, bool binary_meta, transfer::MulticastReceiver* multicast,
+                                         uint32_t& session_id) {
+    protocol::PacketHeader header = transfer::MessageReceiver::receive_header(reader);
+    if (header.command != static_cast<uint32_t>(protocol::CommandType::MANIFEST)) {
+        throw std::runtime_error("Expected MANIFEST packet, got: " + std::to_string(header.command));
+    }
+    protocol::Manifest manifest = transfer::MessageReceiver::receive_manifest(reader, header.payload_size);
+    session_id = header.session_id;
+
+    std::vector<PlannedFile> planned;
+    protocol::ManifestReply reply;
+    uint64_t reserved = 0;
+    planned.reserve(manifest.files.size());
+    reply.files.reserve(manifest.files.size());
+    for (const protocol::ManifestEntry& entry : manifest.files) {
+        ResumeVerifier verify;
+        if (verified_resume) {
+            uint32_t index = static_cast<uint32_t>(planned.size());
+            verify = [&, index](const fs::path& part_file, const transfer::ByteRanges& completed) {
+                return verify_partial_file(socket, reader, header.session_id, index, part_file, entry.size, completed,
+                                           callbacks);
+            };
+        }
+        planned.push_back(plan_file(entry.path, entry.size, entry.mtime, save_dir, callbacks, can_stripe, can_delta,
+                                    multicast != nullptr, reserved, verify));
+        planned.back().mode = entry.mode;
+        if (planned.back().decision.action == protocol::FileAction::MULTICAST) {
+            multicast->expect_file(static_cast<uint32_t>(planned.size() - 1), planned.back().relative_path.generic_string(),
+                                   planned.back().save_path + ".fluxpart", entry.size);
+        }
+        if (planned.back().decision.action != protocol::FileAction::SKIP) {
+            reserved += entry.size;
+        }
+        reply.files.push_back(planned.back().decision);
+    }
+
+    transfer::MessageSender::send_manifest_reply(socket, header.session_id, reply, binary_meta);
+    return planned;
+}
+
+// Looks up the manifest entry a FILE_START or FILE_BUNDLE refers to.
+const PlannedFile& started_file(const std::vector<PlannedFile>& planned, uint32_t index) {
+    if (index >= planned.size() || planned[index].decision.action == protocol::FileAction::SKIP) {
+        throw std::runtime_error("Sender started a file that was not accepted.");
+    }
+    return planned[index];
+}
+
+// Joins the group a MULTICAST_CONFIG names, on the interface of the control
+// connection. Returns null, so that every file comes over TCP, when the
+// sender offers no group or it cannot be joined.
+std::unique_ptr<transfer::MulticastReceiver> join_multicast_group(tcp::socket& socket,
+                                                                  const protocol::MulticastConfig& config,
+                                                                  const ClientCallbacks& callbacks) {
+    boost::system::error_code ec;
+    tcp::endpoint local = socket.local_endpoint(ec);
+    if (config.port == 0 || ec || !local.address().is_v4() || (!config.key.empty() && !callbacks.options.cipher)) {
+        return nullptr;
+    }
+    try {
+        std::shared_ptr<const security::FrameCipher> cipher;
+        if (!config.key.empty()) {
+            cipher = std::make_shared<const security::FrameCipher>(
+                security::open_key(*callbacks.options.cipher, config.key), config.aes_gcm);
+        }
+        return std::make_unique<transfer::MulticastReceiver>(config, local.address().to_v4(), cipher,
+                                                             callbacks.on_progress);
+    } catch (std::exception& e) {
+        if (callbacks.on_status) callbacks.on_status(std::string("Receiving without multicast: ") + e.what());
+        return nullptr;
+    }
+}
+
+// Answers a MULTICAST_CHECK and moves the file into place once the answer
+// lists nothing missing. A file that cannot be written is left to the sender
+// to send over TCP.
+void answer_multicast_check(tcp::socket& socket, transfer::FramedReader& reader, const protocol::PacketHeader& header,
+                            const std::vector<PlannedFile>& planned, transfer::MulticastReceiver* multicast,
+                            const ClientCallbacks& callbacks) {
+    protocol::MulticastCheck check = transfer::MessageReceiver::receive_multicast_check(reader, header.payload_size);
+    const PlannedFile& file = started_file(planned, header.reserved);
+    if (!multicast || file.decision.action != protocol::FileAction::MULTICAST) {
+        throw std::runtime_error("Sender checked a file that was not asked for by multicast.");
+    }
+    protocol::MulticastNack nack = multicast->answer(header.reserved, check);
+    transfer::MessageSender::send_multicast_nack(socket, header.session_id, header.reserved, nack);
+
+    bool complete = false;
+    try {
+        complete = multicast->complete(header.reserved);
+    } catch (const std::exception&) {
+    }
+    if (!complete) {
+        return;
+    }
+    multicast->abandon(header.reserved);
+    fs::path part_file = file.save_path + ".fluxpart";
+    std::error_code ec;
+    fs::remove(transfer::ranges_path(part_file), ec);
+    if (transfer::replace_with_completed_file(part_file, file.save_path)) {
+        apply_sender_metadata(file);
+        if (callbacks.on_status) callbacks.on_status("Received: " + file.relative_path.generic_string());
+    } else if (callbacks.on_error) {
+        callbacks.on_error("Failed to receive: " + file.relative_path.generic_string());
+    }
+}
+
+// Writes out the small files of one FILE_BUNDLE. Returns false when the
+// session should end because the bundle could not be stored.
+bool receive_bundled_files(transfer::FramedReader& reader, const protocol::PacketHeader& header,
+                           const std::vector<PlannedFile>& planned, const ClientCallbacks& callbacks,
+                           transfer::BufferPool& buffer_pool) {
+    std::vector<uint32_t> saved;
+    transfer::TransferState state = transfer::MessageReceiver::receive_bundle(
+        reader, header,
+        [&](uint32_t index) {
+            const PlannedFile& file = started_file(planned, index);
+            if (file.decision.action != protocol::FileAction::SEND || file.decision.offset != 0) {
+                throw std::runtime_error("Sender bundled a file that was not accepted whole.");
+            }
+            return file.save_path;
+        },
+        saved, callbacks.options, &buffer_pool);
+
+    for (uint32_t index : saved) {
+        apply_sender_metadata(planned[index]);
+        if (callbacks.options.relay) {
+            callbacks.options.relay->finish(planned[index].save_path, std::nullopt);
+        }
+    }
+    if (state != transfer::TransferState::COMPLETED) {
+        if (callbacks.on_error) callbacks.on_error("Failed to receive a bundle of small files.");
+        return false;
+    }
+    if (callbacks.on_status) callbacks.on_status("Received " + std::to_string(saved.size()) + " small files");
+    return true;
+}
+
+} // namespace
+
+void Server::start(std::queue<TransferJob> jobs) {
+    try {
+        if (jobs.empty()) {
+            std::cout << "No files to transfer.\n";
+            return;
+        }
+        
+        uint32_t session_id = jobs.front().session_id;
+
+        boost::asio::io_context io_context;
+        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 0));
+        
+        std::string ip = get_local_ip(io_context);
+        unsigned short port = acceptor.local_endpoint().port();
+        
+        uint32_t pin = security::generate_pin();
+        std::string pin_str = std::to_string(pin);
+        
+        std::cout << "Listening on " << ip << ":" << port << std::endl;
+        std::cout << "┌──────────────────────┐\n";
+        std::cout << "│  Room PIN: " << pin_str << "     │\n";
+        std::cout << "└──────────────────────┘\n";
+        
+        SessionAnnouncer announcer(io_context, session_id, port);
+
+        // The CLI speaks the original protocol, so no features are accepted.
+        SenderHandshakeOptions handshake_options{
+            pin_str, 0, session_id,
+            [](const std::string& status) { std::cout << status << "\n"; },
+            [](const std::string& error) { std::cerr << error << "\n"; }
+        };
+        std::optional<AcceptedReceiver> receiver = accept_receiver(io_context, acceptor, handshake_options);
+        if (!receiver) {
+            return;
+        }
+        announcer.stop();
+        tcp::socket& socket = receiver->socket;
+        std::cout << "Authentication successful!\n";
+
+        // The CLI runs the GUI's file exchange with none of the features the
+        // original protocol lacks.
+        ServerCallbacks callbacks;
+        callbacks.on_status = [](const std::string& status) { std::cout << status << "\n"; };
+        callbacks.on_error = [](const std::string& error) { std::cerr << error << "\n"; };
+        restrict_to_features(callbacks.options, 0);
+        transfer::FramedReader reader(socket);
+        transfer::ChunkSizer chunk_sizer = negotiate_chunk_sizer(protocol::SessionConfig{});
+        transfer::BufferPool buffer_pool(chunk_sizer.max_size());
+
+        while (!jobs.empty()) {
             std::error_code ec;
-            auto fsize = std::filesystem::file_size(job.filepath, ec);
+            auto fsize = std::filesystem::file_size(jobs.front().filepath, ec);
             if (ec) {
+                std::cerr << "File not found: " << jobs.front().filepath << "\n";
                 jobs.pop();
                 continue;
             }
 
-            protocol::FileInfo file_info{job.filename, fsize, "application/octet-stream"};
-            if (callbacks.on_status) callbacks.on_status("Sending: " + file_info.filename);
-            transfer::MessageSender::send_file_meta(socket, file_info);
+            if (offer_file(socket, reader, jobs.front(), fsize, 0, callbacks, buffer_pool, chunk_sizer, {}) ==
+                OfferResult::DISCONNECTED) {
+                std::cout << "Client disconnected.\n";
+                return;
+            }
+            jobs.pop();
+        }
+        std::cout << "All transfers completed.\n";
+    } catch (std::exception& e) {
+        std::cerr << "Server Exception: " << e.what() << "\n";
+    }
+}
+
+// Server GUI Mode
+
+void Server::start_gui(std::queue<TransferJob> jobs, ServerCallbacks callbacks) {
+    try {
+        if (jobs.empty()) {
+            if (callbacks.on_error) callbacks.on_error("No files to transfer.");
+            return;
+        }
+
+        uint32_t session_id = jobs.front().session_id;
 
-            bool job_done = false;
-            while (!job_done) {
-                protocol::PacketHeader header = transfer::MessageReceiver::receive_header(socket);
+        boost::asio::io_context io_context;
+        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 0));
 
-                if (header.command == 0 && header.payload_size == 0 && header.session_id == 0) {
-                    if (callbacks.on_error) callbacks.on_error("Client disconnected.");
-                    return;
+        std::string ip = get_local_ip(io_context);
+        unsigned short port = acceptor.local_endpoint().port();
+
+        uint32_t pin = security::generate_pin();
+        std::string pin_str = std::to_string(pin);
+
+        if (callbacks.on_ready) callbacks.on_ready(ip, port, pin);
+
+        // Receivers are served on threads of their own, so the callbacks are
+        // serialized across them.
+        auto callback_mtx = std::make_shared<std::mutex>();
+        callbacks.on_status = serialized(callbacks.on_status, callback_mtx);
+        callbacks.on_progress = serialized(callbacks.on_progress, callback_mtx);
+        callbacks.on_error = serialized(callbacks.on_error, callback_mtx);
+        callbacks.on_receiver_joined = serialized(callbacks.on_receiver_joined, callback_mtx);
+        callbacks.on_receiver_progress = serialized(callbacks.on_receiver_progress, callback_mtx);
+        callbacks.on_receiver_finished = serialized(callbacks.on_receiver_finished, callback_mtx);
+
+        SessionAnnouncer announcer(io_context, session_id, port);
+        uint32_t max_receivers = callbacks.options.max_receivers;
+        std::unique_ptr<transfer::MulticastShare> multicast;
+        if (callbacks.options.multicast) {
+            multicast = std::make_unique<transfer::MulticastShare>(boost::asio::ip::make_address_v4(MULTICAST_GROUP),
+                                                                   callbacks.options, max_receivers);
+        }
+        uint32_t joined = 0;
+        std::size_t serving = 0;
+        bool locked = false; // too many wrong PINs; no more receivers will join
+        std::atomic<bool> all_completed{true};
+        std::vector<std::thread> sessions;
+
+        SenderHandshakeOptions handshake_options{pin_str, supported_features(callbacks.options), session_id,
+                                                 callbacks.on_status, callbacks.on_error};
+        ReceiverGate gate(io_context, acceptor, handshake_options, max_receivers, [&](AcceptedReceiver accepted) {
+            uint32_t id = ++joined;
+            if (joined == max_receivers) {
+                announcer.stop();
+            }
+            ++serving;
+            sessions.emplace_back([&, id, accepted = std::move(accepted)]() mutable {
+                bool completed = false;
+                try {
+                    completed = serve_receiver(id, accepted, jobs, callbacks, gate, multicast.get());
+                } catch (std::exception& e) {
+                    if (callbacks.on_error) callbacks.on_error(std::string("Server error: ") + e.what());
+                }
+                if (!completed) {
+                    all_completed = false;
                 }
+                if (callbacks.on_receiver_finished) callbacks.on_receiver_finished(id, completed);
+                // The share ends with its last receiver.
+                boost::asio::post(io_context, [&] {
+                    if (--serving == 0 && (joined == max_receivers || locked)) {
+                        gate.close();
+                    }
+                });
+            });
+        }, [&] {
+            // Receivers being served may still open their stripes, so the
+            // gate stays up until they are done.
+            locked = true;
+            announcer.stop();
+            if (serving == 0) {
+                gate.close();
+            }
+        });
 
-                if (header.command == static_cast<uint32_t>(protocol::CommandType::PONG)) {
-                    transfer::MessageSender::send_file(socket, job.filepath, header.session_id, 0, callbacks.on_progress, callbacks.cancel_flag);
-                    job_done = true;
-                } else if (header.command == static_cast<uint32_t>(protocol::CommandType::RESUME)) {
-                    uint64_t offset = decode_resume_offset(header);
-                    transfer::MessageSender::send_file(socket, job.filepath, header.session_id, offset, callbacks.on_progress, callbacks.cancel_flag);
-                    job_done = true;
-                } else if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
-                    job_done = true;
-                } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
-                    protocol::PacketHeader pong{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, pong);
+        struct Registration {
+            Server* s;
+            std::vector<std::thread>& sessions;
+            ~Registration() {
+                {
+                    std::lock_guard<std::mutex> lock(s->mtx_);
+                    s->gate_ = nullptr;
+                    for (auto& entry : s->receivers_) {
+                        s->close_receiver(*entry.second);
+                    }
+                }
+                for (auto& session : sessions) {
+                    if (session.joinable()) session.join();
                 }
             }
-            jobs.pop();
+        } registration{this, sessions};
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (stopped_) {
+                if (callbacks.on_status) callbacks.on_status("Sharing cancelled.");
+                return;
+            }
+            gate_ = &gate;
         }
-        
+
+        gate.run();
         {
             std::lock_guard<std::mutex> lock(mtx_);
-            socket_ = nullptr;
+            gate_ = nullptr;
         }
-        break;
+        for (auto& session : sessions) {
+            session.join();
+        }
+
+        if (joined == 0) {
+            if (callbacks.on_status) callbacks.on_status("Sharing cancelled.");
+        } else if (all_completed) {
+            if (callbacks.on_complete) callbacks.on_complete();
         }
-        if (callbacks.on_complete) callbacks.on_complete();
     } catch (std::exception& e) {
         if (callbacks.on_error) callbacks.on_error(std::string("Server error: ") + e.what());
     }
 }
 
+bool Server::serve_receiver(uint32_t id, AcceptedReceiver& accepted, std::queue<TransferJob> jobs,
+                            ServerCallbacks callbacks, ReceiverGate& gate, transfer::MulticastShare* multicast) {
+    Receiver receiver;
+    struct Registration {
+        Server* s;
+        uint32_t id;
+        ~Registration() {
+            std::lock_guard<std::mutex> lock(s->mtx_);
+            s->receivers_.erase(id);
+        }
+    } registration{this, id};
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (stopped_) {
+            return false;
+        }
+        receiver.socket = &accepted.socket;
+        receivers_[id] = &receiver;
+    }
+    if (callbacks.cancel_flag && callbacks.cancel_flag->load()) {
+        receiver.cancel = true;
+    }
+    callbacks.cancel_flag = &receiver.cancel;
+    if (callbacks.on_receiver_progress) {
+        ProgressCallback progress = callbacks.on_progress;
+        ReceiverProgressCallback receiver_progress = callbacks.on_receiver_progress;
+        callbacks.on_progress = [id, progress, receiver_progress](const std::string& file, uint64_t sent,
+                                                                  uint64_t total, double speed) {
+            if (progress) progress(file, sent, total, speed);
+            receiver_progress(id, file, sent, total, speed);
+        };
+    }
+    if (callbacks.on_receiver_joined) {
+        boost::system::error_code ec;
+        tcp::endpoint peer = accepted.socket.remote_endpoint(ec);
+        callbacks.on_receiver_joined(id, ec ? std::string() : peer.address().to_string());
+    }
+    uint32_t session_id = jobs.front().session_id;
+
+    tcp::socket& socket = accepted.socket;
+    transfer::FramedReader reader(socket);
+    uint32_t features = accepted.handshake.features;
+    const std::optional<security::SessionKey>& session_key = accepted.handshake.session_key;
+    if (callbacks.on_status) callbacks.on_status("Authenticated! Sending files...");
+    if ((features & protocol::FEATURE_ENCRYPTION) && session_key) {
+        callbacks.options.cipher = std::make_shared<const security::FrameCipher>(
+            *session_key, (features & protocol::FEATURE_AES_GCM) != 0);
+    }
+    restrict_to_features(callbacks.options, features);
+
+    protocol::SessionConfig peer_config;
+    if (features & protocol::FEATURE_SESSION_CONFIG) {
+        peer_config = expect_session_config(reader);
+    }
+    transfer::ChunkSizer chunk_sizer = negotiate_chunk_sizer(peer_config);
+
+    std::vector<std::unique_ptr<tcp::socket>> stripes;
+    if (features & protocol::FEATURE_STRIPING) {
+        protocol::SessionConfig granted{
+            static_cast<uint32_t>(chunk_sizer.min_size()),
+            static_cast<uint32_t>(chunk_sizer.max_size()),
+            static_cast<uint32_t>(std::min<std::size_t>(peer_config.stripes, callbacks.options.stripes)),
+            security::generate_token()
+        };
+        if (granted.stripe_token.empty()) {
+            granted.stripes = 0;
+        }
+        gate.expect_stripes(granted.stripe_token, granted.stripes);
+        transfer::MessageSender::send_session_config(socket, granted);
+        stripes = gate.take_stripes(granted.stripe_token, kStripeJoinTimeout, callbacks.cancel_flag);
+
+        protocol::PacketHeader joined{static_cast<uint32_t>(protocol::CommandType::STRIPE_JOIN), 0, session_id,
+                                      static_cast<uint32_t>(stripes.size())};
+        transfer::MessageSender::send_header(socket, joined);
+    }
+
+    struct StripeRegistration {
+        Server* s;
+        Receiver& receiver;
+        ~StripeRegistration() {
+            std::lock_guard<std::mutex> lock(s->mtx_);
+            receiver.stripes.clear();
+        }
+    } stripe_registration{this, receiver};
+
+    std::vector<tcp::socket*> stripe_sockets;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (const auto& stripe : stripes) {
+            receiver.stripes.push_back(stripe.get());
+            stripe_sockets.push_back(stripe.get());
+        }
+    }
+
+    // Without a group for this receiver, its MULTICAST_CONFIG has port 0.
+    if (features & protocol::FEATURE_MULTICAST) {
+        protocol::MulticastConfig multicast_config;
+        boost::system::error_code ec;
+        tcp::endpoint local = socket.local_endpoint(ec);
+        if (multicast && !ec) {
+            multicast_config = multicast->config_for(local.address(), callbacks.options.cipher.get());
+        }
+        transfer::MessageSender::send_multicast_config(socket, session_id, multicast_config);
+    } else {
+        multicast = nullptr;
+    }
+
+    transfer::BufferPool buffer_pool(chunk_sizer.max_size());
+
+    auto serve_ranges = [&](const std::string& filepath, uint32_t index, const protocol::PacketHeader& header) {
+        protocol::RangeRequest request = transfer::MessageReceiver::receive_range_request(reader, header.payload_size);
+        std::optional<transfer::SourceFileHash> file_hash;
+        if (callbacks.options.verify_files) {
+            file_hash.emplace(filepath);
+        }
+        if (transfer::MessageSender::send_striped(stripe_sockets, filepath, header.session_id, index, request,
+                                                  callbacks.on_progress, callbacks.cancel_flag,
+                                                  callbacks.options)) {
+            if (file_hash) {
+                transfer::MessageSender::send_file_hash(socket, header.session_id, index, *file_hash,
+                                                        callbacks.options.cipher.get());
+            }
+            if (callbacks.options.chunk_checksums) {
+                transfer::MessageSender::send_repairs(socket, reader, filepath, header.session_id, index,
+                                                      callbacks.cancel_flag, callbacks.options);
+            }
+        } else {
+            // The receiver cannot tell how far each stripe got; closing them
+            // unblocks it and it resumes from its range file next session.
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                receiver.stripes.clear();
+            }
+            stripe_sockets.clear();
+            stripes.clear();
+        }
+    };
+
+    // With parallel files the data connections first carry files below the
+    // striping threshold, several at once; the larger ones follow on the
+    // control connection, where they can be striped across all of them.
+    std::vector<tcp::socket*> pool_connections;
+    if (features & protocol::FEATURE_PARALLEL_FILES) {
+        pool_connections = stripe_sockets;
+    }
+    auto callback_mtx = std::make_shared<std::mutex>();
+    ServerCallbacks pool_callbacks = callbacks;
+    pool_callbacks.on_status = serialized(callbacks.on_status, callback_mtx);
+    pool_callbacks.on_progress = serialized(callbacks.on_progress, callback_mtx);
+
+    if (features & protocol::FEATURE_MANIFEST) {
+        if (send_with_manifest(socket, reader, jobs, session_id, features, callbacks, pool_callbacks,
+                               pool_connections, peer_config, buffer_pool, chunk_sizer, serve_ranges, multicast) ==
+            OfferResult::DISCONNECTED) {
+            if (callbacks.on_error) callbacks.on_error("Client disconnected.");
+            return false;
+        }
+    } else if (!pool_connections.empty()) {
+        std::queue<TransferJob> pooled;
+        std::queue<TransferJob> large;
+        while (!jobs.empty()) {
+            std::error_code ec;
+            auto fsize = std::filesystem::file_size(jobs.front().filepath, ec);
+            if (!ec && fsize >= transfer::STRIPE_THRESHOLD) {
+                large.push(std::move(jobs.front()));
+            } else {
+                pooled.push(std::move(jobs.front()));
+            }
+            jobs.pop();
+        }
+        jobs.swap(large);
+
+        run_file_pool(pool_connections, std::move(pooled), session_id, callbacks.cancel_flag, peer_config,
+                      [&](tcp::socket& connection, transfer::FramedReader& connection_reader, const TransferJob& job,
+                          transfer::ChunkSizer& sizer) {
+                          std::error_code ec;
+                          auto fsize = std::filesystem::file_size(job.filepath, ec);
+                          if (ec) {
+                              return;
+                          }
+                          if (offer_file(connection, connection_reader, job, fsize, features, pool_callbacks,
+                                         buffer_pool, sizer, nullptr) == OfferResult::DISCONNECTED) {
+                              throw std::runtime_error("Client disconnected.");
+                          }
+                      });
+    }
+
+    while (!jobs.empty()) {
+        std::error_code ec;
+        auto fsize = std::filesystem::file_size(jobs.front().filepath, ec);
+        if (ec) {
+            jobs.pop();
+            continue;
+        }
+
+        if (offer_file(socket, reader, jobs.front(), fsize, features, callbacks, buffer_pool, chunk_sizer,
+                       serve_ranges) == OfferResult::DISCONNECTED) {
+            if (callbacks.on_error) callbacks.on_error("Client disconnected.");
+            return false;
+        }
+        jobs.pop();
+    }
+    return !receiver.cancel;
+}
+
+void Client::connect(const std::string& ip, unsigned short port) {
+    try {
+        // Asked for first: the sender only gives a connection a few seconds
+        // to prove the PIN.
+        std::cout << "Enter room PIN: ";
+        std::string pin_input;
+        std::getline(std::cin, pin_input);
+
+        boost::asio::io_context io_context;
+        tcp::socket socket(io_context);
+        tcp::resolver resolver(io_context);
+        boost::asio::connect(socket, resolver.resolve(ip, std::to_string(port)));
+        transfer::configure_socket(socket);
+        std::cout << "Connected to peer!\n";
+
+        // The CLI speaks the original protocol, so no features are offered.
+        Handshake handshake = run_task(io_context, authenticate_to_sender(socket, pin_input, 0));
+        if (!handshake.authenticated) {
+            std::cout << "Authentication failed. Wrong PIN.\n";
+            return;
+        }
+        std::cout << "Authenticated! Waiting for file streams...\n";
+
+        std::cout << "Save files to (default: current directory): ";
+        std::string save_dir;
+        std::getline(std::cin, save_dir);
+        if (save_dir.empty()) save_dir = ".";
+        if (save_dir != ".") {
+            std::filesystem::create_directories(save_dir);
+        }
+        std::cout << "Saving to: " << std::filesystem::absolute(save_dir) << "\n";
+
+        // The CLI runs the GUI's file exchange; each offer is answered on the
+        // terminal.
+        ClientCallbacks callbacks;
+        callbacks.on_status = [](const std::string& status) { std::cout << status << "\n"; };
+        callbacks.on_error = [](const std::string& error) { std::cout << "Error: " << error << "\n"; };
+        callbacks.on_file_request = [](const std::string& filename, uint64_t size) {
+            std::cout << "\nIncoming file: " << filename << " (" << format_size(size) << ")\n";
+            std::cout << "Accept? (y/n) ";
+            std::string answer;
+            std::getline(std::cin, answer);
+            return answer == "y" || answer == "Y";
+        };
+        restrict_to_features(callbacks.options, 0);
+        transfer::FramedReader reader(socket);
+        transfer::BufferPool buffer_pool(transfer::RECEIVE_BUFFER_SIZE);
+
+        while (true) {
+            protocol::PacketHeader header = transfer::MessageReceiver::receive_header(reader);
+
+            if (header.command == 0 && header.payload_size == 0 && header.session_id == 0) {
+                std::cout << "Server closed connection (All files sent or aborted).\n";
+                break;
+            }
+
+            if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_META)) {
+                if (!receive_offered_file(socket, reader, header, save_dir, callbacks, buffer_pool, {}, false)) {
+                    std::cout << "Download failed or interrupted. Leaving .fluxpart for future resume.\n";
+                    break;
+                }
+            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
+                protocol::PacketHeader pong_header{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
+                transfer::MessageSender::send_header(socket, pong_header);
+            }
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Client Exception: " << e.what() << "\n";
+    }
+}
+
 // Client GUI Mode
 
 void Client::connect_gui(const std::string& ip, unsigned short port,
                           const std::string& pin, const std::string& save_dir,
                           ClientCallbacks callbacks) {
     try {
+        // A relay receives on the control connection only, so every file
+        // arrives in order and what it passes on is always a prefix.
+        std::shared_ptr<transfer::RelayFeed> relay_feed;
+        if (callbacks.relay) {
+            relay_feed = std::make_shared<transfer::RelayFeed>();
+            callbacks.options.relay = relay_feed;
+            callbacks.options.stripes = 0;
+            callbacks.options.multicast = false;
+        }
+
         boost::asio::io_context io_context;
         tcp::socket socket(io_context);
 
@@ -740,122 +1725,311 @@ void Client::connect_gui(const std::string& ip, unsigned short port,
             ~ClientSocketGuard() {
                 std::lock_guard<std::mutex> lock(c->mtx_);
                 c->socket_ = nullptr;
+                c->io_context_ = nullptr;
             }
         } cg{this};
 
+        // Until authenticated, stop() posts the socket's close to io_context
+        // rather than closing it under a pending operation.
         {
             std::lock_guard<std::mutex> lock(mtx_);
             if (stopped_ || (callbacks.cancel_flag && callbacks.cancel_flag->load())) {
-                boost::system::error_code ec;
-                socket.close(ec);
+                throw boost::system::system_error(boost::asio::error::operation_aborted);
             }
             socket_ = &socket;
+            io_context_ = &io_context;
         }
         tcp::resolver resolver(io_context);
-        boost::asio::connect(socket, resolver.resolve(ip, std::to_string(port)));
+        bool connected = false;
+        boost::system::error_code connect_ec;
+        boost::asio::async_connect(socket, resolver.resolve(ip, std::to_string(port)),
+                                   [&](const boost::system::error_code& ec, const tcp::endpoint&) {
+                                       connect_ec = ec;
+                                       connected = true;
+                                   });
+        run_until(io_context, connected);
+        if (connect_ec) {
+            throw boost::system::system_error(connect_ec);
+        }
+        transfer::configure_socket(socket);
 
         if (callbacks.on_status) callbacks.on_status("Connected! Authenticating...");
-
-        std::string hashed_pin = security::hash_pin(pin);
-        protocol::PacketHeader auth_header{
-            static_cast<uint32_t>(protocol::CommandType::AUTH),
-            static_cast<uint32_t>(hashed_pin.size()),
-            0, 0
-        };
-        transfer::MessageSender::send_header(socket, auth_header);
-        boost::asio::write(socket, boost::asio::buffer(hashed_pin));
-
-        protocol::PacketHeader auth_response = transfer::MessageReceiver::receive_header(socket);
-        if (auth_response.command == static_cast<uint32_t>(protocol::CommandType::AUTH_FAIL)) {
-            if (callbacks.on_error) callbacks.on_error("Authentication failed. Wrong PIN.");
+        Handshake handshake = run_task(io_context, authenticate_to_sender(socket, pin, supported_features(callbacks.options)));
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            io_context_ = nullptr;
+            if (stopped_) {
+                throw boost::system::system_error(boost::asio::error::operation_aborted);
+            }
+        }
+        if (handshake.key_exchange_refused) {
+            if (callbacks.on_error) {
+                callbacks.on_error("The sender does not support encryption. Turn encryption off to connect to it.");
+            }
             return;
-        } else if (auth_response.command != static_cast<uint32_t>(protocol::CommandType::AUTH_OK)) {
-            if (callbacks.on_error) callbacks.on_error("Unexpected auth response.");
+        }
+        if (!handshake.authenticated) {
+            if (callbacks.on_error) callbacks.on_error("Authentication failed. Wrong PIN.");
             return;
         }
+        transfer::FramedReader reader(socket);
 
-        if (callbacks.on_status) callbacks.on_status("Authenticated! Receiving files...");
+        uint32_t features = handshake.features;
+        restrict_to_features(callbacks.options, features);
+        if (features & protocol::FEATURE_ENCRYPTION) {
+            callbacks.options.cipher = std::make_shared<const security::FrameCipher>(
+                *handshake.session_key, (features & protocol::FEATURE_AES_GCM) != 0);
+        }
+        if (features & protocol::FEATURE_SESSION_CONFIG) {
+            protocol::SessionConfig config;
+            config.min_chunk_size = static_cast<uint32_t>(transfer::DEFAULT_CHUNK_SIZE);
+            config.max_chunk_size = static_cast<uint32_t>(transfer::MAX_CHUNK_SIZE);
+            config.stripes = static_cast<uint32_t>(callbacks.options.stripes);
+            transfer::MessageSender::send_session_config(socket, config);
+        }
 
-        while (true) {
-            protocol::PacketHeader header = transfer::MessageReceiver::receive_header(socket);
+        std::vector<std::unique_ptr<tcp::socket>> stripes;
+        if (features & protocol::FEATURE_STRIPING) {
+            protocol::SessionConfig granted = expect_session_config(reader);
+            stripes = open_stripes(socket, granted);
+            protocol::PacketHeader joined = transfer::MessageReceiver::receive_header(reader);
+            if (joined.command != static_cast<uint32_t>(protocol::CommandType::STRIPE_JOIN)) {
+                if (callbacks.on_error) callbacks.on_error("Unexpected response while opening data connections.");
+                return;
+            }
+            if (joined.reserved != stripes.size()) {
+                stripes.clear();
+            }
+        }
 
-            if (header.command == 0 && header.payload_size == 0 && header.session_id == 0) {
-                break;
+        std::unique_ptr<transfer::MulticastReceiver> multicast;
+        if (features & protocol::FEATURE_MULTICAST) {
+            protocol::PacketHeader header = transfer::MessageReceiver::receive_header(reader);
+            if (header.command != static_cast<uint32_t>(protocol::CommandType::MULTICAST_CONFIG)) {
+                if (callbacks.on_error) callbacks.on_error("Unexpected response while setting up multicast.");
+                return;
             }
+            multicast = join_multicast_group(
+                socket, transfer::MessageReceiver::receive_multicast_config(reader, header.payload_size), callbacks);
+        }
 
-            if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_META)) {
-                protocol::FileInfo meta = transfer::MessageReceiver::receive_file_meta(socket, header.payload_size);
+        struct StripeRegistration {
+            Client* c;
+            ~StripeRegistration() {
+                std::lock_guard<std::mutex> lock(c->mtx_);
+                c->stripes_.clear();
+            }
+        } stripe_registration{this};
 
-                fs::path relative_path;
-                try {
-                    relative_path = sanitize_relative_save_path(meta.filename);
-                } catch (const std::exception& ex) {
-                    if (callbacks.on_error) callbacks.on_error(ex.what());
-                    protocol::PacketHeader reject_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, reject_header);
-                    continue;
-                }
+        std::vector<std::unique_ptr<transfer::FramedReader>> stripe_reader_storage;
+        std::vector<transfer::FramedReader*> stripe_readers;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            for (const auto& stripe : stripes) {
+                stripes_.push_back(stripe.get());
+                stripe_reader_storage.push_back(std::make_unique<transfer::FramedReader>(*stripe));
+                stripe_readers.push_back(stripe_reader_storage.back().get());
+            }
+        }
 
-                if (callbacks.on_status) callbacks.on_status("Receiving: " + relative_path.generic_string() + " (" + format_size(meta.size) + ")");
+        if (callbacks.on_status) callbacks.on_status("Authenticated! Receiving files...");
 
-                fs::path base_dir = save_dir.empty() ? fs::current_path() : fs::path(save_dir);
-                fs::path save_path = (base_dir / relative_path).lexically_normal();
-                uint64_t available_space = available_space_for_target(save_path);
-                if (available_space > 0 && available_space < meta.size) {
-                    if (callbacks.on_error) callbacks.on_error("Insufficient disk space. Requires " + format_size(meta.size) + " but only " + format_size(available_space) + " available.");
-                    protocol::PacketHeader reject_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, reject_header);
-                    continue;
-                }
+        transfer::BufferPool buffer_pool(transfer::RECEIVE_BUFFER_SIZE);
 
-                bool acc = true;
-                if (callbacks.on_file_request) {
-                    acc = callbacks.on_file_request(meta.filename, meta.size);
+        // With parallel files every data connection first carries whole files of
+        // its own until the sender hands it back with STRIPE_JOIN. The sender only
+        // offers files on the control connection after that, so the pool is
+        // drained before anything is striped.
+        struct FilePool {
+            Client* c;
+            std::vector<std::thread> threads;
+            void join() {
+                for (auto& thread : threads) {
+                    if (thread.joinable()) thread.join();
+                }
+            }
+            ~FilePool() {
+                bool running = std::any_of(threads.begin(), threads.end(),
+                                           [](const std::thread& t) { return t.joinable(); });
+                if (running) {
+                    c->stop();
+                    join();
                 }
+            }
+        } file_pool{this, {}};
 
-                if (!acc) {
-                    protocol::PacketHeader reject_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, reject_header);
-                    if (callbacks.on_status) callbacks.on_status("Skipped: " + relative_path.generic_string());
+        // The share a relay passes its files on through. It runs on for as
+        // long as its own receivers take once the download is over.
+        struct RelayShare {
+            Client* c;
+            Server server;
+            std::thread thread;
+            ~RelayShare() {
+                {
+                    std::lock_guard<std::mutex> lock(c->mtx_);
+                    c->relay_ = nullptr;
+                }
+                if (thread.joinable()) {
+                    server.stop();
+                    thread.join();
+                }
+            }
+        } relay_share{this, {}, {}};
+
+        std::vector<PlannedFile> planned;
+        if (features & protocol::FEATURE_MANIFEST) {
+            uint32_t manifest_session_id = 0;
+            planned = answer_manifest(socket, reader, save_dir, callbacks, !stripe_readers.empty(),
+                                      (features & protocol::FEATURE_DELTA) != 0,
+                                      (features & protocol::FEATURE_VERIFIED_RESUME) != 0,
+                                      (features & protocol::FEATURE_BINARY_META) != 0, multicast.get(),
+                                      manifest_session_id);
+
+            // Files on their way are passed on as they arrive; those an
+            // earlier session left whole, from disk.
+            std::queue<TransferJob> relayed;
+            for (const PlannedFile& file : planned) {
+                if (!relay_feed || file.save_path.empty()) {
                     continue;
                 }
-
-                uint64_t resume_offset = 0;
-                std::string save_path_string = save_path.string();
-                std::string part_file = save_path_string + ".fluxpart";
-                std::error_code ec;
-                auto part_size = fs::file_size(part_file, ec);
-                if (!ec) {
-                    resume_offset = part_size;
-                    if (callbacks.on_status) callbacks.on_status("Resuming from " + format_size(resume_offset));
+                std::string name = file.relative_path.generic_string();
+                if (file.decision.action != protocol::FileAction::SKIP) {
+                    uint64_t resumed = file.decision.action == protocol::FileAction::SEND ? file.decision.offset : 0;
+                    relay_feed->follow(file.save_path, {name, file.size, file.mtime.value_or(0), file.mode}, resumed);
+                    relayed.push({file.save_path, name, manifest_session_id});
+                    continue;
                 }
-
-                if (resume_offset > 0) {
-                    protocol::PacketHeader resume_header = make_resume_header(header.session_id, resume_offset);
-                    transfer::MessageSender::send_header(socket, resume_header);
-                } else {
-                    protocol::PacketHeader accept{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
-                    transfer::MessageSender::send_header(socket, accept);
+                std::error_code size_ec;
+                std::error_code time_ec;
+                auto existing_size = fs::file_size(file.save_path, size_ec);
+                auto existing_time = fs::last_write_time(file.save_path, time_ec);
+                if (!size_ec && !time_ec && existing_size == file.size && file.mtime &&
+                    to_unix_seconds(existing_time) == *file.mtime) {
+                    relayed.push({file.save_path, name, manifest_session_id});
+                }
+            }
+            if (!relayed.empty()) {
+                ServerCallbacks relay_callbacks = *callbacks.relay;
+                relay_callbacks.options.relay = relay_feed;
+                relay_callbacks.options.stripes = 0;
+                relay_callbacks.options.bundle_small_files = false;
+                relay_callbacks.options.delta_transfer = false;
+                relay_callbacks.options.multicast = false;
+                if (!relay_callbacks.cancel_flag) {
+                    relay_callbacks.cancel_flag = callbacks.cancel_flag;
                 }
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    if (stopped_) {
+                        throw boost::system::system_error(boost::asio::error::operation_aborted);
+                    }
+                    relay_ = &relay_share.server;
+                }
+                relay_share.thread = std::thread([&server = relay_share.server, relayed, relay_callbacks]() {
+                    server.start_gui(relayed, relay_callbacks);
+                });
+            }
+        }
+
+        if ((features & protocol::FEATURE_PARALLEL_FILES) && !stripe_readers.empty()) {
+            auto callback_mtx = std::make_shared<std::mutex>();
+            auto request_mtx = std::make_shared<std::mutex>();
+            ClientCallbacks pool_callbacks = callbacks;
+            pool_callbacks.on_status = serialized(callbacks.on_status, callback_mtx);
+            pool_callbacks.on_error = serialized(callbacks.on_error, callback_mtx);
+            pool_callbacks.on_progress = serialized(callbacks.on_progress, callback_mtx);
+            pool_callbacks.on_file_request = serialized(callbacks.on_file_request, request_mtx);
+
+            for (std::size_t i = 0; i < stripes.size(); ++i) {
+                file_pool.threads.emplace_back([this, &stripes, &stripe_readers, &planned, &save_dir, &buffer_pool, &multicast, pool_callbacks, features, i]() {
+                    tcp::socket& connection = *stripes[i];
+                    transfer::FramedReader& connection_reader = *stripe_readers[i];
+                    try {
+                        while (true) {
+                            protocol::PacketHeader header = transfer::MessageReceiver::receive_header(connection_reader);
+                            if ((header.command == 0 && header.payload_size == 0 && header.session_id == 0) ||
+                                header.command == static_cast<uint32_t>(protocol::CommandType::STRIPE_JOIN)) {
+                                return;
+                            }
+                            if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_META)) {
+                                if (!receive_offered_file(connection, connection_reader, header, save_dir, pool_callbacks,
+                                                          buffer_pool, {},
+                                                          (features & protocol::FEATURE_VERIFIED_RESUME) != 0)) {
+                                    stop();
+                                    return;
+                                }
+                            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_START)) {
+                                if (multicast) {
+                                    multicast->abandon(header.reserved);
+                                }
+                                if (receive_planned_file(connection_reader, started_file(planned, header.reserved),
+                                                         header.reserved, header.session_id, pool_callbacks,
+                                                         buffer_pool, {}) != transfer::TransferState::COMPLETED) {
+                                    stop();
+                                    return;
+                                }
+                            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_BUNDLE)) {
+                                if (!receive_bundled_files(connection_reader, header, planned, pool_callbacks, buffer_pool)) {
+                                    stop();
+                                    return;
+                                }
+                            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
+                                protocol::PacketHeader pong{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
+                                transfer::MessageSender::send_header(connection, pong);
+                            }
+                        }
+                    } catch (std::exception& e) {
+                        if (pool_callbacks.on_error) pool_callbacks.on_error(std::string("Client error: ") + e.what());
+                        stop();
+                    }
+                });
+            }
+        }
 
-                transfer::TransferState state = transfer::MessageReceiver::receive_file(
-                    socket, save_path_string, meta.size, resume_offset, callbacks.on_progress, callbacks.cancel_flag);
+        while (true) {
+            protocol::PacketHeader header = transfer::MessageReceiver::receive_header(reader);
+
+            if (header.command == 0 && header.payload_size == 0 && header.session_id == 0) {
+                break;
+            }
 
-                if (state == transfer::TransferState::COMPLETED) {
-                    if (callbacks.on_status) callbacks.on_status("Received: " + relative_path.generic_string());
-                } else if (state == transfer::TransferState::CANCELLED) {
-                     if (callbacks.on_status) callbacks.on_status("Cancelled: " + relative_path.generic_string());
-                     break;
-                } else if (state == transfer::TransferState::FAILED) {
-                    if (callbacks.on_error) callbacks.on_error("Failed to receive: " + relative_path.generic_string());
+            if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_META)) {
+                file_pool.join();
+                if (!receive_offered_file(socket, reader, header, save_dir, callbacks, buffer_pool, stripe_readers,
+                                          (features & protocol::FEATURE_VERIFIED_RESUME) != 0)) {
                     break;
                 }
+            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_START)) {
+                file_pool.join();
+                if (multicast) {
+                    multicast->abandon(header.reserved);
+                }
+                if (receive_planned_file(reader, started_file(planned, header.reserved), header.reserved,
+                                         header.session_id, callbacks, buffer_pool,
+                                         stripe_readers) != transfer::TransferState::COMPLETED) {
+                    break;
+                }
+            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_BUNDLE)) {
+                file_pool.join();
+                if (!receive_bundled_files(reader, header, planned, callbacks, buffer_pool)) {
+                    break;
+                }
+            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::MULTICAST_CHECK)) {
+                answer_multicast_check(socket, reader, header, planned, multicast.get(), callbacks);
             } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
                 protocol::PacketHeader pong{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
                 transfer::MessageSender::send_header(socket, pong);
             }
         }
+        file_pool.join();
+        // What the sender did not deliver cannot be passed on; receivers
+        // downstream resume it from another sender, or from this one later.
+        bool relay_complete = relay_feed && relay_feed->close();
         if (callbacks.on_complete) callbacks.on_complete();
+        if (relay_complete && relay_share.thread.joinable()) {
+            if (callbacks.on_status) callbacks.on_status("Passing the files on...");
+            relay_share.thread.join();
+        }
     } catch (std::exception& e) {
         if (callbacks.on_error) callbacks.on_error(std::string("Client error: ") + e.what());
     }
@@ -864,23 +2038,56 @@ void Client::connect_gui(const std::string& ip, unsigned short port,
 void Server::stop() {
     std::lock_guard<std::mutex> lock(mtx_);
     stopped_ = true;
-    if (acceptor_) {
-        boost::system::error_code ec;
-        acceptor_->close(ec);
+    if (gate_) {
+        gate_->close();
     }
-    if (socket_) {
-        boost::system::error_code ec;
-        socket_->close(ec);
+    for (auto& entry : receivers_) {
+        close_receiver(*entry.second);
+    }
+}
+
+void Server::cancel_receiver(uint32_t receiver) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = receivers_.find(receiver);
+    if (it == receivers_.end()) {
+        return;
+    }
+    close_receiver(*it->second);
+    if (gate_) {
+        gate_->wake();
+    }
+}
+
+void Server::close_receiver(Receiver& receiver) {
+    receiver.cancel = true;
+    boost::system::error_code ec;
+    if (receiver.socket) {
+        receiver.socket->close(ec);
+    }
+    for (auto* stripe : receiver.stripes) {
+        stripe->close(ec);
     }
 }
 
 void Client::stop() {
     std::lock_guard<std::mutex> lock(mtx_);
     stopped_ = true;
-    if (socket_) {
+    if (socket_ && io_context_) {
+        boost::asio::post(*io_context_, [socket = socket_] {
+            boost::system::error_code ec;
+            socket->close(ec);
+        });
+    } else if (socket_) {
         boost::system::error_code ec;
         socket_->close(ec);
     }
+    for (auto* stripe : stripes_) {
+        boost::system::error_code ec;
+        stripe->close(ec);
+    }
+    if (relay_) {
+        relay_->stop();
+    }
 }
 
 } // namespace networking
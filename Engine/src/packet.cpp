@@ -1,4 +1,5 @@
 #include "protocol/packet.hpp"
+#include "protocol/multicast.hpp"
 #ifdef _WIN32
   #include <winsock2.h>
 #else
@@ -41,4 +42,190 @@ PacketHeader deserialize_header(const std::array<uint8_t, 16>& buffer) {
     return header;
 }
 
+std::array<uint8_t, SEALED_FRAME_AD_SIZE> sealed_frame_ad(const PacketHeader& header, uint32_t file,
+                                                          uint64_t position) {
+    std::array<uint8_t, SEALED_FRAME_AD_SIZE> ad;
+    auto header_bytes = serialize_header(header);
+    std::memcpy(ad.data(), header_bytes.data(), header_bytes.size());
+    uint8_t* out = ad.data() + header_bytes.size();
+    for (std::size_t i = 0; i < 4; ++i) {
+        *out++ = static_cast<uint8_t>(file >> (24 - 8 * i));
+    }
+    for (std::size_t i = 0; i < 8; ++i) {
+        *out++ = static_cast<uint8_t>(position >> (56 - 8 * i));
+    }
+    return ad;
+}
+
+namespace {
+
+void put_u32(std::vector<uint8_t>& out, uint32_t value) {
+    uint32_t net = htonl(value);
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&net);
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+uint32_t get_u32(const char* data) {
+    uint32_t net;
+    std::memcpy(&net, data, 4);
+    return ntohl(net);
+}
+
+} // namespace
+
+std::vector<uint8_t> serialize_bundle_index(const std::vector<BundleEntry>& entries) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(bundle_index_size(entries.size()));
+    put_u32(buffer, static_cast<uint32_t>(entries.size()));
+    for (const BundleEntry& entry : entries) {
+        put_u32(buffer, entry.index);
+        put_u32(buffer, entry.size);
+    }
+    return buffer;
+}
+
+std::vector<BundleEntry> deserialize_bundle_index(const char* data, std::size_t size) {
+    if (size < bundle_index_size(0)) {
+        throw std::runtime_error("FILE_BUNDLE payload is too short");
+    }
+    std::size_t count = get_u32(data);
+    if (count > (size - bundle_index_size(0)) / 8) {
+        throw std::runtime_error("FILE_BUNDLE index is larger than its payload");
+    }
+
+    std::vector<BundleEntry> entries(count);
+    uint64_t total = bundle_index_size(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        entries[i].index = get_u32(data + bundle_index_size(i));
+        entries[i].size = get_u32(data + bundle_index_size(i) + 4);
+        total += entries[i].size;
+    }
+    if (total != size) {
+        throw std::runtime_error("FILE_BUNDLE index does not match its payload");
+    }
+    return entries;
+}
+
+std::vector<uint8_t> serialize_block_signatures(const BlockSignatures& signatures) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(block_signatures_size(signatures.blocks.size()));
+    put_u32(buffer, signatures.block_size);
+    put_u32(buffer, static_cast<uint32_t>(signatures.blocks.size()));
+    for (const BlockSignature& block : signatures.blocks) {
+        put_u32(buffer, block.weak);
+        buffer.insert(buffer.end(), block.strong.begin(), block.strong.end());
+    }
+    return buffer;
+}
+
+BlockSignatures deserialize_block_signatures(const char* data, std::size_t size) {
+    if (size < block_signatures_size(0)) {
+        throw std::runtime_error("BLOCK_SIGNATURES payload is too short");
+    }
+    BlockSignatures signatures;
+    signatures.block_size = get_u32(data);
+    std::size_t count = get_u32(data + 4);
+    if (size != block_signatures_size(count)) {
+        throw std::runtime_error("BLOCK_SIGNATURES count does not match its payload");
+    }
+    if (count > 0 && signatures.block_size == 0) {
+        throw std::runtime_error("BLOCK_SIGNATURES has an empty block size");
+    }
+
+    signatures.blocks.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const char* block = data + block_signatures_size(i);
+        signatures.blocks[i].weak = get_u32(block);
+        std::memcpy(signatures.blocks[i].strong.data(), block + 4, STRONG_SIGNATURE_SIZE);
+    }
+    return signatures;
+}
+
+std::vector<uint8_t> serialize_hash_request(const HashRequest& request) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(4 + BLOCK_HASH_SIZE);
+    put_u32(buffer, request.block_count);
+    if (request.root) {
+        buffer.insert(buffer.end(), request.root->begin(), request.root->end());
+    }
+    return buffer;
+}
+
+HashRequest deserialize_hash_request(const char* data, std::size_t size) {
+    if (size != 4 && size != 4 + BLOCK_HASH_SIZE) {
+        throw std::runtime_error("HASH_REQUEST payload has the wrong size");
+    }
+    HashRequest request;
+    request.block_count = get_u32(data);
+    if (size > 4) {
+        request.root.emplace();
+        std::memcpy(request.root->data(), data + 4, BLOCK_HASH_SIZE);
+    }
+    return request;
+}
+
+std::vector<uint8_t> serialize_hash_reply(const HashReply& reply) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(1 + reply.hashes.size() * BLOCK_HASH_SIZE);
+    buffer.push_back(reply.root_matches ? 1 : 0);
+    for (const BlockHash& hash : reply.hashes) {
+        buffer.insert(buffer.end(), hash.begin(), hash.end());
+    }
+    return buffer;
+}
+
+HashReply deserialize_hash_reply(const char* data, std::size_t size) {
+    if (size < 1 || (size - 1) % BLOCK_HASH_SIZE != 0) {
+        throw std::runtime_error("HASH_REPLY payload has the wrong size");
+    }
+    HashReply reply;
+    reply.root_matches = data[0] == 1;
+    reply.hashes.resize((size - 1) / BLOCK_HASH_SIZE);
+    for (std::size_t i = 0; i < reply.hashes.size(); ++i) {
+        std::memcpy(reply.hashes[i].data(), data + 1 + i * BLOCK_HASH_SIZE, BLOCK_HASH_SIZE);
+    }
+    return reply;
+}
+
+std::array<uint8_t, SYMBOL_HEADER_SIZE> serialize_symbol_header(const SymbolHeader& header) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(SYMBOL_HEADER_SIZE);
+    put_u32(buffer, header.transfer_id);
+    put_u32(buffer, header.sequence);
+    put_u32(buffer, header.file);
+    put_u32(buffer, header.block);
+    put_u32(buffer, static_cast<uint32_t>(header.symbol) << 16);
+    std::array<uint8_t, SYMBOL_HEADER_SIZE> bytes;
+    std::memcpy(bytes.data(), buffer.data(), bytes.size());
+    return bytes;
+}
+
+SymbolHeader deserialize_symbol_header(const uint8_t* data) {
+    const char* bytes = reinterpret_cast<const char*>(data);
+    SymbolHeader header;
+    header.transfer_id = get_u32(bytes);
+    header.sequence = get_u32(bytes + 4);
+    header.file = get_u32(bytes + 8);
+    header.block = get_u32(bytes + 12);
+    header.symbol = static_cast<uint16_t>(get_u32(bytes + 16) >> 16);
+    return header;
+}
+
+std::array<uint8_t, 8> serialize_multicast_check(const MulticastCheck& check) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(8);
+    put_u32(buffer, check.last_sequence);
+    put_u32(buffer, check.block_end);
+    std::array<uint8_t, 8> bytes;
+    std::memcpy(bytes.data(), buffer.data(), bytes.size());
+    return bytes;
+}
+
+MulticastCheck deserialize_multicast_check(const char* data, std::size_t size) {
+    if (size != 8) {
+        throw std::runtime_error("MULTICAST_CHECK payload has the wrong size");
+    }
+    return MulticastCheck{get_u32(data), get_u32(data + 4)};
+}
+
 } // namespace protocol
@@ -0,0 +1,106 @@
+#include "read_ahead.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace transfer {
+
+FileReadAhead::FileReadAhead(std::ifstream file, std::size_t depth, BufferPool& pool,
+                             const ChunkSizer& chunk_sizer)
+    : file_(std::move(file)), depth_(depth), pool_(pool), chunk_sizer_(chunk_sizer) {
+    if (depth_ > 0) {
+        thread_ = std::thread(&FileReadAhead::run, this);
+    }
+}
+
+FileReadAhead::FileReadAhead(Source source, std::size_t depth, BufferPool& pool, const ChunkSizer& chunk_sizer)
+    : source_(std::move(source)), depth_(depth), pool_(pool), chunk_sizer_(chunk_sizer) {
+    if (depth_ > 0) {
+        thread_ = std::thread(&FileReadAhead::run, this);
+    }
+}
+
+FileReadAhead::~FileReadAhead() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stopping_ = true;
+    }
+    space_cv_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+bool FileReadAhead::next(Chunk& chunk) {
+    if (depth_ == 0) {
+        return read_chunk(chunk);
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    ready_cv_.wait(lock, [this] { return !queue_.empty() || done_; });
+    if (queue_.empty()) {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return false;
+    }
+    chunk = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    space_cv_.notify_one();
+    return true;
+}
+
+void FileReadAhead::run() {
+    try {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                space_cv_.wait(lock, [this] { return stopping_ || queue_.size() < depth_; });
+                if (stopping_) {
+                    return;
+                }
+            }
+
+            Chunk chunk;
+            bool more = read_chunk(chunk);
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (more) {
+                    queue_.push_back(std::move(chunk));
+                } else {
+                    done_ = true;
+                }
+            }
+            ready_cv_.notify_one();
+            if (!more) {
+                return;
+            }
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            error_ = std::current_exception();
+            done_ = true;
+        }
+        ready_cv_.notify_one();
+    }
+}
+
+bool FileReadAhead::read_chunk(Chunk& chunk) {
+    if (!chunk.buffer) {
+        chunk.buffer = pool_.acquire();
+    }
+    std::size_t want = std::min(chunk.buffer.size(), chunk_sizer_.next());
+    if (source_) {
+        chunk.size = source_(chunk.buffer.data(), want);
+        return chunk.size > 0;
+    }
+    file_.read(chunk.buffer.data(), static_cast<std::streamsize>(want));
+    chunk.size = static_cast<std::size_t>(file_.gcount());
+    if (file_.bad()) {
+        throw std::runtime_error("Failed to read file during transfer");
+    }
+    return chunk.size > 0;
+}
+
+} // namespace transfer
@@ -0,0 +1,227 @@
+#include "relay.hpp"
+#include "hash_tree.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace transfer {
+
+namespace {
+
+// Waiting readers look at their cancel flag this often.
+constexpr auto kPollInterval = std::chrono::milliseconds(100);
+// Chunk buffers kept for reuse once they leave the window.
+constexpr std::size_t kMaxSpareBuffers = 16;
+
+} // namespace
+
+RelayFeed::RelayFeed(std::size_t window) : window_(window) {}
+
+RelayFeed::File& RelayFeed::file(const std::string& path) {
+    auto it = files_.find(path);
+    if (it == files_.end()) {
+        throw std::runtime_error("Not relaying " + path);
+    }
+    return it->second;
+}
+
+void RelayFeed::wait(std::unique_lock<std::mutex>& lock, const std::atomic<bool>* cancel_flag) {
+    if (cancel_flag && cancel_flag->load()) {
+        throw std::runtime_error("Relay cancelled");
+    }
+    cv_.wait_for(lock, kPollInterval);
+}
+
+void RelayFeed::follow(const std::string& path, const protocol::ManifestEntry& entry, uint64_t resumed) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    File& file = files_[path];
+    file.entry = entry;
+    file.on_disk = std::min(resumed, entry.size);
+}
+
+bool RelayFeed::follows(const std::string& path) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return files_.count(path) > 0;
+}
+
+void RelayFeed::start(const std::string& path, uint64_t offset) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        File& started = file(path);
+        started.state = State::STREAMING;
+        started.end = offset;
+        started.on_disk = offset;
+    }
+    cv_.notify_all();
+}
+
+void RelayFeed::append(const std::string& path, const char* data, std::size_t size, uint64_t on_disk) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        File& appended = file(path);
+        if (appended.state != State::STREAMING || size == 0) {
+            return;
+        }
+        std::vector<char> buffer;
+        if (!spare_.empty()) {
+            buffer = std::move(spare_.back());
+            spare_.pop_back();
+        }
+        buffer.assign(data, data + size);
+        chunks_.push_back({&appended, appended.end, std::move(buffer)});
+        appended.end += size;
+        appended.on_disk = std::max(appended.on_disk, std::min(on_disk, appended.end));
+        buffered_ += size;
+
+        // A chunk that leaves the window before it reached the disk is only
+        // read again once the file is finished.
+        while (buffered_ > window_ && chunks_.size() > 1) {
+            buffered_ -= chunks_.front().data.size();
+            if (spare_.size() < kMaxSpareBuffers) {
+                spare_.push_back(std::move(chunks_.front().data));
+            }
+            chunks_.pop_front();
+        }
+    }
+    cv_.notify_all();
+}
+
+void RelayFeed::finish(const std::string& path, const std::optional<protocol::BlockHash>& root) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        File& finished = file(path);
+        finished.state = State::FINISHED;
+        finished.end = finished.entry.size;
+        finished.root = root;
+    }
+    cv_.notify_all();
+}
+
+void RelayFeed::fail(const std::string& path) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        File& failed = file(path);
+        if (failed.state != State::FINISHED) {
+            failed.state = State::FAILED;
+        }
+    }
+    cv_.notify_all();
+}
+
+bool RelayFeed::close() {
+    bool all_finished = true;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (auto& [path, file] : files_) {
+            if (file.state != State::FINISHED) {
+                file.state = State::FAILED;
+                all_finished = false;
+            }
+        }
+    }
+    cv_.notify_all();
+    return all_finished;
+}
+
+std::optional<protocol::ManifestEntry> RelayFeed::entry(const std::string& path) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = files_.find(path);
+    if (it == files_.end()) {
+        return std::nullopt;
+    }
+    return it->second.entry;
+}
+
+std::vector<protocol::BlockHash> RelayFeed::block_hashes(const std::string& path, uint64_t count,
+                                                         const std::atomic<bool>* cancel_flag) {
+    std::string source;
+    uint64_t blocks = 0;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        File& hashed = file(path);
+        uint64_t wanted = std::min(count * VERIFY_BLOCK_SIZE, hashed.entry.size);
+        while (hashed.state != State::FINISHED && hashed.state != State::FAILED && hashed.on_disk < wanted) {
+            wait(lock, cancel_flag);
+        }
+        if (hashed.state == State::FINISHED) {
+            source = path;
+            blocks = count;
+        } else {
+            source = path + ".fluxpart";
+            blocks = std::min(count, hashed.on_disk / VERIFY_BLOCK_SIZE);
+            if (hashed.on_disk == hashed.entry.size) {
+                blocks = count;
+            }
+        }
+    }
+    if (blocks == 0) {
+        return {};
+    }
+    return source_block_hashes(source, blocks, cancel_flag);
+}
+
+// RelayFeed::Reader
+
+RelayFeed::Reader::Reader(RelayFeed& feed, const std::string& path, uint64_t offset,
+                          const std::atomic<bool>* cancel_flag)
+    : feed_(feed), path_(path), position_(offset), cancel_flag_(cancel_flag) {}
+
+std::size_t RelayFeed::Reader::read(char* out, std::size_t size) {
+    std::unique_lock<std::mutex> lock(feed_.mtx_);
+    File& file = feed_.file(path_);
+    while (true) {
+        if (file.state == State::FAILED) {
+            throw std::runtime_error("The sender upstream did not deliver " + file.entry.path);
+        }
+        if (file.state == State::FINISHED && position_ >= file.entry.size) {
+            root_ = file.root;
+            return 0;
+        }
+
+        for (const Chunk& chunk : feed_.chunks_) {
+            if (chunk.file == &file && chunk.offset <= position_ && position_ < chunk.offset + chunk.data.size()) {
+                std::size_t n = static_cast<std::size_t>(
+                    std::min<uint64_t>(size, chunk.offset + chunk.data.size() - position_));
+                std::memcpy(out, chunk.data.data() + (position_ - chunk.offset), n);
+                position_ += n;
+                // Caught up; a .fluxpart held open could not be renamed on
+                // every platform.
+                if (disk_.is_open()) {
+                    disk_.close();
+                }
+                return n;
+            }
+        }
+
+        bool finished = file.state == State::FINISHED;
+        uint64_t readable = finished ? file.entry.size : file.on_disk;
+        if (position_ < readable) {
+            std::size_t n = static_cast<std::size_t>(std::min<uint64_t>(size, readable - position_));
+            lock.unlock();
+            // An open .fluxpart stays readable after it is renamed into place.
+            if (!disk_.is_open()) {
+                disk_.clear();
+                disk_.open(finished ? path_ : path_ + ".fluxpart", std::ios::binary);
+                if (!disk_.is_open() && !finished) {
+                    // Renamed between the check and the open; look again.
+                    lock.lock();
+                    feed_.wait(lock, cancel_flag_);
+                    continue;
+                }
+            }
+            disk_.clear();
+            disk_.seekg(static_cast<std::streamoff>(position_));
+            disk_.read(out, static_cast<std::streamsize>(n));
+            if (!disk_ || static_cast<std::size_t>(disk_.gcount()) != n) {
+                throw std::runtime_error("Could not read back " + path_ + " to relay it");
+            }
+            position_ += n;
+            return n;
+        }
+        feed_.wait(lock, cancel_flag_);
+    }
+}
+
+} // namespace transfer
@@ -1,21 +1,23 @@
 #include "security.hpp"
 #include <sodium.h>
+#include <algorithm>
 #include <random>
 #include <sstream>
 #include <iomanip>
 #include <iostream>
+#include <stdexcept>
 
 namespace security {
 
-uint16_t generate_pin() {
+uint32_t generate_pin() {
     if (sodium_init() < 0) {
         std::cerr << "libsodium initialization failed!\n";
         std::random_device rd;
         std::mt19937 gen(rd());
-        std::uniform_int_distribution<uint16_t> dist(1000, 9999);
+        std::uniform_int_distribution<uint32_t> dist(100000, 999999);
         return dist(gen);
     }
-    return 1000 + randombytes_uniform(9000); // 1000–9999
+    return 100000 + randombytes_uniform(900000); // 100000–999999
 }
 
 std::string hash_pin(const std::string& pin) {
@@ -40,4 +42,196 @@ bool verify_pin(const std::string& pin, const std::string& expected_hash) {
     return hash_pin(pin) == expected_hash;
 }
 
+std::string generate_token() {
+    if (sodium_init() < 0) {
+        std::cerr << "libsodium initialization failed!\n";
+        return "";
+    }
+
+    unsigned char token[16];
+    randombytes_buf(token, sizeof(token));
+
+    std::ostringstream oss;
+    for (size_t i = 0; i < sizeof(token); ++i) {
+        oss << std::hex << std::setfill('0') << std::setw(2) << static_cast<int>(token[i]);
+    }
+    return oss.str();
+}
+
+namespace {
+
+// Keyed BLAKE2b-256 of a label followed by the exchange transcript.
+SessionKey derive(const uint8_t* key, std::size_t key_size, const char* label, const std::vector<uint8_t>& transcript) {
+    SessionKey out;
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, key, key_size, out.size());
+    crypto_generichash_update(&state, reinterpret_cast<const unsigned char*>(label), std::char_traits<char>::length(label) + 1);
+    crypto_generichash_update(&state, transcript.data(), transcript.size());
+    crypto_generichash_final(&state, out.data(), out.size());
+    return out;
+}
+
+} // namespace
+
+PinKeyExchange::PinKeyExchange(const std::string& pin, bool server) : server_(server) {
+    if (sodium_init() < 0) {
+        throw std::runtime_error("libsodium initialization failed");
+    }
+
+    // The generator is the PIN hashed onto the group, so no one knows its
+    // discrete log relative to any other PIN's generator.
+    static const char kGeneratorLabel[] = "FluxDrop CPace ristretto255";
+    unsigned char digest[crypto_core_ristretto255_HASHBYTES];
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, nullptr, 0, sizeof(digest));
+    crypto_generichash_update(&state, reinterpret_cast<const unsigned char*>(kGeneratorLabel), sizeof(kGeneratorLabel));
+    crypto_generichash_update(&state, reinterpret_cast<const unsigned char*>(pin.data()), pin.size());
+    crypto_generichash_final(&state, digest, sizeof(digest));
+    unsigned char generator[crypto_core_ristretto255_BYTES];
+    crypto_core_ristretto255_from_hash(generator, digest);
+
+    do {
+        crypto_core_ristretto255_scalar_random(scalar_.data());
+    } while (crypto_scalarmult_ristretto255(share_.data(), scalar_.data(), generator) != 0);
+}
+
+PinKeyExchange::~PinKeyExchange() {
+    sodium_memzero(scalar_.data(), scalar_.size());
+    sodium_memzero(confirm_key_.data(), confirm_key_.size());
+    sodium_memzero(session_key_.data(), session_key_.size());
+}
+
+bool PinKeyExchange::complete(const KeyShare& peer_share, const std::vector<uint8_t>& context) {
+    unsigned char shared[crypto_scalarmult_ristretto255_BYTES];
+    if (crypto_scalarmult_ristretto255(shared, scalar_.data(), peer_share.data()) != 0) {
+        return false;
+    }
+    const KeyShare& client = server_ ? peer_share : share_;
+    const KeyShare& server = server_ ? share_ : peer_share;
+    transcript_.assign(client.begin(), client.end());
+    transcript_.insert(transcript_.end(), server.begin(), server.end());
+    transcript_.insert(transcript_.end(), context.begin(), context.end());
+
+    confirm_key_ = derive(shared, sizeof(shared), "confirm", transcript_);
+    session_key_ = derive(shared, sizeof(shared), "session", transcript_);
+    sodium_memzero(shared, sizeof(shared));
+    return true;
+}
+
+KeyConfirmation PinKeyExchange::confirmation() const {
+    return derive(confirm_key_.data(), confirm_key_.size(), server_ ? "server" : "client", transcript_);
+}
+
+bool PinKeyExchange::check_peer_confirmation(const KeyConfirmation& confirmation) const {
+    KeyConfirmation expected = derive(confirm_key_.data(), confirm_key_.size(), server_ ? "client" : "server", transcript_);
+    return sodium_memcmp(expected.data(), confirmation.data(), expected.size()) == 0;
+}
+
+struct FrameCipher::GcmState {
+    crypto_aead_aes256gcm_state state;
+};
+
+bool FrameCipher::aes_gcm_available() {
+    return sodium_init() >= 0 && crypto_aead_aes256gcm_is_available();
+}
+
+FrameCipher::FrameCipher(const SessionKey& key, bool aes_gcm) : key_(key), aes_gcm_(aes_gcm) {
+    if (aes_gcm_) {
+        if (!aes_gcm_available()) {
+            throw std::runtime_error("AES-256-GCM is not available on this CPU");
+        }
+        gcm_ = std::make_unique<GcmState>();
+        crypto_aead_aes256gcm_beforenm(&gcm_->state, key_.data());
+    }
+}
+
+FrameCipher::~FrameCipher() {
+    sodium_memzero(key_.data(), key_.size());
+    if (gcm_) {
+        sodium_memzero(gcm_.get(), sizeof(GcmState));
+    }
+}
+
+std::size_t FrameCipher::nonce_size() const {
+    return aes_gcm_ ? crypto_aead_aes256gcm_NPUBBYTES : crypto_aead_xchacha20poly1305_ietf_NPUBBYTES;
+}
+
+void FrameCipher::seal(char* data, std::size_t size, const uint8_t* ad, std::size_t ad_size, Nonce& nonce,
+                       Tag& tag) const {
+    auto* bytes = reinterpret_cast<unsigned char*>(data);
+    randombytes_buf(nonce.data(), nonce_size());
+    if (aes_gcm_) {
+        crypto_aead_aes256gcm_encrypt_detached_afternm(bytes, tag.data(), nullptr, bytes, size, ad, ad_size, nullptr,
+                                                        nonce.data(), &gcm_->state);
+    } else {
+        crypto_aead_xchacha20poly1305_ietf_encrypt_detached(bytes, tag.data(), nullptr, bytes, size, ad, ad_size,
+                                                            nullptr, nonce.data(), key_.data());
+    }
+}
+
+void FrameCipher::open(char* data, std::size_t size, const uint8_t* ad, std::size_t ad_size, const Nonce& nonce,
+                       const Tag& tag) const {
+    auto* bytes = reinterpret_cast<unsigned char*>(data);
+    int result = aes_gcm_
+        ? crypto_aead_aes256gcm_decrypt_detached_afternm(bytes, nullptr, bytes, size, tag.data(), ad, ad_size,
+                                                          nonce.data(), &gcm_->state)
+        : crypto_aead_xchacha20poly1305_ietf_decrypt_detached(bytes, nullptr, bytes, size, tag.data(), ad, ad_size,
+                                                              nonce.data(), key_.data());
+    if (result != 0) {
+        throw std::runtime_error("A sealed frame failed authentication");
+    }
+}
+
+SessionKey generate_key() {
+    if (sodium_init() < 0) {
+        throw std::runtime_error("libsodium initialization failed");
+    }
+    SessionKey key;
+    randombytes_buf(key.data(), key.size());
+    return key;
+}
+
+namespace {
+
+constexpr char kGroupKeyLabel[] = "fluxdrop group key";
+
+} // namespace
+
+std::string seal_key(const FrameCipher& cipher, const SessionKey& key) {
+    SessionKey sealed = key;
+    FrameCipher::Nonce nonce{};
+    FrameCipher::Tag tag{};
+    cipher.seal(reinterpret_cast<char*>(sealed.data()), sealed.size(),
+                reinterpret_cast<const uint8_t*>(kGroupKeyLabel), sizeof(kGroupKeyLabel) - 1, nonce, tag);
+
+    std::vector<uint8_t> bytes(nonce.begin(), nonce.begin() + cipher.nonce_size());
+    bytes.insert(bytes.end(), sealed.begin(), sealed.end());
+    bytes.insert(bytes.end(), tag.begin(), tag.end());
+    sodium_memzero(sealed.data(), sealed.size());
+
+    std::string hex(bytes.size() * 2 + 1, '\0');
+    sodium_bin2hex(hex.data(), hex.size(), bytes.data(), bytes.size());
+    hex.pop_back();
+    return hex;
+}
+
+SessionKey open_key(const FrameCipher& cipher, const std::string& sealed) {
+    std::size_t nonce_size = cipher.nonce_size();
+    std::vector<uint8_t> bytes(nonce_size + SESSION_KEY_SIZE + FrameCipher::TAG_SIZE);
+    std::size_t length = 0;
+    if (sodium_hex2bin(bytes.data(), bytes.size(), sealed.data(), sealed.size(), nullptr, &length, nullptr) != 0 ||
+        length != bytes.size()) {
+        throw std::runtime_error("Malformed group key");
+    }
+    FrameCipher::Nonce nonce{};
+    FrameCipher::Tag tag{};
+    SessionKey key;
+    std::copy(bytes.begin(), bytes.begin() + nonce_size, nonce.begin());
+    std::copy(bytes.begin() + nonce_size, bytes.begin() + nonce_size + SESSION_KEY_SIZE, key.begin());
+    std::copy(bytes.end() - FrameCipher::TAG_SIZE, bytes.end(), tag.begin());
+    cipher.open(reinterpret_cast<char*>(key.data()), key.size(), reinterpret_cast<const uint8_t*>(kGroupKeyLabel),
+                sizeof(kGroupKeyLabel) - 1, nonce, tag);
+    return key;
+}
+
 } // namespace security
@@ -0,0 +1,149 @@
+#include "striping.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+namespace transfer {
+
+namespace fs = std::filesystem;
+
+fs::path ranges_path(const fs::path& part_path) {
+    return fs::path(part_path.string() + ".ranges");
+}
+
+ByteRanges load_completed_ranges(const fs::path& part_path, uint64_t file_size) {
+    std::error_code ec;
+    uint64_t part_size = fs::file_size(part_path, ec);
+    if (ec) {
+        return {};
+    }
+
+    std::ifstream sidecar(ranges_path(part_path));
+    if (!sidecar.is_open()) {
+        return {{0, std::min(part_size, file_size)}};
+    }
+
+    try {
+        nlohmann::json j = nlohmann::json::parse(sidecar);
+        if (j.at("size").get<uint64_t>() != file_size) {
+            return {};
+        }
+        ByteRanges completed;
+        for (auto range : j.at("completed").get<ByteRanges>()) {
+            range.end = std::min({range.end, file_size, part_size});
+            if (range.begin < range.end) {
+                completed.push_back(range);
+            }
+        }
+        return merge_ranges(std::move(completed));
+    } catch (std::exception& e) {
+        std::cerr << "Ignoring unreadable range file " << ranges_path(part_path) << ": " << e.what() << "\n";
+        return {};
+    }
+}
+
+void save_completed_ranges(const fs::path& part_path, uint64_t file_size, const ByteRanges& completed) {
+    fs::path target = ranges_path(part_path);
+    fs::path temp = fs::path(target.string() + ".tmp");
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        out << nlohmann::json{{"size", file_size}, {"completed", completed}}.dump();
+        if (!out) {
+            throw std::runtime_error("Failed to write " + temp.string());
+        }
+    }
+    fs::rename(temp, target);
+}
+
+ByteRanges merge_ranges(ByteRanges ranges) {
+    std::sort(ranges.begin(), ranges.end(),
+              [](const protocol::ByteRange& a, const protocol::ByteRange& b) { return a.begin < b.begin; });
+    ByteRanges merged;
+    for (const auto& range : ranges) {
+        if (range.begin >= range.end) {
+            continue;
+        }
+        if (!merged.empty() && range.begin <= merged.back().end) {
+            merged.back().end = std::max(merged.back().end, range.end);
+        } else {
+            merged.push_back(range);
+        }
+    }
+    return merged;
+}
+
+ByteRanges missing_ranges(const ByteRanges& completed, uint64_t file_size) {
+    ByteRanges missing;
+    uint64_t cursor = 0;
+    for (const auto& range : merge_ranges(completed)) {
+        if (range.begin > cursor) {
+            missing.push_back({cursor, std::min(range.begin, file_size)});
+        }
+        cursor = std::max(cursor, range.end);
+    }
+    if (cursor < file_size) {
+        missing.push_back({cursor, file_size});
+    }
+    return missing;
+}
+
+uint64_t total_bytes(const ByteRanges& ranges) {
+    uint64_t total = 0;
+    for (const auto& range : ranges) {
+        total += range.end - range.begin;
+    }
+    return total;
+}
+
+ByteRanges leading_ranges(const ByteRanges& ranges, uint64_t bytes) {
+    ByteRanges result;
+    for (const auto& range : ranges) {
+        if (bytes == 0) {
+            break;
+        }
+        uint64_t take = std::min(bytes, range.end - range.begin);
+        result.push_back({range.begin, range.begin + take});
+        bytes -= take;
+    }
+    return result;
+}
+
+std::vector<ByteRanges> plan_stripes(const ByteRanges& ranges, std::size_t count) {
+    std::vector<ByteRanges> stripes(count);
+    if (count == 0) {
+        return stripes;
+    }
+
+    uint64_t remaining = total_bytes(ranges);
+    std::size_t stripe = 0;
+    uint64_t quota = remaining / count + (remaining % count ? 1 : 0);
+    uint64_t filled = 0;
+    for (auto range : ranges) {
+        while (range.begin < range.end) {
+            uint64_t take = std::min(range.end - range.begin, quota - filled);
+            stripes[stripe].push_back({range.begin, range.begin + take});
+            range.begin += take;
+            filled += take;
+            if (filled == quota && stripe + 1 < count) {
+                ++stripe;
+                filled = 0;
+            }
+        }
+    }
+    return stripes;
+}
+
+uint64_t prepare_sequential_resume(const fs::path& part_path, const ByteRanges& completed) {
+    uint64_t prefix = (!completed.empty() && completed.front().begin == 0) ? completed.front().end : 0;
+
+    std::error_code ec;
+    uint64_t part_size = fs::file_size(part_path, ec);
+    if (!ec && part_size > prefix) {
+        fs::resize_file(part_path, prefix, ec);
+    }
+    fs::remove(ranges_path(part_path), ec);
+    return prefix;
+}
+
+} // namespace transfer
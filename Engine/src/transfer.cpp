@@ -1,282 +1,2321 @@
 #include "transfer.hpp"
+#include "read_ahead.hpp"
+#include "write_behind.hpp"
+#include "striping.hpp"
+#include "compression.hpp"
+#include "crc32c.hpp"
+#include "delta.hpp"
+#include "hash_tree.hpp"
+#include "relay.hpp"
+#include "security.hpp"
+#include "logger.hpp"
+#include "protocol/binary_meta.hpp"
 #include <iostream>
 #include <vector>
 #include <fstream>
 #include <filesystem>
 #include <chrono>
 #include <iomanip>
+#include <algorithm>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef __linux__
+  #include <cerrno>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/stat.h>
+  #include <sys/sendfile.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+#endif
 
 namespace transfer {
 
-namespace fs = std::filesystem;
+namespace fs = std::filesystem;
+
+namespace {
+
+// Payload remainders at least this large bypass the FramedReader buffer so
+// splice can move them without a user-space copy.
+constexpr std::size_t kDirectReadThreshold = 32 * 1024;
+
+struct SendProgress {
+    SendProgress(const std::string& filepath, uint64_t file_size, uint64_t start_offset,
+                 const TransferProgressCallback& progress_cb)
+        : file_size(file_size), start_offset(start_offset), progress_cb(progress_cb) {
+        if (progress_cb) {
+            filename = fs::path(filepath).filename().string();
+        }
+    }
+
+    std::string filename;
+    uint64_t file_size;
+    uint64_t start_offset;
+    const TransferProgressCallback& progress_cb;
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point last_cb_time = start_time;
+
+    void update(uint64_t total_sent) {
+        if (!progress_cb) return;
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed_since_cb = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_cb_time).count();
+        if (elapsed_since_cb >= 300 || total_sent == file_size) {
+            double elapsed = std::chrono::duration<double>(now - start_time).count();
+            uint64_t session_sent = total_sent - start_offset;
+            double speed = (elapsed > 0) ? (session_sent / elapsed / (1024.0 * 1024.0)) : 0;
+            progress_cb(filename, total_sent, file_size, speed);
+            last_cb_time = now;
+        }
+    }
+};
+
+} // namespace
+
+bool replace_with_completed_file(const fs::path& part_path, const fs::path& final_path) {
+    std::error_code ec;
+
+    if (fs::exists(final_path, ec)) {
+        fs::remove(final_path, ec);
+        if (ec) {
+            std::cerr << "Failed to remove existing destination file: " << final_path
+                      << " (" << ec.message() << ")\n";
+            return false;
+        }
+    }
+
+    fs::rename(part_path, final_path, ec);
+    if (ec) {
+        std::cerr << "Failed to finalize received file: " << final_path
+                  << " (" << ec.message() << ")\n";
+        return false;
+    }
+    discard_block_hashes(part_path);
+
+    return true;
+}
+
+namespace {
+
+void send_cancel(boost::asio::ip::tcp::socket& socket, uint32_t session_id) {
+    protocol::PacketHeader cancel_header{
+        static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, session_id, 0
+    };
+    MessageSender::send_header(socket, cancel_header);
+}
+
+// Sends `header` with `size` bytes at `data` sealed under `cipher` for
+// offset `position` of file `index`, behind a clear `prefix`. Sets the
+// header's payload_size and encrypts `data` in place.
+void send_sealed(boost::asio::ip::tcp::socket& socket, const security::FrameCipher& cipher,
+                 protocol::PacketHeader header, uint32_t index, uint64_t position, char* data, std::size_t size,
+                 boost::asio::const_buffer prefix = {}) {
+    header.payload_size = static_cast<uint32_t>(prefix.size() + cipher.overhead() + size);
+    auto header_buf = protocol::serialize_header(header);
+    auto ad = protocol::sealed_frame_ad(header, index, position);
+    security::FrameCipher::Nonce nonce;
+    security::FrameCipher::Tag tag;
+    cipher.seal(data, size, ad.data(), ad.size(), nonce, tag);
+    std::array<boost::asio::const_buffer, 5> frame{
+        boost::asio::buffer(header_buf), prefix, boost::asio::buffer(nonce.data(), cipher.nonce_size()),
+        boost::asio::buffer(data, size), boost::asio::buffer(tag)
+    };
+    boost::asio::write(socket, frame);
+}
+
+// Size of the plaintext in a payload of `header` after `prefix` clear bytes,
+// sealed when there is a cipher.
+std::size_t plaintext_size(const protocol::PacketHeader& header, const security::FrameCipher* cipher,
+                           std::size_t prefix = 0) {
+    std::size_t overhead = prefix + (cipher ? cipher->overhead() : 0);
+    if (header.payload_size < overhead) {
+        throw std::runtime_error("Payload of packet " + std::to_string(header.command) + " is too short");
+    }
+    return header.payload_size - overhead;
+}
+
+// Reads `size` bytes of plaintext of `header` into `out`, opening them when
+// there is a cipher as sealed for offset `position` of file `index`. Throws
+// std::runtime_error if they fail authentication, unless `authentic` is
+// given to report it instead.
+void read_payload(FramedReader& reader, const security::FrameCipher* cipher, const protocol::PacketHeader& header,
+                  uint32_t index, uint64_t position, char* out, std::size_t size, bool* authentic = nullptr) {
+    if (!cipher) {
+        reader.read_exact(out, size);
+        return;
+    }
+    security::FrameCipher::Nonce nonce{};
+    security::FrameCipher::Tag tag;
+    reader.read_exact(reinterpret_cast<char*>(nonce.data()), cipher->nonce_size());
+    reader.read_exact(out, size);
+    reader.read_exact(reinterpret_cast<char*>(tag.data()), tag.size());
+    auto ad = protocol::sealed_frame_ad(header, index, position);
+    if (!authentic) {
+        cipher->open(out, size, ad.data(), ad.size(), nonce, tag);
+        return;
+    }
+    try {
+        cipher->open(out, size, ad.data(), ad.size(), nonce, tag);
+        *authentic = true;
+    } catch (const std::runtime_error&) {
+        *authentic = false;
+    }
+}
+
+protocol::BlockHash read_file_hash(FramedReader& reader, const protocol::PacketHeader& header,
+                                   const security::FrameCipher* cipher, uint32_t index) {
+    protocol::BlockHash root;
+    if (plaintext_size(header, cipher) != root.size()) {
+        throw std::runtime_error("FILE_HASH payload is not a hash");
+    }
+    read_payload(reader, cipher, header, index, 0, reinterpret_cast<char*>(root.data()), root.size());
+    return root;
+}
+
+// Drops a .fluxpart whose content turned out not to match the sender's file,
+// with the sidecars that would let a later session resume from it.
+void discard_mismatched_file(const fs::path& part_path, const fs::path& final_path) {
+    std::cerr << "\n" << final_path.filename().string()
+              << " does not match the sender's copy; the received data was discarded.\n";
+    std::error_code ec;
+    fs::remove(part_path, ec);
+    fs::remove(ranges_path(part_path), ec);
+    discard_block_hashes(part_path);
+}
+
+#ifdef __linux__
+
+enum class ZeroCopyResult {
+    SENT,
+    CANCELLED,
+    UNSUPPORTED // nothing was written, caller should use the buffered path
+};
+
+struct FdGuard {
+    int fd;
+    ~FdGuard() { if (fd >= 0) ::close(fd); }
+};
+
+// Holds TCP_CORK while a file streams through sendfile(2) so every header
+// leaves in the same segment as the start of its payload. Released before
+// anything latency sensitive is written.
+class CorkGuard {
+public:
+    explicit CorkGuard(int fd) : fd_(fd) { set(1); }
+    ~CorkGuard() { release(); }
+
+    void release() {
+        if (fd_ >= 0) {
+            set(0);
+            fd_ = -1;
+        }
+    }
+
+private:
+    void set(int on) { ::setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)); }
+    int fd_;
+};
+
+[[noreturn]] void throw_errno(const char* what) {
+    throw boost::system::system_error(errno, boost::system::system_category(), what);
+}
+
+// Copies [offset, offset + count) of the file through user space. Used when
+// sendfile(2) refuses the file (e.g. some FUSE or network filesystems).
+void write_range_buffered(boost::asio::ip::tcp::socket& socket, int fd, off_t offset,
+                          std::size_t count, BufferPool& pool, BufferPool::Buffer& bounce) {
+    if (!bounce) {
+        bounce = pool.acquire();
+    }
+    while (count > 0) {
+        ssize_t n = ::pread(fd, bounce.data(), std::min(count, bounce.size()), offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw_errno("pread");
+        }
+        if (n == 0) {
+            throw std::runtime_error("File was truncated during transfer");
+        }
+        boost::asio::write(socket, boost::asio::buffer(bounce.data(), n));
+        offset += n;
+        count -= n;
+    }
+}
+
+// Streams FILE_CHUNK frames with the payload moved straight from the page
+// cache to the socket by sendfile(2), so the data never enters user space.
+ZeroCopyResult send_file_zero_copy(boost::asio::ip::tcp::socket& socket, const std::string& filepath,
+                                   uint32_t session_id, uint64_t start_offset,
+                                   const TransferProgressCallback& progress_cb,
+                                   std::atomic<bool>* cancel_flag, BufferPool& pool,
+                                   ChunkSizer& chunk_sizer, std::size_t read_ahead_depth) {
+    FdGuard file{::open(filepath.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (file.fd < 0) {
+        return ZeroCopyResult::UNSUPPORTED;
+    }
+
+    struct stat st;
+    if (::fstat(file.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return ZeroCopyResult::UNSUPPORTED;
+    }
+
+    uint64_t file_size = static_cast<uint64_t>(st.st_size);
+    ::posix_fadvise(file.fd, static_cast<off_t>(start_offset), 0, POSIX_FADV_SEQUENTIAL);
+
+    int sock_fd = socket.native_handle();
+    CorkGuard cork(sock_fd);
+    bool use_sendfile = true;
+    BufferPool::Buffer bounce;
+    SendProgress progress{filepath, file_size, start_offset, progress_cb};
+    uint64_t prefetched = start_offset;
+
+    off_t offset = static_cast<off_t>(start_offset);
+    while (static_cast<uint64_t>(offset) < file_size) {
+        if (cancel_flag && cancel_flag->load()) {
+            std::cout << "\nTransfer cancelled locally.\n";
+            cork.release();
+            send_cancel(socket, session_id);
+            return ZeroCopyResult::CANCELLED;
+        }
+
+        std::size_t chunk = static_cast<std::size_t>(
+            std::min<uint64_t>(chunk_sizer.next(), file_size - static_cast<uint64_t>(offset)));
+
+        // Keep the next few chunks queued for asynchronous readahead so
+        // sendfile(2) finds them in the page cache instead of waiting on disk.
+        uint64_t window_end = std::min<uint64_t>(file_size, offset + read_ahead_depth * chunk);
+        if (window_end > prefetched) {
+            ::posix_fadvise(file.fd, static_cast<off_t>(prefetched),
+                            static_cast<off_t>(window_end - prefetched), POSIX_FADV_WILLNEED);
+            prefetched = window_end;
+        }
+        protocol::PacketHeader header{
+            static_cast<uint32_t>(protocol::CommandType::FILE_CHUNK),
+            static_cast<uint32_t>(chunk),
+            session_id, 0
+        };
+        auto header_buf = protocol::serialize_header(header);
+        boost::asio::write(socket, boost::asio::buffer(header_buf));
+
+        std::size_t remaining = chunk;
+        while (remaining > 0 && use_sendfile) {
+            ssize_t n = ::sendfile(sock_fd, file.fd, &offset, remaining);
+            if (n > 0) {
+                remaining -= static_cast<std::size_t>(n);
+            } else if (n == 0) {
+                throw std::runtime_error("File was truncated during transfer");
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN) {
+                socket.wait(boost::asio::ip::tcp::socket::wait_write);
+            } else if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                use_sendfile = false;
+            } else {
+                throw_errno("sendfile");
+            }
+        }
+        if (remaining > 0) {
+            write_range_buffered(socket, file.fd, offset, remaining, pool, bounce);
+            offset += static_cast<off_t>(remaining);
+        }
+
+        chunk_sizer.record(socket, chunk);
+        progress.update(static_cast<uint64_t>(offset));
+    }
+    return ZeroCopyResult::SENT;
+}
+
+#endif
+
+// Destination for FILE_CHUNK payloads. On Linux the payload is spliced from
+// the socket through a pipe straight into the .fluxpart descriptor, so only
+// the 16-byte PacketHeader is read into user space. Where the payload does
+// pass through user space it is handed to a WriteBehind stage, so disk
+// writes overlap with reading the socket.
+class PartFileWriter {
+public:
+    explicit PartFileWriter(BufferPool& pool) : pool_(pool) {}
+    ~PartFileWriter() { close(); }
+
+    bool open(const fs::path& part_path, uint64_t start_offset, const TransferOptions& options);
+    void write_from_reader(FramedReader& reader, std::size_t count);
+    void write_from_socket(boost::asio::ip::tcp::socket& socket, std::size_t count);
+    void write(const char* data, std::size_t count);
+    // Flushes queued writes; throws if any of them failed.
+    void finish();
+    void close();
+
+    // Time the write-behind stage spent waiting on each side; false if the
+    // file was written without one.
+    bool stalls(WriteBehind::Duration& network, WriteBehind::Duration& disk) const;
+    // End of the bytes that have reached the file, for reading them back
+    // while later ones are still arriving. Not advanced outside Linux, where
+    // writes only land for certain after finish().
+    uint64_t written() const;
+
+private:
+    char* scratch() {
+        if (!buffer_) buffer_ = pool_.acquire();
+        return buffer_.data();
+    }
+    void start_write_behind(std::size_t depth);
+    void read_into_write_behind(boost::asio::ip::tcp::socket& socket, std::size_t count);
+    void write_to_disk(const char* data, std::size_t count);
+
+    BufferPool& pool_;
+    BufferPool::Buffer buffer_;
+    std::unique_ptr<WriteBehind> behind_;
+    std::atomic<uint64_t> written_{0};
+#ifdef __linux__
+    void write_buffered(boost::asio::ip::tcp::socket& socket, std::size_t count);
+    void drain_pipe(std::size_t count);
+
+    int fd_ = -1;
+    int pipe_[2] = {-1, -1};
+    std::unique_ptr<PipeWriteBehind> pipes_;
+    loff_t offset_ = 0;
+    bool use_splice_ = true;
+#else
+    std::ofstream file_;
+#endif
+};
+
+#ifdef __linux__
+
+void pwrite_full(int fd, const char* data, std::size_t count, loff_t& offset) {
+    while (count > 0) {
+        ssize_t n = ::pwrite(fd, data, count, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw_errno("pwrite");
+        }
+        data += n;
+        count -= static_cast<std::size_t>(n);
+        offset += n;
+    }
+}
+
+bool PartFileWriter::open(const fs::path& part_path, uint64_t start_offset, const TransferOptions& options) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    if (start_offset == 0) {
+        flags |= O_TRUNC;
+    }
+    fd_ = ::open(part_path.c_str(), flags, 0644);
+    if (fd_ < 0) {
+        return false;
+    }
+    offset_ = static_cast<loff_t>(start_offset);
+    written_ = start_offset;
+
+    if (options.io_backend != IoBackend::BUFFERED && options.write_behind_depth > 0) {
+        try {
+            pipes_ = std::make_unique<PipeWriteBehind>(fd_, start_offset, options.write_behind_depth,
+                                                       RECEIVE_BUFFER_SIZE, pool_);
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "Spliced write-behind unavailable, copying instead: " << e.what() << "\n";
+        }
+    }
+    // If no pipe could be made for the stage, the buffers take over. With a
+    // depth of 0 payload is still spliced, each chunk written before the next.
+    if (options.io_backend == IoBackend::BUFFERED || options.write_behind_depth > 0 ||
+        ::pipe2(pipe_, O_CLOEXEC) != 0) {
+        pipe_[0] = pipe_[1] = -1;
+        use_splice_ = false;
+        start_write_behind(options.write_behind_depth);
+    } else {
+        ::fcntl(pipe_[1], F_SETPIPE_SZ, static_cast<int>(DEFAULT_CHUNK_SIZE));
+    }
+    return true;
+}
+
+void PartFileWriter::write_from_socket(boost::asio::ip::tcp::socket& socket, std::size_t count) {
+    if (pipes_) {
+        pipes_->splice_from(socket, count);
+        return;
+    }
+    int sock_fd = socket.native_handle();
+    while (count > 0) {
+        if (!use_splice_) {
+            write_buffered(socket, count);
+            return;
+        }
+
+        ssize_t n = ::splice(sock_fd, nullptr, pipe_[1], nullptr, count, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n > 0) {
+            drain_pipe(static_cast<std::size_t>(n));
+            count -= static_cast<std::size_t>(n);
+        } else if (n == 0) {
+            throw boost::system::system_error(boost::asio::error::eof);
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN) {
+            socket.wait(boost::asio::ip::tcp::socket::wait_read);
+        } else if (errno == EINVAL) {
+            use_splice_ = false;
+        } else {
+            throw_errno("splice");
+        }
+    }
+}
+
+void PartFileWriter::write(const char* data, std::size_t count) {
+    if (pipes_) {
+        pipes_->write(data, count);
+    } else if (behind_) {
+        behind_->write(data, count);
+    } else {
+        write_to_disk(data, count);
+    }
+}
+
+void PartFileWriter::write_to_disk(const char* data, std::size_t count) {
+    pwrite_full(fd_, data, count, offset_);
+    written_.store(static_cast<uint64_t>(offset_), std::memory_order_release);
+}
+
+void PartFileWriter::drain_pipe(std::size_t count) {
+    while (count > 0 && use_splice_) {
+        ssize_t n = ::splice(pipe_[0], nullptr, fd_, &offset_, count, SPLICE_F_MOVE);
+        if (n > 0) {
+            count -= static_cast<std::size_t>(n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EINVAL) {
+            // Filesystem cannot accept spliced pages; finish this batch by hand.
+            use_splice_ = false;
+        } else {
+            throw_errno("splice");
+        }
+    }
+
+    while (count > 0) {
+        char* data = scratch();
+        ssize_t n = ::read(pipe_[0], data, std::min(count, pool_.buffer_size()));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw_errno("read");
+        }
+        pwrite_full(fd_, data, static_cast<std::size_t>(n), offset_);
+        count -= static_cast<std::size_t>(n);
+    }
+    written_.store(static_cast<uint64_t>(offset_), std::memory_order_release);
+}
+
+void PartFileWriter::write_buffered(boost::asio::ip::tcp::socket& socket, std::size_t count) {
+    if (behind_) {
+        read_into_write_behind(socket, count);
+        return;
+    }
+    while (count > 0) {
+        char* data = scratch();
+        std::size_t n = std::min(count, pool_.buffer_size());
+        boost::asio::read(socket, boost::asio::buffer(data, n));
+        write_to_disk(data, n);
+        count -= n;
+    }
+}
+
+void PartFileWriter::finish() {
+    if (pipes_) {
+        pipes_->flush();
+    } else if (behind_) {
+        behind_->flush();
+    }
+}
+
+void PartFileWriter::close() {
+    pipes_.reset();
+    behind_.reset();
+    buffer_ = {};
+    for (int* fd : {&pipe_[0], &pipe_[1], &fd_}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+#else
+
+bool PartFileWriter::open(const fs::path& part_path, uint64_t start_offset, const TransferOptions& options) {
+    std::ios_base::openmode mode = std::ios::binary;
+    if (start_offset > 0) {
+        mode |= std::ios::app;
+    }
+    file_.open(part_path, mode);
+    if (file_.is_open()) {
+        start_write_behind(options.write_behind_depth);
+    }
+    return file_.is_open();
+}
+
+void PartFileWriter::write_from_socket(boost::asio::ip::tcp::socket& socket, std::size_t count) {
+    if (behind_) {
+        read_into_write_behind(socket, count);
+        return;
+    }
+    while (count > 0) {
+        char* data = scratch();
+        std::size_t n = std::min(count, pool_.buffer_size());
+        boost::asio::read(socket, boost::asio::buffer(data, n));
+        write(data, n);
+        count -= n;
+    }
+}
+
+void PartFileWriter::write(const char* data, std::size_t count) {
+    if (behind_) {
+        behind_->write(data, count);
+    } else {
+        write_to_disk(data, count);
+    }
+}
+
+void PartFileWriter::write_to_disk(const char* data, std::size_t count) {
+    file_.write(data, static_cast<std::streamsize>(count));
+    if (!file_) {
+        throw std::runtime_error("Failed to write to partial file");
+    }
+}
+
+void PartFileWriter::finish() {
+    if (behind_) {
+        behind_->flush();
+    }
+    file_.flush();
+    if (!file_) {
+        throw std::runtime_error("Failed to flush partial file");
+    }
+}
+
+void PartFileWriter::close() {
+    behind_.reset();
+    buffer_ = {};
+    if (file_.is_open()) {
+        file_.close();
+    }
+}
+
+#endif
+
+bool PartFileWriter::stalls(WriteBehind::Duration& network, WriteBehind::Duration& disk) const {
+#ifdef __linux__
+    if (pipes_) {
+        network = pipes_->network_stall();
+        disk = pipes_->disk_stall();
+        return true;
+    }
+#endif
+    if (behind_) {
+        network = behind_->network_stall();
+        disk = behind_->disk_stall();
+        return true;
+    }
+    return false;
+}
+
+uint64_t PartFileWriter::written() const {
+#ifdef __linux__
+    if (pipes_) {
+        return pipes_->written();
+    }
+#endif
+    return written_.load(std::memory_order_acquire);
+}
+
+void PartFileWriter::start_write_behind(std::size_t depth) {
+    if (depth > 0) {
+        behind_ = std::make_unique<WriteBehind>(
+            [this](const char* data, std::size_t count) { write_to_disk(data, count); }, depth, pool_);
+    }
+}
+
+// Reads payload straight into the write-behind staging buffers.
+void PartFileWriter::read_into_write_behind(boost::asio::ip::tcp::socket& socket, std::size_t count) {
+    while (count > 0) {
+        std::size_t available;
+        char* data = behind_->prepare(available);
+        std::size_t n = std::min(count, available);
+        boost::asio::read(socket, boost::asio::buffer(data, n));
+        behind_->commit(n);
+        count -= n;
+    }
+}
+
+// FILE_RANGE payloads start with the absolute file offset of their data.
+constexpr std::size_t kRangeOffsetSize = 8;
+// Frames on a data connection are fixed; each connection only has to keep
+// its own congestion window full.
+constexpr std::size_t kStripeFrameSize = 1024 * 1024;
+
+std::array<uint8_t, kRangeOffsetSize> encode_range_offset(uint64_t offset) {
+    std::array<uint8_t, kRangeOffsetSize> bytes;
+    for (std::size_t i = 0; i < bytes.size(); ++i) {
+        bytes[i] = static_cast<uint8_t>(offset >> (8 * (bytes.size() - 1 - i)));
+    }
+    return bytes;
+}
+
+uint64_t decode_range_offset(const std::array<uint8_t, kRangeOffsetSize>& bytes) {
+    uint64_t offset = 0;
+    for (uint8_t byte : bytes) {
+        offset = (offset << 8) | byte;
+    }
+    return offset;
+}
+
+// Runs `work(i)` on one thread per stripe and calls `tick()` every 300 ms on
+// the caller's thread until all of them return. The first exception stops
+// the other stripes through `abort` and is rethrown once all have joined.
+template <typename Work, typename Tick>
+void run_stripes(std::size_t count, std::atomic<bool>& abort, Work work, Tick tick) {
+    std::mutex mtx;
+    std::condition_variable done_cv;
+    std::size_t running = count;
+    std::exception_ptr error;
+
+    std::vector<std::thread> threads;
+    threads.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        threads.emplace_back([&, i] {
+            try {
+                work(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!error) error = std::current_exception();
+                abort = true;
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            --running;
+            done_cv.notify_one();
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (running > 0) {
+            done_cv.wait_for(lock, std::chrono::milliseconds(300));
+            lock.unlock();
+            tick();
+            lock.lock();
+        }
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Sends one stripe's share of file `index`, sealed under `cipher` if there is
+// one and otherwise with each frame's CRC32C when `checksums` is set. Stops
+// early, after telling the receiver, when the transfer is cancelled;
+// silently when another stripe failed.
+void send_stripe(boost::asio::ip::tcp::socket& socket, const std::string& filepath, uint32_t session_id,
+                 const std::vector<protocol::ByteRange>& ranges, BufferPool& pool, const security::FrameCipher* cipher,
+                 uint32_t index, bool checksums, std::atomic<uint64_t>& sent, std::atomic<bool>* cancel_flag,
+                 const std::atomic<bool>& abort) {
+    std::ifstream file(filepath, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file for reading: " + filepath);
+    }
+
+    BufferPool::Buffer buffer = pool.acquire();
+    std::size_t frame_size = std::min(buffer.size(), kStripeFrameSize);
+    for (const auto& range : ranges) {
+        file.seekg(static_cast<std::streamoff>(range.begin));
+        uint64_t offset = range.begin;
+        while (offset < range.end) {
+            if (cancel_flag && cancel_flag->load()) {
+                send_cancel(socket, session_id);
+                return;
+            }
+            if (abort) {
+                return;
+            }
+
+            std::size_t n = static_cast<std::size_t>(std::min<uint64_t>(frame_size, range.end - offset));
+            if (!file.read(buffer.data(), static_cast<std::streamsize>(n))) {
+                throw std::runtime_error("File was truncated during transfer");
+            }
+
+            protocol::PacketHeader header{
+                static_cast<uint32_t>(protocol::CommandType::FILE_RANGE),
+                static_cast<uint32_t>(kRangeOffsetSize + n),
+                session_id, checksums && !cipher ? crc32c(buffer.data(), n) : 0
+            };
+            auto offset_buf = encode_range_offset(offset);
+            if (cipher) {
+                send_sealed(socket, *cipher, header, index, offset, buffer.data(), n, boost::asio::buffer(offset_buf));
+            } else {
+                auto header_buf = protocol::serialize_header(header);
+                std::array<boost::asio::const_buffer, 3> frame{
+                    boost::asio::buffer(header_buf), boost::asio::buffer(offset_buf),
+                    boost::asio::buffer(buffer.data(), n)
+                };
+                boost::asio::write(socket, frame);
+            }
+            offset += n;
+            sent += n;
+        }
+    }
+}
+
+// Frames of one stripe that failed their checksum or tag. They are written
+// anyway and asked for again once every stripe is through.
+struct StripeDamage {
+    ByteRanges ranges; // only touched by the stripe's own thread until it ends
+    // Bytes of the stripe received before its first damaged frame.
+    std::atomic<uint64_t> intact{UINT64_MAX};
+};
+
+// Receives one stripe's share into the preallocated .fluxpart. With
+// `damage`, frames are checked as chunk checksums require and the damaged
+// ones recorded there. Returns CANCELLED when the sender cancelled and
+// FAILED when stopped early.
+TransferState receive_stripe(FramedReader& reader, const fs::path& part_path,
+                             const std::vector<protocol::ByteRange>& ranges, BufferPool& pool,
+                             const security::FrameCipher* cipher, uint32_t index,
+                             std::atomic<uint64_t>& received, StripeDamage* damage, std::atomic<bool>* cancel_flag,
+                             const std::atomic<bool>& abort) {
+    std::fstream file;
+    file.rdbuf()->pubsetbuf(nullptr, 0); // bytes counted in `received` must already be in the OS
+    file.open(part_path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file for writing: " + part_path.string());
+    }
+
+    BufferPool::Buffer buffer = pool.acquire();
+    for (const auto& range : ranges) {
+        file.seekp(static_cast<std::streamoff>(range.begin));
+        uint64_t offset = range.begin;
+        while (offset < range.end) {
+            if ((cancel_flag && cancel_flag->load()) || abort) {
+                return TransferState::FAILED;
+            }
+
+            protocol::PacketHeader header = reader.read_header();
+            if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
+                return TransferState::CANCELLED;
+            }
+            if (header.command != static_cast<uint32_t>(protocol::CommandType::FILE_RANGE) ||
+                header.payload_size < kRangeOffsetSize) {
+                throw std::runtime_error("Unexpected packet on data connection: " + std::to_string(header.command));
+            }
+
+            std::array<uint8_t, kRangeOffsetSize> offset_buf;
+            reader.read_exact(reinterpret_cast<char*>(offset_buf.data()), offset_buf.size());
+            uint64_t count = plaintext_size(header, cipher, kRangeOffsetSize);
+            if (decode_range_offset(offset_buf) != offset || count > range.end - offset) {
+                throw std::runtime_error("Data connection sent a range that was not requested");
+            }
+
+            // A sealed or checked frame is read whole before any of it is written.
+            if (cipher || damage) {
+                if (count > buffer.size()) {
+                    throw std::runtime_error("Range exceeds the frame size");
+                }
+                std::size_t n = static_cast<std::size_t>(count);
+                bool intact = true;
+                read_payload(reader, cipher, header, index, offset, buffer.data(), n, damage ? &intact : nullptr);
+                if (damage && !cipher) {
+                    intact = crc32c(buffer.data(), n) == header.reserved;
+                }
+                if (!intact) {
+                    if (damage->ranges.empty()) {
+                        damage->intact = received.load();
+                    }
+                    damage->ranges.push_back({offset, offset + n});
+                }
+                file.write(buffer.data(), static_cast<std::streamsize>(n));
+                if (!file) {
+                    throw std::runtime_error("Failed to write to partial file");
+                }
+                offset += n;
+                received += n;
+                continue;
+            }
+            while (count > 0) {
+                std::size_t n = static_cast<std::size_t>(std::min<uint64_t>(count, buffer.size()));
+                reader.read_exact(buffer.data(), n);
+                file.write(buffer.data(), static_cast<std::streamsize>(n));
+                if (!file) {
+                    throw std::runtime_error("Failed to write to partial file");
+                }
+                offset += n;
+                count -= n;
+                received += n;
+            }
+        }
+    }
+    return TransferState::COMPLETED;
+}
+
+// Rounds of CHUNK_NACK a receiver asks for before it gives up on a file.
+constexpr int kMaxRepairRounds = 5;
+
+// Asks the sender with CHUNK_NACK for the `damaged` ranges of a file it
+// streamed with chunk checksums and writes the FILE_RANGE frames that resend
+// them into the .fluxpart, for further rounds while some arrive damaged
+// again. Ends with an empty CHUNK_NACK. Returns FAILED if damage is left
+// after kMaxRepairRounds and CANCELLED when either side cancelled.
+TransferState repair_damaged_ranges(FramedReader& reader, const fs::path& part_path, ByteRanges damaged,
+                                    const security::FrameCipher* cipher, uint32_t index,
+                                    std::atomic<bool>* cancel_flag) {
+    std::fstream file;
+    file.rdbuf()->pubsetbuf(nullptr, 0); // the file hash reads the repairs back through another stream
+    std::vector<char> buffer;
+    for (int round = 0; round < kMaxRepairRounds && !damaged.empty(); ++round) {
+        if (cancel_flag && cancel_flag->load()) {
+            send_cancel(reader.socket(), 0);
+            return TransferState::CANCELLED;
+        }
+        damaged = merge_ranges(std::move(damaged));
+        FD_LOG("Asking again for " << total_bytes(damaged) << " damaged bytes of "
+               << part_path.filename().string() << " in " << damaged.size() << " ranges");
+        MessageSender::send_chunk_nack(reader.socket(), 0, {damaged});
+        if (!file.is_open()) {
+            file.open(part_path, std::ios::in | std::ios::out | std::ios::binary);
+            if (!file.is_open()) {
+                throw std::runtime_error("Could not open file for writing: " + part_path.string());
+            }
+        }
+
+        ByteRanges again;
+        for (const auto& range : damaged) {
+            uint64_t offset = range.begin;
+            while (offset < range.end) {
+                protocol::PacketHeader header = reader.read_header();
+                if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
+                    return TransferState::CANCELLED;
+                }
+                if (header.command != static_cast<uint32_t>(protocol::CommandType::FILE_RANGE) ||
+                    header.payload_size < kRangeOffsetSize) {
+                    throw std::runtime_error("Expected FILE_RANGE packet, got: " + std::to_string(header.command));
+                }
+
+                std::array<uint8_t, kRangeOffsetSize> offset_buf;
+                reader.read_exact(reinterpret_cast<char*>(offset_buf.data()), offset_buf.size());
+                uint64_t count = plaintext_size(header, cipher, kRangeOffsetSize);
+                if (decode_range_offset(offset_buf) != offset || count > range.end - offset ||
+                    count > kStripeFrameSize) {
+                    throw std::runtime_error("Sender resent a range that was not asked for");
+                }
+                std::size_t n = static_cast<std::size_t>(count);
+                buffer.resize(std::max(buffer.size(), n));
+                bool intact = true;
+                read_payload(reader, cipher, header, index, offset, buffer.data(), n, &intact);
+                if (!cipher) {
+                    intact = crc32c(buffer.data(), n) == header.reserved;
+                }
+                if (intact) {
+                    file.seekp(static_cast<std::streamoff>(offset));
+                    file.write(buffer.data(), static_cast<std::streamsize>(n));
+                    if (!file) {
+                        throw std::runtime_error("Failed to write to partial file");
+                    }
+                } else {
+                    again.push_back({offset, offset + n});
+                }
+                offset += n;
+            }
+        }
+        damaged = std::move(again);
+    }
+    MessageSender::send_chunk_nack(reader.socket(), 0, {});
+    return damaged.empty() ? TransferState::COMPLETED : TransferState::FAILED;
+}
+
+// Payload bytes already pulled into the reader are written from its buffer.
+// The rest is read through the buffer when small (batching the frames that
+// follow) or moved straight from the socket when large.
+void PartFileWriter::write_from_reader(FramedReader& reader, std::size_t count) {
+    std::size_t from_buffer = std::min(count, reader.buffered());
+    if (from_buffer > 0) {
+        write(reader.data(), from_buffer);
+        reader.consume(from_buffer);
+        count -= from_buffer;
+    }
+
+    bool direct = count >= kDirectReadThreshold || count > reader.capacity();
+    reader.set_read_ahead(!direct);
+    if (count == 0) {
+        return;
+    }
+    if (direct) {
+        write_from_socket(reader.socket(), count);
+    } else {
+        reader.fill(count);
+        write(reader.data(), count);
+        reader.consume(count);
+    }
+}
+
+// Reads exactly `size` bytes of a small file. Returns false if it cannot be
+// opened or has shrunk.
+bool read_small_file(const std::string& filepath, char* out, std::size_t size) {
+#ifdef __linux__
+    FdGuard file{::open(filepath.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (file.fd < 0) {
+        return false;
+    }
+    std::size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(file.fd, out + done, size - done, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return false;
+        }
+        done += static_cast<std::size_t>(n);
+    }
+    return true;
+#else
+    std::ifstream file(filepath, std::ios::binary);
+    return file.read(out, static_cast<std::streamsize>(size)).good();
+#endif
+}
+
+// Creates or replaces `path` with `size` bytes in one open/write/close. A
+// file that could not be written in full is removed.
+void write_small_file(const fs::path& path, const char* data, std::size_t size) {
+#ifdef __linux__
+    FdGuard file{::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if (file.fd < 0) {
+        throw_errno("open");
+    }
+    try {
+        loff_t offset = 0;
+        pwrite_full(file.fd, data, size, offset);
+    } catch (...) {
+        std::error_code ec;
+        fs::remove(path, ec);
+        throw;
+    }
+#else
+    bool written;
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        written = file.write(data, static_cast<std::streamsize>(size)) && file.flush();
+    }
+    if (!written) {
+        std::error_code ec;
+        fs::remove(path, ec);
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+#endif
+}
+
+} // namespace
+
+void configure_socket(boost::asio::ip::tcp::socket& socket) {
+    boost::system::error_code ec;
+    socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+    if (ec) {
+        std::cerr << "Failed to set TCP_NODELAY: " << ec.message() << "\n";
+    }
+}
+
+void MessageSender::send(boost::asio::ip::tcp::socket& socket, const std::string& message) {
+    try {
+        std::string msg = message + "\n";
+        boost::asio::write(socket, boost::asio::buffer(msg));
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception: " << e.what() << "\n";
+    }
+}
+
+void MessageSender::send_header(boost::asio::ip::tcp::socket& socket, const protocol::PacketHeader& header) {
+    send_packet(socket, header, boost::asio::const_buffer());
+}
+
+void MessageSender::send_packet(boost::asio::ip::tcp::socket& socket, const protocol::PacketHeader& header,
+                                boost::asio::const_buffer payload) {
+    try {
+        auto buf = protocol::serialize_header(header);
+        std::array<boost::asio::const_buffer, 2> frame{boost::asio::buffer(buf), payload};
+        boost::asio::write(socket, frame);
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception: " << e.what() << "\n";
+    }
+}
+
+void MessageSender::send_file_meta(boost::asio::ip::tcp::socket& socket, const protocol::FileInfo& info, bool binary) {
+    try {
+        std::string payload = binary ? protocol::encode_file_info(info) : nlohmann::json(info).dump();
+
+        protocol::PacketHeader header{
+            static_cast<uint32_t>(protocol::CommandType::FILE_META),
+            static_cast<uint32_t>(payload.size()),
+            0, 0
+        };
+        
+        send_packet(socket, header, boost::asio::buffer(payload));
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception (meta): " << e.what() << "\n";
+    }
+}
+
+void MessageSender::send_session_config(boost::asio::ip::tcp::socket& socket, const protocol::SessionConfig& config) {
+    try {
+        nlohmann::json j = config;
+        std::string payload = j.dump();
+
+        protocol::PacketHeader header{
+            static_cast<uint32_t>(protocol::CommandType::SESSION_CONFIG),
+            static_cast<uint32_t>(payload.size()),
+            0, 0
+        };
+
+        send_packet(socket, header, boost::asio::buffer(payload));
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception (session config): " << e.what() << "\n";
+    }
+}
+
+std::string MessageReceiver::receive(boost::asio::ip::tcp::socket& socket) {
+    try {
+        boost::asio::streambuf buf;
+        boost::asio::read_until(socket, buf, '\n');
+        
+        std::istream is(&buf);
+        std::string message;
+        std::getline(is, message);
+        return message;
+    } catch (const boost::system::system_error& e) {
+        if (e.code() == boost::asio::error::eof ||
+            e.code() == boost::asio::error::operation_aborted) {
+            return "";
+        }
+        std::cerr << "MessageReceiver Exception: " << e.what() << "\n";
+        return "";
+    } catch (std::exception& e) {
+        std::cerr << "MessageReceiver Exception: " << e.what() << "\n";
+        return "";
+    }
+}
+
+protocol::PacketHeader MessageReceiver::receive_header(boost::asio::ip::tcp::socket& socket) {
+    FramedReader reader(socket, 0);
+    return receive_header(reader);
+}
+
+protocol::PacketHeader MessageReceiver::receive_header(FramedReader& reader) {
+    protocol::PacketHeader empty_header{0, 0, 0, 0};
+    try {
+        return reader.read_header();
+    } catch (const boost::system::system_error& e) {
+        if (e.code() == boost::asio::error::eof ||
+            e.code() == boost::asio::error::operation_aborted) {
+            return empty_header;
+        }
+        std::cerr << "MessageReceiver Exception: " << e.what() << "\n";
+        return empty_header;
+    } catch (std::exception& e) {
+        std::cerr << "MessageReceiver Exception: " << e.what() << "\n";
+        return empty_header;
+    }
+}
+
+protocol::FileInfo MessageReceiver::receive_file_meta(boost::asio::ip::tcp::socket& socket, uint32_t payload_size, BufferPool* pool) {
+    FramedReader reader(socket, 0);
+    return receive_file_meta(reader, payload_size, pool);
+}
+
+protocol::FileInfo MessageReceiver::receive_file_meta(FramedReader& reader, uint32_t payload_size, BufferPool* pool) {
+    protocol::FileInfo info;
+    try {
+        BufferPool::Buffer pooled;
+        std::vector<char> fallback;
+        char* data;
+        if (pool && payload_size <= pool->buffer_size()) {
+            pooled = pool->acquire();
+            data = pooled.data();
+        } else {
+            fallback.resize(payload_size);
+            data = fallback.data();
+        }
+        reader.read_exact(data, payload_size);
+
+        if (protocol::is_binary_meta(data, payload_size)) {
+            info = protocol::decode_file_info(data, payload_size);
+        } else {
+            info = nlohmann::json::parse(data, data + payload_size).get<protocol::FileInfo>();
+        }
+    } catch (std::exception& e) {
+        std::cerr << "MessageReceiver Exception (meta): " << e.what() << "\n";
+    }
+    return info;
+}
+
+protocol::SessionConfig MessageReceiver::receive_session_config(FramedReader& reader, uint32_t payload_size) {
+    protocol::SessionConfig config;
+    try {
+        std::vector<char> data(payload_size);
+        reader.read_exact(data.data(), data.size());
+        config = nlohmann::json::parse(data.begin(), data.end()).get<protocol::SessionConfig>();
+    } catch (std::exception& e) {
+        std::cerr << "MessageReceiver Exception (session config): " << e.what() << "\n";
+    }
+    return config;
+}
+
+namespace {
+
+// Enough for a stable ratio while compressing in about a millisecond.
+constexpr std::size_t kCompressionSampleSize = 256 * 1024;
+
+// Samples the start of what is left of `filepath` for compression_pays_off().
+bool worth_compressing(const std::string& filepath, uint64_t start_offset, BufferPool& pool, double link_rate) {
+    std::ifstream file(filepath, std::ios::binary);
+    file.seekg(static_cast<std::streamoff>(start_offset));
+    BufferPool::Buffer sample = pool.acquire();
+    file.read(sample.data(), static_cast<std::streamsize>(std::min(sample.size(), kCompressionSampleSize)));
+    bool pays_off = compression_pays_off(sample.data(), static_cast<std::size_t>(file.gcount()), link_rate);
+    if (link_rate > 0) {
+        FD_LOG("Compression for " << fs::path(filepath).filename().string() << ": "
+               << (pays_off ? "on" : "off") << " over a " << std::fixed << std::setprecision(0)
+               << link_rate / 1e6 << " MB/s link");
+    }
+    return pays_off;
+}
+
+} // namespace
+
+bool MessageSender::send_file(boost::asio::ip::tcp::socket& socket, const std::string& filepath, uint32_t session_id, uint32_t index, uint64_t start_offset, TransferProgressCallback progress_cb, std::atomic<bool>* cancel_flag, const TransferOptions& options, BufferPool* pool, ChunkSizer* chunk_sizer) {
+    try {
+        std::optional<BufferPool> local_pool;
+        if (!pool) {
+            pool = &local_pool.emplace(DEFAULT_CHUNK_SIZE, options.read_ahead_depth + 1);
+        }
+        std::optional<ChunkSizer> fixed_sizer;
+        if (!chunk_sizer) {
+            chunk_sizer = &fixed_sizer.emplace(DEFAULT_CHUNK_SIZE, DEFAULT_CHUNK_SIZE);
+        }
+        chunk_sizer->start_file();
+        // A file a relay is still receiving comes from its feed, which also
+        // has the root to vouch for it with once it is finished.
+        std::optional<RelayFeed::Reader> relayed;
+        if (options.relay && options.relay->follows(filepath)) {
+            relayed.emplace(*options.relay, filepath, start_offset, cancel_flag);
+        }
+        bool compress = options.compress_chunks && compression_available();
+        if (compress && !relayed) {
+            compress = worth_compressing(filepath, start_offset, *pool, chunk_sizer->throughput());
+        }
+        const security::FrameCipher* cipher = options.cipher.get();
+        // All three need every chunk in user space.
+        bool transform = compress || cipher || options.chunk_checksums;
+        std::optional<SourceFileHash> file_hash;
+        if (options.verify_files && !relayed) {
+            file_hash.emplace(filepath);
+        }
+        auto sent = [&]() {
+            if (options.verify_files && relayed) {
+                if (relayed->root()) {
+                    file_hash.emplace(*relayed->root());
+                } else {
+                    file_hash.emplace(filepath);
+                }
+            }
+            return !file_hash || send_file_hash(socket, session_id, index, *file_hash, options.cipher.get());
+        };
+
+#ifdef __linux__
+        if (options.io_backend != IoBackend::BUFFERED && !transform && !relayed) {
+            switch (send_file_zero_copy(socket, filepath, session_id, start_offset, progress_cb, cancel_flag, *pool, *chunk_sizer,
+                                        options.read_ahead_depth)) {
+                case ZeroCopyResult::SENT:        return sent();
+                case ZeroCopyResult::CANCELLED:   return false;
+                case ZeroCopyResult::UNSUPPORTED: break;
+            }
+        }
+#endif
+
+        // The feed holds what a relay received in memory already, so it is
+        // read on this thread.
+        std::optional<FileReadAhead> source;
+        uint64_t file_size = 0;
+        if (relayed) {
+            file_size = options.relay->entry(filepath)->size;
+            source.emplace([&](char* out, std::size_t size) { return relayed->read(out, size); }, 0, *pool,
+                           *chunk_sizer);
+        } else {
+            std::ifstream file(filepath, std::ios::binary);
+            if (!file.is_open()) {
+                std::cerr << "Could not open file for reading: " << filepath << "\n";
+                return false;
+            }
+
+            file.seekg(0, std::ios::end);
+            file_size = file.tellg();
+            file.seekg(start_offset);
+            source.emplace(std::move(file), options.read_ahead_depth, *pool, *chunk_sizer);
+        }
+        FileReadAhead& read_ahead = *source;
+
+        uint64_t total_sent = start_offset;
+        SendProgress progress{filepath, file_size, start_offset, progress_cb};
+
+        std::optional<ChunkCompressor> compressor;
+        if (transform) {
+            compressor.emplace(read_ahead, *pool, session_id, compress, cipher, index, start_offset,
+                               options.chunk_checksums);
+        }
+        uint64_t wire_bytes = 0;
+        ChunkCompressor::Frame chunk;
+        while (compressor ? compressor->next(chunk) : read_ahead.next(chunk.chunk)) {
+            if (cancel_flag && cancel_flag->load()) {
+                std::cout << "\nTransfer cancelled locally.\n";
+                send_cancel(socket, session_id);
+                return false;
+            }
+
+            if (!compressor) {
+                chunk.header = {static_cast<uint32_t>(protocol::CommandType::FILE_CHUNK),
+                                static_cast<uint32_t>(chunk.chunk.size), session_id, 0};
+            }
+            auto header_buf = protocol::serialize_header(chunk.header);
+            std::size_t nonce_size = chunk.sealed ? cipher->nonce_size() : 0;
+            std::size_t tag_size = chunk.sealed ? chunk.tag.size() : 0;
+            std::array<boost::asio::const_buffer, 4> frame{
+                boost::asio::buffer(header_buf), boost::asio::buffer(chunk.nonce.data(), nonce_size),
+                boost::asio::buffer(chunk.payload(), chunk.payload_size()), boost::asio::buffer(chunk.tag.data(), tag_size)
+            };
+            boost::asio::write(socket, frame);
+            total_sent += chunk.chunk.size;
+            wire_bytes += chunk.header.payload_size;
+            chunk_sizer->record(socket, chunk.header.payload_size);
+
+            progress.update(total_sent);
+        }
+        if (compress && total_sent > start_offset) {
+            FD_LOG("Compression for " << fs::path(filepath).filename().string() << ": "
+                   << (total_sent - start_offset) << " bytes sent as " << wire_bytes
+                   << ", zstd level " << compressor->level() << " at the end");
+        }
+        return sent();
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception (send_file): " << e.what() << "\n";
+        return false;
+    }
+}
+
+TransferState MessageReceiver::receive_file(boost::asio::ip::tcp::socket& socket, const std::string& filepath, uint64_t expected_size, uint32_t index, uint64_t start_offset, TransferProgressCallback progress_cb, std::atomic<bool>* cancel_flag, const TransferOptions& options, BufferPool* pool) {
+    FramedReader reader(socket, 0);
+    return receive_file(reader, filepath, expected_size, index, start_offset, progress_cb, cancel_flag, options, pool);
+}
+
+TransferState MessageReceiver::receive_file(FramedReader& reader, const std::string& filepath, uint64_t expected_size, uint32_t index, uint64_t start_offset, TransferProgressCallback progress_cb, std::atomic<bool>* cancel_flag, const TransferOptions& options, BufferPool* pool, DeltaBasis* basis) {
+    auto& socket = reader.socket();
+    try {
+        std::optional<BufferPool> local_pool;
+        if (!pool) {
+            pool = &local_pool.emplace(RECEIVE_BUFFER_SIZE, options.write_behind_depth + 2);
+        }
+
+        fs::path final_path(filepath);
+        fs::path part_path(filepath + ".fluxpart");
+        
+        fs::path parent = part_path.parent_path();
+        if (!parent.empty()) {
+            fs::create_directories(parent);
+        }
+        
+        if (start_offset == 0) {
+            discard_block_hashes(part_path);
+        }
+        // A relay's share waits on the file until it is finished or given up.
+        struct RelayedFile {
+            RelayFeed* feed;
+            const std::string& path;
+            bool finished = false;
+            ~RelayedFile() {
+                if (feed && !finished) feed->fail(path);
+            }
+        } relayed{options.relay && options.relay->follows(filepath) ? options.relay.get() : nullptr, filepath};
+
+        PartFileWriter file(*pool);
+        if (!file.open(part_path, start_offset, options)) {
+            std::cerr << "Could not open file for writing: " << part_path << "\n";
+            return TransferState::FAILED;
+        }
+        if (relayed.feed) {
+            relayed.feed->start(filepath, start_offset);
+        }
+        // Chunks that fail their checksum are written anyway and sent again
+        // once the file is through. The file hash stops short of the first.
+        ByteRanges damaged;
+        std::atomic<uint64_t> first_damaged{UINT64_MAX};
+        std::optional<PartFileHash> part_hash;
+        std::optional<protocol::BlockHash> sender_hash;
+        if (options.verify_files) {
+            part_hash.emplace(part_path, expected_size, [&file, &first_damaged]() {
+                return ByteRanges{{0, std::min(file.written(), first_damaged.load())}};
+            });
+        }
+
+        uint64_t total_received = start_offset;
+        auto start_time = std::chrono::steady_clock::now();
+        auto last_print_time = start_time;
+
+        auto report_progress = [&]() {
+            auto now = std::chrono::steady_clock::now();
+            auto elapsed_since_print = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_print_time).count();
+
+            if (elapsed_since_print >= 300 || total_received == expected_size) {
+                double elapsed_seconds = std::chrono::duration<double>(now - start_time).count();
+                uint64_t session_received = total_received - start_offset;
+                double speed_bps = (elapsed_seconds > 0) ? (session_received / elapsed_seconds) : 0;
+                double speed_mbps = speed_bps / (1024.0 * 1024.0);
+
+                if (progress_cb) {
+                    progress_cb(filepath, total_received, expected_size, speed_mbps);
+                } else {
+                    int percent = (expected_size > 0) ? static_cast<int>((total_received * 100.0) / expected_size) : 100;
+                    uint64_t remaining_bytes = expected_size - total_received;
+                    double eta_seconds = (speed_bps > 0) ? (remaining_bytes / speed_bps) : 0;
+                    int eta_min = static_cast<int>(eta_seconds) / 60;
+                    int eta_sec = static_cast<int>(eta_seconds) % 60;
+
+                    std::cout << "\r" << percent << "% | "
+                              << std::fixed << std::setprecision(1) << speed_mbps << " MB/s | "
+                              << "ETA " << std::setfill('0') << std::setw(2) << eta_min << ":"
+                              << std::setfill('0') << std::setw(2) << eta_sec << "    " << std::flush;
+                }
+                last_print_time = now;
+            }
+        };
+
+        // FILE_CHUNK_Z frames are read whole, then decompressed into the
+        // .fluxpart. So are checked FILE_CHUNK frames, without the latter.
+        std::optional<ChunkDecompressor> decompressor;
+        std::vector<char> compressed_chunk;
+        std::vector<char> decompressed_chunk;
+        bool checksums = options.chunk_checksums;
+        auto mark_damaged = [&](uint64_t offset, std::size_t n) {
+            if (damaged.empty()) {
+                first_damaged = offset;
+            }
+            damaged.push_back({offset, offset + n});
+        };
+        // Sealed chunks are opened on the worker pool and written in order.
+        const security::FrameCipher* cipher = options.cipher.get();
+        std::optional<ChunkOpener> opener;
+        if (cipher) {
+            opener.emplace(*cipher);
+        }
+        // A relay passes on every chunk as it is written, up to the first
+        // damaged one; its share reads the rest back once the file is whole.
+        auto pass_on = [&](const char* data, std::size_t n) {
+            if (relayed.feed && damaged.empty()) {
+                relayed.feed->append(filepath, data, n, file.written());
+            }
+        };
+        uint64_t write_position = start_offset;
+        auto write = [&](const char* data, std::size_t n) {
+            file.write(data, n);
+            write_position += n;
+            pass_on(data, n);
+        };
+        std::function<void(const char*, std::size_t)> write_damaged;
+        if (checksums) {
+            write_damaged = [&](const char* data, std::size_t n) {
+                mark_damaged(write_position, n);
+                write(data, n);
+            };
+        }
+
+        while (total_received < expected_size || (part_hash && !sender_hash)) {
+            if (cancel_flag && cancel_flag->load()) {
+                std::cout << "\nTransfer cancelled locally.\n";
+                file.close();
+                protocol::PacketHeader cancel_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, 0, 0};
+                MessageSender::send_header(socket, cancel_header);
+                return TransferState::CANCELLED;
+            }
+
+            protocol::PacketHeader header = reader.read_header();
+            
+            bool chunk = header.command == static_cast<uint32_t>(protocol::CommandType::FILE_CHUNK);
+            bool compressed = header.command == static_cast<uint32_t>(protocol::CommandType::FILE_CHUNK_Z);
+            if ((chunk || compressed) && opener) {
+                std::size_t size = compressed ? header.reserved : plaintext_size(header, cipher);
+                if (size > MAX_CHUNK_SIZE || size > expected_size - total_received ||
+                    (compressed && plaintext_size(header, cipher) > size)) {
+                    throw std::runtime_error("Sealed chunk exceeds the negotiated chunk size");
+                }
+                opener->submit(reader, header, size, index, total_received);
+                opener->drain(opener->depth(), write, write_damaged);
+                total_received += size;
+                report_progress();
+            } else if (chunk && (checksums || relayed.feed)) {
+                if (header.payload_size > MAX_CHUNK_SIZE || header.payload_size > expected_size - total_received) {
+                    throw std::runtime_error("Chunk exceeds the negotiated chunk size");
+                }
+                compressed_chunk.resize(std::max<std::size_t>(compressed_chunk.size(), header.payload_size));
+                reader.read_exact(compressed_chunk.data(), header.payload_size);
+                if (checksums && crc32c(compressed_chunk.data(), header.payload_size) != header.reserved) {
+                    mark_damaged(total_received, header.payload_size);
+                }
+                file.write(compressed_chunk.data(), header.payload_size);
+                pass_on(compressed_chunk.data(), header.payload_size);
+                total_received += header.payload_size;
+                report_progress();
+            } else if (chunk) {
+                if (header.payload_size > expected_size - total_received) {
+                    throw std::runtime_error("Chunk runs past the end of the file");
+                }
+                file.write_from_reader(reader, header.payload_size);
+                total_received += header.payload_size;
+                report_progress();
+            } else if (compressed) {
+                std::size_t trailer = checksums ? protocol::CHUNK_CRC_SIZE : 0;
+                if (header.reserved > MAX_CHUNK_SIZE || header.reserved > expected_size - total_received ||
+                    header.payload_size > header.reserved + trailer || header.payload_size < trailer) {
+                    throw std::runtime_error("Compressed chunk exceeds the negotiated chunk size");
+                }
+                if (!decompressor) {
+                    decompressor.emplace();
+                }
+                compressed_chunk.resize(std::max<std::size_t>(compressed_chunk.size(), header.payload_size));
+                decompressed_chunk.resize(std::max<std::size_t>(decompressed_chunk.size(), header.reserved));
+                reader.read_exact(compressed_chunk.data(), header.payload_size);
+                std::size_t frame_size = header.payload_size - trailer;
+                uint32_t crc = 0;
+                for (std::size_t i = 0; i < trailer; ++i) {
+                    crc = (crc << 8) | static_cast<uint8_t>(compressed_chunk[frame_size + i]);
+                }
+                if (checksums && crc32c(compressed_chunk.data(), frame_size) != crc) {
+                    // Whatever the buffer holds stands in for the chunk until it is sent again.
+                    mark_damaged(total_received, header.reserved);
+                } else {
+                    decompressor->decompress(compressed_chunk.data(), frame_size,
+                                             decompressed_chunk.data(), header.reserved);
+                }
+                file.write(decompressed_chunk.data(), header.reserved);
+                pass_on(decompressed_chunk.data(), header.reserved);
+                total_received += header.reserved;
+                report_progress();
+            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::BLOCK_COPY) && basis) {
+                std::array<uint8_t, 4> count_bytes;
+                if (plaintext_size(header, cipher) != count_bytes.size()) {
+                    throw std::runtime_error("BLOCK_COPY payload is not a block count");
+                }
+                read_payload(reader, cipher, header, index, total_received,
+                             reinterpret_cast<char*>(count_bytes.data()), count_bytes.size());
+                if (opener) {
+                    opener->drain(0, write, write_damaged);
+                }
+                uint32_t count = (uint32_t{count_bytes[0]} << 24) | (uint32_t{count_bytes[1]} << 16) |
+                                 (uint32_t{count_bytes[2]} << 8) | uint32_t{count_bytes[3]};
+                uint64_t size = static_cast<uint64_t>(count) * basis->block_size();
+                if (size > expected_size - total_received) {
+                    throw std::runtime_error("BLOCK_COPY runs past the end of the file");
+                }
+                basis->copy(header.reserved, count, write);
+                total_received += size;
+                report_progress();
+            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_HASH) && part_hash) {
+                if (total_received < expected_size) {
+                    throw std::runtime_error("FILE_HASH arrived before the end of the file");
+                }
+                if (opener) {
+                    opener->drain(0, write, write_damaged);
+                }
+                sender_hash = read_file_hash(reader, header, options.cipher.get(), index);
+            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
+                std::cout << "\nTransfer cancelled by sender.\n";
+                file.close();
+                std::error_code ec;
+                fs::remove(part_path, ec);
+                return TransferState::CANCELLED;
+            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
+                protocol::PacketHeader pong_header{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
+                MessageSender::send_header(socket, pong_header);
+            }
+        }
+        if (opener) {
+            opener->drain(0, write, write_damaged);
+        }
+        file.finish();
+        using seconds = std::chrono::duration<double>;
+        WriteBehind::Duration network_stall{}, disk_stall{};
+        if (file.stalls(network_stall, disk_stall) && total_received > start_offset) {
+            FD_LOG("Write-behind for " << final_path.filename().string() << ": waited "
+                   << std::fixed << std::setprecision(2)
+                   << seconds(network_stall).count() << " s on the network, "
+                   << seconds(disk_stall).count() << " s on the disk");
+        }
+        file.close();
+        if (checksums) {
+            TransferState repaired = repair_damaged_ranges(reader, part_path, std::move(damaged), cipher, index,
+                                                           cancel_flag);
+            if (repaired == TransferState::CANCELLED) {
+                std::cout << "\nTransfer cancelled.\n";
+                std::error_code ec;
+                fs::remove(part_path, ec);
+                return repaired;
+            }
+            if (repaired == TransferState::FAILED) {
+                discard_mismatched_file(part_path, final_path);
+                return repaired;
+            }
+        }
+        std::optional<protocol::BlockHash> root;
+        if (part_hash) {
+            auto hashing_since = std::chrono::steady_clock::now();
+            root = part_hash->finish();
+            FD_LOG("File hash for " << final_path.filename().string() << ": ready "
+                   << std::fixed << std::setprecision(3)
+                   << seconds(std::chrono::steady_clock::now() - hashing_since).count() << " s after the last byte");
+        }
+        if (basis) {
+            basis->close();
+        }
+
+        if (root && *root != *sender_hash) {
+            discard_mismatched_file(part_path, final_path);
+            return TransferState::FAILED;
+        }
+        if (!progress_cb) {
+            std::cout << "\r                                                                 " << std::flush;
+            std::cout << "\nFile transfer completed successfully.\n";
+        }
+        if (!replace_with_completed_file(part_path, final_path)) {
+            return TransferState::FAILED;
+        }
+        if (relayed.feed) {
+            relayed.feed->finish(filepath, sender_hash);
+            relayed.finished = true;
+        }
+
+        return TransferState::COMPLETED;
+    } catch (std::exception& e) {
+        std::cerr << "\nMessageReceiver Exception (receive_file): " << e.what() << "\n";
+        return TransferState::FAILED;
+    }
+}
+
+TransferState MessageReceiver::receive_delta(FramedReader& reader, const std::string& filepath, uint64_t expected_size, uint32_t session_id, uint32_t index, TransferProgressCallback progress_cb, std::atomic<bool>* cancel_flag, const TransferOptions& options, BufferPool* pool) {
+    try {
+        uint32_t block_size = delta_block_size(fs::file_size(filepath));
+        protocol::BlockSignatures signatures = compute_block_signatures(filepath, block_size, cancel_flag);
+        if (cancel_flag && cancel_flag->load()) {
+            std::cout << "\nTransfer cancelled locally.\n";
+            send_cancel(reader.socket(), session_id);
+            return TransferState::CANCELLED;
+        }
+
+        std::vector<uint8_t> payload = protocol::serialize_block_signatures(signatures);
+        protocol::PacketHeader header{
+            static_cast<uint32_t>(protocol::CommandType::BLOCK_SIGNATURES),
+            static_cast<uint32_t>(payload.size()),
+            session_id, 0
+        };
+        MessageSender::send_packet(reader.socket(), header, boost::asio::buffer(payload));
+
+        DeltaBasis basis(filepath, signatures);
+        return receive_file(reader, filepath, expected_size, index, 0, progress_cb, cancel_flag, options, pool, &basis);
+    } catch (std::exception& e) {
+        std::cerr << "\nMessageReceiver Exception (receive_delta): " << e.what() << "\n";
+        return TransferState::FAILED;
+    }
+}
+
+bool MessageSender::send_delta(boost::asio::ip::tcp::socket& socket, const std::string& filepath, uint32_t session_id,
+                               uint32_t index, const protocol::BlockSignatures& signatures, TransferProgressCallback progress_cb,
+                               std::atomic<bool>* cancel_flag, const TransferOptions& options, ChunkSizer* chunk_sizer) {
+    try {
+        std::optional<SourceFileHash> file_hash;
+        if (options.verify_files) {
+            file_hash.emplace(filepath);
+        }
+        std::optional<ChunkSizer> fixed_sizer;
+        if (!chunk_sizer) {
+            chunk_sizer = &fixed_sizer.emplace(DEFAULT_CHUNK_SIZE, DEFAULT_CHUNK_SIZE);
+        }
+        chunk_sizer->start_file();
+
+        std::ifstream file(filepath, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Could not open file for reading: " << filepath << "\n";
+            return false;
+        }
+        file.seekg(0, std::ios::end);
+        uint64_t file_size = file.tellg();
+        file.seekg(0);
 
-namespace {
+        SendProgress progress{filepath, file_size, 0, progress_cb};
+        uint64_t total_sent = 0;
+        uint64_t literal_bytes = 0;
+        const security::FrameCipher* cipher = options.cipher.get();
+        // Literal data is sealed from a copy, since the encoder still reads it.
+        std::vector<char> sealed;
 
-bool replace_with_completed_file(const fs::path& part_path, const fs::path& final_path) {
-    std::error_code ec;
+        auto literal = [&](const char* data, std::size_t size) {
+            protocol::PacketHeader header{
+                static_cast<uint32_t>(protocol::CommandType::FILE_CHUNK),
+                static_cast<uint32_t>(size),
+                session_id, options.chunk_checksums && !cipher ? crc32c(data, size) : 0
+            };
+            if (cipher) {
+                sealed.assign(data, data + size);
+                send_sealed(socket, *cipher, header, index, total_sent, sealed.data(), size);
+            } else {
+                send_packet(socket, header, boost::asio::buffer(data, size));
+            }
+            chunk_sizer->record(socket, size);
+            literal_bytes += size;
+            total_sent += size;
+            progress.update(total_sent);
+        };
+        auto copy = [&](uint32_t first, uint32_t count) {
+            std::array<uint8_t, 4> count_bytes{
+                static_cast<uint8_t>(count >> 24), static_cast<uint8_t>(count >> 16),
+                static_cast<uint8_t>(count >> 8), static_cast<uint8_t>(count)
+            };
+            protocol::PacketHeader header{
+                static_cast<uint32_t>(protocol::CommandType::BLOCK_COPY),
+                static_cast<uint32_t>(count_bytes.size()),
+                session_id, first
+            };
+            if (cipher) {
+                send_sealed(socket, *cipher, header, index, total_sent, reinterpret_cast<char*>(count_bytes.data()),
+                            count_bytes.size());
+            } else {
+                send_packet(socket, header, boost::asio::buffer(count_bytes));
+            }
+            total_sent += static_cast<uint64_t>(count) * signatures.block_size;
+            progress.update(total_sent);
+        };
 
-    if (fs::exists(final_path, ec)) {
-        fs::remove(final_path, ec);
-        if (ec) {
-            std::cerr << "Failed to remove existing destination file: " << final_path
-                      << " (" << ec.message() << ")\n";
+        if (!encode_delta(file, signatures, chunk_sizer->next(), literal, copy, cancel_flag)) {
+            std::cout << "\nTransfer cancelled locally.\n";
+            send_cancel(socket, session_id);
             return false;
         }
+        FD_LOG("Delta for " << fs::path(filepath).filename().string() << ": " << literal_bytes << " of "
+               << file_size << " bytes sent as literal data, the rest copied from "
+               << signatures.blocks.size() << " signed blocks");
+        return !file_hash || send_file_hash(socket, session_id, index, *file_hash, options.cipher.get());
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception (send_delta): " << e.what() << "\n";
+        return false;
     }
+}
 
-    fs::rename(part_path, final_path, ec);
-    if (ec) {
-        std::cerr << "Failed to finalize received file: " << final_path
-                  << " (" << ec.message() << ")\n";
+bool MessageSender::send_file_hash(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t index,
+                                   SourceFileHash& hash, const security::FrameCipher* cipher) {
+    protocol::BlockHash root;
+    try {
+        root = hash.get();
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception (file hash): " << e.what() << "\n";
+        send_cancel(socket, session_id);
         return false;
     }
-
+    protocol::PacketHeader header{
+        static_cast<uint32_t>(protocol::CommandType::FILE_HASH),
+        static_cast<uint32_t>(root.size()),
+        session_id, 0
+    };
+    if (cipher) {
+        send_sealed(socket, *cipher, header, index, 0, reinterpret_cast<char*>(root.data()), root.size());
+    } else {
+        send_packet(socket, header, boost::asio::buffer(root));
+    }
     return true;
 }
 
-} // namespace
+void MessageSender::send_range_request(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                       const protocol::RangeRequest& request) {
+    try {
+        nlohmann::json j = request;
+        std::string payload = j.dump();
 
-void MessageSender::send(boost::asio::ip::tcp::socket& socket, const std::string& message) {
+        protocol::PacketHeader header{
+            static_cast<uint32_t>(protocol::CommandType::RANGE_REQUEST),
+            static_cast<uint32_t>(payload.size()),
+            session_id, 0
+        };
+
+        send_packet(socket, header, boost::asio::buffer(payload));
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception (range request): " << e.what() << "\n";
+    }
+}
+
+protocol::RangeRequest MessageReceiver::receive_range_request(FramedReader& reader, uint32_t payload_size) {
+    protocol::RangeRequest request;
     try {
-        std::string msg = message + "\n";
-        boost::asio::write(socket, boost::asio::buffer(msg));
+        std::vector<char> data(payload_size);
+        reader.read_exact(data.data(), data.size());
+        request = nlohmann::json::parse(data.begin(), data.end()).get<protocol::RangeRequest>();
     } catch (std::exception& e) {
-        std::cerr << "MessageSender Exception: " << e.what() << "\n";
+        std::cerr << "MessageReceiver Exception (range request): " << e.what() << "\n";
     }
+    return request;
 }
 
-void MessageSender::send_header(boost::asio::ip::tcp::socket& socket, const protocol::PacketHeader& header) {
+void MessageSender::send_chunk_nack(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                    const protocol::ChunkNack& nack) {
     try {
-        auto buf = protocol::serialize_header(header);
-        boost::asio::write(socket, boost::asio::buffer(buf));
+        nlohmann::json j = nack;
+        std::string payload = j.dump();
+
+        protocol::PacketHeader header{
+            static_cast<uint32_t>(protocol::CommandType::CHUNK_NACK),
+            static_cast<uint32_t>(payload.size()),
+            session_id, 0
+        };
+
+        send_packet(socket, header, boost::asio::buffer(payload));
     } catch (std::exception& e) {
-        std::cerr << "MessageSender Exception: " << e.what() << "\n";
+        std::cerr << "MessageSender Exception (chunk nack): " << e.what() << "\n";
     }
 }
 
-void MessageSender::send_file_meta(boost::asio::ip::tcp::socket& socket, const protocol::FileInfo& info) {
+protocol::ChunkNack MessageReceiver::receive_chunk_nack(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    return nlohmann::json::parse(data.begin(), data.end()).get<protocol::ChunkNack>();
+}
+
+void MessageSender::send_multicast_config(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                          const protocol::MulticastConfig& config) {
     try {
-        nlohmann::json j = info;
+        nlohmann::json j = config;
         std::string payload = j.dump();
 
         protocol::PacketHeader header{
-            static_cast<uint32_t>(protocol::CommandType::FILE_META),
+            static_cast<uint32_t>(protocol::CommandType::MULTICAST_CONFIG),
             static_cast<uint32_t>(payload.size()),
-            0, 0
+            session_id, 0
         };
-        
-        send_header(socket, header);
-        boost::asio::write(socket, boost::asio::buffer(payload));
+
+        send_packet(socket, header, boost::asio::buffer(payload));
     } catch (std::exception& e) {
-        std::cerr << "MessageSender Exception (meta): " << e.what() << "\n";
+        std::cerr << "MessageSender Exception (multicast config): " << e.what() << "\n";
     }
 }
 
-std::string MessageReceiver::receive(boost::asio::ip::tcp::socket& socket) {
+void MessageSender::send_multicast_check(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t file,
+                                         const protocol::MulticastCheck& check) {
+    auto payload = protocol::serialize_multicast_check(check);
+    protocol::PacketHeader header{
+        static_cast<uint32_t>(protocol::CommandType::MULTICAST_CHECK),
+        static_cast<uint32_t>(payload.size()),
+        session_id, file
+    };
+    send_packet(socket, header, boost::asio::buffer(payload));
+}
+
+void MessageSender::send_multicast_nack(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t file,
+                                        const protocol::MulticastNack& nack) {
+    nlohmann::json j = nack;
+    std::string payload = j.dump();
+
+    protocol::PacketHeader header{
+        static_cast<uint32_t>(protocol::CommandType::MULTICAST_NACK),
+        static_cast<uint32_t>(payload.size()),
+        session_id, file
+    };
+
+    send_packet(socket, header, boost::asio::buffer(payload));
+}
+
+protocol::MulticastConfig MessageReceiver::receive_multicast_config(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    return nlohmann::json::parse(data.begin(), data.end()).get<protocol::MulticastConfig>();
+}
+
+protocol::MulticastCheck MessageReceiver::receive_multicast_check(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    return protocol::deserialize_multicast_check(data.data(), data.size());
+}
+
+protocol::MulticastNack MessageReceiver::receive_multicast_nack(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    return nlohmann::json::parse(data.begin(), data.end()).get<protocol::MulticastNack>();
+}
+
+bool MessageSender::send_repairs(boost::asio::ip::tcp::socket& socket, FramedReader& reader, const std::string& filepath,
+                                 uint32_t session_id, uint32_t index, std::atomic<bool>* cancel_flag, const TransferOptions& options,
+                                 BufferPool* pool) {
     try {
-        boost::asio::streambuf buf;
-        boost::asio::read_until(socket, buf, '\n');
-        
-        std::istream is(&buf);
-        std::string message;
-        std::getline(is, message);
-        return message;
-    } catch (const boost::system::system_error& e) {
-        if (e.code() == boost::asio::error::eof ||
-            e.code() == boost::asio::error::operation_aborted) {
-            return "";
+        std::optional<BufferPool> local_pool;
+        if (!pool) {
+            pool = &local_pool.emplace(kStripeFrameSize, 1);
+        }
+        while (true) {
+            protocol::PacketHeader header = reader.read_header();
+            if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
+                return false;
+            }
+            if (header.command != static_cast<uint32_t>(protocol::CommandType::CHUNK_NACK)) {
+                throw std::runtime_error("Expected CHUNK_NACK packet, got: " + std::to_string(header.command));
+            }
+            protocol::ChunkNack nack = MessageReceiver::receive_chunk_nack(reader, header.payload_size);
+            if (nack.ranges.empty()) {
+                return true;
+            }
+            FD_LOG("Sending " << total_bytes(nack.ranges) << " damaged bytes of "
+                   << fs::path(filepath).filename().string() << " again");
+            std::atomic<uint64_t> sent{0};
+            std::atomic<bool> abort{false};
+            send_stripe(socket, filepath, session_id, nack.ranges, *pool, options.cipher.get(), index, true, sent,
+                        cancel_flag, abort);
+            if (cancel_flag && cancel_flag->load()) {
+                return false;
+            }
         }
-        std::cerr << "MessageReceiver Exception: " << e.what() << "\n";
-        return "";
     } catch (std::exception& e) {
-        std::cerr << "MessageReceiver Exception: " << e.what() << "\n";
-        return "";
+        std::cerr << "MessageSender Exception (repairs): " << e.what() << "\n";
+        return false;
     }
 }
 
-protocol::PacketHeader MessageReceiver::receive_header(boost::asio::ip::tcp::socket& socket) {
-    protocol::PacketHeader empty_header{0, 0, 0, 0};
+protocol::BlockSignatures MessageReceiver::receive_block_signatures(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    protocol::BlockSignatures signatures;
     try {
-        std::array<uint8_t, 16> buf;
-        boost::asio::read(socket, boost::asio::buffer(buf));
-        return protocol::deserialize_header(buf);
-    } catch (const boost::system::system_error& e) {
-        if (e.code() == boost::asio::error::eof ||
-            e.code() == boost::asio::error::operation_aborted) {
-            return empty_header;
+        signatures = protocol::deserialize_block_signatures(data.data(), data.size());
+    } catch (std::exception& e) {
+        std::cerr << "MessageReceiver Exception (block signatures): " << e.what() << "\n";
+    }
+    return signatures;
+}
+
+void MessageSender::send_hash_request(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t index,
+                                      const protocol::HashRequest& request) {
+    std::vector<uint8_t> payload = protocol::serialize_hash_request(request);
+    protocol::PacketHeader header{
+        static_cast<uint32_t>(protocol::CommandType::HASH_REQUEST),
+        static_cast<uint32_t>(payload.size()),
+        session_id, index
+    };
+    send_packet(socket, header, boost::asio::buffer(payload));
+}
+
+void MessageSender::send_hash_reply(boost::asio::ip::tcp::socket& socket, uint32_t session_id, uint32_t index,
+                                    const protocol::HashReply& reply) {
+    std::vector<uint8_t> payload = protocol::serialize_hash_reply(reply);
+    protocol::PacketHeader header{
+        static_cast<uint32_t>(protocol::CommandType::HASH_REPLY),
+        static_cast<uint32_t>(payload.size()),
+        session_id, index
+    };
+    send_packet(socket, header, boost::asio::buffer(payload));
+}
+
+protocol::HashRequest MessageReceiver::receive_hash_request(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    protocol::HashRequest request;
+    try {
+        request = protocol::deserialize_hash_request(data.data(), data.size());
+    } catch (std::exception& e) {
+        std::cerr << "MessageReceiver Exception (hash request): " << e.what() << "\n";
+    }
+    return request;
+}
+
+protocol::HashReply MessageReceiver::receive_hash_reply(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    protocol::HashReply reply;
+    try {
+        reply = protocol::deserialize_hash_reply(data.data(), data.size());
+    } catch (std::exception& e) {
+        std::cerr << "MessageReceiver Exception (hash reply): " << e.what() << "\n";
+    }
+    return reply;
+}
+
+void MessageSender::send_manifest(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                  const protocol::Manifest& manifest, bool binary) {
+    std::string payload = binary ? protocol::encode_manifest(manifest) : nlohmann::json(manifest).dump();
+
+    protocol::PacketHeader header{
+        static_cast<uint32_t>(protocol::CommandType::MANIFEST),
+        static_cast<uint32_t>(payload.size()),
+        session_id, 0
+    };
+
+    send_packet(socket, header, boost::asio::buffer(payload));
+}
+
+void MessageSender::send_manifest_reply(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                        const protocol::ManifestReply& reply, bool binary) {
+    std::string payload = binary ? protocol::encode_manifest_reply(reply) : nlohmann::json(reply).dump();
+
+    protocol::PacketHeader header{
+        static_cast<uint32_t>(protocol::CommandType::MANIFEST_REPLY),
+        static_cast<uint32_t>(payload.size()),
+        session_id, 0
+    };
+
+    send_packet(socket, header, boost::asio::buffer(payload));
+}
+
+protocol::Manifest MessageReceiver::receive_manifest(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    protocol::Manifest manifest;
+    try {
+        if (protocol::is_binary_meta(data.data(), data.size())) {
+            manifest = protocol::decode_manifest(data.data(), data.size());
+        } else {
+            manifest = nlohmann::json::parse(data.begin(), data.end()).get<protocol::Manifest>();
         }
-        std::cerr << "MessageReceiver Exception: " << e.what() << "\n";
-        return empty_header;
     } catch (std::exception& e) {
-        std::cerr << "MessageReceiver Exception: " << e.what() << "\n";
-        return empty_header;
+        std::cerr << "MessageReceiver Exception (manifest): " << e.what() << "\n";
     }
+    return manifest;
 }
 
-protocol::FileInfo MessageReceiver::receive_file_meta(boost::asio::ip::tcp::socket& socket, uint32_t payload_size) {
-    protocol::FileInfo info;
+protocol::ManifestReply MessageReceiver::receive_manifest_reply(FramedReader& reader, uint32_t payload_size) {
+    std::vector<char> data(payload_size);
+    reader.read_exact(data.data(), data.size());
+    protocol::ManifestReply reply;
     try {
-        std::vector<char> buf(payload_size);
-        boost::asio::read(socket, boost::asio::buffer(buf));
-        
-        std::string payload(buf.begin(), buf.end());
-        nlohmann::json j = nlohmann::json::parse(payload);
-        info = j.get<protocol::FileInfo>();
+        if (protocol::is_binary_meta(data.data(), data.size())) {
+            reply = protocol::decode_manifest_reply(data.data(), data.size());
+        } else {
+            reply = nlohmann::json::parse(data.begin(), data.end()).get<protocol::ManifestReply>();
+        }
     } catch (std::exception& e) {
-        std::cerr << "MessageReceiver Exception (meta): " << e.what() << "\n";
+        std::cerr << "MessageReceiver Exception (manifest reply): " << e.what() << "\n";
     }
-    return info;
+    return reply;
 }
 
-bool MessageSender::send_file(boost::asio::ip::tcp::socket& socket, const std::string& filepath, uint32_t session_id, uint64_t start_offset, TransferProgressCallback progress_cb, std::atomic<bool>* cancel_flag) {
+bool MessageSender::send_bundle(boost::asio::ip::tcp::socket& socket, uint32_t session_id,
+                                const std::vector<BundledFile>& files, const TransferOptions& options,
+                                BufferPool* pool) {
     try {
-        std::ifstream file(filepath, std::ios::binary);
-        if (!file.is_open()) {
-            std::cerr << "Could not open file for reading: " << filepath << "\n";
-            return false;
+        std::size_t data_size = 0;
+        for (const BundledFile& file : files) {
+            data_size += file.size;
         }
+        // A sealed bundle is encrypted in one piece, so the index gets room
+        // in front of the data.
+        const security::FrameCipher* cipher = options.cipher.get();
+        std::size_t index_room = cipher ? protocol::bundle_index_size(files.size()) : 0;
 
-        file.seekg(0, std::ios::end);
-        uint64_t file_size = file.tellg();
-        file.seekg(start_offset);
+        BufferPool::Buffer pooled;
+        std::vector<char> fallback;
+        char* data;
+        if (pool && index_room + data_size <= pool->buffer_size()) {
+            pooled = pool->acquire();
+            data = pooled.data() + index_room;
+        } else {
+            fallback.resize(index_room + data_size);
+            data = fallback.data() + index_room;
+        }
 
-        uint64_t total_sent = start_offset;
-        auto start_time = std::chrono::steady_clock::now();
-        auto last_cb_time = start_time;
+        std::vector<protocol::BundleEntry> entries;
+        entries.reserve(files.size());
+        std::size_t filled = 0;
+        for (const BundledFile& file : files) {
+            if (!read_small_file(file.filepath, data + filled, file.size)) {
+                std::cerr << "Could not read " << file.filepath << ", leaving it out of the bundle\n";
+                continue;
+            }
+            entries.push_back({file.index, file.size});
+            filled += file.size;
+        }
 
-        std::vector<char> buffer(64 * 1024); // 64KB per chunk
-        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
-            if (cancel_flag && cancel_flag->load()) {
-                std::cout << "\nTransfer cancelled locally.\n";
-                protocol::PacketHeader cancel_header{
-                    static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, session_id, 0
-                };
-                send_header(socket, cancel_header);
-                return false;
+        std::vector<uint8_t> index = protocol::serialize_bundle_index(entries);
+        uint32_t first = entries.empty() ? 0 : entries.front().index;
+        protocol::PacketHeader header{
+            static_cast<uint32_t>(protocol::CommandType::FILE_BUNDLE),
+            static_cast<uint32_t>(index.size() + filled),
+            session_id, first
+        };
+        if (cipher) {
+            char* payload = data - index.size();
+            std::memcpy(payload, index.data(), index.size());
+            send_sealed(socket, *cipher, header, first, 0, payload, index.size() + filled);
+            return true;
+        }
+        auto header_buf = protocol::serialize_header(header);
+        std::array<boost::asio::const_buffer, 3> frame{
+            boost::asio::buffer(header_buf), boost::asio::buffer(index), boost::asio::buffer(data, filled)
+        };
+        boost::asio::write(socket, frame);
+        return true;
+    } catch (std::exception& e) {
+        std::cerr << "MessageSender Exception (send_bundle): " << e.what() << "\n";
+        return false;
+    }
+}
+
+TransferState MessageReceiver::receive_bundle(FramedReader& reader, const protocol::PacketHeader& header,
+                                              const std::function<std::string(uint32_t)>& save_path,
+                                              std::vector<uint32_t>& saved, const TransferOptions& options,
+                                              BufferPool* pool) {
+    try {
+        const security::FrameCipher* cipher = options.cipher.get();
+        std::size_t size = plaintext_size(header, cipher);
+        if (size > BUNDLE_SIZE) {
+            throw std::runtime_error("Bundle exceeds the bundle size");
+        }
+        BufferPool::Buffer pooled;
+        std::vector<char> fallback;
+        char* data;
+        if (pool && size <= pool->buffer_size()) {
+            pooled = pool->acquire();
+            data = pooled.data();
+        } else {
+            fallback.resize(size);
+            data = fallback.data();
+        }
+        read_payload(reader, cipher, header, header.reserved, 0, data, size);
+
+        std::vector<protocol::BundleEntry> entries = protocol::deserialize_bundle_index(data, size);
+        if (cipher && !entries.empty() && entries.front().index != header.reserved) {
+            throw std::runtime_error("Bundle was sealed for another file");
+        }
+        const char* file_data = data + protocol::bundle_index_size(entries.size());
+        fs::path created_dir;
+        for (const protocol::BundleEntry& entry : entries) {
+            fs::path path(save_path(entry.index));
+            // Bundled files usually share a folder; create each one only once.
+            fs::path parent = path.parent_path();
+            if (!parent.empty() && parent != created_dir) {
+                fs::create_directories(parent);
+                created_dir = parent;
             }
+            write_small_file(path, file_data, entry.size);
+            file_data += entry.size;
+            saved.push_back(entry.index);
+        }
+        return TransferState::COMPLETED;
+    } catch (std::exception& e) {
+        std::cerr << "\nMessageReceiver Exception (receive_bundle): " << e.what() << "\n";
+        return TransferState::FAILED;
+    }
+}
 
-            std::streamsize bytes_read = file.gcount();
-            protocol::PacketHeader header{
-                static_cast<uint32_t>(protocol::CommandType::FILE_CHUNK),
-                static_cast<uint32_t>(bytes_read),
-                session_id, 0
-            };
-            send_header(socket, header);
-            boost::asio::write(socket, boost::asio::buffer(buffer.data(), bytes_read));
-            total_sent += bytes_read;
-
-            if (progress_cb) {
-                auto now = std::chrono::steady_clock::now();
-                auto elapsed_since_cb = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_cb_time).count();
-                if (elapsed_since_cb >= 300 || total_sent == file_size) {
-                    double elapsed = std::chrono::duration<double>(now - start_time).count();
-                    uint64_t session_sent = total_sent - start_offset;
-                    double speed = (elapsed > 0) ? (session_sent / elapsed / (1024.0 * 1024.0)) : 0;
-                    fs::path p(filepath);
-                    progress_cb(p.filename().string(), total_sent, file_size, speed);
-                    last_cb_time = now;
+bool MessageSender::send_striped(const std::vector<boost::asio::ip::tcp::socket*>& stripes,
+                                 const std::string& filepath, uint32_t session_id, uint32_t index,
+                                 const protocol::RangeRequest& request,
+                                 TransferProgressCallback progress_cb, std::atomic<bool>* cancel_flag,
+                                 const TransferOptions& options, BufferPool* pool) {
+    try {
+        uint64_t file_size = fs::file_size(filepath);
+        if (request.stripes.empty() || request.stripes.size() > stripes.size()) {
+            throw std::runtime_error("Range request does not match the data connections");
+        }
+        uint64_t requested = 0;
+        for (const auto& ranges : request.stripes) {
+            for (const auto& range : ranges) {
+                if (range.begin >= range.end || range.end > file_size) {
+                    throw std::runtime_error("Range request is outside the file");
                 }
+                requested += range.end - range.begin;
             }
         }
+        if (requested > file_size) {
+            throw std::runtime_error("Range request overlaps itself");
+        }
+
+        std::optional<BufferPool> local_pool;
+        if (!pool) {
+            pool = &local_pool.emplace(kStripeFrameSize, stripes.size());
+        }
+
+        uint64_t start_offset = file_size - requested;
+        SendProgress progress{filepath, file_size, start_offset, progress_cb};
+        std::atomic<uint64_t> sent{0};
+        std::atomic<bool> abort{false};
+
+        run_stripes(request.stripes.size(), abort,
+            [&](std::size_t i) {
+                send_stripe(*stripes[i], filepath, session_id, request.stripes[i], *pool, options.cipher.get(), index,
+                            options.chunk_checksums, sent, cancel_flag, abort);
+            },
+            [&] { progress.update(start_offset + sent); });
+
+        if (cancel_flag && cancel_flag->load()) {
+            std::cout << "\nTransfer cancelled locally.\n";
+            return false;
+        }
         return true;
     } catch (std::exception& e) {
-        std::cerr << "MessageSender Exception (send_file): " << e.what() << "\n";
+        std::cerr << "MessageSender Exception (send_striped): " << e.what() << "\n";
         return false;
     }
 }
 
-TransferState MessageReceiver::receive_file(boost::asio::ip::tcp::socket& socket, const std::string& filepath, uint64_t expected_size, uint64_t start_offset, TransferProgressCallback progress_cb, std::atomic<bool>* cancel_flag) {
+TransferState MessageReceiver::receive_striped(FramedReader& control,
+                                               const std::vector<FramedReader*>& stripes,
+                                               const std::string& filepath, uint64_t expected_size,
+                                               uint32_t session_id, uint32_t index,
+                                               const std::vector<protocol::ByteRange>& completed,
+                                               TransferProgressCallback progress_cb, std::atomic<bool>* cancel_flag,
+                                               const TransferOptions& options, BufferPool* pool) {
+    fs::path final_path(filepath);
+    fs::path part_path(filepath + ".fluxpart");
+    ByteRanges done = merge_ranges(completed);
+    protocol::RangeRequest request{plan_stripes(missing_ranges(done, expected_size), stripes.size())};
+    std::vector<std::atomic<uint64_t>> received(stripes.size());
+    bool checksums = options.chunk_checksums;
+    std::vector<StripeDamage> damage(checksums ? stripes.size() : 0);
+
+    // What is on disk intact; a stripe counts up to its first damaged frame.
+    auto completed_now = [&] {
+        ByteRanges ranges = done;
+        for (std::size_t i = 0; i < stripes.size(); ++i) {
+            uint64_t intact = checksums ? std::min(received[i].load(), damage[i].intact.load()) : received[i].load();
+            ByteRanges prefix = leading_ranges(request.stripes[i], intact);
+            ranges.insert(ranges.end(), prefix.begin(), prefix.end());
+        }
+        return merge_ranges(std::move(ranges));
+    };
+
     try {
-        fs::path final_path(filepath);
-        fs::path part_path(filepath + ".fluxpart");
-        
+        std::optional<BufferPool> local_pool;
+        if (!pool) {
+            pool = &local_pool.emplace(RECEIVE_BUFFER_SIZE, stripes.size());
+        }
+
         fs::path parent = part_path.parent_path();
         if (!parent.empty()) {
             fs::create_directories(parent);
         }
-        
-        std::ios_base::openmode mode = std::ios::binary;
-        if (start_offset > 0) {
-            mode |= std::ios::app;
+
+        if (done.empty()) {
+            discard_block_hashes(part_path);
         }
-        
-        std::ofstream file(part_path, mode);
-        if (!file.is_open()) {
-            std::cerr << "Could not open file for writing: " << part_path << "\n";
-            return TransferState::FAILED;
+        // The sidecar must exist before the .fluxpart grows to full size, or
+        // a crash in between would read as a complete prefix.
+        save_completed_ranges(part_path, expected_size, done);
+        std::ofstream(part_path, std::ios::binary | std::ios::app).close();
+        fs::resize_file(part_path, expected_size);
+
+        std::optional<PartFileHash> part_hash;
+        if (options.verify_files) {
+            part_hash.emplace(part_path, expected_size, completed_now);
         }
+        MessageSender::send_range_request(control.socket(), session_id, request);
 
-        uint64_t total_received = start_offset;
+        uint64_t start_offset = total_bytes(done);
         auto start_time = std::chrono::steady_clock::now();
-        auto last_print_time = start_time;
+        auto last_save = start_time;
+        std::atomic<bool> abort{false};
+        std::atomic<bool> sender_cancelled{false};
+
+        try {
+            run_stripes(stripes.size(), abort,
+                [&](std::size_t i) {
+                    TransferState state = receive_stripe(*stripes[i], part_path, request.stripes[i], *pool,
+                                                         options.cipher.get(), index, received[i],
+                                                         checksums ? &damage[i] : nullptr, cancel_flag, abort);
+                    if (state == TransferState::CANCELLED) {
+                        sender_cancelled = true;
+                        abort = true;
+                    }
+                },
+                [&] {
+                    auto now = std::chrono::steady_clock::now();
+                    uint64_t total = start_offset;
+                    for (const auto& stripe : received) total += stripe;
+                    if (progress_cb) {
+                        double elapsed = std::chrono::duration<double>(now - start_time).count();
+                        double speed = elapsed > 0 ? (total - start_offset) / elapsed / (1024.0 * 1024.0) : 0;
+                        progress_cb(filepath, total, expected_size, speed);
+                    }
+                    if (now - last_save >= std::chrono::seconds(1)) {
+                        save_completed_ranges(part_path, expected_size, completed_now());
+                        last_save = now;
+                    }
+                });
+        } catch (std::exception& e) {
+            std::cerr << "\nMessageReceiver Exception (receive_striped): " << e.what() << "\n";
+            save_completed_ranges(part_path, expected_size, completed_now());
+            return TransferState::FAILED;
+        }
+
+        std::error_code ec;
+        if (sender_cancelled) {
+            std::cout << "\nTransfer cancelled by sender.\n";
+            fs::remove(part_path, ec);
+            fs::remove(ranges_path(part_path), ec);
+            return TransferState::CANCELLED;
+        }
 
-        while (total_received < expected_size) {
+        uint64_t total = start_offset;
+        for (const auto& stripe : received) total += stripe;
+        if (total < expected_size) {
+            save_completed_ranges(part_path, expected_size, completed_now());
             if (cancel_flag && cancel_flag->load()) {
                 std::cout << "\nTransfer cancelled locally.\n";
-                file.close();
                 protocol::PacketHeader cancel_header{static_cast<uint32_t>(protocol::CommandType::CANCEL), 0, 0, 0};
-                MessageSender::send_header(socket, cancel_header);
+                MessageSender::send_header(control.socket(), cancel_header);
                 return TransferState::CANCELLED;
             }
+            return TransferState::FAILED;
+        }
 
-            protocol::PacketHeader header = receive_header(socket);
-            
-            if (header.command == static_cast<uint32_t>(protocol::CommandType::FILE_CHUNK)) {
-                std::vector<char> buffer(header.payload_size);
-                boost::asio::read(socket, boost::asio::buffer(buffer));
-                file.write(buffer.data(), buffer.size());
-                total_received += header.payload_size;
-
-                auto now = std::chrono::steady_clock::now();
-                auto elapsed_since_print = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_print_time).count();
-                
-                if (elapsed_since_print >= 300 || total_received == expected_size) {
-                    double elapsed_seconds = std::chrono::duration<double>(now - start_time).count();
-                    uint64_t session_received = total_received - start_offset;
-                    double speed_bps = (elapsed_seconds > 0) ? (session_received / elapsed_seconds) : 0;
-                    double speed_mbps = speed_bps / (1024.0 * 1024.0);
-                    
-                    if (progress_cb) {
-                        progress_cb(filepath, total_received, expected_size, speed_mbps);
-                    } else {
-                        int percent = (expected_size > 0) ? static_cast<int>((total_received * 100.0) / expected_size) : 100;
-                        uint64_t remaining_bytes = expected_size - total_received;
-                        double eta_seconds = (speed_bps > 0) ? (remaining_bytes / speed_bps) : 0;
-                        int eta_min = static_cast<int>(eta_seconds) / 60;
-                        int eta_sec = static_cast<int>(eta_seconds) % 60;
-
-                        std::cout << "\r" << percent << "% | " 
-                                  << std::fixed << std::setprecision(1) << speed_mbps << " MB/s | "
-                                  << "ETA " << std::setfill('0') << std::setw(2) << eta_min << ":"
-                                  << std::setfill('0') << std::setw(2) << eta_sec << "    " << std::flush;
-                    }
-                    last_print_time = now;
-                }
-
-            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
+        // The sender's FILE_HASH follows its last range on the control
+        // connection, and the CHUNK_NACK exchange for damaged frames that.
+        std::optional<protocol::BlockHash> sender_hash;
+        if (part_hash) {
+            protocol::PacketHeader header = control.read_header();
+            if (header.command == static_cast<uint32_t>(protocol::CommandType::CANCEL)) {
                 std::cout << "\nTransfer cancelled by sender.\n";
-                file.close();
-                std::error_code ec;
                 fs::remove(part_path, ec);
+                fs::remove(ranges_path(part_path), ec);
                 return TransferState::CANCELLED;
-            } else if (header.command == static_cast<uint32_t>(protocol::CommandType::PING)) {
-                protocol::PacketHeader pong_header{static_cast<uint32_t>(protocol::CommandType::PONG), 0, header.session_id, 0};
-                MessageSender::send_header(socket, pong_header);
             }
+            if (header.command != static_cast<uint32_t>(protocol::CommandType::FILE_HASH)) {
+                throw std::runtime_error("Expected FILE_HASH packet, got: " + std::to_string(header.command));
+            }
+            sender_hash = read_file_hash(control, header, options.cipher.get(), index);
         }
-        if (!progress_cb) {
-            std::cout << "\r                                                                 " << std::flush;
-            std::cout << "\nFile transfer completed successfully.\n";
+        if (checksums) {
+            ByteRanges damaged;
+            for (const auto& stripe : damage) {
+                damaged.insert(damaged.end(), stripe.ranges.begin(), stripe.ranges.end());
+            }
+            TransferState repaired = repair_damaged_ranges(control, part_path, std::move(damaged),
+                                                           options.cipher.get(), index, cancel_flag);
+            if (repaired == TransferState::CANCELLED) {
+                std::cout << "\nTransfer cancelled.\n";
+                fs::remove(part_path, ec);
+                fs::remove(ranges_path(part_path), ec);
+                return repaired;
+            }
+            if (repaired == TransferState::FAILED) {
+                discard_mismatched_file(part_path, final_path);
+                return repaired;
+            }
+            for (auto& stripe : damage) {
+                stripe.intact = UINT64_MAX;
+            }
         }
-        file.close();
-        
-        if (!replace_with_completed_file(part_path, final_path)) {
+        if (part_hash && part_hash->finish() != *sender_hash) {
+            discard_mismatched_file(part_path, final_path);
             return TransferState::FAILED;
         }
 
+        fs::remove(ranges_path(part_path), ec);
+        if (!replace_with_completed_file(part_path, final_path)) {
+            return TransferState::FAILED;
+        }
         return TransferState::COMPLETED;
     } catch (std::exception& e) {
-        std::cerr << "\nMessageReceiver Exception (receive_file): " << e.what() << "\n";
+        std::cerr << "\nMessageReceiver Exception (receive_striped): " << e.what() << "\n";
         return TransferState::FAILED;
     }
 }
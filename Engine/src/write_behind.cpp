@@ -0,0 +1,389 @@
+#include "write_behind.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __linux__
+  #include <cerrno>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace transfer {
+
+WriteBehind::WriteBehind(Sink sink, std::size_t depth, BufferPool& pool)
+    : sink_(std::move(sink)), depth_(std::max<std::size_t>(depth, 1)), pool_(pool) {}
+
+WriteBehind::~WriteBehind() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stopping_ = true;
+        queue_.clear();
+    }
+    ready_cv_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+char* WriteBehind::prepare(std::size_t& available) {
+    if (!staging_) {
+        staging_ = pool_.acquire();
+        staged_ = 0;
+    }
+    available = staging_.size() - staged_;
+    return staging_.data() + staged_;
+}
+
+void WriteBehind::commit(std::size_t size) {
+    staged_ += size;
+    if (staged_ == staging_.size()) {
+        enqueue();
+    }
+}
+
+void WriteBehind::write(const char* data, std::size_t size) {
+    while (size > 0) {
+        std::size_t available;
+        char* out = prepare(available);
+        std::size_t n = std::min(size, available);
+        std::memcpy(out, data, n);
+        commit(n);
+        data += n;
+        size -= n;
+    }
+}
+
+void WriteBehind::enqueue() {
+    if (!staging_ || staged_ == 0) {
+        return;
+    }
+    if (!thread_.joinable()) {
+        thread_ = std::thread(&WriteBehind::run, this);
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (queue_.size() >= depth_ && !error_) {
+        auto wait_start = std::chrono::steady_clock::now();
+        space_cv_.wait(lock, [this] { return queue_.size() < depth_ || error_; });
+        disk_stall_ += std::chrono::steady_clock::now() - wait_start;
+    }
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    queue_.push_back({std::move(staging_), staged_});
+    staged_ = 0;
+    lock.unlock();
+    ready_cv_.notify_one();
+}
+
+void WriteBehind::flush() {
+    enqueue();
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    space_cv_.wait(lock, [this] { return (queue_.empty() && !writing_) || error_; });
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+WriteBehind::Duration WriteBehind::network_stall() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return network_stall_;
+}
+
+void WriteBehind::run() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (true) {
+        auto wait_start = std::chrono::steady_clock::now();
+        ready_cv_.wait(lock, [this] { return !queue_.empty() || stopping_; });
+        if (stopping_) {
+            return;
+        }
+        network_stall_ += std::chrono::steady_clock::now() - wait_start;
+
+        Pending pending = std::move(queue_.front());
+        queue_.pop_front();
+        writing_ = true;
+        lock.unlock();
+        space_cv_.notify_one();
+
+        try {
+            sink_(pending.buffer.data(), pending.size);
+        } catch (...) {
+            lock.lock();
+            error_ = std::current_exception();
+            writing_ = false;
+            space_cv_.notify_all();
+            return;
+        }
+
+        pending = {};
+        lock.lock();
+        writing_ = false;
+        if (queue_.empty()) {
+            space_cv_.notify_all();
+        }
+    }
+}
+
+#ifdef __linux__
+
+namespace {
+
+[[noreturn]] void throw_errno(const char* what) {
+    throw boost::system::system_error(errno, boost::system::system_category(), what);
+}
+
+} // namespace
+
+PipeWriteBehind::PipeWriteBehind(int fd, uint64_t offset, std::size_t depth, std::size_t pipe_size,
+                                 BufferPool& pool)
+    : fd_(fd), depth_(std::max<std::size_t>(depth, 1)), pipe_size_(pipe_size), pool_(pool),
+      offset_(static_cast<int64_t>(offset)), written_(offset) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!create_pipe()) {
+        throw_errno("pipe2");
+    }
+}
+
+PipeWriteBehind::~PipeWriteBehind() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stopping_ = true;
+        queue_.clear();
+    }
+    ready_cv_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    for (const auto& pipe : pipes_) {
+        ::close(pipe->read_fd);
+        ::close(pipe->write_fd);
+    }
+}
+
+bool PipeWriteBehind::create_pipe() {
+    int fds[2];
+    // Non-blocking, so a full pipe fails the splice instead of holding the
+    // socket side until the disk thread empties it.
+    if (::pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+        return false;
+    }
+    ::fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(pipe_size_));
+    int capacity = ::fcntl(fds[1], F_GETPIPE_SZ);
+    auto pipe = std::make_unique<Pipe>();
+    pipe->read_fd = fds[0];
+    pipe->write_fd = fds[1];
+    pipe->capacity = capacity > 0 ? std::min(static_cast<std::size_t>(capacity), pipe_size_) : pipe_size_;
+    free_.push_back(pipe.get());
+    pipes_.push_back(std::move(pipe));
+    return true;
+}
+
+PipeWriteBehind::Pipe& PipeWriteBehind::filling() {
+    if (filling_) {
+        return *filling_;
+    }
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (free_.empty() && pipes_.size() < depth_) {
+        create_pipe();
+    }
+    if (free_.empty() && !error_) {
+        auto wait_start = std::chrono::steady_clock::now();
+        space_cv_.wait(lock, [this] { return !free_.empty() || error_; });
+        disk_stall_ += std::chrono::steady_clock::now() - wait_start;
+    }
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    filling_ = free_.back();
+    free_.pop_back();
+    return *filling_;
+}
+
+void PipeWriteBehind::splice_from(boost::asio::ip::tcp::socket& socket, std::size_t count) {
+    int sock_fd = socket.native_handle();
+    while (count > 0) {
+        if (!splice_socket_) {
+            if (!socket_bounce_) {
+                socket_bounce_ = pool_.acquire();
+            }
+            std::size_t n = std::min(count, socket_bounce_.size());
+            boost::asio::read(socket, boost::asio::buffer(socket_bounce_.data(), n));
+            write(socket_bounce_.data(), n);
+            count -= n;
+            continue;
+        }
+
+        Pipe& pipe = filling();
+        ssize_t n = ::splice(sock_fd, nullptr, pipe.write_fd, nullptr, std::min(count, pipe.capacity - pipe.filled),
+                             SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            pipe.filled += static_cast<std::size_t>(n);
+            count -= static_cast<std::size_t>(n);
+            if (pipe.filled == pipe.capacity) {
+                enqueue();
+            }
+        } else if (n == 0) {
+            throw boost::system::system_error(boost::asio::error::eof);
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN) {
+            // Either the pipe ran out of slots, which partial pages can do
+            // before it holds its capacity, or the socket is dry. An empty
+            // pipe tells the two apart on the next try.
+            if (pipe.filled > 0) {
+                enqueue();
+            } else {
+                socket.wait(boost::asio::ip::tcp::socket::wait_read);
+            }
+        } else if (errno == EINVAL) {
+            splice_socket_ = false;
+        } else {
+            throw_errno("splice");
+        }
+    }
+}
+
+void PipeWriteBehind::write(const char* data, std::size_t size) {
+    while (size > 0) {
+        Pipe& pipe = filling();
+        ssize_t n = ::write(pipe.write_fd, data, std::min(size, pipe.capacity - pipe.filled));
+        if (n > 0) {
+            pipe.filled += static_cast<std::size_t>(n);
+            data += n;
+            size -= static_cast<std::size_t>(n);
+            if (pipe.filled == pipe.capacity) {
+                enqueue();
+            }
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN && pipe.filled > 0) {
+            enqueue();
+        } else {
+            throw_errno("write");
+        }
+    }
+}
+
+void PipeWriteBehind::enqueue() {
+    if (!filling_ || filling_->filled == 0) {
+        return;
+    }
+    if (!thread_.joinable()) {
+        thread_ = std::thread(&PipeWriteBehind::run, this);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        queue_.push_back(filling_);
+        filling_ = nullptr;
+    }
+    ready_cv_.notify_one();
+}
+
+void PipeWriteBehind::flush() {
+    // A file that never filled a pipe is written without starting the thread.
+    if (!thread_.joinable()) {
+        if (filling_ && filling_->filled > 0) {
+            drain(*filling_);
+        }
+        return;
+    }
+    enqueue();
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    space_cv_.wait(lock, [this] { return (queue_.empty() && !writing_) || error_; });
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+PipeWriteBehind::Duration PipeWriteBehind::network_stall() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return network_stall_;
+}
+
+void PipeWriteBehind::run() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (true) {
+        auto wait_start = std::chrono::steady_clock::now();
+        ready_cv_.wait(lock, [this] { return !queue_.empty() || stopping_; });
+        if (stopping_) {
+            return;
+        }
+        network_stall_ += std::chrono::steady_clock::now() - wait_start;
+
+        Pipe* pipe = queue_.front();
+        queue_.pop_front();
+        writing_ = true;
+        lock.unlock();
+
+        try {
+            drain(*pipe);
+        } catch (...) {
+            lock.lock();
+            error_ = std::current_exception();
+            writing_ = false;
+            space_cv_.notify_all();
+            return;
+        }
+
+        lock.lock();
+        free_.push_back(pipe);
+        writing_ = false;
+        space_cv_.notify_all();
+    }
+}
+
+void PipeWriteBehind::drain(Pipe& pipe) {
+    while (pipe.filled > 0 && splice_file_) {
+        ssize_t n = ::splice(pipe.read_fd, nullptr, fd_, &offset_, pipe.filled, SPLICE_F_MOVE);
+        if (n > 0) {
+            pipe.filled -= static_cast<std::size_t>(n);
+            written_.store(static_cast<uint64_t>(offset_), std::memory_order_release);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EINVAL) {
+            // The filesystem cannot take spliced pages; copy from now on.
+            splice_file_ = false;
+        } else {
+            throw_errno("splice");
+        }
+    }
+
+    while (pipe.filled > 0) {
+        if (!file_bounce_) {
+            file_bounce_ = pool_.acquire();
+        }
+        ssize_t n = ::read(pipe.read_fd, file_bounce_.data(), std::min(pipe.filled, file_bounce_.size()));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw_errno("read");
+        }
+        if (n == 0) {
+            throw std::runtime_error("Pipe to the partial file ran dry");
+        }
+        const char* data = file_bounce_.data();
+        std::size_t left = static_cast<std::size_t>(n);
+        while (left > 0) {
+            ssize_t written = ::pwrite(fd_, data, left, offset_);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw_errno("pwrite");
+            }
+            data += written;
+            left -= static_cast<std::size_t>(written);
+            offset_ += written;
+        }
+        pipe.filled -= static_cast<std::size_t>(n);
+        written_.store(static_cast<uint64_t>(offset_), std::memory_order_release);
+    }
+}
+
+#endif
+
+} // namespace transfer
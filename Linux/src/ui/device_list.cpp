@@ -661,8 +661,8 @@ void DeviceListPanel::connect_to_device(const networking::DiscoveredDevice& devi
     gtk_box_append(GTK_BOX(vbox), prompt);
 
     GtkWidget* entry = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Enter 4-digit PIN");
-    gtk_entry_set_max_length(GTK_ENTRY(entry), 4);
+    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Enter 6-digit PIN");
+    gtk_entry_set_max_length(GTK_ENTRY(entry), 6);
     gtk_box_append(GTK_BOX(vbox), entry);
 
     GtkWidget* connect_btn = gtk_button_new_with_label("Connect");
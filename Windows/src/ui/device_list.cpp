@@ -212,8 +212,8 @@ void DeviceListPanel::connect_to_device(const networking::DiscoveredDevice& devi
     vbox->addWidget(prompt);
 
     auto* entry = new QLineEdit(dialog);
-    entry->setPlaceholderText("Enter 4-digit PIN");
-    entry->setMaxLength(4);
+    entry->setPlaceholderText("Enter 6-digit PIN");
+    entry->setMaxLength(6);
     vbox->addWidget(entry);
 
     auto* connect_btn = new QPushButton("Connect", dialog);
@@ -162,7 +162,7 @@ fun SendScreen(modifier: Modifier = Modifier) {
                         status = "Starting server..."
                         FluxDropCore.startServer(paths.toTypedArray(), object : ServerCallbacks {
                             override fun onReady(ip: String, port: Int, newPin: Int) {
-                                pin = String.format("%04d", newPin)
+                                pin = String.format("%06d", newPin)
                                 status = "Waiting for receiver on $ip:$port"
                             }
                             override fun onStatus(message: String) { status = message }